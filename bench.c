@@ -0,0 +1,1023 @@
+//------------------------------------------------------------------------------
+// Benchmarks del servidor, sin red. No forman parte del binario del servidor:
+// incluyen server.c (sin su main) y se compilan aparte:
+//   gcc -O2 -o bench bench.c -lwebsockets -ljson-c -lz -lpthread
+//   ./bench NOMBRE:ARG [opciones del servidor]
+// Las opciones son las de ./server (--hilos, --cola-max, --presencia-ms...)
+// y ajustan lo que mide cada benchmark. ./bench sin argumentos los lista.
+//------------------------------------------------------------------------------
+#define BENCH_SERVIDOR
+#include "server.c"
+
+#include <sched.h>
+#include <json-c/json.h>
+
+#define BENCH_BUZONES_USUARIOS 100 // destinatarios en buzones:N
+#define BENCH_DEFLATE_DESTINOS 100 // destinatarios en deflate:N
+#define BENCH_BINARIO_USUARIOS 50 // emisores distintos en binario:N
+#define BENCH_JSON_VUELTAS   100  // pasadas sobre el corpus en json:RUTA
+#define BENCH_EPOCAS_NOMBRES 1024 // nombres que se asignan y liberan en epocas:N
+#define BENCH_REGISTRO_MAX   100000 // sesiones en el último tamaño de registro:N
+#define BENCH_REGISTRO_LINEAL 1000 // búsquedas por recorrido lineal en registro:N
+#define BENCH_SHARDS_SESIONES 1024 // sesiones repartidas entre los shards en shards:N
+#define BENCH_SHARDS_BROADCAST 100 // en shards:N, 1 de cada N mensajes es broadcast
+
+//------------------------------------------------------------------------------
+// buzones:N: mide cuánto tarda guardar N privados para usuarios
+// desconectados, bajarlos a los .idx y vaciar los buzones como al registrarse
+// (sin red): lo que hace el hilo de servicio, lo que le queda a
+// hilo_historial (leer los .idx) y la entrega al shard. Con --buzon-memoria
+// chico casi todo sale del disco. Usa un historial temporal que se borra al
+// terminar.
+//------------------------------------------------------------------------------
+static double segundos_desde(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (double)(t1.tv_sec - t0->tv_sec) + (double)(t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void borrar_directorio(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *de;
+    char ruta[512];
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        snprintf(ruta, sizeof(ruta), "%s/%s", dir, de->d_name);
+        if (unlink(ruta) < 0 && errno == EISDIR) borrar_directorio(ruta);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static int bench_buzones(int n) {
+    char dir[] = "/tmp/chat-buzones-XXXXXX";
+    if (!mkdtemp(dir)) return -1;
+    cfg.historial_dir = dir;
+    if (historial_iniciar() < 0) {
+        borrar_directorio(dir);
+        return -1;
+    }
+    // Los destinatarios se registran en el shard 0 (sin wsi)
+    const int hilos = cfg.hilos;
+    cfg.hilos = 1;
+    shards[0].tsi = 0;
+    buzon_iniciar(&shards[0].buzon);
+    shard_actual = &shards[0];
+    struct per_session_data__chat *sesiones = calloc(BENCH_BUZONES_USUARIOS, sizeof(*sesiones));
+    int ret = -1, num_sesiones = 0;
+    if (!sesiones) goto fin;
+
+    char ts[64], destino[32], contenido[64];
+    get_timestamp(ts, sizeof(ts));
+    long rechazados = 0;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        snprintf(destino, sizeof(destino), "bench-%d", i % BENCH_BUZONES_USUARIOS);
+        snprintf(contenido, sizeof(contenido), "mensaje pendiente %d", i);
+        struct frame_salida *f = json_privado((uint64_t)i + 1, "bench", contenido, ts);
+        if (buzon_guardar(destino, f) < 0) rechazados++;
+        frame_soltar(f);
+    }
+    double t_guardar = segundos_desde(&t0);
+
+    // Lo que hace hilo_historial en cada pasada: bajar los .idx
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    buzones_persistir();
+    double t_persistir = segundos_desde(&t0);
+
+    for (; num_sesiones < BENCH_BUZONES_USUARIOS; num_sesiones++) {
+        struct per_session_data__chat *pss = &sesiones[num_sesiones];
+        pss->id = atomic_fetch_add(&siguiente_id, 1);
+        pss->shard = 0;
+        snprintf(pss->ip, sizeof(pss->ip), "127.0.0.1");
+        snprintf(destino, sizeof(destino), "bench-%d", num_sesiones);
+        if (cola_iniciar(&pss->cola, cfg.cola_max) < 0 || registrar_cliente(pss) < 0
+            || asignar_nombre(pss, destino) < 0 || shard_agregar(&shards[0], pss) < 0)
+            goto fin;
+    }
+
+    // Lo que hace el hilo de servicio en cada registro
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int u = 0; u < num_sesiones; u++) {
+        struct per_session_data__chat *pss = &sesiones[u];
+        struct manija_sesion yo = { pss->ficha, pss->id, pss->shard };
+        pss->reproducir = buzon_vaciar(pss->username, &yo, &pss->num_reproducir);
+    }
+    double t_registro = segundos_desde(&t0);
+
+    // Lo que queda para hilo_historial y la entrega por el buzón del shard
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    buzones_persistir();
+    shard_drenar_buzon(&shards[0]);
+    double t_disco = segundos_desde(&t0);
+
+    // Armar cada frame como en WRITEABLE
+    long entregados = 0;
+    uint64_t bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int u = 0; u < num_sesiones; u++) {
+        struct per_session_data__chat *pss = &sesiones[u];
+        for (size_t j = 0; j < pss->num_reproducir; j++) {
+            struct frame_salida *f = historial_frame(pss->reproducir[j]);
+            if (!f) continue;
+            bytes += f->len;
+            entregados++;
+            frame_soltar(f);
+        }
+    }
+    double t_frames = segundos_desde(&t0);
+
+    printf("buzones: %d mensajes para %d usuarios (%d en memoria por buzón)\n",
+           n, BENCH_BUZONES_USUARIOS, cfg.buzon_memoria);
+    printf("  guardar:   %.3f s, %.0f msg/s (%ld rechazados)\n",
+           t_guardar, t_guardar > 0 ? (double)n / t_guardar : 0.0, rechazados);
+    printf("  persistir: %.3f s (hilo_historial)\n", t_persistir);
+    printf("  registro:  %.3f s, %.1f us por registro (hilo de servicio)\n",
+           t_registro, t_registro * 1e6 / num_sesiones);
+    printf("  leer .idx: %.3f s (hilo_historial y entrega al shard)\n", t_disco);
+    printf("  frames:    %.3f s, %.0f msg/s (%ld entregados, %" PRIu64 " bytes)\n",
+           t_frames, t_frames > 0 ? (double)entregados / t_frames : 0.0, entregados, bytes);
+    ret = 0;
+fin:
+    for (; num_sesiones > 0; num_sesiones--) {
+        struct per_session_data__chat *pss = &sesiones[num_sesiones - 1];
+        shard_quitar(&shards[0], pss);
+        if (pss->ficha) eliminar_cliente(pss);
+        cola_liberar(&pss->cola);
+        free(pss->reproducir);
+    }
+    free(sesiones);
+    shard_actual = NULL;
+    cfg.hilos = hilos;
+    historial_detener();
+    borrar_directorio(dir);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// deflate:N: ancho de banda y CPU de mandar N broadcasts típicos a
+// BENCH_DEFLATE_DESTINOS destinatarios: sin comprimir, con permessage-deflate
+// por conexión (con y sin contexto entre mensajes) y comprimiendo una sola
+// vez por frame (--deflate-compartido). Sin red: solo zlib.
+//------------------------------------------------------------------------------
+static int bench_deflate(int n) {
+    static const char *frases[] = {
+        "hola a todos", "alguien sabe si la reunión sigue a las 3?",
+        "ya subí los cambios al repositorio", "jajaja", "me voy a almorzar, vuelvo en 1 hora",
+        "el servidor de pruebas está caído otra vez", "ok", "gracias!",
+    };
+    const int num_frases = (int)(sizeof(frases) / sizeof(frases[0]));
+    char ts[64], usuario[32], contenido[128];
+    get_timestamp(ts, sizeof(ts));
+
+    struct frame_salida **frames = calloc((size_t)n, sizeof(*frames));
+    z_stream *conexiones[BENCH_DEFLATE_DESTINOS] = { NULL };
+    unsigned char *out = NULL;
+    size_t max_len = 0;
+    int ret = -1;
+    if (!frames) return -1;
+    for (int i = 0; i < n; i++) {
+        snprintf(usuario, sizeof(usuario), "usuario%d", i % 50);
+        snprintf(contenido, sizeof(contenido), "%s (%d)", frases[i % num_frases], i);
+        frames[i] = json_mensaje_chat("broadcast", usuario, contenido, ts);
+        if (!frames[i]) goto fin;
+        if (frames[i]->len > max_len) max_len = frames[i]->len;
+    }
+    if (!(out = malloc(deflate_cota(max_len)))) goto fin;
+    for (int d = 0; d < BENCH_DEFLATE_DESTINOS; d++)
+        if (!(conexiones[d] = deflate_nuevo(DEFLATE_VENTANA_MAX))) goto fin;
+
+    uint64_t crudo = 0, con_contexto = 0, sin_contexto = 0, compartido = 0;
+    for (int i = 0; i < n; i++) crudo += frames[i]->len;
+
+    // Por conexión, como lws por defecto: cada destinatario comprime cada
+    // mensaje con su propio contexto
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++)
+        for (int d = 0; d < BENCH_DEFLATE_DESTINOS; d++)
+            con_contexto += (uint64_t)deflate_mensaje(conexiones[d], frames[i]->datos,
+                                                      frames[i]->len, out);
+    double t_con = segundos_desde(&t0);
+
+    // Por conexión con server_no_context_takeover
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        for (int d = 0; d < BENCH_DEFLATE_DESTINOS; d++) {
+            deflateReset(conexiones[d]);
+            sin_contexto += (uint64_t)deflate_mensaje(conexiones[d], frames[i]->datos,
+                                                      frames[i]->len, out);
+        }
+    }
+    double t_sin = segundos_desde(&t0);
+
+    // Compartido: una compresión por frame, los mismos bytes para todos
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        struct frame_comprimido *c = frame_comprimido(frames[i], DEFLATE_VENTANA_MAX);
+        if (c) compartido += (uint64_t)c->len * BENCH_DEFLATE_DESTINOS;
+    }
+    double t_compartido = segundos_desde(&t0);
+    crudo *= BENCH_DEFLATE_DESTINOS;
+
+    printf("deflate: %d broadcasts a %d destinatarios (nivel %d, memLevel %d)\n",
+           n, BENCH_DEFLATE_DESTINOS, cfg.deflate_nivel, cfg.deflate_memoria);
+    printf("  %-22s %12s %10s %12s\n", "modo", "bytes", "relación", "CPU (ms)");
+    printf("  %-22s %12" PRIu64 " %10.2f %12s\n", "sin comprimir", crudo, 1.0, "-");
+    printf("  %-22s %12" PRIu64 " %10.2f %12.1f\n", "por conexión", con_contexto,
+           (double)con_contexto / (double)crudo, t_con * 1e3);
+    printf("  %-22s %12" PRIu64 " %10.2f %12.1f\n", "por conexión sin ctx", sin_contexto,
+           (double)sin_contexto / (double)crudo, t_sin * 1e3);
+    printf("  %-22s %12" PRIu64 " %10.2f %12.1f\n", "compartido", compartido,
+           (double)compartido / (double)crudo, t_compartido * 1e3);
+    printf("  (compartido incluye la cabecera WebSocket; los demás, solo el payload)\n");
+    ret = 0;
+fin:
+    for (int d = 0; d < BENCH_DEFLATE_DESTINOS; d++) {
+        if (!conexiones[d]) continue;
+        deflateEnd(conexiones[d]);
+        free(conexiones[d]);
+    }
+    for (int i = 0; i < n; i++) frame_soltar(frames[i]);
+    free(frames);
+    free(out);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// binario:N: costo de codificar y decodificar N mensajes típicos
+// (broadcast, private y ack entre BENCH_BINARIO_USUARIOS usuarios) en JSON
+// y en chat-protocol-bin, la traducción JSON -> binario que se hace para
+// los clientes mixtos, y los bytes de payload de cada formato.
+//------------------------------------------------------------------------------
+static int bench_binario(int n) {
+    static const char *frases[] = {
+        "hola a todos", "alguien sabe si la reunión sigue a las 3?",
+        "ya subí los cambios al repositorio", "jajaja", "me voy a almorzar, vuelvo en 1 hora",
+        "el servidor de pruebas está caído otra vez", "ok", "gracias!",
+    };
+    const int num_frases = (int)(sizeof(frases) / sizeof(frases[0]));
+    char ts[64], usuario[32], destino[32], contenido[128];
+    get_timestamp(ts, sizeof(ts));
+    uint64_t ts_us = 0;
+    timestamp_a_us(ts, &ts_us);
+
+    struct frame_salida **frames = calloc((size_t)n, sizeof(*frames));
+    unsigned char **binarios = calloc((size_t)n, sizeof(*binarios));
+    size_t *len_binarios = calloc((size_t)n, sizeof(*len_binarios));
+    char *copia = malloc(2 * MAX_PAYLOAD_SIZE);
+    const int codigos[] = {          // broadcast, private, ack
+        tabla_tipos_buscar(&tipos_bin, "broadcast", strlen("broadcast")),
+        tabla_tipos_buscar(&tipos_bin, "private", strlen("private")),
+        tabla_tipos_buscar(&tipos_bin, "ack", strlen("ack")),
+    };
+    int ret = -1;
+    if (!frames || !binarios || !len_binarios || !copia) goto fin;
+
+    // Codificar: JSON con los escritores de siempre, binario desde los campos
+    uint64_t bytes_json = 0, bytes_bin = 0, presentaciones = 0;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        snprintf(usuario, sizeof(usuario), "usuario%d", i % BENCH_BINARIO_USUARIOS);
+        snprintf(destino, sizeof(destino), "usuario%d", (i * 7 + 3) % BENCH_BINARIO_USUARIOS);
+        snprintf(contenido, sizeof(contenido), "%s (%d)", frases[i % num_frases], i);
+        int tipo = i % 10;
+        if (tipo < 7) frames[i] = json_mensaje_chat("broadcast", usuario, contenido, ts);
+        else if (tipo < 9) frames[i] = json_privado((uint64_t)i, usuario, contenido, ts);
+        else frames[i] = json_ack((uint64_t)i, usuario, NULL, "entregado", ts);
+        if (!frames[i]) goto fin;
+        bytes_json += frames[i]->len;
+    }
+    double t_cod_json = segundos_desde(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        snprintf(usuario, sizeof(usuario), "usuario%d", i % BENCH_BINARIO_USUARIOS);
+        snprintf(contenido, sizeof(contenido), "%s (%d)", frases[i % num_frases], i);
+        int tipo = i % 10;
+        struct bin_mensaje b;
+        memset(&b, 0, sizeof(b));
+        b.tipo = (uint8_t)codigos[tipo < 7 ? 0 : tipo < 9 ? 1 : 2];
+        b.campos = BIN_CAMPO_TS | BIN_CAMPO_SENDER | BIN_CAMPO_CONTENT;
+        if (tipo >= 7) {
+            b.campos |= BIN_CAMPO_ID;
+            b.id = (uint64_t)i;
+        }
+        b.ts_us = ts_us;
+        b.sender.id = usuario_internar(usuario);
+        b.content.p = tipo < 9 ? contenido : "entregado";
+        b.content.len = strlen(b.content.p);
+        len_binarios[i] = bin_tam(&b);
+        if (!(binarios[i] = malloc(len_binarios[i]))) goto fin;
+        bin_codificar(&b, binarios[i]);
+        bytes_bin += len_binarios[i];
+    }
+    double t_cod_bin = segundos_desde(&t0);
+    // Cada cliente binario recibe una vez el nombre de cada usuario
+    for (int u = 0; u < BENCH_BINARIO_USUARIOS; u++) {
+        int len = snprintf(usuario, sizeof(usuario), "usuario%d", u);
+        presentaciones += BIN_CABECERA + 8 + 4 + (uint64_t)len;
+    }
+
+    // Decodificar: lo que hace RECEIVE con cada formato
+    struct mensaje_entrante m;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        memcpy(copia, frames[i]->datos, frames[i]->len);
+        if (parsear_mensaje(copia, frames[i]->len, &m) < 0) goto fin;
+    }
+    double t_dec_json = segundos_desde(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        if (parsear_binario(binarios[i], len_binarios[i], &m, copia, 2 * MAX_PAYLOAD_SIZE) < 0)
+            goto fin;
+    }
+    double t_dec_bin = segundos_desde(&t0);
+
+    // Traducir: un frame JSON para los clientes binarios (una vez por shard)
+    uint64_t bytes_traducidos = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        struct frame_binario *fb = frame_binario(frames[i]);
+        if (!fb) goto fin;
+        bytes_traducidos += fb->len;
+    }
+    double t_traducir = segundos_desde(&t0);
+
+    printf("binario: %d mensajes (70%% broadcast, 20%% private, 10%% ack) de %d usuarios\n",
+           n, BENCH_BINARIO_USUARIOS);
+    printf("  %-10s %14s %14s %12s\n", "formato", "codificar ns", "decodificar ns", "bytes/msg");
+    printf("  %-10s %14.0f %14.0f %12.1f\n", "json", t_cod_json * 1e9 / n,
+           t_dec_json * 1e9 / n, (double)bytes_json / n);
+    printf("  %-10s %14.0f %14.0f %12.1f\n", "binario", t_cod_bin * 1e9 / n,
+           t_dec_bin * 1e9 / n, (double)bytes_bin / n);
+    printf("  traducir json -> binario: %.0f ns/msg, %.1f bytes/msg\n",
+           t_traducir * 1e9 / n, (double)bytes_traducidos / n);
+    printf("  presentaciones de usuarios: %" PRIu64 " bytes por conexión\n", presentaciones);
+    ret = 0;
+fin:
+    for (int i = 0; frames && i < n; i++) frame_soltar(frames[i]);
+    for (int i = 0; binarios && i < n; i++) free(binarios[i]);
+    free(frames);
+    free(binarios);
+    free(len_binarios);
+    free(copia);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// json:RUTA: cada línea no vacía del archivo es un frame entrante
+// (tráfico grabado, un .jsonl). Pasa BENCH_JSON_VUELTAS veces por el corpus
+// con parsear_mensaje y con lo que hacía RECEIVE antes (json_tokener_parse
+// y un json_object_object_get_ex por campo), sobre copias como las de lws.
+//------------------------------------------------------------------------------
+static int bench_json_c(char *copia) {
+    static const char *const claves[] = { "id", "type", "room", "sender", "target",
+                                          "content", "timestamp" };
+    struct json_object *obj = json_tokener_parse(copia);
+    if (!obj || !json_object_is_type(obj, json_type_object)) {
+        if (obj) json_object_put(obj);
+        return -1;
+    }
+    struct json_object *v;
+    for (size_t i = 0; i < sizeof(claves) / sizeof(claves[0]); i++) {
+        if (json_object_object_get_ex(obj, claves[i], &v) && v)
+            json_object_get_string(v);
+    }
+    json_object_put(obj);
+    return 0;
+}
+
+static int bench_json(const char *ruta) {
+    FILE *f = fopen(ruta, "r");
+    if (!f) {
+        fprintf(stderr, "No se pudo abrir %s: %s\n", ruta, strerror(errno));
+        return -1;
+    }
+    char **frames = NULL;
+    size_t *lens = NULL, n = 0, cap = 0, bytes = 0, max = 0;
+    char *linea = NULL, *copia = NULL;
+    size_t tam_linea = 0;
+    ssize_t leidos;
+    int ret = -1;
+    while ((leidos = getline(&linea, &tam_linea, f)) > 0) {
+        size_t len = (size_t)leidos;
+        while (len && (linea[len - 1] == '\n' || linea[len - 1] == '\r')) len--;
+        if (!len) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            char **nf = realloc(frames, cap * sizeof(*frames));
+            if (nf) frames = nf;
+            size_t *nl = realloc(lens, cap * sizeof(*lens));
+            if (nl) lens = nl;
+            if (!nf || !nl) goto fin;
+        }
+        if (!(frames[n] = malloc(len))) goto fin;
+        memcpy(frames[n], linea, len);
+        lens[n++] = len;
+        bytes += len;
+        if (len > max) max = len;
+    }
+    if (!n) {
+        fprintf(stderr, "%s no tiene frames\n", ruta);
+        goto fin;
+    }
+    if (!(copia = malloc(max + 1))) goto fin;
+
+    // Primero, en cuántos frames no coinciden
+    size_t aceptados = 0, aceptados_c = 0, desacuerdos = 0;
+    struct mensaje_entrante m;
+    for (size_t i = 0; i < n; i++) {
+        memcpy(copia, frames[i], lens[i]);
+        int propio = parsear_mensaje(copia, lens[i], &m) == 0;
+        memcpy(copia, frames[i], lens[i]);
+        copia[lens[i]] = '\0';
+        int c = bench_json_c(copia) == 0;
+        aceptados += (size_t)propio;
+        aceptados_c += (size_t)c;
+        desacuerdos += (size_t)(propio != c);
+    }
+
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int v = 0; v < BENCH_JSON_VUELTAS; v++) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(copia, frames[i], lens[i]);
+            parsear_mensaje(copia, lens[i], &m);
+        }
+    }
+    double t_propio = segundos_desde(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int v = 0; v < BENCH_JSON_VUELTAS; v++) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(copia, frames[i], lens[i]);
+            copia[lens[i]] = '\0';
+            bench_json_c(copia);
+        }
+    }
+    double t_c = segundos_desde(&t0);
+
+    double total = (double)n * BENCH_JSON_VUELTAS;
+    double mb = (double)bytes * BENCH_JSON_VUELTAS / 1e6;
+    printf("json: %zu frames de %s (%.1f bytes/frame) x %d vueltas\n",
+           n, ruta, (double)bytes / (double)n, BENCH_JSON_VUELTAS);
+    printf("  %-16s %10s %10s %10s\n", "parser", "ns/frame", "MB/s", "aceptados");
+    printf("  %-16s %10.0f %10.1f %10zu\n", "parsear_mensaje", t_propio * 1e9 / total,
+           t_propio > 0 ? mb / t_propio : 0.0, aceptados);
+    printf("  %-16s %10.0f %10.1f %10zu\n", "json-c", t_c * 1e9 / total,
+           t_c > 0 ? mb / t_c : 0.0, aceptados_c);
+    printf("  frames en los que no coinciden: %zu\n", desacuerdos);
+    ret = 0;
+fin:
+    for (size_t i = 0; i < n; i++) free(frames[i]);
+    free(frames);
+    free(lens);
+    free(linea);
+    free(copia);
+    fclose(f);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// epocas:N: prueba de estrés de la reclamación por épocas. El hilo
+// principal hace N altas y bajas de nombres entre BENCH_EPOCAS_NOMBRES
+// sesiones sin red (vínculos retirados, fichas recicladas, índice rehecho)
+// mientras cfg.hilos lectores con marca propia, como los hilos de servicio,
+// y uno con la marca compartida buscan esos nombres sin parar. Cada lector
+// revisa dentro de su época el vínculo que encontró: compilado con
+// -fsanitize=thread o address, un vínculo liberado antes de tiempo aparece
+// como carrera o uso después de liberar.
+//------------------------------------------------------------------------------
+struct lector_epocas {
+    pthread_t hilo;
+    int marca;                    // tsi que simula; -1 = hilo que no es de servicio
+    const nombre_usuario *nombres;
+    uint64_t busquedas;
+    uint64_t encontrados;
+    uint64_t errores;
+};
+
+static atomic_int bench_epocas_fin = 0;
+
+static void *bench_epocas_lector(void *arg) {
+    struct lector_epocas *l = arg;
+    epoca_hilo = l->marca;
+    uint32_t semilla = 2654435761u * (uint32_t)(l->marca + 2);
+    while (!atomic_load_explicit(&bench_epocas_fin, memory_order_relaxed)) {
+        semilla = semilla * 1103515245u + 12345u;
+        const char *nombre = l->nombres[(semilla >> 8) % BENCH_EPOCAS_NOMBRES];
+        uint32_t h = hash_nombre(nombre);
+        epoca_entrar();
+        struct vinculo_nombre *v = indice_buscar(nombre, h);
+        if (v) {
+            l->encontrados++;
+            if (v->hash != h || strcmp(v->nombre, nombre) != 0 || !v->sesion.ficha)
+                l->errores++;
+        }
+        epoca_salir();
+        l->busquedas++;
+    }
+    return NULL;
+}
+
+static int bench_epocas(int n) {
+    nombre_usuario *nombres = calloc(BENCH_EPOCAS_NOMBRES, sizeof(*nombres));
+    struct per_session_data__chat *sesiones = calloc(BENCH_EPOCAS_NOMBRES, sizeof(*sesiones));
+    struct lector_epocas *lectores = calloc((size_t)cfg.hilos + 1, sizeof(*lectores));
+    int num_lectores = 0, ret = -1;
+    if (!nombres || !sesiones || !lectores) goto fin;
+    for (int i = 0; i < BENCH_EPOCAS_NOMBRES; i++) {
+        snprintf(nombres[i], sizeof(nombres[i]), "epoca-%d", i);
+        struct per_session_data__chat *pss = &sesiones[i];
+        pss->id = atomic_fetch_add(&siguiente_id, 1);
+        pss->shard = i % cfg.hilos;
+        snprintf(pss->ip, sizeof(pss->ip), "127.0.0.1");
+        if (registrar_cliente(pss) < 0) goto fin;
+    }
+
+    uint64_t global_inicial = atomic_load(&epocas.global);
+    for (; num_lectores <= cfg.hilos; num_lectores++) {
+        struct lector_epocas *l = &lectores[num_lectores];
+        l->marca = num_lectores < cfg.hilos ? num_lectores : -1;
+        l->nombres = (const nombre_usuario *)nombres;
+        if (pthread_create(&l->hilo, NULL, bench_epocas_lector, l) != 0) goto fin;
+    }
+
+    // Altas y bajas: de cada 8 bajas, una cierra la sesión entera (retira la
+    // ficha) y la vuelve a abrir con otro id
+    uint64_t altas = 0, bajas = 0, cierres = 0;
+    uint32_t semilla = 12345;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < n; i++) {
+        semilla = semilla * 1103515245u + 12345u;
+        int k = (int)((semilla >> 8) % BENCH_EPOCAS_NOMBRES);
+        struct per_session_data__chat *pss = &sesiones[k];
+        if (!pss->username) {
+            if (asignar_nombre(pss, nombres[k]) == 0) altas++;
+        } else if (i % 8 == 0) {
+            eliminar_cliente(pss);
+            pss->username = NULL;
+            pss->id = atomic_fetch_add(&siguiente_id, 1);
+            if (registrar_cliente(pss) < 0) goto fin;
+            cierres++;
+        } else {
+            liberar_nombre(pss);
+            bajas++;
+        }
+    }
+    double t = segundos_desde(&t0);
+    ret = 0;
+
+fin:
+    atomic_store(&bench_epocas_fin, 1);
+    uint64_t errores = 0;
+    for (int i = 0; i < num_lectores; i++) {
+        pthread_join(lectores[i].hilo, NULL);
+        errores += lectores[i].errores;
+    }
+    if (ret == 0) {
+        printf("epocas: %d operaciones (%" PRIu64 " altas, %" PRIu64 " bajas, %" PRIu64
+               " cierres) en %.3f s, %.0f/s\n", n, altas, bajas, cierres, t,
+               t > 0 ? (double)n / t : 0.0);
+        printf("  épocas avanzadas: %" PRIu64 "\n", (uint64_t)atomic_load(&epocas.global)
+                                                    - global_inicial);
+        for (int i = 0; i < num_lectores; i++) {
+            struct lector_epocas *l = &lectores[i];
+            printf("  lector %-6s %12.0f búsquedas/s, %5.1f%% encontradas, %" PRIu64
+                   " errores\n", l->marca >= 0 ? "propio" : "otros",
+                   t > 0 ? (double)l->busquedas / t : 0.0,
+                   l->busquedas ? 100.0 * (double)l->encontrados / (double)l->busquedas : 0.0,
+                   l->errores);
+        }
+        if (errores) ret = -1;
+    }
+    for (int i = 0; sesiones && i < BENCH_EPOCAS_NOMBRES; i++)
+        if (sesiones[i].ficha) eliminar_cliente(&sesiones[i]);
+    free(nombres);
+    free(sesiones);
+    free(lectores);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// registro:N: N búsquedas por nombre (buscar_sesion, como en un hilo
+// de servicio) con 100, 1k, 10k y BENCH_REGISTRO_MAX sesiones registradas,
+// contra el recorrido lineal con strcmp que hacía buscar_destinatario sobre
+// el arreglo fijo (BENCH_REGISTRO_LINEAL búsquedas). Sin red. Los sondeos
+// por búsqueda son el trabajo del índice; lo que crecen los ns con el tamaño
+// son fallos de caché (tabla y vínculos ya no entran).
+//------------------------------------------------------------------------------
+// "usuario-<i>" sin snprintf, para no medirlo
+static void bench_nombre(char *buf, uint32_t i) {
+    char digitos[16];
+    int n = 0;
+    do {
+        digitos[n++] = (char)('0' + i % 10);
+        i /= 10;
+    } while (i);
+    memcpy(buf, "usuario-", 8);
+    for (int k = 0; k < n; k++) buf[8 + k] = digitos[n - 1 - k];
+    buf[8 + n] = '\0';
+}
+
+// Sondeos promedio de una búsqueda que encuentra su nombre
+static double indice_sondeos(void) {
+    struct tabla_indice *t = atomic_load(&registro.indice);
+    uint64_t sondeos = 0, nombres = 0;
+    for (size_t i = 0; t && i < t->cap; i++) {
+        struct vinculo_nombre *v = atomic_load_explicit(&t->v[i], memory_order_relaxed);
+        if (!v || v == &lapida) continue;
+        sondeos += ((i - v->hash) & (t->cap - 1)) + 1;
+        nombres++;
+    }
+    return nombres ? (double)sondeos / (double)nombres : 0.0;
+}
+
+static int bench_registro(int n) {
+    static const uint32_t tamanos[] = { 100, 1000, 10000, BENCH_REGISTRO_MAX };
+    struct per_session_data__chat *sesiones = calloc(BENCH_REGISTRO_MAX, sizeof(*sesiones));
+    nombre_usuario nombre;
+    uint32_t num = 0;
+    int ret = -1;
+    if (!sesiones) return -1;
+    epoca_hilo = 0;
+
+    printf("registro: %d búsquedas por tamaño\n", n);
+    printf("  %10s %12s %10s %14s\n", "sesiones", "índice ns", "sondeos", "lineal ns");
+    for (size_t t = 0; t < sizeof(tamanos) / sizeof(tamanos[0]); t++) {
+        for (; num < tamanos[t]; num++) {
+            struct per_session_data__chat *pss = &sesiones[num];
+            bench_nombre(nombre, num);
+            pss->id = atomic_fetch_add(&siguiente_id, 1);
+            snprintf(pss->ip, sizeof(pss->ip), "127.0.0.1");
+            if (registrar_cliente(pss) < 0 || asignar_nombre(pss, nombre) < 0) goto fin;
+        }
+
+        uint32_t semilla = 12345;
+        uint64_t encontrados = 0;
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++) {
+            semilla = semilla * 1103515245u + 12345u;
+            bench_nombre(nombre, (semilla >> 8) % num);
+            encontrados += buscar_sesion(nombre).ficha != NULL;
+        }
+        double t_indice = segundos_desde(&t0);
+
+        uint64_t encontrados_lineal = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < BENCH_REGISTRO_LINEAL; i++) {
+            semilla = semilla * 1103515245u + 12345u;
+            bench_nombre(nombre, (semilla >> 8) % num);
+            pthread_rwlock_rdlock(&registro_lock);
+            for (size_t j = 0; j < registro.num_sesiones; j++) {
+                const char *u = registro.sesiones[j]->username;
+                if (u && strcmp(u, nombre) == 0) {
+                    encontrados_lineal++;
+                    break;
+                }
+            }
+            pthread_rwlock_unlock(&registro_lock);
+        }
+        double t_lineal = segundos_desde(&t0);
+        if (encontrados != (uint64_t)n || encontrados_lineal != BENCH_REGISTRO_LINEAL) goto fin;
+        printf("  %10u %12.1f %10.2f %14.1f\n", num, t_indice * 1e9 / n, indice_sondeos(),
+               t_lineal * 1e9 / BENCH_REGISTRO_LINEAL);
+    }
+    ret = 0;
+fin:
+    for (uint32_t i = 0; i < num; i++)
+        if (sesiones[i].ficha) eliminar_cliente(&sesiones[i]);
+    free(sesiones);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// shards:N: reparto de N mensajes (privados entre usuarios de
+// cualquier shard y, 1 de cada BENCH_SHARDS_BROADCAST, broadcasts) con 1, 2,
+// 4... hasta --hilos hilos de servicio, sin red. Cada hilo es dueño de su
+// shard: arma los frames, busca los destinos y entrega por los buzones MPSC
+// igual que en el servidor; en vez de lws_write, vacía las colas de sus
+// sesiones. Las BENCH_SHARDS_SESIONES sesiones se reparten entre los hilos,
+// así que el fan-out de un broadcast no cambia con el número de hilos.
+//------------------------------------------------------------------------------
+struct hilo_bench_shards {
+    pthread_t hilo;
+    int tsi;
+    int mensajes;
+    uint64_t esperados;           // entregas que tienen que salir de sus mensajes
+    uint64_t entregados;          // frames sacados de las colas de su shard
+};
+
+static atomic_int bench_shards_enviando = 0;
+
+// Lo que haría WRITEABLE con cada sesión del shard, sin escribir. Suma a
+// *bytes (si no es NULL) el payload de lo que sacó.
+static uint64_t bench_vaciar_colas(struct shard *sh, uint64_t *bytes) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < sh->num_sesiones; i++) {
+        struct frame_salida *f;
+        while ((f = cola_sacar(&sh->sesiones[i]->cola)) != NULL) {
+            if (bytes) *bytes += f->len;
+            frame_soltar(f);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void *bench_shards_hilo(void *arg) {
+    struct hilo_bench_shards *h = arg;
+    struct shard *sh = &shards[h->tsi];
+    shard_actual = sh;
+    slab_hilo = sh->tsi;
+    epoca_hilo = sh->tsi;
+    char ts[64], contenido[64];
+    nombre_usuario destino;
+    get_timestamp(ts, sizeof(ts));
+    uint32_t semilla = 2654435761u * (uint32_t)(h->tsi + 1);
+    for (int i = 0; i < h->mensajes; i++) {
+        semilla = semilla * 1103515245u + 12345u;
+        snprintf(contenido, sizeof(contenido), "mensaje %d del shard %d", i, sh->tsi);
+        if (i % BENCH_SHARDS_BROADCAST == 0) {
+            enviar_broadcast(json_mensaje_chat("broadcast", "bench", contenido, ts), NULL);
+            h->esperados += BENCH_SHARDS_SESIONES;
+        } else {
+            bench_nombre(destino, (semilla >> 8) % BENCH_SHARDS_SESIONES);
+            enviar_a_usuario(destino, json_privado((uint64_t)i + 1, "bench", contenido, ts));
+            h->esperados++;
+        }
+        if (i % 64 == 63) {
+            shard_drenar_buzon(sh);
+            h->entregados += bench_vaciar_colas(sh, NULL);
+        }
+    }
+    // Seguir recibiendo hasta que todos terminen de enviar; después ya no
+    // queda ningún productor a medio insertar
+    atomic_fetch_sub(&bench_shards_enviando, 1);
+    while (atomic_load(&bench_shards_enviando) > 0) {
+        shard_drenar_buzon(sh);
+        h->entregados += bench_vaciar_colas(sh, NULL);
+        sched_yield();
+    }
+    shard_drenar_buzon(sh);
+    h->entregados += bench_vaciar_colas(sh, NULL);
+    return NULL;
+}
+
+static int bench_shards(int n) {
+    const int max_hilos = cfg.hilos;
+    struct per_session_data__chat *sesiones = calloc(BENCH_SHARDS_SESIONES, sizeof(*sesiones));
+    struct hilo_bench_shards *hilos = calloc((size_t)max_hilos, sizeof(*hilos));
+    nombre_usuario nombre;
+    int ret = -1, num_sesiones = 0;
+    if (!sesiones || !hilos) goto fin;
+
+    printf("shards: %d mensajes (1 de cada %d broadcast) entre %d sesiones\n",
+           n, BENCH_SHARDS_BROADCAST, BENCH_SHARDS_SESIONES);
+    printf("  %6s %10s %14s %14s %8s\n", "hilos", "segundos", "mensajes/s", "entregas/s",
+           "escala");
+    double base = 0;
+    for (int k = 1; ; k *= 2) {
+        if (k > max_hilos) k = max_hilos;
+        cfg.hilos = k;
+        for (int t = 0; t < k; t++) {
+            shards[t].tsi = t;
+            buzon_iniciar(&shards[t].buzon);
+        }
+        for (; num_sesiones < BENCH_SHARDS_SESIONES; num_sesiones++) {
+            struct per_session_data__chat *pss = &sesiones[num_sesiones];
+            memset(pss, 0, sizeof(*pss));
+            pss->id = atomic_fetch_add(&siguiente_id, 1);
+            pss->shard = num_sesiones % k;
+            snprintf(pss->ip, sizeof(pss->ip), "127.0.0.1");
+            bench_nombre(nombre, (uint32_t)num_sesiones);
+            if (cola_iniciar(&pss->cola, cfg.cola_max) < 0 || registrar_cliente(pss) < 0
+                || asignar_nombre(pss, nombre) < 0
+                || shard_agregar(&shards[pss->shard], pss) < 0)
+                goto fin;
+        }
+
+        int creados = 0;
+        atomic_store(&bench_shards_enviando, k);
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (; creados < k; creados++) {
+            struct hilo_bench_shards *h = &hilos[creados];
+            h->tsi = creados;
+            h->mensajes = n / k + (creados < n % k);
+            h->esperados = h->entregados = 0;
+            if (pthread_create(&h->hilo, NULL, bench_shards_hilo, h) != 0) break;
+        }
+        if (creados < k) atomic_fetch_sub(&bench_shards_enviando, k - creados);
+        uint64_t esperados = 0, entregados = 0;
+        for (int t = 0; t < creados; t++) {
+            pthread_join(hilos[t].hilo, NULL);
+            esperados += hilos[t].esperados;
+            entregados += hilos[t].entregados;
+        }
+        double seg = segundos_desde(&t0);
+        if (creados < k || entregados != esperados) {
+            fprintf(stderr, "shards: con %d hilos salieron %" PRIu64 " de %" PRIu64
+                    " entregas\n", k, entregados, esperados);
+            goto fin;
+        }
+        if (k == 1) base = seg;
+        printf("  %6d %10.3f %14.0f %14.0f %7.2fx\n", k, seg, seg > 0 ? n / seg : 0.0,
+               seg > 0 ? (double)entregados / seg : 0.0, seg > 0 ? base / seg : 0.0);
+
+        // Cerrar todo para repartir de nuevo con más hilos
+        for (; num_sesiones > 0; num_sesiones--) {
+            struct per_session_data__chat *pss = &sesiones[num_sesiones - 1];
+            shard_quitar(&shards[pss->shard], pss);
+            eliminar_cliente(pss);
+            cola_liberar(&pss->cola);
+        }
+        if (k == max_hilos) break;
+    }
+    ret = 0;
+fin:
+    for (; num_sesiones > 0; num_sesiones--) {
+        struct per_session_data__chat *pss = &sesiones[num_sesiones - 1];
+        shard_quitar(&shards[pss->shard], pss);
+        if (pss->ficha) eliminar_cliente(pss);
+        cola_liberar(&pss->cola);
+    }
+    cfg.hilos = max_hilos;
+    free(sesiones);
+    free(hilos);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// presencia:N: N usuarios conectados pasan a INACTIVO en la misma
+// pasada de la rueda (lo que hace inactividad_vencida con cada uno). Cuenta
+// los frames y bytes que salen sin agrupar (--presencia-ms=0, un
+// status_update por cambio a cada cliente), con todos los clientes en
+// status_batch y con la mitad en cada forma. Un solo shard, sin red.
+// Descartados: frames que no entraron en la cola del cliente (--cola-max).
+//------------------------------------------------------------------------------
+static int bench_presencia(int n) {
+    static const char *modos[] = { "status_update", "status_batch", "mitad y mitad" };
+    const int hilos = cfg.hilos, ventana = cfg.presencia_ms;
+    struct per_session_data__chat *sesiones = calloc((size_t)n, sizeof(*sesiones));
+    struct shard *sh = &shards[0];
+    nombre_usuario nombre;
+    char ts[64];
+    int ret = -1, num = 0;
+    if (!sesiones) return -1;
+    cfg.hilos = 1;
+    sh->tsi = 0;
+    buzon_iniciar(&sh->buzon);
+    shard_actual = sh;
+    slab_hilo = 0;
+    epoca_hilo = 0;
+    get_timestamp(ts, sizeof(ts));
+    for (; num < n; num++) {
+        struct per_session_data__chat *pss = &sesiones[num];
+        pss->id = atomic_fetch_add(&siguiente_id, 1);
+        snprintf(pss->ip, sizeof(pss->ip), "127.0.0.1");
+        bench_nombre(nombre, (uint32_t)num);
+        if (cola_iniciar(&pss->cola, cfg.cola_max) < 0 || registrar_cliente(pss) < 0
+            || asignar_nombre(pss, nombre) < 0 || shard_agregar(sh, pss) < 0)
+            goto fin;
+    }
+
+    printf("presencia: %d usuarios pasan a INACTIVO en la misma ventana\n", n);
+    printf("  %-14s %12s %14s %12s %10s %10s\n", "clientes", "frames", "bytes",
+           "descartados", "segundos", "reducción");
+    uint64_t base = 0;
+    for (int m = 0; m < 3; m++) {
+        cfg.presencia_ms = m == 0 ? 0 : ventana > 0 ? ventana : PRESENCIA_MS;
+        long con_lotes = 0;
+        for (int i = 0; i < n; i++) {
+            int lotes = m == 1 || (m == 2 && i % 2 == 0);
+            sesiones[i].capacidades = lotes ? CAP_STATUS_BATCH : 0;
+            sesiones[i].ficha->est = ESTADO_ACTIVO;
+            atomic_store(&sesiones[i].ficha->descartados, 0);
+            con_lotes += lotes;
+        }
+        atomic_store(&sesiones_con_lotes, con_lotes);
+        atomic_store(&sesiones_sin_lotes, n - con_lotes);
+
+        // Se vacían las colas después de cada cambio, como si WRITEABLE
+        // diera abasto: así ningún frame se pierde por la cola llena
+        uint64_t frames = 0, bytes = 0;
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++) {
+            sesiones[i].ficha->est = ESTADO_INACTIVO;
+            publicar_estado(sesiones[i].username, ESTADO_INACTIVO, 0, ts);
+            frames += bench_vaciar_colas(sh, &bytes);
+        }
+        if (cfg.presencia_ms > 0) presencia_publicar();
+        frames += bench_vaciar_colas(sh, &bytes);
+        double seg = segundos_desde(&t0);
+        uint64_t descartados = 0;
+        for (int i = 0; i < n; i++) descartados += atomic_load(&sesiones[i].ficha->descartados);
+        if (m == 0) base = frames;
+        printf("  %-14s %12" PRIu64 " %14" PRIu64 " %12" PRIu64 " %10.3f %9.1fx\n", modos[m],
+               frames, bytes, descartados, seg,
+               frames ? (double)base / (double)frames : 0.0);
+    }
+    ret = 0;
+fin:
+    for (; num > 0; num--) {
+        struct per_session_data__chat *pss = &sesiones[num - 1];
+        shard_quitar(sh, pss);
+        if (pss->ficha) eliminar_cliente(pss);
+        cola_liberar(&pss->cola);
+    }
+    atomic_store(&sesiones_con_lotes, 0);
+    atomic_store(&sesiones_sin_lotes, 0);
+    cfg.presencia_ms = ventana;
+    cfg.hilos = hilos;
+    free(sesiones);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// Tabla de benchmarks
+//------------------------------------------------------------------------------
+struct benchmark {
+    const char *nombre;
+    int (*con_n)(int n);                 // NOMBRE:N
+    int (*con_ruta)(const char *ruta);   // NOMBRE:RUTA
+    const char *ayuda;
+};
+
+static const struct benchmark benchmarks[] = {
+    { "buzones", bench_buzones, NULL,
+      "guardar/bajar/vaciar N privados pendientes" },
+    { "deflate", bench_deflate, NULL,
+      "comprimir N broadcasts (--deflate-nivel, --deflate-memoria)" },
+    { "binario", bench_binario, NULL,
+      "JSON contra chat-protocol-bin con N mensajes" },
+    { "json", NULL, bench_json,
+      "parser de entrada contra json-c sobre un corpus (un frame por línea)" },
+    { "epocas", bench_epocas, NULL,
+      "estrés de las búsquedas sin lock (N altas/bajas, --hilos lectores)" },
+    { "registro", bench_registro, NULL,
+      "N búsquedas por nombre con 100, 1k, 10k y 100k sesiones" },
+    { "shards", bench_shards, NULL,
+      "repartir N mensajes con 1, 2, 4... hasta --hilos shards" },
+    { "presencia", bench_presencia, NULL,
+      "frames de presencia cuando N usuarios pasan a INACTIVO juntos" },
+};
+
+static void uso_bench(const char *prog) {
+    fprintf(stderr, "Uso: %s NOMBRE:ARG [opciones del servidor]\n", prog);
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        const struct benchmark *b = &benchmarks[i];
+        char forma[32];
+        snprintf(forma, sizeof(forma), "%s:%s", b->nombre, b->con_n ? "N" : "RUTA");
+        fprintf(stderr, "  %-14s %s\n", forma, b->ayuda);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        uso_bench(argv[0]);
+        return -1;
+    }
+    const struct benchmark *b = NULL;
+    const char *arg = strchr(argv[1], ':');
+    for (size_t i = 0; arg && i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (strlen(benchmarks[i].nombre) == (size_t)(arg - argv[1])
+            && strncmp(argv[1], benchmarks[i].nombre, (size_t)(arg - argv[1])) == 0)
+            b = &benchmarks[i];
+    }
+    long n = 0;
+    if (b && b->con_n) {
+        char *fin;
+        n = strtol(arg + 1, &fin, 10);
+        if (*fin != '\0' || n < 1 || n > INT32_MAX) b = NULL;
+    } else if (b && arg[1] == '\0') {
+        b = NULL;
+    }
+    // argv[1] hace de nombre del programa para parsear_argumentos
+    if (!b || parsear_argumentos(argc - 1, argv + 1) < 0) {
+        uso_bench(argv[0]);
+        return -1;
+    }
+    if (log_iniciar() < 0) {
+        fprintf(stderr, "No se pudo iniciar el hilo de log\n");
+        return -1;
+    }
+    if (iniciar_manejadores() < 0 || bin_tipos_iniciar(&tipos_bin) < 0
+        || limites_iniciar(&tipos_mensaje) < 0) {
+        log_detener();
+        return -1;
+    }
+    atomic_store(&siguiente_mensaje_id, (uint64_t)time(NULL) << 20);
+    int r = b->con_n ? b->con_n((int)n) : b->con_ruta(arg + 1);
+    log_detener();
+    return r;
+}
@@ -6,21 +6,37 @@
  *  - list_users (lista de usuarios y estados)
  *  - user_info (IP y estado de un usuario)
  *  - disconnect (cierra sesión)
+ *  - salas (join, leave y room_message)
+ *
+ * Con --bench no hay menú: simula muchos usuarios para medir el servidor
+ * (ver modo_carga).
+ * Con --binario habla chat-protocol-bin en lugar de JSON (ver
+ * protocolo_bin.h).
  *****************************************************************************/
 
+ #define _GNU_SOURCE          // memmem
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
- #include <unistd.h>          // usleep
  #include <pthread.h>         // hilos
+ #include <stdarg.h>
+ #include <stdint.h>
+ #include <inttypes.h>
+ #include <time.h>
+ #include <unistd.h>          // STDOUT_FILENO
+ #include <sys/ioctl.h>       // TIOCGWINSZ
  #include <libwebsockets.h>
  #include <json-c/json.h>     // Manejo de JSON
+ #include "tabla_tipos.h"     // Despacho por tipo de mensaje
+ #include "protocolo_bin.h"   // chat-protocol-bin (--binario)
  
  //-----------------------------------------------------------------------------
  // Configuraciones
  //-----------------------------------------------------------------------------
- #define MAX_PAYLOAD_SIZE 1024
- #define MAX_CHAT_LINES   20
+ #define MAX_PAYLOAD_SIZE 1024   // bytes por lectura (rx_buffer_size)
+ #define MENSAJE_MAX_DEFECTO 65536  // bytes de un mensaje, al enviar y al recibir
+ #define FRAGMENTO_DEFECTO   16384  // enviar en fragmentos los más largos
+ #define MAX_CHAT_LINES   20     // líneas del log a la vista (--historial guarda más)
  
  //-----------------------------------------------------------------------------
  // Estructura por sesión (aunque aquí la usemos mínimo)
@@ -31,153 +47,877 @@
  //-----------------------------------------------------------------------------
  // Variables globales
  //-----------------------------------------------------------------------------
- static struct lws *global_wsi = NULL;
- static int g_connection_established = 0;
+ static struct lws *global_wsi = NULL;     // solo la toca el hilo de servicio
  static char g_username[100] = "invitado";
  
- // Almacenar las últimas líneas del “chat log” (o mensajes en general)
- static char chat_log[MAX_CHAT_LINES][256];
- static int  chat_count = 0;
+ // Estado de la conexión: lo cambia el hilo de servicio y main lo espera con
+ // g_cond_conexion. g_lock protege también la cola de envío.
+ enum estado_conexion {
+     CONEXION_PENDIENTE,
+     CONEXION_ABIERTA,
+     CONEXION_CERRADA
+ };
+ static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t g_cond_conexion = PTHREAD_COND_INITIALIZER;
+ static enum estado_conexion g_conexion = CONEXION_PENDIENTE;
  
  // Hilo de servicio
  static volatile int stop_service = 0;
  static pthread_t service_thread_id;
  static struct lws_context *global_context = NULL;
  
+ // Copia local de la lista de usuarios y su versión en el servidor
+ // (0 = todavía no hay copia: se pide la lista completa)
+ static char **g_roster = NULL;
+ static int g_roster_num = 0;
+ static volatile unsigned long long g_roster_version = 0;
+ 
+ // Valor de una opción --nombre=valor, o NULL si arg es otra cosa
+ static const char *valor_opcion(const char *arg, const char *nombre) {
+     size_t n = strlen(nombre);
+     if (strncmp(arg, nombre, n) == 0 && arg[n] == '=') return arg + n + 1;
+     return NULL;
+ }
+ 
+ //-----------------------------------------------------------------------------
+ // Historial del chat
+ // Las líneas se guardan una tras otra en una arena circular de bytes, y un
+ // anillo de g_historial entradas dice dónde está cada una: agregar es O(1) y
+ // una línea puede tener cualquier largo. Cuando falta lugar en el anillo o en
+ // la arena se descartan las más viejas. Las posiciones en la arena son
+ // virtuales y solo crecen (la real es pos % arena_cap); una línea no se parte
+ // en el borde, empieza de nuevo al principio.
+ //
+ // Cada línea con emisor apunta a la anterior del mismo emisor, y la tabla de
+ // emisores guarda la última: ver solo las de un usuario recorre esas y nada
+ // más, por grande que sea el historial. g_pantalla protege el historial y la
+ // pantalla, que tocan el hilo de servicio (manejadores) y el del menú.
+ //-----------------------------------------------------------------------------
+ #define HISTORIAL_MAX       1000000
+ #define BYTES_POR_LINEA     128      // promedio previsto, para la arena
+ #define ARENA_MIN           65536
+ 
+ struct linea {
+     uint64_t pos;          // posición virtual en la arena
+     uint32_t len;          // sin el '\0'
+     int32_t emisor;        // índice en emisores, -1 = sin emisor
+     uint64_t anterior;     // número + 1 de la anterior del mismo emisor, 0 = ninguna
+ };
+ 
+ struct emisor {
+     char *nombre;
+     uint64_t ultima;       // número + 1 de su última línea, 0 = ninguna
+     int num;               // sus líneas que siguen en el historial
+ };
+ 
+ static pthread_mutex_t g_pantalla = PTHREAD_MUTEX_INITIALIZER;
+ static int g_historial = 1000;                // --historial
+ static struct linea *lineas = NULL;           // la línea número n está en n % g_historial
+ static char *arena = NULL;
+ static size_t arena_cap = 0;
+ static uint64_t arena_fin = 0;                // posición virtual de la próxima
+ static uint64_t chat_primera = 0;             // número de la más vieja
+ static uint64_t chat_total = 0;               // número de la próxima
+ 
+ static struct emisor *emisores = NULL;
+ static int emisores_num = 0, emisores_cap = 0;
+ static int32_t *emisores_slots = NULL;        // hash -> índice, -1 = libre
+ static uint32_t emisores_mascara = 0;
+ 
+ static int g_desplazamiento = 0;              // líneas sobre el final (0 = lo último)
+ static int32_t g_filtro = -1;                 // emisor a la vista, -1 = todos
+ 
+ static int historial_iniciar(void) {
+     arena_cap = (size_t)g_historial * BYTES_POR_LINEA;
+     if (arena_cap < ARENA_MIN) arena_cap = ARENA_MIN;
+     lineas = calloc((size_t)g_historial, sizeof(*lineas));
+     arena = malloc(arena_cap);
+     return lineas && arena ? 0 : -1;
+ }
+ 
+ static int32_t *slot_emisor(const char *nombre, size_t len) {
+     uint32_t s = tabla_tipos_hash(0, nombre, len) & emisores_mascara;
+     while (emisores_slots[s] >= 0 && strcmp(emisores[emisores_slots[s]].nombre, nombre) != 0)
+         s = (s + 1) & emisores_mascara;
+     return &emisores_slots[s];
+ }
+ 
+ // Índice del emisor; con crear lo agrega si no está. -1 si no está (o no
+ // hay memoria).
+ static int32_t buscar_emisor(const char *nombre, int crear) {
+     size_t len = strlen(nombre);
+     if (emisores_slots) {
+         int32_t *slot = slot_emisor(nombre, len);
+         if (*slot >= 0 || !crear) return *slot;
+     } else if (!crear) {
+         return -1;
+     }
+     // Agrandar a la mitad de carga: se rearma el índice, los emisores no se mueven
+     if (2 * (uint32_t)(emisores_num + 1) > emisores_mascara + 1) {
+         uint32_t slots = emisores_mascara ? 2 * (emisores_mascara + 1) : 64;
+         int32_t *nuevos = malloc(slots * sizeof(*nuevos));
+         if (!nuevos) return -1;
+         memset(nuevos, -1, slots * sizeof(*nuevos));
+         free(emisores_slots);
+         emisores_slots = nuevos;
+         emisores_mascara = slots - 1;
+         for (int i = 0; i < emisores_num; i++)
+             *slot_emisor(emisores[i].nombre, strlen(emisores[i].nombre)) = i;
+     }
+     if (emisores_num == emisores_cap) {
+         int cap = emisores_cap ? 2 * emisores_cap : 32;
+         struct emisor *nuevo = realloc(emisores, (size_t)cap * sizeof(*nuevo));
+         if (!nuevo) return -1;
+         emisores = nuevo;
+         emisores_cap = cap;
+     }
+     char *copia = strdup(nombre);
+     if (!copia) return -1;
+     int32_t i = emisores_num++;
+     emisores[i].nombre = copia;
+     emisores[i].ultima = 0;
+     emisores[i].num = 0;
+     *slot_emisor(nombre, len) = i;
+     return i;
+ }
+ 
+ static struct linea *linea_numero(uint64_t n) {
+     return &lineas[n % g_historial];
+ }
+ 
+ static const char *texto_linea(const struct linea *l) {
+     return &arena[l->pos % arena_cap];
+ }
+ 
+ // Líneas que se pueden ver con el filtro actual
+ static int total_vista(void) {
+     return g_filtro < 0 ? (int)(chat_total - chat_primera) : emisores[g_filtro].num;
+ }
+ 
+ static void acotar_desplazamiento(void) {
+     int max = total_vista() - MAX_CHAT_LINES;
+     if (g_desplazamiento > max) g_desplazamiento = max;
+     if (g_desplazamiento < 0) g_desplazamiento = 0;
+ }
+ 
+ // Agrega al final una línea de hasta len bytes (se corta si no entra en la
+ // arena) y descarta las viejas que haga falta. Con g_pantalla.
+ static struct linea *reservar_linea(size_t len, int32_t emisor) {
+     if (len >= arena_cap) len = arena_cap - 1;
+     uint64_t pos = arena_fin;
+     size_t off = (size_t)(pos % arena_cap);
+     if (off + len + 1 > arena_cap) pos += arena_cap - off;
+     while (chat_total > chat_primera
+            && (chat_total - chat_primera == (uint64_t)g_historial
+                || pos + len + 1 - linea_numero(chat_primera)->pos > arena_cap)) {
+         struct linea *vieja = linea_numero(chat_primera++);
+         if (vieja->emisor >= 0) emisores[vieja->emisor].num--;
+     }
+     struct linea *l = linea_numero(chat_total);
+     l->pos = pos;
+     l->len = (uint32_t)len;
+     l->emisor = emisor;
+     l->anterior = 0;
+     if (emisor >= 0) {
+         l->anterior = emisores[emisor].ultima;
+         emisores[emisor].ultima = chat_total + 1;
+         emisores[emisor].num++;
+     }
+     chat_total++;
+     arena_fin = pos + len + 1;
+     return l;
+ }
+ 
  //-----------------------------------------------------------------------------
- // add_chat_line: agrega una línea al array chat_log, desplazando si está lleno
+ // chat_printf: agrega una línea con formato de printf, de emisor (o NULL si
+ // es del sistema)
  //-----------------------------------------------------------------------------
+ static void chat_printf(const char *emisor, const char *fmt, ...) {
+     va_list ap;
+     va_start(ap, fmt);
+     int n = vsnprintf(NULL, 0, fmt, ap);
+     va_end(ap);
+     if (n < 0) return;
+ 
+     pthread_mutex_lock(&g_pantalla);
+     int32_t e = emisor ? buscar_emisor(emisor, 1) : -1;
+     struct linea *l = reservar_linea((size_t)n, e);
+     va_start(ap, fmt);
+     vsnprintf(&arena[l->pos % arena_cap], l->len + 1, fmt, ap);
+     va_end(ap);
+     // Si se está mirando más arriba, la vista se queda en las mismas líneas
+     if (g_desplazamiento > 0 && (g_filtro < 0 || g_filtro == e)) g_desplazamiento++;
+     acotar_desplazamiento();
+     pthread_mutex_unlock(&g_pantalla);
+ }
+ 
  static void add_chat_line(const char *line) {
-     if (chat_count == MAX_CHAT_LINES) {
-         // Desplazar líneas hacia arriba
-         for (int i = 1; i < MAX_CHAT_LINES; i++) {
-             strcpy(chat_log[i-1], chat_log[i]);
-         }
-         chat_count--;
+     chat_printf(NULL, "%s", line);
+ }
+ 
+ // n > 0 sube n líneas, n < 0 baja, 0 vuelve al final
+ static void desplazar_historial(int n) {
+     pthread_mutex_lock(&g_pantalla);
+     g_desplazamiento = n == 0 ? 0 : g_desplazamiento + n;
+     acotar_desplazamiento();
+     pthread_mutex_unlock(&g_pantalla);
+ }
+ 
+ // Deja a la vista solo las líneas de nombre ("" = todas). -1 si nadie con
+ // ese nombre tiene líneas en el historial.
+ static int filtrar_historial(const char *nombre) {
+     pthread_mutex_lock(&g_pantalla);
+     int32_t e = nombre[0] ? buscar_emisor(nombre, 0) : -1;
+     int r = nombre[0] && (e < 0 || emisores[e].num == 0) ? -1 : 0;
+     if (r == 0) {
+         g_filtro = e;
+         g_desplazamiento = 0;
      }
-     strncpy(chat_log[chat_count], line, sizeof(chat_log[0]) - 1);
-     chat_log[chat_count][sizeof(chat_log[0]) - 1] = '\0';
-     chat_count++;
+     pthread_mutex_unlock(&g_pantalla);
+     return r;
+ }
+ 
+ // Números de las líneas a la vista, de arriba abajo; devuelve cuántas, y en
+ // *desde la posición (desde 1) de la primera entre las total_vista().
+ static int lineas_visibles(uint64_t *vis, int *desde) {
+     int n = 0;
+     if (g_filtro < 0) {
+         uint64_t fin = chat_total - (uint64_t)g_desplazamiento;
+         uint64_t ini = fin - chat_primera > MAX_CHAT_LINES ? fin - MAX_CHAT_LINES : chat_primera;
+         for (uint64_t k = ini; k < fin; k++) vis[n++] = k;
+         *desde = (int)(ini - chat_primera) + 1;
+         return n;
+     }
+     // Por la cadena del emisor, de la última hacia atrás
+     int saltar = g_desplazamiento;
+     for (uint64_t sig = emisores[g_filtro].ultima;
+          sig > chat_primera && n < MAX_CHAT_LINES;
+          sig = linea_numero(sig - 1)->anterior) {
+         if (saltar > 0) saltar--;
+         else vis[MAX_CHAT_LINES - 1 - n++] = sig - 1;
+     }
+     memmove(vis, vis + MAX_CHAT_LINES - n, (size_t)n * sizeof(*vis));
+     *desde = total_vista() - g_desplazamiento - n + 1;
+     return n;
  }
  
  //-----------------------------------------------------------------------------
- // print_interface: limpia pantalla y muestra el chat + menú
+ // Pantalla
+ // Se ven MAX_CHAT_LINES líneas del historial a la vez; la opción 11 desplaza
+ // la vista y la 12 la filtra por emisor. En vez de limpiar y reimprimir todo
+ // en cada evento, se recuerda qué hay dibujado en cada fila y se reescriben
+ // solo las que cambiaron, con secuencias ANSI. print_interface solo marca la
+ // pantalla como sucia: el hilo de servicio la redibuja con un timer, a lo
+ // sumo g_fps veces por segundo.
  //-----------------------------------------------------------------------------
- static void print_interface() {
-     system("clear");
-     printf("========== CHAT LOG (últimas %d líneas) ==========\n", MAX_CHAT_LINES);
-     for (int i = 0; i < chat_count; i++) {
-         printf("%s\n", chat_log[i]);
-     }
-     printf("==================================================\n\n");
- 
-     printf("=== MENÚ ===\n");
-     printf("1) Enviar mensaje (broadcast)\n");
-     printf("2) Enviar mensaje privado\n");
-     printf("3) Cambiar estado (ACTIVO/OCUPADO/INACTIVO)\n");
-     printf("4) Listar usuarios\n");
-     printf("5) Info de usuario\n");
-     printf("6) Desconectar (cerrar sesión)\n");
-     printf("7) Salir del programa\n");
-     printf("Selecciona una opción: ");
+ #define LINEA_MAX   256
+ #define FILAS_LOG   (MAX_CHAT_LINES + 1)     // encabezado + líneas visibles
+ #define SEPARADOR   "=================================================="
+ 
+ static const char *const menu_opciones[] = {
+     "=== MENÚ ===",
+     "1) Enviar mensaje (broadcast)",
+     "2) Enviar mensaje privado",
+     "3) Cambiar estado (ACTIVO/OCUPADO/INACTIVO)",
+     "4) Listar usuarios",
+     "5) Info de usuario",
+     "6) Desconectar (cerrar sesión)",
+     "7) Salir del programa",
+     "8) Unirse a una sala",
+     "9) Salir de una sala",
+     "10) Enviar mensaje a una sala",
+     "11) Desplazar el historial",
+     "12) Ver solo los mensajes de un usuario"
+ };
+ #define FILAS_MENU  ((int)(sizeof(menu_opciones) / sizeof(menu_opciones[0])))
+ // Fila (desde 1) donde van las preguntas del menú
+ #define FILA_PROMPT (FILAS_LOG + 3 + FILAS_MENU)
+ 
+ static int g_fps = 30;                       // --fps
+ 
+ static char filas[FILAS_LOG][LINEA_MAX];     // lo dibujado en cada fila
+ static int pantalla_valida = 0;              // 0 = falta el cuadro completo
+ static int pantalla_sucia = 0;
+ static int g_columnas = 80;
+ static char salida[FILAS_LOG * (LINEA_MAX + 16) + 2048];
+ 
+ // Solo del hilo de servicio
+ static lws_sorted_usec_list_t sul_pantalla;
+ static int pantalla_programada = 0;
+ static lws_usec_t pantalla_ultima = 0;
+ 
+ // 1 si arg es --historial=N o --fps=N, 0 si no lo es, -1 si es inválida
+ static int opcion_pantalla(const char *arg) {
+     const char *v;
+     long n;
+     if ((v = valor_opcion(arg, "--historial")) != NULL) {
+         n = strtol(v, NULL, 10);
+         if (n < MAX_CHAT_LINES || n > HISTORIAL_MAX) return -1;
+         g_historial = (int)n;
+         return 1;
+     }
+     if ((v = valor_opcion(arg, "--fps")) != NULL) {
+         n = strtol(v, NULL, 10);
+         if (n < 1 || n > 1000) return -1;
+         g_fps = (int)n;
+         return 1;
+     }
+     return 0;
+ }
+ 
+ static void columnas_terminal(void) {
+     struct winsize ws;
+     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 1) g_columnas = ws.ws_col;
+ }
+ 
+ // Copia s en out (LINEA_MAX) cortado al ancho de la terminal, para que una
+ // línea larga no baje el resto de la pantalla. Los caracteres de control
+ // pasan a espacios: un mensaje no debe poder mover el cursor.
+ static void copiar_visible(char *out, const char *s) {
+     int cols = g_columnas - 1;
+     size_t n = 0;
+     for (; *s && n < LINEA_MAX - 1; s++) {
+         unsigned char c = (unsigned char)*s;
+         if ((c & 0xC0) != 0x80 && cols-- == 0) break;   // UTF-8: cuenta los que empiezan
+         out[n++] = c < 0x20 || c == 0x7f ? ' ' : (char)c;
+     }
+     out[n] = '\0';
+ }
+ 
+ // Texto de la fila f del log (0 = encabezado), con vis y desde de
+ // lineas_visibles. Con g_pantalla.
+ static void texto_fila(int f, const uint64_t *vis, int n, int desde, char *out) {
+     char tmp[LINEA_MAX];
+     if (f > 0) {
+         if (f <= n) copiar_visible(out, texto_linea(linea_numero(vis[f - 1])));
+         else out[0] = '\0';
+         return;
+     }
+     if (g_filtro >= 0)
+         snprintf(tmp, sizeof(tmp), "========== CHAT LOG de %s (líneas %d-%d de %d) ==========",
+                  emisores[g_filtro].nombre, desde, desde + n - 1, total_vista());
+     else if (g_desplazamiento == 0)
+         snprintf(tmp, sizeof(tmp), "========== CHAT LOG (últimas %d líneas) ==========",
+                  MAX_CHAT_LINES);
+     else
+         snprintf(tmp, sizeof(tmp), "========== CHAT LOG (líneas %d-%d de %d) ==========",
+                  desde, desde + n - 1, total_vista());
+     copiar_visible(out, tmp);
+ }
+ 
+ // Escribe lo que cambió desde el último cuadro, en un solo fwrite. Con
+ // prompt borra la zona de preguntas y lo escribe ahí; con NULL deja el
+ // cursor donde estaba (el usuario puede estar a mitad de una respuesta).
+ // Con g_pantalla tomado.
+ static void dibujar_pantalla(const char *prompt) {
+     char fila[LINEA_MAX];
+     uint64_t vis[MAX_CHAT_LINES];
+     int desde;
+     int num_vis = lineas_visibles(vis, &desde);
+     size_t n = 0;
+     int cambios = 0;
+     if (!pantalla_valida) {
+         columnas_terminal();
+         n += sprintf(salida + n, "\033[H\033[2J\033[%d;1H%s\n\n", FILAS_LOG + 1, SEPARADOR);
+         for (int i = 0; i < FILAS_MENU; i++) n += sprintf(salida + n, "%s\n", menu_opciones[i]);
+         for (int f = 0; f < FILAS_LOG; f++) strcpy(filas[f], "\x01");   // ningún texto la iguala
+         pantalla_valida = 1;
+         cambios = 1;
+         if (!prompt) prompt = "Selecciona una opción: ";
+     }
+     if (!prompt) n += sprintf(salida + n, "\0337");
+     for (int f = 0; f < FILAS_LOG; f++) {
+         texto_fila(f, vis, num_vis, desde, fila);
+         if (strcmp(fila, filas[f]) == 0) continue;
+         strcpy(filas[f], fila);
+         n += sprintf(salida + n, "\033[%d;1H%s\033[K", f + 1, fila);
+         cambios = 1;
+     }
+     pantalla_sucia = 0;
+     if (prompt) n += snprintf(salida + n, sizeof(salida) - n, "\033[%d;1H\033[J%s",
+                               FILA_PROMPT, prompt);
+     else if (!cambios) return;
+     else n += sprintf(salida + n, "\0338");
+     fwrite(salida, 1, n, stdout);
      fflush(stdout);
  }
  
+ //-----------------------------------------------------------------------------
+ // print_interface: pide un redibujo (lo hace el hilo de servicio)
+ //-----------------------------------------------------------------------------
+ static void print_interface() {
+     pthread_mutex_lock(&g_pantalla);
+     int avisar = !pantalla_sucia;
+     pantalla_sucia = 1;
+     pthread_mutex_unlock(&g_pantalla);
+     // Si ya estaba sucia, el cuadro pendiente incluye este cambio
+     if (avisar && global_context) lws_cancel_service(global_context);
+ }
+ 
+ // Dibuja ya, y deja el cursor en la zona de preguntas tras prompt (menú)
+ static void pantalla_prompt(const char *prompt) {
+     pthread_mutex_lock(&g_pantalla);
+     dibujar_pantalla(prompt);
+     pthread_mutex_unlock(&g_pantalla);
+ }
+ 
+ static void redibujar(lws_sorted_usec_list_t *sul) {
+     (void)sul;
+     pantalla_programada = 0;
+     pantalla_ultima = lws_now_usecs();
+     pthread_mutex_lock(&g_pantalla);
+     // Hasta que el menú dibuje el primer cuadro no se toca la terminal
+     if (pantalla_sucia && pantalla_valida) dibujar_pantalla(NULL);
+     pthread_mutex_unlock(&g_pantalla);
+ }
+ 
+ // En EVENT_WAIT_CANCELLED: si hay cambios, agenda un cuadro respetando g_fps
+ static void programar_redibujo(void) {
+     pthread_mutex_lock(&g_pantalla);
+     int sucia = pantalla_sucia;
+     pthread_mutex_unlock(&g_pantalla);
+     if (!sucia || pantalla_programada) return;
+     lws_usec_t espera = pantalla_ultima + LWS_US_PER_SEC / g_fps - lws_now_usecs();
+     lws_sul_schedule(global_context, 0, &sul_pantalla, redibujar, espera > 0 ? espera : 1);
+     pantalla_programada = 1;
+ }
+ 
  //-----------------------------------------------------------------------------
  // service_loop: hilo secundario para lws_service
  //-----------------------------------------------------------------------------
  static void* service_loop(void* arg) {
      struct lws_context *ctx = (struct lws_context *)arg;
+     // lws_service duerme en poll() hasta que hay red, un timer o un
+     // lws_cancel_service (envíos nuevos, o stop_service para terminar)
      while (!stop_service) {
-         lws_service(ctx, 50);
-         usleep(5000); // Evita usar 100% CPU
+         if (lws_service(ctx, 0) < 0) break;
      }
      return NULL;
  }
  
+ static void cambiar_conexion(enum estado_conexion e) {
+     pthread_mutex_lock(&g_lock);
+     g_conexion = e;
+     pthread_cond_broadcast(&g_cond_conexion);
+     pthread_mutex_unlock(&g_lock);
+ }
+ 
+ static int conexion_abierta(void) {
+     pthread_mutex_lock(&g_lock);
+     int abierta = g_conexion == CONEXION_ABIERTA;
+     pthread_mutex_unlock(&g_lock);
+     return abierta;
+ }
+ 
  //-----------------------------------------------------------------------------
- // Funciones de envío de mensajes JSON
+ // Mensajes largos (--mensaje-max, --fragmento)
+ // Los mensajes se arman en memoria propia del tamaño justo, sin truncar, y
+ // los que pasan de g_fragmento bytes salen en varios fragmentos. Lo que
+ // llega en varias partes se rearma en g_entrada antes de parsearlo.
  //-----------------------------------------------------------------------------
+ static size_t g_mensaje_max = MENSAJE_MAX_DEFECTO;
+ static size_t g_fragmento = FRAGMENTO_DEFECTO;
+ static char *g_entrada = NULL;           // mensaje a medio llegar
+ static size_t g_entrada_len = 0, g_entrada_cap = 0;
+ static int g_entrada_descartada = 0;     // pasó g_mensaje_max: se ignora el resto
  
- // Broadcast / Mensaje general
- static int send_json_message(struct lws *wsi, const char *type,
-                              const char *sender, const char *content)
- {
-     if (!wsi) {
-         fprintf(stderr, "[send_json_message] Error: wsi es NULL\n");
+ // Arma un mensaje con formato de printf, con LWS_PRE bytes libres delante.
+ // Devuelve el payload (terminado en '\0', liberar con soltar_json) y su
+ // largo en *len; NULL si no hay memoria o si pasa de g_mensaje_max.
+ static char *armar_json(size_t *len, const char *fmt, ...) {
+     va_list ap;
+     va_start(ap, fmt);
+     int n = vsnprintf(NULL, 0, fmt, ap);
+     va_end(ap);
+     if (n < 0) return NULL;
+     if ((size_t)n > g_mensaje_max) {
+         add_chat_line("[Sistema] Mensaje demasiado largo: no se envió");
+         return NULL;
+     }
+     unsigned char *buf = malloc(LWS_PRE + (size_t)n + 1);
+     if (!buf) return NULL;
+     va_start(ap, fmt);
+     vsnprintf((char *)&buf[LWS_PRE], (size_t)n + 1, fmt, ap);
+     va_end(ap);
+     *len = (size_t)n;
+     return (char *)&buf[LWS_PRE];
+ }
+ 
+ static void soltar_json(char *json) {
+     if (json) free(json - LWS_PRE);
+ }
+ 
+ // Escribe el siguiente fragmento (hasta g_fragmento bytes) de buf, que
+ // tiene LWS_PRE bytes libres delante y len de payload, de los que *enviado
+ // ya salieron. La cabecera del fragmento pisa el final del anterior, que
+ // lws ya envió o copió. Un solo lws_write: solo desde el WRITEABLE de wsi.
+ // Devuelve 1 si terminó el mensaje, 0 si queda algo y -1 si falló.
+ static int escribir_fragmento(struct lws *wsi, unsigned char *buf, size_t len,
+                               size_t *enviado, enum lws_write_protocol tipo) {
+     size_t n = len - *enviado;
+     if (g_fragmento && n > g_fragmento) n = g_fragmento;
+     int modo = *enviado ? LWS_WRITE_CONTINUATION : tipo;
+     if (*enviado + n < len) modo |= LWS_WRITE_NO_FIN;
+     if (lws_write(wsi, &buf[LWS_PRE + *enviado], n, (enum lws_write_protocol)modo) < 0)
          return -1;
+     *enviado += n;
+     return *enviado == len;
+ }
+ 
+ // Junta una parte de un mensaje entrante. Devuelve 1 con el mensaje
+ // completo en *msg (terminado en '\0', válido hasta la próxima llamada), 0
+ // si faltan partes y -1 si el mensaje pasó de g_mensaje_max (se descarta).
+ static int juntar_entrada(const char *in, size_t len, int ultima, char **msg, size_t *msg_len) {
+     if (!g_entrada_descartada) {
+         if (len > g_mensaje_max - g_entrada_len) {
+             g_entrada_descartada = 1;
+         } else if (g_entrada_len + len + 1 > g_entrada_cap) {
+             size_t cap = g_entrada_cap ? g_entrada_cap : MAX_PAYLOAD_SIZE;
+             while (cap < g_entrada_len + len + 1) cap *= 2;
+             char *nuevo = realloc(g_entrada, cap);
+             if (!nuevo) {
+                 g_entrada_descartada = 1;
+             } else {
+                 g_entrada = nuevo;
+                 g_entrada_cap = cap;
+             }
+         }
+         if (!g_entrada_descartada) {
+             if (len) memcpy(g_entrada + g_entrada_len, in, len);
+             g_entrada_len += len;
+         }
+     }
+     if (!ultima) return 0;
+     int descartada = g_entrada_descartada;
+     *msg = g_entrada;
+     *msg_len = g_entrada_len;
+     if (g_entrada) g_entrada[g_entrada_len] = '\0';
+     g_entrada_len = 0;
+     g_entrada_descartada = 0;
+     return descartada || !g_entrada ? -1 : 1;
+ }
+ 
+ // 1 si arg es --mensaje-max=N o --fragmento=N, 0 si no lo es, -1 si es inválida
+ static int opcion_mensajes(const char *arg) {
+     const char *v;
+     long n;
+     if ((v = valor_opcion(arg, "--mensaje-max")) != NULL) {
+         n = strtol(v, NULL, 10);
+         if (n < 256 || n > INT32_MAX) return -1;
+         g_mensaje_max = (size_t)n;
+         return 1;
+     }
+     if ((v = valor_opcion(arg, "--fragmento")) != NULL) {
+         n = strtol(v, NULL, 10);
+         if (n < 0 || (n > 0 && n < 128) || n > INT32_MAX) return -1;
+         g_fragmento = (size_t)n;
+         return 1;
+     }
+     return 0;
+ }
+ 
+ //-----------------------------------------------------------------------------
+ // Protocolo binario (--binario, ver protocolo_bin.h)
+ // Los send_json_* y los manejadores siguen en JSON; acá se traduce en el
+ // borde. Lo que sale se pasa a binario si entra en los campos del protocolo
+ // (si no, va el JSON dentro de un BIN_JSON); lo que llega se vuelve a armar
+ // como el objeto JSON que habría mandado el servidor. Los ids de usuario
+ // los presenta el servidor (BIN_USUARIO) antes de usarlos.
+ //-----------------------------------------------------------------------------
+ static int g_binario = 0;
+ static struct tabla_tipos tipos_bin;
+ static char **g_nombres_bin = NULL;     // id -> nombre
+ static uint32_t g_num_nombres_bin = 0;
+ 
+ static int nombre_bin_guardar(uint32_t id, const struct bin_cadena *nombre) {
+     if (id == 0) return -1;
+     if (id >= g_num_nombres_bin) {
+         uint32_t num = g_num_nombres_bin ? g_num_nombres_bin : 64;
+         while (num <= id) num *= 2;
+         char **n = realloc(g_nombres_bin, num * sizeof(*n));
+         if (!n) return -1;
+         memset(n + g_num_nombres_bin, 0, (num - g_num_nombres_bin) * sizeof(*n));
+         g_nombres_bin = n;
+         g_num_nombres_bin = num;
      }
-     unsigned char buffer[LWS_PRE + MAX_PAYLOAD_SIZE];
-     memset(buffer, 0, sizeof(buffer));
-     char *json_part = (char *)&buffer[LWS_PRE];
+     free(g_nombres_bin[id]);
+     g_nombres_bin[id] = strndup(nombre->p, nombre->len);
+     return g_nombres_bin[id] ? 0 : -1;
+ }
+ 
+ static struct json_object *json_de_usuario(const struct bin_usuario *u) {
+     if (!u->id) return json_object_new_string_len(u->nombre.p, (int)u->nombre.len);
+     if (u->id >= g_num_nombres_bin || !g_nombres_bin[u->id]) return NULL;
+     return json_object_new_string(g_nombres_bin[u->id]);
+ }
  
-     snprintf(json_part, MAX_PAYLOAD_SIZE,
+ // Arma el objeto JSON equivalente a un mensaje binario del servidor.
+ // Devuelve 0 con *obj armado, 1 si era la presentación de un usuario (no
+ // hay objeto) o -1 si el mensaje no es válido.
+ static int objeto_de_binario(const unsigned char *in, size_t len, struct json_object **obj) {
+     struct bin_mensaje b;
+     *obj = NULL;
+     if (bin_decodificar(in, len, &b) < 0 || b.tipo >= BIN_NUM_TIPOS) return -1;
+     if (b.tipo == BIN_USUARIO)
+         return nombre_bin_guardar((uint32_t)b.id, &b.content) < 0 ? -1 : 1;
+     if (b.tipo == BIN_JSON) {
+         char *texto = strndup(b.content.p, b.content.len);
+         if (texto) *obj = json_tokener_parse(texto);
+         free(texto);
+         return *obj ? 0 : -1;
+     }
+ 
+     struct json_object *o = json_object_new_object();
+     json_object_object_add(o, "type", json_object_new_string(bin_nombres_tipo[b.tipo]));
+     if (b.campos & BIN_CAMPO_ID)
+         json_object_object_add(o, "id", json_object_new_int64((int64_t)b.id));
+     struct json_object *u;
+     if (b.campos & BIN_CAMPO_SENDER) {
+         if (!(u = json_de_usuario(&b.sender))) goto invalido;
+         json_object_object_add(o, "sender", u);
+     }
+     if (b.campos & BIN_CAMPO_TARGET) {
+         if (!(u = json_de_usuario(&b.target))) goto invalido;
+         json_object_object_add(o, "target", u);
+     }
+     if (b.campos & BIN_CAMPO_ROOM)
+         json_object_object_add(o, "room", json_object_new_string_len(b.room.p, (int)b.room.len));
+     if (b.campos & BIN_CAMPO_CONTENT)
+         json_object_object_add(o, "content",
+                                json_object_new_string_len(b.content.p, (int)b.content.len));
+     if (b.campos & BIN_CAMPO_TS) {
+         // Mismo formato que el timestamp del servidor (hora local)
+         time_t t = (time_t)(b.ts_us / 1000000u);
+         struct tm tm;
+         char ts[64];
+         localtime_r(&t, &tm);
+         strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+         json_object_object_add(o, "timestamp", json_object_new_string(ts));
+     }
+     *obj = o;
+     return 0;
+ invalido:
+     json_object_put(o);
+     return -1;
+ }
+ 
+ // Llena b con el objeto si todas sus claves entran en el protocolo
+ static int binario_de_objeto(struct json_object *obj, struct bin_mensaje *b) {
+     static const char *const claves[] = { "type", "id", "sender", "target", "room", "content" };
+     memset(b, 0, sizeof(*b));
+     if (!obj || !json_object_is_type(obj, json_type_object)) return -1;
+     int presentes = 0;
+     for (size_t i = 0; i < sizeof(claves) / sizeof(claves[0]); i++) {
+         struct json_object *v = NULL;
+         if (!json_object_object_get_ex(obj, claves[i], &v)) continue;
+         presentes++;
+         if (!v) continue;                       // null: como si no estuviera
+         if (i == 1) {
+             if (!json_object_is_type(v, json_type_int)) return -1;
+             b->id = (uint64_t)json_object_get_int64(v);
+             b->campos |= BIN_CAMPO_ID;
+             continue;
+         }
+         if (!json_object_is_type(v, json_type_string)) return -1;
+         struct bin_cadena c = { json_object_get_string(v),
+                                 (size_t)json_object_get_string_len(v) };
+         if (i < 5 && c.len > UINT16_MAX) return -1;
+         switch (i) {
+         case 0: {
+             int t = tabla_tipos_buscar(&tipos_bin, c.p, c.len);
+             if (t <= BIN_USUARIO) return -1;
+             b->tipo = (uint8_t)t;
+             break;
+         }
+         case 2: b->sender.nombre = c; b->campos |= BIN_CAMPO_SENDER; break;
+         case 3: b->target.nombre = c; b->campos |= BIN_CAMPO_TARGET; break;
+         case 4: b->room = c; b->campos |= BIN_CAMPO_ROOM; break;
+         default: b->content = c; b->campos |= BIN_CAMPO_CONTENT; break;
+         }
+     }
+     if (presentes != json_object_object_length(obj) || !b->tipo) return -1;
+     return 0;
+ }
+ 
+ // Traduce un mensaje JSON ('\0' al final) a chat-protocol-bin. Lo codifica
+ // en buf (cap bytes, con LWS_PRE libres delante) si entra, o si no en
+ // memoria nueva. Devuelve el buffer usado, con el largo en *n; NULL si no
+ // hay memoria.
+ static unsigned char *json_a_binario(const char *json, size_t len, unsigned char *buf,
+                                      size_t cap, size_t *n) {
+     struct json_object *obj = json_tokener_parse(json);
+     struct bin_mensaje b;
+     if (binario_de_objeto(obj, &b) < 0) {
+         memset(&b, 0, sizeof(b));
+         b.tipo = BIN_JSON;
+         b.campos = BIN_CAMPO_CONTENT;
+         b.content.p = json;
+         b.content.len = len;
+     }
+     size_t tam = bin_tam(&b);
+     if (LWS_PRE + tam > cap) buf = malloc(LWS_PRE + tam);
+     if (buf) *n = bin_codificar(&b, &buf[LWS_PRE]);
+     if (obj) json_object_put(obj);
+     return buf;
+ }
+ 
+ //-----------------------------------------------------------------------------
+ // Cola de envío
+ // lws solo admite lws_write desde el callback WRITEABLE del hilo de servicio.
+ // Los send_json_* (que corren en el hilo del menú o en un manejador) arman
+ // el mensaje y lo dejan en esta cola; lws_cancel_service despierta al bucle
+ // de servicio, que en EVENT_WAIT_CANCELLED pide el WRITEABLE, y ahí se
+ // escribe de a un fragmento por callback.
+ //-----------------------------------------------------------------------------
+ struct envio {
+     struct envio *sig;
+     unsigned char *buf;           // payload en buf + LWS_PRE
+     size_t len;
+     size_t enviado;               // bytes ya escritos (fragmentos)
+     enum lws_write_protocol tipo; // LWS_WRITE_TEXT o LWS_WRITE_BINARY
+ };
+ 
+ static struct envio *envios_cabeza = NULL, *envios_cola = NULL;
+ 
+ // Encola json (de armar_json; la cola se queda con él). Devuelve len si
+ // quedó en la cola, -1 si no hay conexión o memoria.
+ static int encolar_envio(char *json, size_t len) {
+     struct envio *e = malloc(sizeof(*e));
+     if (!e) {
+         soltar_json(json);
+         return -1;
+     }
+     e->sig = NULL;
+     e->enviado = 0;
+     if (g_binario) {
+         e->buf = json_a_binario(json, len, NULL, 0, &e->len);
+         e->tipo = LWS_WRITE_BINARY;
+         soltar_json(json);
+         if (!e->buf) {
+             free(e);
+             return -1;
+         }
+     } else {
+         e->buf = (unsigned char *)json - LWS_PRE;
+         e->len = len;
+         e->tipo = LWS_WRITE_TEXT;
+     }
+ 
+     pthread_mutex_lock(&g_lock);
+     int abierta = g_conexion == CONEXION_ABIERTA;
+     if (abierta) {
+         if (envios_cola) envios_cola->sig = e;
+         else envios_cabeza = e;
+         envios_cola = e;
+     }
+     pthread_mutex_unlock(&g_lock);
+     if (!abierta) {
+         free(e->buf);
+         free(e);
+         return -1;
+     }
+     lws_cancel_service(global_context);
+     return (int)len;
+ }
+ 
+ static int hay_envios(void) {
+     pthread_mutex_lock(&g_lock);
+     int hay = envios_cabeza != NULL;
+     pthread_mutex_unlock(&g_lock);
+     return hay;
+ }
+ 
+ // Descarta lo pendiente (la conexión se cerró)
+ static void vaciar_envios(void) {
+     pthread_mutex_lock(&g_lock);
+     struct envio *e = envios_cabeza;
+     envios_cabeza = envios_cola = NULL;
+     pthread_mutex_unlock(&g_lock);
+     while (e) {
+         struct envio *sig = e->sig;
+         free(e->buf);
+         free(e);
+         e = sig;
+     }
+ }
+ 
+ // Escribe el siguiente fragmento del primer envío de la cola (en
+ // CLIENT_WRITEABLE) y pide otro WRITEABLE si queda algo. Solo este hilo
+ // saca de la cola, así que la cabeza no cambia sin el lock.
+ static int drenar_envios(struct lws *wsi) {
+     pthread_mutex_lock(&g_lock);
+     struct envio *e = envios_cabeza;
+     pthread_mutex_unlock(&g_lock);
+     if (!e) return 0;
+ 
+     int r = escribir_fragmento(wsi, e->buf, e->len, &e->enviado, e->tipo);
+     if (r < 0) return -1;
+     if (r) {
+         pthread_mutex_lock(&g_lock);
+         envios_cabeza = e->sig;
+         if (!envios_cabeza) envios_cola = NULL;
+         pthread_mutex_unlock(&g_lock);
+         free(e->buf);
+         free(e);
+     }
+     if (hay_envios()) lws_callback_on_writable(wsi);
+     return 0;
+ }
+ 
+ //-----------------------------------------------------------------------------
+ // Funciones de envío de mensajes JSON
+ //-----------------------------------------------------------------------------
+ 
+ // Broadcast / Mensaje general
+ static int send_json_message(const char *type, const char *sender, const char *content)
+ {
+     size_t msg_len;
+     char *json_part = armar_json(&msg_len,
               "{\"type\":\"%s\",\"sender\":\"%s\",\"content\":\"%s\"}",
               type, sender, content);
- 
-     size_t msg_len = strlen(json_part);
-     int written = lws_write(wsi, (unsigned char *)json_part, msg_len, LWS_WRITE_TEXT);
+     if (!json_part) return -1;
+     int written = encolar_envio(json_part, msg_len);
      if (written < (int)msg_len) {
          fprintf(stderr, "[send_json_message] Error al enviar (ret=%d)\n", written);
          return -1;
      }
  
      // Para que localmente veamos la acción
-     char temp[256];
-     snprintf(temp, sizeof(temp), "[Tú->Broadcast] %s", content);
-     add_chat_line(temp);
+     chat_printf(g_username, "[Tú->Broadcast] %s", content);
      print_interface();
      return 0;
  }
  
  // Mensaje privado
- static int send_json_message_private(struct lws *wsi, const char *sender,
-                                      const char *target, const char *content)
+ static int send_json_message_private(const char *sender, const char *target,
+                                      const char *content)
  {
-     if (!wsi) {
-         fprintf(stderr, "[send_json_message_private] wsi NULL\n");
-         return -1;
-     }
-     unsigned char buffer[LWS_PRE + MAX_PAYLOAD_SIZE];
-     memset(buffer, 0, sizeof(buffer));
-     char *json_part = (char *)&buffer[LWS_PRE];
- 
-     snprintf(json_part, MAX_PAYLOAD_SIZE,
+     size_t msg_len;
+     char *json_part = armar_json(&msg_len,
               "{\"type\":\"private\",\"sender\":\"%s\",\"target\":\"%s\",\"content\":\"%s\"}",
               sender, target, content);
- 
-     size_t msg_len = strlen(json_part);
-     int written = lws_write(wsi, (unsigned char *)json_part, msg_len, LWS_WRITE_TEXT);
+     if (!json_part) return -1;
+     int written = encolar_envio(json_part, msg_len);
      if (written < (int)msg_len) {
          fprintf(stderr, "[send_json_message_private] Error (ret=%d)\n", written);
          return -1;
      }
  
-     char temp[256];
-     snprintf(temp, sizeof(temp), "[Tú->%s] %s", target, content);
-     add_chat_line(temp);
+     chat_printf(g_username, "[Tú->%s] %s", target, content);
      print_interface();
      return 0;
  }
  
  // Cambiar estado
- static int send_json_change_status(struct lws *wsi, const char *sender, const char *nuevo_estado)
+ static int send_json_change_status(const char *sender, const char *nuevo_estado)
  {
-     if (!wsi) {
-         fprintf(stderr, "[send_json_change_status] wsi NULL\n");
-         return -1;
-     }
-     unsigned char buffer[LWS_PRE + MAX_PAYLOAD_SIZE];
-     memset(buffer, 0, sizeof(buffer));
-     char *json_part = (char *)&buffer[LWS_PRE];
- 
      // {type:"change_status", sender:"...", content:"ACTIVO/OCUPADO/INACTIVO"}
-     snprintf(json_part, MAX_PAYLOAD_SIZE,
+     size_t msg_len;
+     char *json_part = armar_json(&msg_len,
               "{\"type\":\"change_status\",\"sender\":\"%s\",\"content\":\"%s\"}",
               sender, nuevo_estado);
- 
-     size_t msg_len = strlen(json_part);
-     int written = lws_write(wsi, (unsigned char *)json_part, msg_len, LWS_WRITE_TEXT);
+     if (!json_part) return -1;
+     int written = encolar_envio(json_part, msg_len);
      if (written < (int)msg_len) {
          fprintf(stderr, "[send_json_change_status] Error (ret=%d)\n", written);
          return -1;
@@ -191,19 +931,23 @@
  }
  
  // Listar usuarios
- static int send_json_list_users(struct lws *wsi, const char *sender)
+ static int send_json_list_users(const char *sender)
  {
-     if (!wsi) return -1;
-     unsigned char buffer[LWS_PRE + MAX_PAYLOAD_SIZE];
-     memset(buffer, 0, sizeof(buffer));
-     char *json_part = (char *)&buffer[LWS_PRE];
- 
-     // {type:"list_users", sender:"..."}
-     snprintf(json_part, MAX_PAYLOAD_SIZE,
-        "{\"type\":\"list_users\",\"sender\":\"%s\",\"content\":null}", sender);
- 
-     size_t msg_len = strlen(json_part);
-     int written = lws_write(wsi, (unsigned char *)json_part, msg_len, LWS_WRITE_TEXT);
+     // {type:"list_users", sender:"..."}; si ya tenemos una copia pedimos
+     // solo los cambios: content {"since_version": N}
+     unsigned long long version = g_roster_version;
+     size_t msg_len;
+     char *json_part;
+     if (version > 0) {
+         json_part = armar_json(&msg_len,
+            "{\"type\":\"list_users\",\"sender\":\"%s\","
+            "\"content\":{\"since_version\":%llu}}", sender, version);
+     } else {
+         json_part = armar_json(&msg_len,
+            "{\"type\":\"list_users\",\"sender\":\"%s\",\"content\":null}", sender);
+     }
+     if (!json_part) return -1;
+     int written = encolar_envio(json_part, msg_len);
      if (written < (int)msg_len) {
          fprintf(stderr, "[send_json_list_users] Error ret=%d\n", written);
          return -1;
@@ -212,20 +956,15 @@
  }
  
  // user_info (IP y estado de un usuario)
- static int send_json_user_info(struct lws *wsi, const char *sender, const char *target)
+ static int send_json_user_info(const char *sender, const char *target)
  {
-     if (!wsi) return -1;
-     unsigned char buffer[LWS_PRE + MAX_PAYLOAD_SIZE];
-     memset(buffer, 0, sizeof(buffer));
-     char *json_part = (char *)&buffer[LWS_PRE];
- 
      // {type:"user_info", sender:"...", target:"..."}
-     snprintf(json_part, MAX_PAYLOAD_SIZE,
+     size_t msg_len;
+     char *json_part = armar_json(&msg_len,
               "{\"type\":\"user_info\",\"sender\":\"%s\",\"target\":\"%s\"}",
               sender, target);
- 
-     size_t msg_len = strlen(json_part);
-     int written = lws_write(wsi, (unsigned char *)json_part, msg_len, LWS_WRITE_TEXT);
+     if (!json_part) return -1;
+     int written = encolar_envio(json_part, msg_len);
      if (written < (int)msg_len) {
          fprintf(stderr, "[send_json_user_info] Error ret=%d\n", written);
          return -1;
@@ -233,21 +972,61 @@
      return 0;
  }
  
- // Desconectarse
- static int send_json_disconnect(struct lws *wsi, const char *sender)
+ // join / leave / room_message (content solo en room_message)
+ static int send_json_room(const char *type, const char *sender, const char *room,
+                           const char *content)
  {
-     if (!wsi) return -1;
-     unsigned char buffer[LWS_PRE + MAX_PAYLOAD_SIZE];
-     memset(buffer, 0, sizeof(buffer));
-     char *json_part = (char *)&buffer[LWS_PRE];
+     // {type:"join"|"leave"|"room_message", sender:"...", room:"...", content:"..."}
+     size_t msg_len;
+     char *json_part;
+     if (content)
+         json_part = armar_json(&msg_len,
+                  "{\"type\":\"%s\",\"sender\":\"%s\",\"room\":\"%s\",\"content\":\"%s\"}",
+                  type, sender, room, content);
+     else
+         json_part = armar_json(&msg_len,
+                  "{\"type\":\"%s\",\"sender\":\"%s\",\"room\":\"%s\"}",
+                  type, sender, room);
+     if (!json_part) return -1;
+     int written = encolar_envio(json_part, msg_len);
+     if (written < (int)msg_len) {
+         fprintf(stderr, "[send_json_room] Error ret=%d\n", written);
+         return -1;
+     }
+     if (content) {
+         chat_printf(g_username, "[Tú->#%s] %s", room, content);
+         print_interface();
+     }
+     return 0;
+ }
+ 
+ // Confirmar al emisor que un privado llegó
+ static int send_json_ack(const char *sender, const char *target, long long id)
+ {
+     // {type:"ack", sender:"...", target:"<emisor>", id:N}
+     size_t msg_len;
+     char *json_part = armar_json(&msg_len,
+              "{\"type\":\"ack\",\"sender\":\"%s\",\"target\":\"%s\",\"id\":%lld}",
+              sender, target, id);
+     if (!json_part) return -1;
+     int written = encolar_envio(json_part, msg_len);
+     if (written < (int)msg_len) {
+         fprintf(stderr, "[send_json_ack] Error ret=%d\n", written);
+         return -1;
+     }
+     return 0;
+ }
  
+ // Desconectarse
+ static int send_json_disconnect(const char *sender)
+ {
      // {type:"disconnect", sender:"...", content:"Cierre de sesión"}
-     snprintf(json_part, MAX_PAYLOAD_SIZE,
+     size_t msg_len;
+     char *json_part = armar_json(&msg_len,
               "{\"type\":\"disconnect\",\"sender\":\"%s\",\"content\":\"Cierre de sesión\"}",
               sender);
- 
-     size_t msg_len = strlen(json_part);
-     int written = lws_write(wsi, (unsigned char *)json_part, msg_len, LWS_WRITE_TEXT);
+     if (!json_part) return -1;
+     int written = encolar_envio(json_part, msg_len);
      if (written < (int)msg_len) {
          fprintf(stderr, "[send_json_disconnect] Error ret=%d\n", written);
          return -1;
@@ -257,6 +1036,302 @@
      return 0;
  }
  
+ //-----------------------------------------------------------------------------
+ // Manejadores de mensajes recibidos
+ // Se despachan por el campo "type" con la tabla de hash perfecto de
+ // tabla_tipos.h; un tipo nuevo solo necesita registrar su manejador en
+ // iniciar_manejadores().
+ //-----------------------------------------------------------------------------
+ struct mensaje_recibido {
+     struct json_object *parsed;
+     struct json_object *jcontent;
+     struct json_object *jtarget;
+     const char *sender_str;
+     const char *content_str;
+ };
+ 
+ typedef void (*manejador_recibido)(const struct mensaje_recibido *m);
+ 
+ static struct tabla_tipos tipos_recibidos;
+ static manejador_recibido manejadores[TABLA_TIPOS_MAX];
+ 
+ static int registrar_manejador(const char *tipo, manejador_recibido fn) {
+     int i = tabla_tipos_agregar(&tipos_recibidos, tipo);
+     if (i < 0) return -1;
+     manejadores[i] = fn;
+     return 0;
+ }
+ 
+ // Broadcast
+ static void manejar_publico(const struct mensaje_recibido *m) {
+     chat_printf(m->sender_str, "[msg público] %s: %s",
+                 m->sender_str ? m->sender_str : "???",
+                 m->content_str ? m->content_str : "");
+ }
+ 
+ // Mensaje privado (si trae id, se confirma la entrega al emisor)
+ static void manejar_privado(const struct mensaje_recibido *m) {
+     chat_printf(m->sender_str, "[msg privado] %s te dice: %s",
+                 m->sender_str ? m->sender_str : "???",
+                 m->content_str ? m->content_str : "");
+ 
+     struct json_object *jid = NULL;
+     if (m->sender_str && json_object_object_get_ex(m->parsed, "id", &jid))
+         send_json_ack(g_username, m->sender_str, (long long)json_object_get_int64(jid));
+ }
+ 
+ // Mensaje de una sala a la que nos unimos
+ static void manejar_mensaje_sala(const struct mensaje_recibido *m) {
+     struct json_object *jroom = NULL;
+     json_object_object_get_ex(m->parsed, "room", &jroom);
+     chat_printf(m->sender_str, "[#%s] %s: %s",
+                 jroom ? json_object_get_string(jroom) : "???",
+                 m->sender_str ? m->sender_str : "???",
+                 m->content_str ? m->content_str : "");
+ }
+ 
+ // room_joined / room_left / room_error
+ static void manejar_respuesta_sala(const struct mensaje_recibido *m) {
+     struct json_object *jroom = NULL, *jmiembros = NULL;
+     json_object_object_get_ex(m->parsed, "room", &jroom);
+     char line[256];
+     if (json_object_object_get_ex(m->parsed, "members", &jmiembros))
+         snprintf(line, sizeof(line), "[Sistema] #%s: %s (%d miembros)",
+                  jroom ? json_object_get_string(jroom) : "???",
+                  m->content_str ? m->content_str : "", json_object_get_int(jmiembros));
+     else
+         snprintf(line, sizeof(line), "[Sistema] #%s: %s",
+                  jroom ? json_object_get_string(jroom) : "???",
+                  m->content_str ? m->content_str : "");
+     add_chat_line(line);
+ }
+ 
+ // Estado de un privado nuestro: "enviado", "en_espera" o "rechazado" (del
+ // servidor) y "entregado" (del destinatario)
+ static void manejar_ack(const struct mensaje_recibido *m) {
+     struct json_object *jid = NULL;
+     json_object_object_get_ex(m->parsed, "id", &jid);
+     const char *estado = m->content_str ? m->content_str : "";
+     if (strcmp(estado, "enviado") == 0) return;   // lo normal: no llenar el log
+     char line[256];
+     if (strcmp(estado, "entregado") == 0) {
+         snprintf(line, sizeof(line), "[Sistema] %s recibió tu mensaje #%lld",
+                  m->sender_str ? m->sender_str : "???",
+                  jid ? (long long)json_object_get_int64(jid) : 0LL);
+     } else {
+         snprintf(line, sizeof(line), "[Sistema] Mensaje #%lld para %s: %s",
+                  jid ? (long long)json_object_get_int64(jid) : 0LL,
+                  m->jtarget ? json_object_get_string(m->jtarget) : "???",
+                  strcmp(estado, "en_espera") == 0
+                      ? "sin conexión, se entregará cuando se registre" : estado);
+     }
+     add_chat_line(line);
+ }
+ 
+ //-----------------------------------------------------------------------------
+ // Roster local
+ //-----------------------------------------------------------------------------
+ static void roster_vaciar(void) {
+     for (int i = 0; i < g_roster_num; i++) free(g_roster[i]);
+     free(g_roster);
+     g_roster = NULL;
+     g_roster_num = 0;
+     g_roster_version = 0;
+ }
+ 
+ static void roster_agregar(const char *usuario) {
+     char **nuevo = realloc(g_roster, (g_roster_num + 1) * sizeof(*nuevo));
+     if (!nuevo) return;
+     g_roster = nuevo;
+     g_roster[g_roster_num] = strdup(usuario);
+     if (g_roster[g_roster_num]) g_roster_num++;
+ }
+ 
+ static void roster_quitar(const char *usuario) {
+     for (int i = 0; i < g_roster_num; i++) {
+         if (strcmp(g_roster[i], usuario) == 0) {
+             free(g_roster[i]);
+             g_roster[i] = g_roster[--g_roster_num];
+             return;
+         }
+     }
+ }
+ 
+ // Reemplaza la copia con un arreglo de nombres y la "version" del mensaje
+ static void roster_reemplazar(struct json_object *jarr, struct json_object *parsed) {
+     roster_vaciar();
+     int n = json_object_array_length(jarr);
+     for (int i = 0; i < n; i++) {
+         struct json_object *juser = json_object_array_get_idx(jarr, i);
+         if (juser) roster_agregar(json_object_get_string(juser));
+     }
+     struct json_object *jversion = NULL;
+     if (json_object_object_get_ex(parsed, "version", &jversion))
+         g_roster_version = (unsigned long long)json_object_get_int64(jversion);
+ }
+ 
+ static void mostrar_roster(void) {
+     char line[256];
+     snprintf(line, sizeof(line), "[Usuarios] Lista (%d):", g_roster_num);
+     add_chat_line(line);
+ 
+     for (int i = 0; i < g_roster_num; i++) {
+         char user_line[256];
+         snprintf(user_line, sizeof(user_line), " - %s", g_roster[i]);
+         add_chat_line(user_line);
+     }
+ }
+ 
+ static void manejar_register_success(const struct mensaje_recibido *m) {
+     struct json_object *jlista = NULL;
+     if (json_object_object_get_ex(m->parsed, "userList", &jlista)
+         && json_object_is_type(jlista, json_type_array))
+         roster_reemplazar(jlista, m->parsed);
+     add_chat_line("[Sistema] Registro exitoso");
+ }
+ 
+ // El nombre ya está en uso por otra sesión
+ static void manejar_register_error(const struct mensaje_recibido *m) {
+     char line[256];
+     snprintf(line, sizeof(line), "[Sistema] Registro rechazado: %s",
+              m->content_str ? m->content_str : "");
+     add_chat_line(line);
+ }
+ 
+ // El servidor descartó un mensaje nuestro por su límite de tasa
+ static void manejar_rate_limited(const struct mensaje_recibido *m) {
+     char line[256];
+     snprintf(line, sizeof(line), "[Sistema] Límite de mensajes: %s",
+              m->content_str ? m->content_str : "");
+     add_chat_line(line);
+ }
+ 
+ // El servidor no reconoció un mensaje nuestro
+ static void manejar_error(const struct mensaje_recibido *m) {
+     char line[256];
+     snprintf(line, sizeof(line), "[Error del servidor] %s",
+              m->content_str ? m->content_str : "");
+     add_chat_line(line);
+ }
+ 
+ static void manejar_status_update(const struct mensaje_recibido *m) {
+     // content: {"user":"...", "status":"..."}
+     struct json_object *jcobj = m->jcontent;
+     if (jcobj) {
+         struct json_object *jusr, *jst;
+         json_object_object_get_ex(jcobj, "user", &jusr);
+         json_object_object_get_ex(jcobj, "status", &jst);
+ 
+         const char *u = jusr ? json_object_get_string(jusr):"???";
+         const char *s = jst  ? json_object_get_string(jst) :"???";
+         char line[256];
+         snprintf(line, sizeof(line),
+                  "[Sistema] %s cambió su estado a %s", u, s);
+         add_chat_line(line);
+     }
+ }
+ 
+ // content: [{"user":"...", "status":"..."}, ...]
+ static void manejar_status_batch(const struct mensaje_recibido *m) {
+     struct json_object *jarr = m->jcontent;
+     if (!jarr || !json_object_is_type(jarr, json_type_array)) return;
+     int n = json_object_array_length(jarr);
+     for (int i = 0; i < n; i++) {
+         struct json_object *jcambio = json_object_array_get_idx(jarr, i);
+         struct json_object *jusr = NULL, *jst = NULL;
+         json_object_object_get_ex(jcambio, "user", &jusr);
+         json_object_object_get_ex(jcambio, "status", &jst);
+ 
+         const char *u = jusr ? json_object_get_string(jusr):"???";
+         const char *s = jst  ? json_object_get_string(jst) :"???";
+         char line[256];
+         snprintf(line, sizeof(line),
+                  "[Sistema] %s cambió su estado a %s", u, s);
+         add_chat_line(line);
+     }
+ }
+ 
+ static void manejar_list_users_response(const struct mensaje_recibido *m) {
+     struct json_object *jcontent = m->jcontent;
+     if (jcontent && json_object_is_type(jcontent, json_type_array)) {
+         roster_reemplazar(jcontent, m->parsed);
+         mostrar_roster();
+     }
+ }
+ 
+ // content: [{"user":"...", "event":"join"|"leave"}, ...] desde since_version
+ static void manejar_list_users_delta(const struct mensaje_recibido *m) {
+     struct json_object *jcontent = m->jcontent;
+     if (!jcontent || !json_object_is_type(jcontent, json_type_array)) return;
+     int n = json_object_array_length(jcontent);
+     for (int i = 0; i < n; i++) {
+         struct json_object *jcambio = json_object_array_get_idx(jcontent, i);
+         struct json_object *jusr = NULL, *jev = NULL;
+         json_object_object_get_ex(jcambio, "user", &jusr);
+         json_object_object_get_ex(jcambio, "event", &jev);
+         if (!jusr || !jev) continue;
+         const char *u = json_object_get_string(jusr);
+         if (strcmp(json_object_get_string(jev), "join") == 0) roster_agregar(u);
+         else roster_quitar(u);
+     }
+     struct json_object *jversion = NULL;
+     if (json_object_object_get_ex(m->parsed, "version", &jversion))
+         g_roster_version = (unsigned long long)json_object_get_int64(jversion);
+     mostrar_roster();
+ }
+ 
+ static void manejar_user_info_response(const struct mensaje_recibido *m) {
+     // "content": {"ip":"...", "status":"..."}, "target":"usuario"
+     struct json_object *jcont = m->jcontent;
+     if (jcont) {
+         struct json_object *jip, *jst;
+         json_object_object_get_ex(jcont, "ip", &jip);
+         json_object_object_get_ex(jcont, "status", &jst);
+         const char *ip_str = jip ? json_object_get_string(jip) :"???";
+         const char *st_str = jst ? json_object_get_string(jst) :"???";
+ 
+         const char *targ_str = m->jtarget ? json_object_get_string(m->jtarget) : "???";
+         char line[256];
+         snprintf(line, sizeof(line),
+                  "[Info] %s => IP: %s, Estado: %s", targ_str, ip_str, st_str);
+         add_chat_line(line);
+     }
+ }
+ 
+ static void manejar_user_disconnected(const struct mensaje_recibido *m) {
+     // content: "<nombre_usuario> ha salido"
+     // El server forzará cierre
+     char line[256];
+     snprintf(line, sizeof(line),
+              "[Sistema] %s", m->content_str ? m->content_str : "(desconectado)");
+     add_chat_line(line);
+ }
+ 
+ static int iniciar_manejadores(void) {
+     tabla_tipos_iniciar(&tipos_recibidos);
+     // El servidor reenvía los mensajes generales con type "broadcast"
+     if (registrar_manejador("chat", manejar_publico) < 0
+         || registrar_manejador("broadcast", manejar_publico) < 0
+         || registrar_manejador("private", manejar_privado) < 0
+         || registrar_manejador("ack", manejar_ack) < 0
+         || registrar_manejador("room_message", manejar_mensaje_sala) < 0
+         || registrar_manejador("room_joined", manejar_respuesta_sala) < 0
+         || registrar_manejador("room_left", manejar_respuesta_sala) < 0
+         || registrar_manejador("room_error", manejar_respuesta_sala) < 0
+         || registrar_manejador("register_success", manejar_register_success) < 0
+         || registrar_manejador("register_error", manejar_register_error) < 0
+         || registrar_manejador("error", manejar_error) < 0
+         || registrar_manejador("rate_limited", manejar_rate_limited) < 0
+         || registrar_manejador("status_update", manejar_status_update) < 0
+         || registrar_manejador("status_batch", manejar_status_batch) < 0
+         || registrar_manejador("list_users_response", manejar_list_users_response) < 0
+         || registrar_manejador("list_users_delta", manejar_list_users_delta) < 0
+         || registrar_manejador("user_info_response", manejar_user_info_response) < 0
+         || registrar_manejador("user_disconnected", manejar_user_disconnected) < 0)
+         return -1;
+     return 0;
+ }
+ 
  //-----------------------------------------------------------------------------
  // Callback lws
  //-----------------------------------------------------------------------------
@@ -267,14 +1342,45 @@
      case LWS_CALLBACK_CLIENT_ESTABLISHED:
          add_chat_line("[Sistema] Conexión establecida");
          global_wsi = wsi;
-         g_connection_established = 1;
+         cambiar_conexion(CONEXION_ABIERTA);
          print_interface();
          break;
  
-     case LWS_CALLBACK_CLIENT_RECEIVE:
-         if (in && len > 0) {
-             // Parsear JSON
-             struct json_object *parsed = json_tokener_parse((char *)in);
+     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+         add_chat_line("[Sistema] No se pudo conectar");
+         cambiar_conexion(CONEXION_CERRADA);
+         break;
+ 
+     case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+         // Un send_json_* dejó algo en la cola, o hay que redibujar
+         if (global_wsi && hay_envios()) lws_callback_on_writable(global_wsi);
+         programar_redibujo();
+         break;
+ 
+     case LWS_CALLBACK_CLIENT_WRITEABLE:
+         return drenar_envios(wsi);
+ 
+     case LWS_CALLBACK_CLIENT_RECEIVE: {
+         // Lo que llega en partes se junta antes de parsear
+         char *msg;
+         size_t msg_len;
+         int completo = juntar_entrada(in, len, lws_is_final_fragment(wsi), &msg, &msg_len);
+         if (completo < 0) {
+             add_chat_line("[Sistema] Mensaje descartado: supera --mensaje-max");
+             print_interface();
+             break;
+         }
+         if (completo == 0) break;
+         in = msg;
+         len = msg_len;
+         if (len > 0) {
+             // Parsear JSON (o rearmarlo desde binario)
+             struct json_object *parsed = NULL;
+             if (g_binario && lws_frame_is_binary(wsi)) {
+                 if (objeto_de_binario(in, len, &parsed) > 0) break;   // presentación
+             } else {
+                 parsed = json_tokener_parse((char *)in);
+             }
              if (!parsed) {
                  // Mensaje no-JSON
                  char raw_line[256];
@@ -285,100 +1391,23 @@
                  break;
              }
  
-             // Campos: type, sender, content, ...
-             struct json_object *jtype, *jsender, *jcontent, *jusers, *jtarget;
+             // Campos: type, sender, content, target
+             struct json_object *jtype = NULL, *jsender = NULL;
+             struct mensaje_recibido m = { parsed, NULL, NULL, NULL, NULL };
              json_object_object_get_ex(parsed, "type", &jtype);
              json_object_object_get_ex(parsed, "sender", &jsender);
-             json_object_object_get_ex(parsed, "content", &jcontent);
-             // Para list_users
-             json_object_object_get_ex(parsed, "content", &jusers);
-             // user_info_response
-             json_object_object_get_ex(parsed, "target", &jtarget);
- 
-             const char *type_str    = jtype    ? json_object_get_string(jtype)    : NULL;
-             const char *sender_str  = jsender  ? json_object_get_string(jsender)  : NULL;
-             const char *content_str = jcontent ? json_object_get_string(jcontent) : NULL;
- 
-             if (type_str && strcmp(type_str, "chat") == 0) {
-                 // Broadcast
-                 char line[256];
-                 snprintf(line, sizeof(line),
-                          "[msg público] %s: %s",
-                          sender_str ? sender_str : "???",
-                          content_str ? content_str : "");
-                 add_chat_line(line);
-             }
-             else if (type_str && strcmp(type_str, "private") == 0) {
-                 // Mensaje privado
-                 char line[256];
-                 snprintf(line, sizeof(line),
-                          "[msg privado] %s te dice: %s",
-                          sender_str ? sender_str : "???",
-                          content_str ? content_str : "");
-                 add_chat_line(line);
-             }
-             else if (type_str && strcmp(type_str, "register_success") == 0) {
-                 add_chat_line("[Sistema] Registro exitoso");
-             }
-             else if (type_str && strcmp(type_str, "status_update") == 0) {
-                 // content: {"user":"...", "status":"..."}
-                 struct json_object *jcobj = jcontent; 
-                 if (jcobj) {
-                     struct json_object *jusr, *jst;
-                     json_object_object_get_ex(jcobj, "user", &jusr);
-                     json_object_object_get_ex(jcobj, "status", &jst);
- 
-                     const char *u = jusr ? json_object_get_string(jusr):"???";
-                     const char *s = jst  ? json_object_get_string(jst) :"???";
-                     char line[256];
-                     snprintf(line, sizeof(line),
-                              "[Sistema] %s cambió su estado a %s", u, s);
-                     add_chat_line(line);
-                 }
-             }
-             else if (type_str && strcmp(type_str, "list_users_response") == 0) {
-                if (jcontent && json_object_is_type(jcontent, json_type_array)) {
-                    int arr_len = json_object_array_length(jcontent);
-                    char line[256];
-                    snprintf(line, sizeof(line), "[Usuarios] Lista (%d):", arr_len);
-                    add_chat_line(line);
-            
-                    for (int i = 0; i < arr_len; i++) {
-                        struct json_object *juser = json_object_array_get_idx(jcontent, i);
-                        const char *uname = juser ? json_object_get_string(juser) : "???";
-                        char user_line[256];
-                        snprintf(user_line, sizeof(user_line), " - %s", uname);
-                        add_chat_line(user_line);
-                    }
-                }
-            }
-             else if (type_str && strcmp(type_str, "user_info_response") == 0) {
-                 // "content": {"ip":"...", "status":"..."}, "target":"usuario"
-                 struct json_object *jcont;
-                 json_object_object_get_ex(parsed, "content", &jcont);
-                 if (jcont) {
-                     struct json_object *jip, *jst;
-                     json_object_object_get_ex(jcont, "ip", &jip);
-                     json_object_object_get_ex(jcont, "status", &jst);
-                     const char *ip_str = jip ? json_object_get_string(jip) :"???";
-                     const char *st_str = jst ? json_object_get_string(jst) :"???";
- 
-                     const char *targ_str = jtarget ? json_object_get_string(jtarget) : "???";
-                     char line[256];
-                     snprintf(line, sizeof(line),
-                              "[Info] %s => IP: %s, Estado: %s", targ_str, ip_str, st_str);
-                     add_chat_line(line);
-                 }
-             }
-             else if (type_str && strcmp(type_str, "user_disconnected") == 0) {
-                 // content: "<nombre_usuario> ha salido"
-                 // El server forzará cierre
-                 char line[256];
-                 snprintf(line, sizeof(line),
-                          "[Sistema] %s", content_str ? content_str : "(desconectado)");
-                 add_chat_line(line);
-             }
-             else {
+             json_object_object_get_ex(parsed, "content", &m.jcontent);
+             json_object_object_get_ex(parsed, "target", &m.jtarget);
+             m.sender_str  = jsender    ? json_object_get_string(jsender)    : NULL;
+             m.content_str = m.jcontent ? json_object_get_string(m.jcontent) : NULL;
+ 
+             const char *type_str = jtype ? json_object_get_string(jtype) : NULL;
+             int i = type_str ? tabla_tipos_buscar(&tipos_recibidos, type_str,
+                                                   strlen(type_str))
+                              : -1;
+             if (i >= 0) {
+                 manejadores[i](&m);
+             } else {
                  // Mostrar tal cual
                  char line[256];
                  snprintf(line, sizeof(line),
@@ -393,11 +1422,15 @@
              print_interface();
          }
          break;
+     }
  
-     case LWS_CALLBACK_CLOSED:
+     case LWS_CALLBACK_CLIENT_CLOSED:
          add_chat_line("[Sistema] Conexión cerrada");
          global_wsi = NULL;
-         g_connection_established = 0;
+         g_entrada_len = 0;
+         g_entrada_descartada = 0;
+         cambiar_conexion(CONEXION_CERRADA);
+         vaciar_envios();
          print_interface();
          break;
  
@@ -413,18 +1446,18 @@
  //-----------------------------------------------------------------------------
  static void menu_interactivo(void) {
      while (1) {
-         print_interface();
+         pantalla_prompt("Selecciona una opción: ");
  
          int opcion = 0;
          if (scanf("%d", &opcion) != 1) {
-             fprintf(stderr, "[Sistema] Entrada inválida.\n");
+             add_chat_line("[Sistema] Entrada inválida.");
              fseek(stdin, 0, SEEK_END);
              continue;
          }
          // Consumir salto
          fgetc(stdin);
  
-         if (!g_connection_established || !global_wsi) {
+         if (opcion != 11 && opcion != 12 && !conexion_abierta()) {
              add_chat_line("[Sistema] Conexión no establecida aún.");
              continue;
          }
@@ -440,7 +1473,7 @@
              }
              mensaje[strcspn(mensaje, "\n")] = 0;
              // Usamos 'broadcast' en lugar de 'chat' si quieres apegarte EXACTO al PDF
-             send_json_message(global_wsi, "broadcast", g_username, mensaje);
+             send_json_message("broadcast", g_username, mensaje);
              break;
          }
          case 2: {
@@ -463,7 +1496,7 @@
              mensaje[strcspn(mensaje, "\n")] = 0;
  
              // 'private' apega 100% al PDF
-             send_json_message_private(global_wsi, g_username, target, mensaje);
+             send_json_message_private(g_username, target, mensaje);
              break;
          }
          case 3: {
@@ -478,16 +1511,16 @@
              fgetc(stdin);
              // mandar change_status
              // {type:"change_status",sender:"...",content:"ACTIVO/OCUPADO/INACTIVO"}
-                send_json_change_status(global_wsi, g_username, nuevo_est);
+                send_json_change_status(g_username, nuevo_est);
                 char msg[256];
                 snprintf(msg, sizeof(msg), "%s ha cambiado su estado a %s", g_username, nuevo_est);
-                send_json_message(global_wsi, "broadcast", g_username, msg);
+                send_json_message("broadcast", g_username, msg);
 
              break;
          }
          case 4: {
              // list_users
-             send_json_list_users(global_wsi, g_username);
+             send_json_list_users(g_username);
              break;
          }
          case 5: {
@@ -500,16 +1533,16 @@
                  break;
              }
              fgetc(stdin);
-             send_json_user_info(global_wsi, g_username, targ);
+             send_json_user_info(g_username, targ);
              break;
          }
          case 6: {
              // desconectar
              // {type:"disconnect", sender:"...", content:"Cierre de sesión"}
-                send_json_disconnect(global_wsi, g_username);
+                send_json_disconnect(g_username);
                 char msg[256];
                 snprintf(msg, sizeof(msg), "%s ha cerrado sesión", g_username);
-                send_json_message(global_wsi, "broadcast", g_username, msg);
+                send_json_message("broadcast", g_username, msg);
              
              break;
          }
@@ -518,6 +1551,67 @@
              add_chat_line("[Sistema] Saliendo del programa local...");
              print_interface();
              return;
+         case 8:
+         case 9: {
+             // join / leave
+             char sala[65];
+             printf("Sala: ");
+             if (scanf("%64s", sala) != 1) {
+                 fseek(stdin, 0, SEEK_END);
+                 add_chat_line("[Sistema] Error al leer la sala.");
+                 break;
+             }
+             fgetc(stdin);
+             send_json_room(opcion == 8 ? "join" : "leave", g_username, sala, NULL);
+             break;
+         }
+         case 10: {
+             // room_message
+             char sala[65];
+             char mensaje[256];
+             printf("Sala: ");
+             if (scanf("%64s", sala) != 1) {
+                 fseek(stdin, 0, SEEK_END);
+                 add_chat_line("[Sistema] Error al leer la sala.");
+                 break;
+             }
+             fgetc(stdin);
+ 
+             printf("Mensaje para la sala: ");
+             if (fgets(mensaje, sizeof(mensaje), stdin) == NULL) {
+                 add_chat_line("[Sistema] Error al leer el mensaje.");
+                 break;
+             }
+             mensaje[strcspn(mensaje, "\n")] = 0;
+             send_json_room("room_message", g_username, sala, mensaje);
+             break;
+         }
+         case 11: {
+             // desplazar el historial (local)
+             int lineas;
+             printf("Líneas a subir (negativo baja, 0 vuelve al final): ");
+             if (scanf("%d", &lineas) != 1) {
+                 fseek(stdin, 0, SEEK_END);
+                 add_chat_line("[Sistema] Error al leer las líneas.");
+                 break;
+             }
+             fgetc(stdin);
+             desplazar_historial(lineas);
+             break;
+         }
+         case 12: {
+             // filtrar el historial por emisor (local)
+             char nombre[100];
+             printf("Usuario (vacío = todos): ");
+             if (fgets(nombre, sizeof(nombre), stdin) == NULL) {
+                 add_chat_line("[Sistema] Error al leer el usuario.");
+                 break;
+             }
+             nombre[strcspn(nombre, "\n")] = 0;
+             if (filtrar_historial(nombre) < 0)
+                 add_chat_line("[Sistema] Ese usuario no tiene mensajes en el historial.");
+             break;
+         }
          default:
              add_chat_line("[Sistema] Opción inválida.");
              break;
@@ -525,12 +1619,545 @@
      }
  }
  
+ //-----------------------------------------------------------------------------
+ // Compresión (permessage-deflate)
+ // lws comprime y descomprime solo; acá se arma la oferta. Con
+ // --deflate-compartido se pide server_no_context_takeover, que le permite al
+ // servidor comprimir cada broadcast una sola vez para todos (a costa de
+ // comprimir peor); --deflate-ventana=N pide server_max_window_bits=N.
+ //-----------------------------------------------------------------------------
+ static int deflate_activo = 1;
+ static int deflate_compartido = 0;
+ static int deflate_ventana = 0;             // 0 = la que elija el servidor
+ static char oferta_deflate[128];
+ static struct lws_extension extensiones[2];
+ 
+ // 1 si arg es una opción de compresión, 0 si no lo es, -1 si es inválida
+ static int opcion_deflate(const char *arg) {
+     const char *v;
+     if (strcmp(arg, "--sin-deflate") == 0) {
+         deflate_activo = 0;
+     } else if (strcmp(arg, "--deflate-compartido") == 0) {
+         deflate_compartido = 1;
+     } else if ((v = valor_opcion(arg, "--deflate-ventana")) != NULL) {
+         deflate_ventana = atoi(v);
+         if (deflate_ventana < 9 || deflate_ventana > 15) return -1;
+     } else {
+         return 0;
+     }
+     return 1;
+ }
+ 
+ // Extensiones para info.extensions (NULL sin compresión)
+ static const struct lws_extension *extensiones_deflate(void) {
+     if (!deflate_activo) return NULL;
+     int n = snprintf(oferta_deflate, sizeof(oferta_deflate),
+                      "permessage-deflate; client_max_window_bits");
+     if (deflate_compartido)
+         n += snprintf(oferta_deflate + n, sizeof(oferta_deflate) - (size_t)n,
+                       "; server_no_context_takeover");
+     if (deflate_ventana)
+         snprintf(oferta_deflate + n, sizeof(oferta_deflate) - (size_t)n,
+                  "; server_max_window_bits=%d", deflate_ventana);
+     extensiones[0].name = "permessage-deflate";
+     extensiones[0].callback = lws_extension_callback_pm_deflate;
+     extensiones[0].client_offer = oferta_deflate;
+     return extensiones;
+ }
+ 
+ //-----------------------------------------------------------------------------
+ // Modo de carga (--bench)
+ // Abre K conexiones desde un solo lws_context, cada una con un usuario
+ // simulado que manda una mezcla de mensajes a ritmo fijo (sin menú ni
+ // pantalla). Los broadcast/private llevan en el content la hora de envío
+ // ("bench:<us>") y quien los recibe mide la latencia de punta a punta.
+ //-----------------------------------------------------------------------------
+ #define HIST_SUB 64            // sub-cubetas por potencia de 2 (~1.5% de error)
+ 
+ enum accion_carga {
+     ACC_BROADCAST,
+     ACC_PRIVATE,
+     ACC_LIST_USERS,
+     ACC_CHANGE_STATUS,
+     ACC_DISCONNECT,
+     NUM_ACCIONES
+ };
+ 
+ static const char *nombres_accion[NUM_ACCIONES] = {
+     "broadcast", "private", "list_users", "change_status", "disconnect"
+ };
+ 
+ struct config_carga {
+     int usuarios;                 // conexiones simultáneas
+     double tasa;                  // mensajes/s entre todos los usuarios
+     int duracion;                 // segundos
+     int pesos[NUM_ACCIONES];      // mezcla de acciones
+     const char *servidor;
+     int puerto;
+ };
+ 
+ static struct config_carga ccarga = {
+     100, 1000.0, 10, { 70, 20, 4, 5, 1 }, "localhost", 8080
+ };
+ 
+ struct usuario_simulado {
+     int id;
+     char nombre[32];
+     struct lws *wsi;
+     int registrado;
+     lws_sorted_usec_list_t sul;     // próximo envío o reconexión
+     unsigned char pendiente[LWS_PRE + MAX_PAYLOAD_SIZE];
+     unsigned char binario[LWS_PRE + 64 + MAX_PAYLOAD_SIZE];
+     unsigned char *salida;          // pendiente, binario o memoria propia
+     size_t len_pendiente;           // de salida; 0 = nada que escribir
+     size_t enviado;                 // bytes de salida ya escritos
+     enum lws_write_protocol tipo;
+     int cerrar_tras_envio;          // disconnect: cerrar al escribirlo
+     int cuenta_envio;               // el pendiente cuenta como mensaje enviado
+     int en_partes;                  // llegando un mensaje en varias partes
+ };
+ 
+ static struct lws_context *ctx_carga = NULL;
+ static struct usuario_simulado *simulados = NULL;
+ static lws_sorted_usec_list_t sul_reporte;
+ static lws_usec_t inicio_carga;
+ static volatile int fin_carga = 0;
+ static unsigned int semilla_carga = 1;
+ 
+ // Contadores (todo corre en el hilo de lws_service)
+ static uint64_t enviados = 0, entregas = 0, recibidos = 0;
+ static uint64_t omitidos = 0, errores = 0, conectados = 0, limitados = 0;
+ static uint64_t enviados_antes = 0, entregas_antes = 0;
+ static uint64_t hist_latencia[64][HIST_SUB];
+ static uint64_t latencia_max = 0;
+ 
+ // Histograma log-lineal: valores < 64 exactos, después 64 cubetas por octava
+ static void hist_registrar(uint64_t us) {
+     if (us > latencia_max) latencia_max = us;
+     if (us < HIST_SUB) {
+         hist_latencia[0][us]++;
+         return;
+     }
+     int e = 63 - __builtin_clzll(us);
+     hist_latencia[e - 5][(us >> (e - 6)) & (HIST_SUB - 1)]++;
+ }
+ 
+ static uint64_t hist_percentil(double p) {
+     uint64_t total = 0;
+     for (int k = 0; k < 64; k++)
+         for (int s = 0; s < HIST_SUB; s++) total += hist_latencia[k][s];
+     if (total == 0) return 0;
+     uint64_t objetivo = (uint64_t)(p * (double)total);
+     if (objetivo >= total) objetivo = total - 1;
+     uint64_t acumulado = 0;
+     for (int k = 0; k < 64; k++) {
+         for (int s = 0; s < HIST_SUB; s++) {
+             acumulado += hist_latencia[k][s];
+             if (acumulado > objetivo)
+                 return k == 0 ? (uint64_t)s : (uint64_t)(HIST_SUB + s) << (k - 1);
+         }
+     }
+     return latencia_max;
+ }
+ 
+ static int aleatorio(int n) {
+     return (int)(rand_r(&semilla_carga) % (unsigned)n);
+ }
+ 
+ static enum accion_carga elegir_accion(void) {
+     int total = 0;
+     for (int i = 0; i < NUM_ACCIONES; i++) total += ccarga.pesos[i];
+     int r = aleatorio(total);
+     for (int i = 0; i < NUM_ACCIONES; i++) {
+         if (r < ccarga.pesos[i]) return (enum accion_carga)i;
+         r -= ccarga.pesos[i];
+     }
+     return ACC_BROADCAST;
+ }
+ 
+ // Deja un mensaje listo para el próximo WRITEABLE
+ static void carga_preparar(struct usuario_simulado *u, int cuenta, const char *fmt, ...) {
+     va_list ap;
+     va_start(ap, fmt);
+     int n = vsnprintf((char *)&u->pendiente[LWS_PRE], MAX_PAYLOAD_SIZE, fmt, ap);
+     va_end(ap);
+     if (n < 0 || n >= MAX_PAYLOAD_SIZE) return;
+     if (g_binario) {
+         u->salida = json_a_binario((char *)&u->pendiente[LWS_PRE], (size_t)n, u->binario,
+                                    sizeof(u->binario), &u->len_pendiente);
+         if (!u->salida) {
+             u->len_pendiente = 0;
+             errores++;
+             return;
+         }
+         u->tipo = LWS_WRITE_BINARY;
+     } else {
+         u->salida = u->pendiente;
+         u->len_pendiente = (size_t)n;
+         u->tipo = LWS_WRITE_TEXT;
+     }
+     u->enviado = 0;
+     u->cuenta_envio = cuenta;
+     lws_callback_on_writable(u->wsi);
+ }
+ 
+ // Descarta el mensaje pendiente (a medio escribir o no)
+ static void carga_soltar(struct usuario_simulado *u) {
+     if (u->salida && u->salida != u->pendiente && u->salida != u->binario) free(u->salida);
+     u->salida = NULL;
+     u->len_pendiente = 0;
+     u->enviado = 0;
+ }
+ 
+ static void carga_conectar(struct usuario_simulado *u);
+ 
+ static void carga_reconectar(lws_sorted_usec_list_t *sul) {
+     struct usuario_simulado *u = lws_container_of(sul, struct usuario_simulado, sul);
+     if (!fin_carga && !u->wsi) carga_conectar(u);
+ }
+ 
+ // Intervalo entre envíos de un usuario: media usuarios/tasa, con jitter
+ static lws_usec_t carga_intervalo(void) {
+     double media = (double)ccarga.usuarios / ccarga.tasa * LWS_US_PER_SEC;
+     return (lws_usec_t)(media * (0.5 + (double)aleatorio(1000) / 1000.0));
+ }
+ 
+ static void carga_tick(lws_sorted_usec_list_t *sul) {
+     struct usuario_simulado *u = lws_container_of(sul, struct usuario_simulado, sul);
+     if (fin_carga || !u->wsi || !u->registrado) return;
+ 
+     if (u->len_pendiente) {
+         // El socket no alcanzó a escribir el anterior
+         omitidos++;
+     } else {
+         lws_usec_t ahora = lws_now_usecs();
+         switch (elegir_accion()) {
+         case ACC_BROADCAST:
+             carga_preparar(u, 1,
+                 "{\"type\":\"broadcast\",\"sender\":\"%s\",\"content\":\"bench:%lld\"}",
+                 u->nombre, (long long)ahora);
+             break;
+         case ACC_PRIVATE: {
+             int destino = aleatorio(ccarga.usuarios);
+             carga_preparar(u, 1,
+                 "{\"type\":\"private\",\"sender\":\"%s\",\"target\":\"%s\","
+                 "\"content\":\"bench:%lld\"}",
+                 u->nombre, simulados[destino].nombre, (long long)ahora);
+             break;
+         }
+         case ACC_LIST_USERS:
+             carga_preparar(u, 1,
+                 "{\"type\":\"list_users\",\"sender\":\"%s\",\"content\":null}", u->nombre);
+             break;
+         case ACC_CHANGE_STATUS:
+             carga_preparar(u, 1,
+                 "{\"type\":\"change_status\",\"sender\":\"%s\",\"content\":\"%s\"}",
+                 u->nombre, aleatorio(2) ? "OCUPADO" : "ACTIVO");
+             break;
+         case ACC_DISCONNECT:
+             carga_preparar(u, 1,
+                 "{\"type\":\"disconnect\",\"sender\":\"%s\",\"content\":\"Cierre de sesión\"}",
+                 u->nombre);
+             u->cerrar_tras_envio = 1;
+             return;   // se vuelve a conectar al cerrarse
+         default:
+             break;
+         }
+     }
+     lws_sul_schedule(ctx_carga, 0, &u->sul, carga_tick, carga_intervalo());
+ }
+ 
+ static int codigo_register_error = -1, codigo_rate_limited = -1;
+
+ static void carga_recibido(struct usuario_simulado *u, const char *in, size_t len,
+                            int binario) {
+     // En binario, register_error llega con su código de tipo y las
+     // presentaciones de usuarios no cuentan como mensajes
+     if (binario && (unsigned char)in[0] == BIN_USUARIO) return;
+     recibidos++;
+     if (!u->registrado && memmem(in, len, "register_success", 16)) {
+         u->registrado = 1;
+         lws_sul_schedule(ctx_carga, 0, &u->sul, carga_tick, carga_intervalo());
+         return;
+     }
+     if (binario ? (unsigned char)in[0] == codigo_register_error
+                 : memmem(in, len, "register_error", 14) != NULL) {
+         errores++;
+         return;
+     }
+     if (binario ? (unsigned char)in[0] == codigo_rate_limited
+                 : memmem(in, len, "\"rate_limited\"", 14) != NULL) {
+         limitados++;
+         return;
+     }
+     const char *marca = memmem(in, len, "bench:", 6);
+     if (marca) {
+         long long enviado = strtoll(marca + 6, NULL, 10);
+         lws_usec_t ahora = lws_now_usecs();
+         // El historial que el servidor reproduce al registrarse puede traer
+         // mensajes de una corrida anterior: esos no cuentan
+         if (enviado >= inicio_carga && ahora >= enviado) {
+             entregas++;
+             hist_registrar((uint64_t)(ahora - enviado));
+         }
+     }
+ }
+ 
+ static int callback_carga(struct lws *wsi, enum lws_callback_reasons reason,
+                           void *user, void *in, size_t len)
+ {
+     (void)user;
+     struct usuario_simulado *u = lws_get_opaque_user_data(wsi);
+     if (!u) return 0;
+ 
+     switch (reason) {
+     case LWS_CALLBACK_CLIENT_ESTABLISHED:
+         conectados++;
+         u->wsi = wsi;
+         u->registrado = 0;
+         carga_soltar(u);
+         u->cerrar_tras_envio = 0;
+         u->en_partes = 0;
+         carga_preparar(u, 0,
+             "{\"type\":\"register\",\"sender\":\"%s\",\"content\":\"status_batch\"}",
+             u->nombre);
+         break;
+ 
+     case LWS_CALLBACK_CLIENT_RECEIVE: {
+         // De un mensaje en varias partes alcanza con la primera (tipo y marca)
+         int primera = !u->en_partes;
+         u->en_partes = !lws_is_final_fragment(wsi);
+         if (primera && in && len > 0)
+             carga_recibido(u, in, len, g_binario && lws_frame_is_binary(wsi));
+         break;
+     }
+ 
+     case LWS_CALLBACK_CLIENT_WRITEABLE: {
+         // Un fragmento por callback, como drenar_envios
+         if (!u->len_pendiente) break;
+         int r = escribir_fragmento(wsi, u->salida, u->len_pendiente, &u->enviado, u->tipo);
+         if (r < 0) {
+             carga_soltar(u);
+             errores++;
+             return -1;
+         }
+         if (!r) {
+             lws_callback_on_writable(wsi);
+             break;
+         }
+         carga_soltar(u);
+         if (u->cuenta_envio) enviados++;
+         if (u->cerrar_tras_envio) return -1;
+         break;
+     }
+ 
+     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+         errores++;
+         /* fall through */
+     case LWS_CALLBACK_CLIENT_CLOSED:
+         if (u->wsi == wsi || !u->wsi) {
+             if (u->wsi) conectados--;
+             u->wsi = NULL;
+             u->registrado = 0;
+             carga_soltar(u);
+             if (!fin_carga)
+                 lws_sul_schedule(ctx_carga, 0, &u->sul, carga_reconectar, LWS_US_PER_SEC);
+         }
+         break;
+ 
+     default:
+         break;
+     }
+     return 0;
+ }
+ 
+ static void carga_conectar(struct usuario_simulado *u) {
+     struct lws_client_connect_info ccinfo = {
+         .context = ctx_carga,
+         .address = ccarga.servidor,
+         .port = ccarga.puerto,
+         .path = "/chat",
+         .host = ccarga.servidor,
+         .origin = ccarga.servidor,
+         .protocol = g_binario ? PROTOCOLO_BIN : "chat-protocol",
+         .local_protocol_name = "chat-protocol",
+         .ssl_connection = 0,
+         .opaque_user_data = u
+     };
+     if (!lws_client_connect_via_info(&ccinfo)) {
+         errores++;
+         lws_sul_schedule(ctx_carga, 0, &u->sul, carga_reconectar, LWS_US_PER_SEC);
+     }
+ }
+ 
+ static void carga_reporte(lws_sorted_usec_list_t *sul) {
+     (void)sul;
+     double t = (double)(lws_now_usecs() - inicio_carga) / LWS_US_PER_SEC;
+     printf("[carga] t=%5.1fs conectados=%" PRIu64 " enviados/s=%" PRIu64
+            " entregas/s=%" PRIu64 " p99=%" PRIu64 "us omitidos=%" PRIu64
+            " errores=%" PRIu64 " limitados=%" PRIu64 "\n",
+            t, conectados, enviados - enviados_antes, entregas - entregas_antes,
+            hist_percentil(0.99), omitidos, errores, limitados);
+     enviados_antes = enviados;
+     entregas_antes = entregas;
+     if (t >= ccarga.duracion) {
+         fin_carga = 1;
+         return;
+     }
+     lws_sul_schedule(ctx_carga, 0, &sul_reporte, carga_reporte, LWS_US_PER_SEC);
+ }
+ 
+ static int parsear_mezcla(const char *v) {
+     int pesos[NUM_ACCIONES] = { 0 };
+     while (*v) {
+         size_t n = strcspn(v, ":");
+         int i;
+         for (i = 0; i < NUM_ACCIONES; i++)
+             if (strlen(nombres_accion[i]) == n && strncmp(v, nombres_accion[i], n) == 0) break;
+         if (i == NUM_ACCIONES || v[n] != ':') return -1;
+         pesos[i] = atoi(v + n + 1);
+         v += n + 1;
+         v += strcspn(v, ",");
+         if (*v == ',') v++;
+     }
+     int total = 0;
+     for (int i = 0; i < NUM_ACCIONES; i++) total += pesos[i];
+     if (total <= 0) return -1;
+     memcpy(ccarga.pesos, pesos, sizeof(pesos));
+     return 0;
+ }
+ 
+ static int parsear_opciones_carga(int argc, char **argv) {
+     for (int i = 1; i < argc; i++) {
+         const char *v;
+         int d = opcion_deflate(argv[i]), m = opcion_mensajes(argv[i]);
+         if (d < 0 || m < 0) return -1;
+         if (d > 0 || m > 0 || strcmp(argv[i], "--bench") == 0) {
+             continue;
+         } else if (strcmp(argv[i], "--binario") == 0) {
+             g_binario = 1;
+         } else if ((v = valor_opcion(argv[i], "--usuarios")) != NULL) {
+             ccarga.usuarios = atoi(v);
+         } else if ((v = valor_opcion(argv[i], "--tasa")) != NULL) {
+             ccarga.tasa = atof(v);
+         } else if ((v = valor_opcion(argv[i], "--duracion")) != NULL) {
+             ccarga.duracion = atoi(v);
+         } else if ((v = valor_opcion(argv[i], "--mezcla")) != NULL) {
+             if (parsear_mezcla(v) < 0) return -1;
+         } else if ((v = valor_opcion(argv[i], "--servidor")) != NULL) {
+             ccarga.servidor = v;
+         } else if ((v = valor_opcion(argv[i], "--puerto")) != NULL) {
+             ccarga.puerto = atoi(v);
+         } else {
+             return -1;
+         }
+     }
+     if (ccarga.usuarios <= 0 || ccarga.tasa <= 0 || ccarga.duracion <= 0) return -1;
+     return 0;
+ }
+ 
+ static int modo_carga(int argc, char **argv) {
+     if (parsear_opciones_carga(argc, argv) < 0) {
+         fprintf(stderr,
+                 "uso: %s --bench [--usuarios=K] [--tasa=MSG_S] [--duracion=SEG]\n"
+                 "        [--mezcla=broadcast:70,private:20,list_users:4,"
+                 "change_status:5,disconnect:1]\n"
+                 "        [--servidor=HOST] [--puerto=N]\n"
+                 "        [--sin-deflate] [--deflate-compartido] [--deflate-ventana=N]"
+                 " [--binario]\n"
+                 "        [--mensaje-max=N] [--fragmento=N]\n",
+                 argv[0]);
+         return -1;
+     }
+     lws_set_log_level(LLL_ERR, NULL);
+     codigo_register_error = tabla_tipos_buscar(&tipos_bin, "register_error",
+                                                strlen("register_error"));
+     codigo_rate_limited = tabla_tipos_buscar(&tipos_bin, "rate_limited",
+                                              strlen("rate_limited"));
+ 
+     static struct lws_protocols protocolos_carga[] = {
+         { "chat-protocol", callback_carga, 0, MAX_PAYLOAD_SIZE },
+         { NULL, NULL, 0, 0 }
+     };
+     struct lws_context_creation_info info;
+     memset(&info, 0, sizeof(info));
+     info.port = CONTEXT_PORT_NO_LISTEN;
+     info.protocols = protocolos_carga;
+     info.fd_limit_per_thread = (unsigned int)ccarga.usuarios + 16;
+     info.extensions = extensiones_deflate();
+ 
+     ctx_carga = lws_create_context(&info);
+     if (!ctx_carga) {
+         fprintf(stderr, "[carga] Error al crear el contexto\n");
+         return -1;
+     }
+     simulados = calloc((size_t)ccarga.usuarios, sizeof(*simulados));
+     if (!simulados) {
+         lws_context_destroy(ctx_carga);
+         return -1;
+     }
+     semilla_carga = (unsigned int)time(NULL);
+ 
+     printf("[carga] %d usuarios, %.0f msg/s, %d s contra %s:%d\n",
+            ccarga.usuarios, ccarga.tasa, ccarga.duracion, ccarga.servidor, ccarga.puerto);
+     inicio_carga = lws_now_usecs();
+     for (int i = 0; i < ccarga.usuarios; i++) {
+         simulados[i].id = i;
+         snprintf(simulados[i].nombre, sizeof(simulados[i].nombre), "sim%d", i);
+         carga_conectar(&simulados[i]);
+     }
+     lws_sul_schedule(ctx_carga, 0, &sul_reporte, carga_reporte, LWS_US_PER_SEC);
+ 
+     while (!fin_carga) {
+         if (lws_service(ctx_carga, 0) < 0) break;
+     }
+ 
+     double t = (double)(lws_now_usecs() - inicio_carga) / LWS_US_PER_SEC;
+     printf("[carga] enviados=%" PRIu64 " (%.0f msg/s) entregas=%" PRIu64 " (%.0f msg/s)"
+            " recibidos=%" PRIu64 " omitidos=%" PRIu64 " errores=%" PRIu64
+            " limitados=%" PRIu64 "\n",
+            enviados, (double)enviados / t, entregas, (double)entregas / t,
+            recibidos, omitidos, errores, limitados);
+     printf("[carga] latencia p50=%" PRIu64 "us p99=%" PRIu64 "us p999=%" PRIu64
+            "us max=%" PRIu64 "us\n",
+            hist_percentil(0.50), hist_percentil(0.99), hist_percentil(0.999), latencia_max);
+ 
+     lws_context_destroy(ctx_carga);
+     free(simulados);
+     return 0;
+ }
+ 
  //-----------------------------------------------------------------------------
  // main
  //-----------------------------------------------------------------------------
  static void* service_loop(void* arg);
  
- int main() {
+ int main(int argc, char **argv) {
+     if (bin_tipos_iniciar(&tipos_bin) < 0) return 1;
+     if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+         return modo_carga(argc, argv) < 0 ? 1 : 0;
+     }
+     for (int i = 1; i < argc; i++) {
+         if (strcmp(argv[i], "--binario") == 0) {
+             g_binario = 1;
+         } else if (opcion_deflate(argv[i]) <= 0 && opcion_mensajes(argv[i]) <= 0 &&
+                    opcion_pantalla(argv[i]) <= 0) {
+             fprintf(stderr, "uso: %s [--sin-deflate] [--deflate-compartido] "
+                     "[--deflate-ventana=N] [--binario]\n"
+                     "          [--mensaje-max=N] [--fragmento=N] [--historial=N] [--fps=N]\n"
+                     "       %s --bench ...\n",
+                     argv[0], argv[0]);
+             return 1;
+         }
+     }
+     if (historial_iniciar() < 0) {
+         fprintf(stderr, "[main] Sin memoria para el historial\n");
+         return 1;
+     }
+     if (iniciar_manejadores() < 0) {
+         fprintf(stderr, "[main] Error al registrar los manejadores\n");
+         return -1;
+     }
      lws_set_log_level(LLL_ERR | LLL_WARN | LLL_NOTICE | LLL_INFO, NULL);
  
      struct lws_context_creation_info info;
@@ -547,6 +2174,7 @@
          { NULL, NULL, 0, 0 }
      };
      info.protocols = protocols;
+     info.extensions = extensiones_deflate();
  
      // Crear contexto
      struct lws_context *context = lws_create_context(&info);
@@ -556,9 +2184,6 @@
      }
      global_context = context;
  
-     // Crear hilo para lws_service
-     pthread_create(&service_thread_id, NULL, service_loop, (void*)context);
- 
      // Conectarse al servidor
      struct lws_client_connect_info ccinfo = {
          .context = context,
@@ -567,38 +2192,46 @@
          .path = "/chat",
          .host = "localhost",
          .origin = "localhost",
-         .protocol = "chat-protocol",
+         .protocol = g_binario ? PROTOCOLO_BIN : "chat-protocol",
+         .local_protocol_name = "chat-protocol",   // el mismo callback para los dos
          .ssl_connection = 0
      };
  
-     struct lws *wsi = lws_client_connect_via_info(&ccinfo);
-     if (!wsi) {
+     if (!lws_client_connect_via_info(&ccinfo)) {
          fprintf(stderr, "[main] Fallo al conectar\n");
-         stop_service = 1;
-         pthread_join(service_thread_id, NULL);
          lws_context_destroy(context);
          return -1;
      }
  
-     // Esperar a que se establezca la conexión
-     while (!g_connection_established) {
-         usleep(50000);
+     // Todo lo que toca lws corre en este hilo; el menú solo encola
+     pthread_create(&service_thread_id, NULL, service_loop, (void*)context);
+ 
+     // Esperar a que se establezca (o falle) la conexión
+     pthread_mutex_lock(&g_lock);
+     while (g_conexion == CONEXION_PENDIENTE)
+         pthread_cond_wait(&g_cond_conexion, &g_lock);
+     int abierta = g_conexion == CONEXION_ABIERTA;
+     pthread_mutex_unlock(&g_lock);
+     if (!abierta) {
+         fprintf(stderr, "[main] Fallo al conectar\n");
+         stop_service = 1;
+         lws_cancel_service(context);
+         pthread_join(service_thread_id, NULL);
+         lws_context_destroy(context);
+         return -1;
      }
  
      // Registrar usuario
      printf("Ingresa tu nombre de usuario para registrarte: ");
      scanf("%s", g_username);
  
-     // {type:"register",sender:"<username>",content:null}
-     unsigned char buffer[LWS_PRE + MAX_PAYLOAD_SIZE];
-     memset(buffer, 0, sizeof(buffer));
-     char *json_part = (char *)&buffer[LWS_PRE];
-     snprintf(json_part, MAX_PAYLOAD_SIZE,
-              "{\"type\":\"register\",\"sender\":\"%s\",\"content\":null}",
+     // {type:"register",sender:"<username>",content:"<capacidades>"}
+     // Anunciamos que entendemos los cambios de estado agrupados
+     size_t msg_len = 0;
+     char *json_part = armar_json(&msg_len,
+              "{\"type\":\"register\",\"sender\":\"%s\",\"content\":\"status_batch\"}",
               g_username);
- 
-     size_t msg_len = strlen(json_part);
-     int written = lws_write(wsi, (unsigned char *)json_part, msg_len, LWS_WRITE_TEXT);
+     int written = json_part ? encolar_envio(json_part, msg_len) : -1;
      if (written < (int)msg_len) {
          fprintf(stderr, "[main] Error al registrar (ret=%d)\n", written);
      }
@@ -606,9 +2239,11 @@
      // Bucle de menú
      menu_interactivo();
  
-     // Salimos => detener hilo
+     // Salimos => despertar al hilo de servicio para que termine
      stop_service = 1;
+     lws_cancel_service(context);
      pthread_join(service_thread_id, NULL);
+     pantalla_prompt("");     // lo que quedó pendiente, y el cursor abajo
  
      // Destruir contexto
      lws_context_destroy(context);
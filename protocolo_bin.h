@@ -0,0 +1,182 @@
+/******************************************************************************
+ * protocolo_bin.h
+ * Codificación binaria de los mensajes del chat (sub-protocolo
+ * "chat-protocol-bin"). La usan server.c y client.c.
+ *
+ * Cada mensaje es un frame WebSocket binario:
+ *   [tipo u8][campos u8][id u64]?[timestamp u64]?[sender]?[target]?
+ *   [room str16]?[content str32]?
+ * "campos" dice cuáles de las partes opcionales vienen (BIN_CAMPO_*), en ese
+ * orden. Los enteros van en little-endian; el timestamp son microsegundos
+ * desde 1970. Un usuario (sender/target) es un u32 con su id en la tabla
+ * del servidor, o 0 seguido del nombre como str16. strN: largo uN y los
+ * bytes, sin '\0'.
+ *
+ * El servidor presenta cada id con un mensaje BIN_USUARIO (id = el id,
+ * content = el nombre) antes de usarlo por primera vez en la conexión; el
+ * cliente manda nombres. Lo que no entra en estos campos (content que es
+ * un objeto o arreglo, claves extra) viaja como BIN_JSON con el texto JSON
+ * en content.
+ *****************************************************************************/
+
+#ifndef PROTOCOLO_BIN_H
+#define PROTOCOLO_BIN_H
+
+#include <stdint.h>
+#include <string.h>
+#include "tabla_tipos.h"
+
+#define PROTOCOLO_BIN "chat-protocol-bin"
+
+#define BIN_CAMPO_ID       0x01u
+#define BIN_CAMPO_TS       0x02u
+#define BIN_CAMPO_SENDER   0x04u
+#define BIN_CAMPO_TARGET   0x08u
+#define BIN_CAMPO_ROOM     0x10u
+#define BIN_CAMPO_CONTENT  0x20u
+
+#define BIN_CABECERA       2
+#define BIN_JSON           0       // content = mensaje JSON completo
+#define BIN_USUARIO        1       // id -> nombre, del servidor al cliente
+
+// Códigos de tipo: el índice en este arreglo. Solo se agregan al final.
+static const char *const bin_nombres_tipo[] = {
+    "json", "usuario",
+    "register", "register_success", "register_error",
+    "broadcast", "private", "ack",
+    "list_users", "list_users_response", "list_users_delta",
+    "user_info", "user_info_response",
+    "change_status", "status_update", "status_batch",
+    "user_disconnected", "disconnect",
+    "join", "leave", "room_message", "room_joined", "room_left", "room_error",
+    "error", "chat",
+    "rate_limited"
+};
+#define BIN_NUM_TIPOS ((int)(sizeof(bin_nombres_tipo) / sizeof(bin_nombres_tipo[0])))
+
+struct bin_cadena {
+    const char *p;
+    size_t len;
+};
+
+struct bin_usuario {
+    uint32_t id;                  // 0 = viene el nombre
+    struct bin_cadena nombre;
+};
+
+struct bin_mensaje {
+    uint8_t tipo;
+    uint8_t campos;               // BIN_CAMPO_*
+    uint64_t id;
+    uint64_t ts_us;
+    struct bin_usuario sender;
+    struct bin_usuario target;
+    struct bin_cadena room;
+    struct bin_cadena content;
+};
+
+// Registra los tipos en la tabla de forma que índice == código
+static inline int bin_tipos_iniciar(struct tabla_tipos *t) {
+    tabla_tipos_iniciar(t);
+    for (int i = 0; i < BIN_NUM_TIPOS; i++)
+        if (tabla_tipos_agregar(t, bin_nombres_tipo[i]) != i) return -1;
+    return 0;
+}
+
+static inline size_t bin_tam_usuario(const struct bin_usuario *u) {
+    return 4 + (u->id ? 0 : 2 + u->nombre.len);
+}
+
+// Bytes que ocupa m codificado
+static inline size_t bin_tam(const struct bin_mensaje *m) {
+    size_t n = BIN_CABECERA;
+    if (m->campos & BIN_CAMPO_ID) n += 8;
+    if (m->campos & BIN_CAMPO_TS) n += 8;
+    if (m->campos & BIN_CAMPO_SENDER) n += bin_tam_usuario(&m->sender);
+    if (m->campos & BIN_CAMPO_TARGET) n += bin_tam_usuario(&m->target);
+    if (m->campos & BIN_CAMPO_ROOM) n += 2 + m->room.len;
+    if (m->campos & BIN_CAMPO_CONTENT) n += 4 + m->content.len;
+    return n;
+}
+
+static inline unsigned char *bin_poner(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (unsigned char)(v >> (8 * i));
+    return p + bytes;
+}
+
+static inline unsigned char *bin_poner_cadena(unsigned char *p, const struct bin_cadena *c,
+                                              int bytes_len) {
+    p = bin_poner(p, c->len, bytes_len);
+    if (c->len) memcpy(p, c->p, c->len);
+    return p + c->len;
+}
+
+static inline unsigned char *bin_poner_usuario(unsigned char *p, const struct bin_usuario *u) {
+    p = bin_poner(p, u->id, 4);
+    return u->id ? p : bin_poner_cadena(p, &u->nombre, 2);
+}
+
+// Escribe m en out, que necesita bin_tam(m) bytes. Devuelve los bytes escritos.
+// Las cadenas de room y de los nombres deben caber en 16 bits.
+static inline size_t bin_codificar(const struct bin_mensaje *m, unsigned char *out) {
+    unsigned char *p = out;
+    *p++ = m->tipo;
+    *p++ = m->campos;
+    if (m->campos & BIN_CAMPO_ID) p = bin_poner(p, m->id, 8);
+    if (m->campos & BIN_CAMPO_TS) p = bin_poner(p, m->ts_us, 8);
+    if (m->campos & BIN_CAMPO_SENDER) p = bin_poner_usuario(p, &m->sender);
+    if (m->campos & BIN_CAMPO_TARGET) p = bin_poner_usuario(p, &m->target);
+    if (m->campos & BIN_CAMPO_ROOM) p = bin_poner_cadena(p, &m->room, 2);
+    if (m->campos & BIN_CAMPO_CONTENT) p = bin_poner_cadena(p, &m->content, 4);
+    return (size_t)(p - out);
+}
+
+struct bin_lector {
+    const unsigned char *p;
+    const unsigned char *fin;
+};
+
+static inline int bin_leer(struct bin_lector *l, uint64_t *v, int bytes) {
+    if (l->fin - l->p < bytes) return -1;
+    *v = 0;
+    for (int i = 0; i < bytes; i++) *v |= (uint64_t)l->p[i] << (8 * i);
+    l->p += bytes;
+    return 0;
+}
+
+static inline int bin_leer_cadena(struct bin_lector *l, struct bin_cadena *c, int bytes_len) {
+    uint64_t n;
+    if (bin_leer(l, &n, bytes_len) < 0 || (uint64_t)(l->fin - l->p) < n) return -1;
+    c->p = (const char *)l->p;
+    c->len = (size_t)n;
+    l->p += n;
+    return 0;
+}
+
+static inline int bin_leer_usuario(struct bin_lector *l, struct bin_usuario *u) {
+    uint64_t id;
+    if (bin_leer(l, &id, 4) < 0) return -1;
+    u->id = (uint32_t)id;
+    u->nombre.p = NULL;
+    u->nombre.len = 0;
+    return id ? 0 : bin_leer_cadena(l, &u->nombre, 2);
+}
+
+// Decodifica un mensaje; las cadenas apuntan dentro de buf (sin '\0').
+// Devuelve 0, o -1 si el mensaje está truncado o trae bytes de más.
+static inline int bin_decodificar(const unsigned char *buf, size_t len, struct bin_mensaje *m) {
+    struct bin_lector l = { buf, buf + len };
+    memset(m, 0, sizeof(*m));
+    if (len < BIN_CABECERA) return -1;
+    m->tipo = *l.p++;
+    m->campos = *l.p++;
+    if ((m->campos & BIN_CAMPO_ID) && bin_leer(&l, &m->id, 8) < 0) return -1;
+    if ((m->campos & BIN_CAMPO_TS) && bin_leer(&l, &m->ts_us, 8) < 0) return -1;
+    if ((m->campos & BIN_CAMPO_SENDER) && bin_leer_usuario(&l, &m->sender) < 0) return -1;
+    if ((m->campos & BIN_CAMPO_TARGET) && bin_leer_usuario(&l, &m->target) < 0) return -1;
+    if ((m->campos & BIN_CAMPO_ROOM) && bin_leer_cadena(&l, &m->room, 2) < 0) return -1;
+    if ((m->campos & BIN_CAMPO_CONTENT) && bin_leer_cadena(&l, &m->content, 4) < 0) return -1;
+    return l.p == l.fin ? 0 : -1;
+}
+
+#endif
@@ -3,12 +3,142 @@
 #include <string.h>
 #include <time.h>
 #include <libwebsockets.h>
-#include <json-c/json.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "tabla_tipos.h"
+#include "protocolo_bin.h"
 
-#define MAX_PAYLOAD_SIZE 1024
-#define MAX_CLIENTES 100
-static pthread_mutex_t clientes_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define MAX_PAYLOAD_SIZE 1024     // bytes por lectura (rx_buffer_size); lo más largo llega en partes
+#define REGISTRO_CAP_INICIAL 64   // capacidad inicial (crece al doble)
+#define COLA_CAP_DEFECTO     256  // frames pendientes por conexión
+#define MAX_HILOS            64   // hilos de servicio (shards) como máximo
+#define INACTIVIDAD_SEG      10   // segundos sin actividad => INACTIVO (defecto)
+#define PRESENCIA_MS         100  // ventana de agrupación de cambios de estado
+#define REPLAY_DEFECTO       50   // broadcasts reproducidos al registrarse
+#define HISTORIAL_SYNC_MS    100  // intervalo de msync del historial
+#define HISTORIAL_SEGMENTOS  16   // segmentos del historial que se conservan
+#define BUZON_MAX_DEFECTO    10000 // mensajes pendientes por usuario desconectado
+#define BUZON_MEMORIA        256  // de esos, cuántos se guardan en memoria
+#define SALAS_MAX_DEFECTO    10000 // salas que se pueden crear
+#define MAX_SALAS_SESION     64   // salas a las que se une una misma sesión
+#define DEFLATE_NIVEL        6    // nivel de zlib para permessage-deflate
+#define DEFLATE_MEMORIA      8    // memLevel de zlib (memoria por conexión)
+#define LIMITES_MAX          16   // tipos de mensaje con límite de tasa propio
+#define IPS_RANURAS          4096 // IPs con cubetas propias (potencia de 2)
+#define FICHA                1000000u // una ficha de token bucket, en millonésimas
+#define MENSAJE_MAX_DEFECTO  65536 // bytes de un mensaje entrante rearmado
+#define FRAGMENTO_DEFECTO    16384 // bytes por fragmento al enviar mensajes largos
+#define ENTRADA_POOL         16   // buffers de rearmado libres por shard
+#define ENTRADA_POOL_CAP     65536 // los más grandes no vuelven al pool
+#define SLAB_LIBRES_MAX      1024 // bloques libres por shard y clase de slab
+#define ARENA_INICIAL        16384 // arena de mensaje por shard
+#define ARENA_MAX            (1 << 20) // no crece más; lo que pase se pide aparte
+#define USUARIO_MAX          64   // bytes de un nombre de usuario
+
+// Niveles de log (ver log_escribir)
+#define NIVEL_ERROR  0
+#define NIVEL_AVISO  1
+#define NIVEL_INFO   2
+#define NIVEL_DEBUG  3
+
+// Capacidades que el cliente anuncia en el content de "register"
+#define CAP_STATUS_BATCH     0x1u // acepta "status_batch" en vez de "status_update"
+
+// Protege las altas y bajas del registro global de nombres (las búsquedas
+// no lo toman, ver "Reclamación por épocas"). Las colas y la lista de
+// sesiones de cada shard no usan lock: solo las toca el hilo dueño del shard.
+static pthread_rwlock_t registro_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Qué hacer cuando la cola de salida de un cliente está llena
+enum politica_desborde {
+    DESBORDE_DESCARTAR_VIEJO,  // se descarta el frame más antiguo
+    DESBORDE_DESCONECTAR       // se cierra la conexión del consumidor lento
+};
+
+// Qué hacer con un mensaje que excede su límite de tasa
+enum politica_limite {
+    LIMITE_RESPONDER,          // se descarta y se avisa con "rate_limited"
+    LIMITE_DESCONECTAR         // se cierra la conexión
+};
+
+// Token bucket: se recargan por_ms millonésimas de ficha por milisegundo,
+// hasta rafaga millonésimas. por_ms = 0: sin límite.
+struct limite {
+    uint32_t por_ms;
+    uint32_t rafaga;
+};
+
+//------------------------------------------------------------------------------
+// Configuración (modificable por línea de comandos)
+//------------------------------------------------------------------------------
+struct config_servidor {
+    size_t cola_max;                 // frames pendientes por sesión
+    enum politica_desborde desborde;
+    int hilos;                       // hilos de servicio (count_threads)
+    int inactividad_seg;             // segundos sin actividad => INACTIVO
+    int inactivo_desde_ocupado;      // también pasar OCUPADO a INACTIVO
+    int presencia_ms;                // ventana de status_batch (0 = sin agrupar)
+    int log_nivel;                   // NIVEL_* máximo que se registra
+    unsigned log_muestreo;           // logs por mensaje: 1 de cada N
+    int log_json;                    // líneas JSON en vez de texto
+    const char *historial_dir;       // directorio del historial (NULL = sin historial)
+    int historial_replay;            // broadcasts que se reproducen al registrarse
+    int historial_sync_ms;           // cada cuánto se baja el historial a disco
+    int historial_segmentos;         // segmentos que se conservan (0 = todos)
+    int buzon_max;                   // mensajes pendientes por buzón
+    int buzon_memoria;               // entradas en memoria antes de dejarlas sólo en disco
+    int salas_max;                   // salas que se pueden crear
+    int deflate;                     // negociar permessage-deflate
+    int deflate_nivel;               // nivel de compresión de zlib (0..9)
+    int deflate_memoria;             // memLevel de zlib (1..9)
+    int deflate_compartido;          // comprimir cada frame una vez por ventana
+    struct limite limite_ip;         // mensajes por IP (todos los tipos)
+    struct limite conexiones_ip;     // conexiones nuevas por IP
+    enum politica_limite limite_accion;
+    size_t mensaje_max;              // bytes de un mensaje entrante (rearmado)
+    size_t fragmento;                // bytes por fragmento de salida (0 = no partir)
+};
+
+static struct config_servidor cfg = {
+    .cola_max = COLA_CAP_DEFECTO,
+    .desborde = DESBORDE_DESCARTAR_VIEJO,
+    .hilos = 1,
+    .inactividad_seg = INACTIVIDAD_SEG,
+    .inactivo_desde_ocupado = 0,
+    .presencia_ms = PRESENCIA_MS,
+    .log_nivel = NIVEL_INFO,
+    .log_muestreo = 100,
+    .log_json = 0,
+    .historial_dir = NULL,
+    .historial_replay = REPLAY_DEFECTO,
+    .historial_sync_ms = HISTORIAL_SYNC_MS,
+    .historial_segmentos = HISTORIAL_SEGMENTOS,
+    .buzon_max = BUZON_MAX_DEFECTO,
+    .buzon_memoria = BUZON_MEMORIA,
+    .salas_max = SALAS_MAX_DEFECTO,
+    .deflate = 1,
+    .deflate_nivel = DEFLATE_NIVEL,
+    .deflate_memoria = DEFLATE_MEMORIA,
+    .deflate_compartido = 0,
+    .limite_ip = { .por_ms = 200 * 1000, .rafaga = 400 * FICHA },
+    .conexiones_ip = { .por_ms = 5 * 1000, .rafaga = 20 * FICHA },
+    .limite_accion = LIMITE_RESPONDER,
+    .mensaje_max = MENSAJE_MAX_DEFECTO,
+    .fragmento = FRAGMENTO_DEFECTO,
+};
+
+static struct lws_context *contexto = NULL;
 
 // Estados posibles: "ACTIVO", "OCUPADO", "INACTIVO"
 enum estado_usuario {
@@ -17,107 +147,4687 @@ enum estado_usuario {
     ESTADO_INACTIVO
 };
 
-struct per_session_data__chat {
-    char *username;           // Nombre de usuario
-    char ip[64];              // IP del cliente
-    enum estado_usuario est;  // Estado (ACTIVO, OCUPADO, INACTIVO)
-    struct lws *wsi;
-    time_t last_activity;  
-};
+// Bytes de un frame ya comprimidos con permessage-deflate (ver frame_comprimido)
+struct frame_comprimido {
+    struct frame_comprimido *sig;
+    int ventana;              // server_max_window_bits
+    unsigned char *inicio;    // cabecera WebSocket + datos comprimidos
+    size_t len;
+    unsigned char buf[];
+};
+
+// Traducción de un frame a chat-protocol-bin (ver frame_binario)
+struct frame_binario {
+    size_t len;
+    uint32_t usuarios[2];     // ids que el destinatario tiene que conocer
+    int num_usuarios;
+    unsigned char buf[];      // LWS_PRE + len bytes
+};
+
+// Frame listo para lws_write: LWS_PRE bytes de cabecera + payload.
+// Se serializa una sola vez y se comparte entre todas las colas que lo
+// contienen; se libera cuando el último destinatario lo termina de enviar.
+struct frame_salida {
+    atomic_int refs;
+    size_t len;
+    struct frame_comprimido *comprimidos;  // por ventana, solo el shard dueño
+    struct frame_binario *binario;         // solo el shard dueño
+    unsigned char *datos;     // payload (&buf[LWS_PRE]), con LWS_PRE bytes libres delante
+    unsigned char buf[];      // LWS_PRE + len bytes
+};
+
+// Mensaje entrante que llegó en varias partes (fragmentos WebSocket o más
+// de rx_buffer_size bytes), rearmado antes de parsearlo
+struct buffer_entrada {
+    struct buffer_entrada *sig;   // en el pool del shard
+    size_t len;
+    size_t cap;
+    char datos[];
+};
+
+// Registro del historial persistente (segmento y offset dentro de él)
+struct ubicacion {
+    uint32_t segmento;
+    uint32_t offset;
+};
+
+// Miembros de una sala en un shard (solo los toca el hilo de ese shard)
+struct miembros_shard {
+    struct per_session_data__chat **v;
+    size_t num;
+    size_t cap;
+};
+
+struct sala {
+    struct sala *sig;         // misma lista de la tabla de salas
+    char *nombre;
+    uint32_t hash;
+    atomic_size_t total;      // miembros en todos los shards
+    atomic_size_t num_por_shard[MAX_HILOS];  // miembros[t].num, para los demás hilos
+    struct miembros_shard miembros[MAX_HILOS];
+};
+
+// Sala a la que pertenece una sesión y su posición en miembros[shard].v
+struct membresia {
+    struct sala *sala;
+    size_t pos;
+};
+
+// Anillo acotado de frames pendientes de enviar a una conexión
+struct cola_salida {
+    struct frame_salida **frames;
+    size_t cap;
+    size_t cabeza;            // índice del frame más antiguo
+    size_t num;
+};
+
+// Nodo intrusivo de la rueda de timers
+struct timer_nodo {
+    struct timer_nodo *prev;
+    struct timer_nodo *sig;
+    uint64_t vence;           // tick de vencimiento
+};
+
+// Nombre de usuario guardado en su lugar, sin reservar memoria
+typedef char nombre_usuario[USUARIO_MAX + 1];
+
+struct per_session_data__chat {
+    char *username;           // Nombre de usuario (apunta a nombre; NULL = ninguno)
+    nombre_usuario nombre;
+    char ip[64];              // IP del cliente
+    struct ficha_sesion *ficha;      // Lo visible a otros hilos (est, en_cola, ...)
+    struct vinculo_nombre *vinculo;  // Entrada del nombre en el índice
+    struct lws *wsi;
+    time_t last_activity;  
+    struct timer_nodo timer_inactividad;  // En la rueda del shard dueño
+    size_t slot;              // Posición en registro.sesiones
+    uint64_t id;              // Identificador único de la conexión
+    int shard;                // Hilo de servicio dueño (tsi)
+    unsigned capacidades;     // CAP_* negociadas al registrarse
+    int deflate_ventana;      // > 0: recibe frames ya comprimidos (deflate compartido)
+    int binario;              // conectada con chat-protocol-bin
+    uint64_t *anunciados;     // ids de usuario ya presentados (bits)
+    size_t num_anunciados;    // palabras de anunciados
+    size_t shard_slot;        // Posición en shards[shard].sesiones
+    struct cola_salida cola;  // Frames pendientes (solo el hilo dueño)
+    int desbordado;           // Cerrar en el próximo WRITEABLE
+    int alta;                 // ESTABLISHED completo: CLOSED tiene qué deshacer
+    struct ubicacion *reproducir;  // Historial pendiente de enviar al registrarse
+    size_t num_reproducir;
+    size_t pos_reproducir;
+    struct membresia *salas;  // Salas a las que se unió
+    size_t num_salas;
+    size_t cap_salas;
+    uint64_t cubetas[LIMITES_MAX];  // Token buckets por tipo (solo el hilo dueño)
+    uint32_t limitado;        // Cubetas que ya respondieron "rate_limited" (bits)
+    struct ranura_ip *ranura_ip;    // Cubetas de su IP (ver buscar_ranura_ip)
+    uint64_t clave_ip;        // Clave de la ranura cuando se la buscó
+    int ip_local;             // Loopback: sin límites por IP
+    struct buffer_entrada *entrada;  // Mensaje a medio llegar (NULL = ninguno)
+    struct frame_salida *enviando;   // Frame que sale en fragmentos
+    size_t enviado;           // Bytes ya escritos de enviando
+};
+
+//------------------------------------------------------------------------------
+// Función para tomar la hora actual en ISO8601 (aproximado) o un formato de tu elección
+//------------------------------------------------------------------------------
+static void get_timestamp(char *buf, size_t buflen) {
+    time_t now = time(NULL);
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);   // la llaman todos los hilos de servicio
+    strftime(buf, buflen, "%Y-%m-%d %H:%M:%S", &tm_info);
+}
+
+//------------------------------------------------------------------------------
+// Log asíncrono
+// Los hilos de servicio no escriben a stdout: formatean la línea en una
+// ranura de un anillo MPSC acotado (cola de Vyukov, sin locks) y un hilo
+// aparte la vuelca. Si el anillo está lleno la línea se descarta y se cuenta;
+// nunca se bloquea el bucle de servicio.
+// Con -DLOG_NIVEL_MAX=2 (o menor) las llamadas a log_debug desaparecen del
+// binario.
+//------------------------------------------------------------------------------
+#ifndef LOG_NIVEL_MAX
+#define LOG_NIVEL_MAX NIVEL_DEBUG
+#endif
+
+#define LOG_RANURAS    4096       // potencia de 2
+#define LOG_MAX_TEXTO  448
+
+struct ranura_log {
+    atomic_size_t secuencia;
+    int nivel;
+    int hilo;                     // tsi del productor (-1 = otro hilo)
+    const char *evento;           // literal: nombre del evento
+    struct timespec ts;
+    char texto[LOG_MAX_TEXTO];
+};
+
+static struct {
+    struct ranura_log ranuras[LOG_RANURAS];
+    _Alignas(64) atomic_size_t pos_escritura;   // productores
+    _Alignas(64) size_t pos_lectura;            // solo el hilo escritor
+    atomic_uint_fast64_t descartados;
+    atomic_int parar;
+    pthread_t hilo;
+} bitacora;
+
+static _Thread_local int log_hilo = -1;
+static _Thread_local unsigned log_contador_muestra = 0;
+
+static const char *nombres_nivel[] = { "error", "aviso", "info", "debug" };
+
+static void log_escribir(int nivel, const char *evento, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void log_escribir(int nivel, const char *evento, const char *fmt, ...) {
+    size_t pos = atomic_load_explicit(&bitacora.pos_escritura, memory_order_relaxed);
+    struct ranura_log *r;
+    for (;;) {
+        r = &bitacora.ranuras[pos & (LOG_RANURAS - 1)];
+        size_t seq = atomic_load_explicit(&r->secuencia, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&bitacora.pos_escritura, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            atomic_fetch_add_explicit(&bitacora.descartados, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&bitacora.pos_escritura, memory_order_relaxed);
+        }
+    }
+    r->nivel = nivel;
+    r->hilo = log_hilo;
+    r->evento = evento;
+    clock_gettime(CLOCK_REALTIME, &r->ts);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(r->texto, sizeof(r->texto), fmt, ap);
+    va_end(ap);
+    atomic_store_explicit(&r->secuencia, pos + 1, memory_order_release);
+}
+
+// El nivel se compara antes de formatear nada
+#define log_nivel(n, ev, ...) \
+    do { if ((n) <= cfg.log_nivel) log_escribir((n), (ev), __VA_ARGS__); } while (0)
+#define log_error(ev, ...)  log_nivel(NIVEL_ERROR, ev, __VA_ARGS__)
+#define log_aviso(ev, ...)  log_nivel(NIVEL_AVISO, ev, __VA_ARGS__)
+#define log_info(ev, ...)   log_nivel(NIVEL_INFO, ev, __VA_ARGS__)
+#if LOG_NIVEL_MAX >= NIVEL_DEBUG
+#define log_debug(ev, ...)  log_nivel(NIVEL_DEBUG, ev, __VA_ARGS__)
+// Logs por mensaje: solo 1 de cada cfg.log_muestreo (por hilo)
+#define log_debug_muestreado(ev, ...) \
+    do { if (NIVEL_DEBUG <= cfg.log_nivel \
+             && ++log_contador_muestra % cfg.log_muestreo == 0) \
+             log_escribir(NIVEL_DEBUG, (ev), __VA_ARGS__); } while (0)
+#else
+#define log_debug(ev, ...)             ((void)0)
+#define log_debug_muestreado(ev, ...)  ((void)0)
+#endif
+
+// Escapa s como cadena JSON (sin comillas)
+static void log_json_cadena(FILE *out, const char *s) {
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+}
+
+static void log_volcar(const struct ranura_log *r) {
+    FILE *out = r->nivel <= NIVEL_AVISO ? stderr : stdout;
+    struct tm tm;
+    char fecha[32];
+    localtime_r(&r->ts.tv_sec, &tm);
+    strftime(fecha, sizeof(fecha), "%Y-%m-%d %H:%M:%S", &tm);
+    int ms = (int)(r->ts.tv_nsec / 1000000);
+
+    if (cfg.log_json) {
+        fprintf(out, "{\"ts\":\"%s.%03d\",\"nivel\":\"%s\",\"hilo\":%d,\"evento\":\"%s\",\"msg\":\"",
+                fecha, ms, nombres_nivel[r->nivel], r->hilo, r->evento);
+        log_json_cadena(out, r->texto);
+        fputs("\"}\n", out);
+    } else {
+        fprintf(out, "%s.%03d %-5s [%d] %s\n",
+                fecha, ms, nombres_nivel[r->nivel], r->hilo, r->texto);
+    }
+}
+
+// Vuelca lo que haya en el anillo; devuelve cuántas líneas escribió
+static int log_drenar(void) {
+    int n = 0;
+    for (;;) {
+        struct ranura_log *r = &bitacora.ranuras[bitacora.pos_lectura & (LOG_RANURAS - 1)];
+        size_t seq = atomic_load_explicit(&r->secuencia, memory_order_acquire);
+        if (seq != bitacora.pos_lectura + 1) break;
+        log_volcar(r);
+        atomic_store_explicit(&r->secuencia, bitacora.pos_lectura + LOG_RANURAS,
+                              memory_order_release);
+        bitacora.pos_lectura++;
+        n++;
+    }
+    return n;
+}
+
+static void *hilo_log(void *arg) {
+    (void)arg;
+    uint64_t avisados = 0;
+    while (!atomic_load(&bitacora.parar)) {
+        if (log_drenar() > 0) continue;
+        uint64_t perdidos = atomic_load_explicit(&bitacora.descartados, memory_order_relaxed);
+        if (perdidos != avisados) {
+            fprintf(stderr, "[log] %" PRIu64 " líneas descartadas (anillo lleno)\n",
+                    perdidos - avisados);
+            avisados = perdidos;
+        }
+        fflush(stdout);
+        struct timespec espera = { 0, 2 * 1000 * 1000 };
+        nanosleep(&espera, NULL);
+    }
+    log_drenar();
+    fflush(stdout);
+    return NULL;
+}
+
+static int log_iniciar(void) {
+    for (size_t i = 0; i < LOG_RANURAS; i++)
+        atomic_init(&bitacora.ranuras[i].secuencia, i);
+    atomic_init(&bitacora.pos_escritura, 0);
+    bitacora.pos_lectura = 0;
+    return pthread_create(&bitacora.hilo, NULL, hilo_log, NULL) == 0 ? 0 : -1;
+}
+
+static void log_detener(void) {
+    atomic_store(&bitacora.parar, 1);
+    pthread_join(bitacora.hilo, NULL);
+}
+
+//------------------------------------------------------------------------------
+// Métricas
+// Cada hilo de servicio escribe solo en su bloque metricas[tsi], con un load
+// y un store relajados (sin locks ni lock-prefixed RMW). /metrics lee todos
+// los bloques y los suma, sin tomar registro_lock.
+// Los histogramas son log-lineales (estilo HDR): valores < HIST_SUB exactos
+// y luego HIST_SUB cubetas por octava.
+//------------------------------------------------------------------------------
+#define HIST_SUB_BITS  4
+#define HIST_SUB       (1u << HIST_SUB_BITS)   // cubetas por octava (~6%)
+#define HIST_OCTAVAS   48
+
+struct histograma {
+    atomic_uint_fast64_t cubetas[HIST_OCTAVAS][HIST_SUB];
+    atomic_uint_fast64_t suma;
+    atomic_uint_fast64_t cuenta;
+};
+
+enum contador_metrica {
+    MET_FRAMES_ENVIADOS,
+    MET_BYTES_ENTRADA,
+    MET_BYTES_SALIDA,
+    MET_DESCARTADOS,          // frames perdidos por cola llena
+    MET_LENTOS_CERRADOS,      // sesiones cerradas por desborde
+    MET_INVALIDOS,            // frames que no son JSON válido
+    MET_TIPO_DESCONOCIDO,
+    MET_DEFLATE_COMPARTIDO,   // frames enviados ya comprimidos
+    MET_BYTES_DEFLATE,        // bytes en el cable de esos frames
+    MET_TRADUCCIONES_BIN,     // frames traducidos a chat-protocol-bin
+    MET_LIMITADOS,            // mensajes descartados por límite de tasa
+    MET_CONEXIONES_RECHAZADAS,// conexiones por encima del límite de su IP
+    MET_REARMADOS,            // mensajes recibidos en varias partes
+    MET_DEMASIADO_GRANDES,    // mensajes de más de cfg.mensaje_max
+    MET_FRAGMENTADOS,         // frames enviados en varios fragmentos
+    NUM_CONTADORES
+};
+
+// Alineado a 64 para que dos hilos nunca compartan una línea de caché
+struct metricas_hilo {
+    _Alignas(64) atomic_uint_fast64_t contadores[NUM_CONTADORES];
+    atomic_uint_fast64_t por_tipo[TABLA_TIPOS_MAX];   // mensajes recibidos por tipo
+    atomic_int_fast64_t sesiones;                     // conexiones abiertas
+    atomic_int_fast64_t frames_en_cola;               // suma de las colas de salida
+    struct histograma parseo_ns;
+    struct histograma fanout;                         // destinatarios por entrega
+    struct histograma profundidad_cola;               // cola tras cada encolado
+};
+
+static struct metricas_hilo metricas[MAX_HILOS];   // uno por hilo (tsi)
+
+static void met_sumar(atomic_uint_fast64_t *c, uint64_t n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static void met_ajustar(atomic_int_fast64_t *g, int64_t d) {
+    atomic_store_explicit(g, atomic_load_explicit(g, memory_order_relaxed) + d,
+                          memory_order_relaxed);
+}
+
+static void hist_registrar(struct histograma *h, uint64_t v) {
+    unsigned oct = 0, sub = (unsigned)v;
+    if (v >= HIST_SUB) {
+        unsigned e = 63u - (unsigned)__builtin_clzll(v);
+        oct = e - HIST_SUB_BITS + 1;
+        sub = (unsigned)(v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1);
+        if (oct >= HIST_OCTAVAS) {
+            oct = HIST_OCTAVAS - 1;
+            sub = HIST_SUB - 1;
+        }
+    }
+    met_sumar(&h->cubetas[oct][sub], 1);
+    met_sumar(&h->suma, v);
+    met_sumar(&h->cuenta, 1);
+}
+
+// Límite superior (inclusivo) de una cubeta
+static uint64_t hist_limite(unsigned oct, unsigned sub) {
+    if (oct == 0) return sub;
+    return ((uint64_t)(HIST_SUB + sub + 1) << (oct - 1)) - 1;
+}
+
+//------------------------------------------------------------------------------
+// Reclamación por épocas
+// Las búsquedas por nombre no toman locks. El lector marca la época global
+// mientras busca (epoca_entrar / epoca_salir), y lo que un escritor
+// desengancha (vínculos de nombre, tablas del índice, fichas de sesión) se
+// retira en vez de liberarse. Lo retirado en la época e se libera cuando la
+// global llega a e + 2: para entonces ya salió todo lector que pudo verlo.
+// La global avanza cuando todos los lectores activos la marcaron. Cada hilo
+// de servicio tiene su propia marca; los demás hilos (el de /metrics, el del
+// historial, los de bench.c) comparten una y la toman de a uno con
+// epocas.otros, así que solo en los hilos de servicio la búsqueda no toma
+// ningún lock. bench.c epocas:N es la prueba de estrés (con -fsanitize=thread).
+//------------------------------------------------------------------------------
+struct retirado {
+    struct retirado *sig;
+    uint64_t epoca;
+    void (*liberar)(struct retirado *r);
+};
+
+struct marca_epoca {
+    _Alignas(64) atomic_uint_fast64_t epoca;   // 0 = fuera de una búsqueda
+};
+
+static struct {
+    atomic_uint_fast64_t global;
+    struct marca_epoca marcas[MAX_HILOS + 1];  // [MAX_HILOS]: hilos que no son de servicio
+    pthread_mutex_t otros;                     // turno de la marca compartida
+    pthread_mutex_t lock;                      // protege retirados
+    struct retirado *retirados;                // el más reciente primero
+} epocas = { .global = 1, .otros = PTHREAD_MUTEX_INITIALIZER,
+             .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static _Thread_local int epoca_hilo = -1;      // tsi del hilo de servicio, -1 = otro
+static _Thread_local int epoca_anidada = 0;
+
+static void epoca_entrar(void) {
+    if (epoca_anidada++) return;
+    int h = epoca_hilo >= 0 ? epoca_hilo : MAX_HILOS;
+    if (h == MAX_HILOS) pthread_mutex_lock(&epocas.otros);
+    // Una marca vieja solo demora el avance: nunca libera de más
+    atomic_store(&epocas.marcas[h].epoca, atomic_load(&epocas.global));
+    atomic_thread_fence(memory_order_seq_cst);   // la marca, antes que cualquier lectura
+}
+
+static void epoca_salir(void) {
+    if (--epoca_anidada) return;
+    int h = epoca_hilo >= 0 ? epoca_hilo : MAX_HILOS;
+    atomic_store_explicit(&epocas.marcas[h].epoca, 0, memory_order_release);
+    if (h == MAX_HILOS) pthread_mutex_unlock(&epocas.otros);
+}
+
+// Avanza la global si se puede y libera lo que ya nadie puede estar leyendo
+// (requiere epocas.lock)
+static void epoca_recolectar_locked(void) {
+    atomic_thread_fence(memory_order_seq_cst);   // lo desenganchado, antes de ver las marcas
+    uint64_t g = atomic_load(&epocas.global);
+    int avanzar = 1;
+    for (int h = 0; h <= MAX_HILOS && avanzar; h++) {
+        uint64_t e = atomic_load(&epocas.marcas[h].epoca);
+        if (e && e != g) avanzar = 0;
+    }
+    if (avanzar) atomic_store(&epocas.global, ++g);
+
+    struct retirado **p = &epocas.retirados;
+    while (*p && (*p)->epoca + 2 > g) p = &(*p)->sig;
+    struct retirado *r = *p;
+    *p = NULL;
+    while (r) {
+        struct retirado *sig = r->sig;
+        r->liberar(r);
+        r = sig;
+    }
+}
+
+// Entrega r para liberarlo (con liberar) cuando no quede lector que lo vea.
+// Ya tiene que estar desenganchado de todo lo que se lee sin lock.
+static void epoca_retirar(struct retirado *r, void (*liberar)(struct retirado *r)) {
+    pthread_mutex_lock(&epocas.lock);
+    r->epoca = atomic_load(&epocas.global);
+    r->liberar = liberar;
+    r->sig = epocas.retirados;
+    epocas.retirados = r;
+    epoca_recolectar_locked();
+    pthread_mutex_unlock(&epocas.lock);
+}
+
+//------------------------------------------------------------------------------
+// Registro global de sesiones
+//  - sesiones: arreglo denso con todas las conexiones (pss->slot = índice)
+//  - indice:   tabla hash de direccionamiento abierto (sondeo lineal)
+//              nombre -> vínculo, solo para sesiones con username
+// Se modifican con registro_lock de escritura. El índice además se lee
+// dentro de una época, sin lock en los hilos de servicio: los vínculos no cambian después de publicarse,
+// un borrado deja una lápida y la tabla se rehace entera en otra (nunca se
+// mueve una entrada de una tabla publicada).
+//
+// Lo que otros hilos leen de una conexión está en su ficha, no en el pss
+// (ese lo libera lws al cerrarse). Las fichas salen de bloques que no se
+// liberan nunca y se reciclan después de retirarse, así que una manija
+// {ficha, generación} se comprueba en cualquier momento sin época: si la
+// generación ya no coincide, la conexión se cerró.
+//------------------------------------------------------------------------------
+#define FICHAS_BLOQUE 256
+
+// Definidas en "Memoria por shard"
+static void *slab_tomar_tam(size_t tam, size_t *cap);
+static void slab_devolver(void *p);
+
+struct ficha_sesion {
+    struct retirado retiro;
+    atomic_uint_fast64_t generacion;   // id de la conexión; 0 = cerrada
+    int shard;
+    char ip[64];
+    _Atomic(enum estado_usuario) est;  // Estado (ACTIVO, OCUPADO, INACTIVO)
+    atomic_size_t en_cola;             // Copia de cola.num
+    atomic_size_t descartados;         // Frames perdidos por desborde
+    struct per_session_data__chat *pss;  // solo lo desreferencia el hilo dueño
+};
+
+// Referencia a una sesión que se puede guardar y pasar a otro hilo
+struct manija_sesion {
+    struct ficha_sesion *ficha;        // NULL = ninguna
+    uint64_t generacion;
+    int shard;
+};
+
+struct vinculo_nombre {
+    struct retirado retiro;
+    uint32_t hash;
+    struct manija_sesion sesion;
+    nombre_usuario nombre;
+};
+
+struct tabla_indice {
+    struct retirado retiro;
+    size_t cap;                        // siempre potencia de 2
+    _Atomic(struct vinculo_nombre *) v[];  // NULL = libre
+};
+
+struct registro_sesiones {
+    struct per_session_data__chat **sesiones;
+    size_t num_sesiones;
+    size_t cap_sesiones;
+
+    _Atomic(struct tabla_indice *) indice;
+    size_t num_nombres;
+    size_t num_lapidas;
+
+    struct retirado *fichas_libres;      // fichas para reciclar (por retiro.sig)
+    pthread_mutex_t lock_fichas;
+};
+
+static struct registro_sesiones registro = {
+    .lock_fichas = PTHREAD_MUTEX_INITIALIZER
+};
+
+static struct vinculo_nombre lapida;   // entrada borrada del índice
+
+// FNV-1a de 32 bits
+static uint32_t hash_nombre(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Busca el vínculo del nombre; NULL si no está. Requiere estar en una época
+// o tener registro_lock. Se compara el hash antes de hacer strcmp.
+static struct vinculo_nombre *indice_buscar(const char *nombre, uint32_t h) {
+    struct tabla_indice *t = atomic_load_explicit(&registro.indice, memory_order_acquire);
+    if (!t) return NULL;
+    size_t mask = t->cap - 1;
+    for (size_t i = h & mask; ; i = (i + 1) & mask) {
+        struct vinculo_nombre *v = atomic_load_explicit(&t->v[i], memory_order_acquire);
+        if (!v) return NULL;
+        if (v != &lapida && v->hash == h && strcmp(v->nombre, nombre) == 0) return v;
+    }
+}
+
+static void indice_insertar_sin_crecer(struct tabla_indice *t, struct vinculo_nombre *v) {
+    size_t mask = t->cap - 1;
+    size_t i = v->hash & mask;
+    struct vinculo_nombre *x;
+    while ((x = atomic_load_explicit(&t->v[i], memory_order_relaxed)) && x != &lapida)
+        i = (i + 1) & mask;
+    if (x == &lapida) registro.num_lapidas--;
+    atomic_store_explicit(&t->v[i], v, memory_order_release);
+}
+
+static void liberar_tabla(struct retirado *r) {
+    free(lws_container_of(r, struct tabla_indice, retiro));
+}
+
+// Rehace el índice en una tabla nueva sin lápidas y con lugar para uno más
+// (el uso queda en a lo sumo un cuarto). La vieja se retira.
+static int indice_rehacer(void) {
+    size_t cap = REGISTRO_CAP_INICIAL * 2;
+    while ((registro.num_nombres + 1) * 4 > cap) cap *= 2;
+    struct tabla_indice *nueva = malloc(sizeof(*nueva) + cap * sizeof(nueva->v[0]));
+    if (!nueva) return -1;
+    nueva->cap = cap;
+    for (size_t i = 0; i < cap; i++) atomic_init(&nueva->v[i], NULL);
+
+    struct tabla_indice *vieja = atomic_load_explicit(&registro.indice, memory_order_relaxed);
+    registro.num_lapidas = 0;
+    for (size_t i = 0; vieja && i < vieja->cap; i++) {
+        struct vinculo_nombre *v = atomic_load_explicit(&vieja->v[i], memory_order_relaxed);
+        if (v && v != &lapida) indice_insertar_sin_crecer(nueva, v);
+    }
+    atomic_store_explicit(&registro.indice, nueva, memory_order_release);
+    if (vieja) epoca_retirar(&vieja->retiro, liberar_tabla);
+    return 0;
+}
+
+static void liberar_vinculo(struct retirado *r) {
+    slab_devolver(lws_container_of(r, struct vinculo_nombre, retiro));
+}
+
+// Deja una lápida en lugar de v y lo retira
+static void indice_borrar(struct vinculo_nombre *v) {
+    struct tabla_indice *t = atomic_load_explicit(&registro.indice, memory_order_relaxed);
+    size_t mask = t->cap - 1;
+    size_t i = v->hash & mask;
+    while (atomic_load_explicit(&t->v[i], memory_order_relaxed) != v) i = (i + 1) & mask;
+    atomic_store_explicit(&t->v[i], &lapida, memory_order_release);
+    registro.num_nombres--;
+    registro.num_lapidas++;
+    epoca_retirar(&v->retiro, liberar_vinculo);
+}
+
+static void reciclar_ficha_locked(struct retirado *r) {
+    r->sig = registro.fichas_libres;
+    registro.fichas_libres = r;
+}
+
+static void reciclar_ficha(struct retirado *r) {
+    pthread_mutex_lock(&registro.lock_fichas);
+    reciclar_ficha_locked(r);
+    pthread_mutex_unlock(&registro.lock_fichas);
+}
+
+static struct ficha_sesion *tomar_ficha(void) {
+    pthread_mutex_lock(&registro.lock_fichas);
+    if (!registro.fichas_libres) {
+        struct ficha_sesion *b = calloc(FICHAS_BLOQUE, sizeof(*b));
+        for (int i = 0; b && i < FICHAS_BLOQUE; i++) reciclar_ficha_locked(&b[i].retiro);
+    }
+    struct retirado *r = registro.fichas_libres;
+    if (r) registro.fichas_libres = r->sig;
+    pthread_mutex_unlock(&registro.lock_fichas);
+    return r ? lws_container_of(r, struct ficha_sesion, retiro) : NULL;
+}
+
+// 1 si la sesión de la manija sigue abierta
+static int manija_valida(const struct manija_sesion *m) {
+    return m->ficha
+           && atomic_load_explicit(&m->ficha->generacion, memory_order_acquire) == m->generacion;
+}
+//------------------------------------------------------------------------------
+// Roster versionado
+// Cada alta o baja de un nombre sube roster.version y queda anotada en un
+// historial circular (protegido por registro_lock) con el que se arman los
+// deltas de list_users. La lista completa ya serializada se guarda en
+// roster.snapshot y solo se rearma cuando cambió la versión.
+//------------------------------------------------------------------------------
+#define ROSTER_HISTORIAL 1024     // altas/bajas recordadas para los deltas
+
+struct evento_roster {
+    nombre_usuario usuario;   // "" si no hubo evento (obliga a lista completa)
+    int alta;                 // 1 = entró, 0 = salió
+};
+
+static struct {
+    atomic_uint_fast64_t version;
+    struct evento_roster historial[ROSTER_HISTORIAL];  // versión v en [v % ROSTER_HISTORIAL]
+    pthread_mutex_t lock;                 // protege snapshot y version_snapshot
+    struct frame_salida *snapshot;        // [ "u1", "u2", ... ]
+    uint64_t version_snapshot;
+} roster = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Anota un alta o baja (requiere registro_lock de escritura)
+static void roster_evento_locked(const char *usuario, int alta) {
+    uint64_t v = atomic_load_explicit(&roster.version, memory_order_relaxed) + 1;
+    struct evento_roster *ev = &roster.historial[v % ROSTER_HISTORIAL];
+    strcpy(ev->usuario, usuario);     // los nombres registrados entran
+    ev->alta = alta;
+    atomic_store_explicit(&roster.version, v, memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+// Añadir cliente a la lista (y darle su ficha)
+//------------------------------------------------------------------------------
+int registrar_cliente(struct per_session_data__chat *pss) {
+    int ret = 0;
+    struct ficha_sesion *ficha = tomar_ficha();
+    if (!ficha) return -1;
+    ficha->shard = pss->shard;
+    memcpy(ficha->ip, pss->ip, sizeof(ficha->ip));
+    atomic_store_explicit(&ficha->est, ESTADO_ACTIVO, memory_order_relaxed);
+    atomic_store_explicit(&ficha->en_cola, 0, memory_order_relaxed);
+    atomic_store_explicit(&ficha->descartados, 0, memory_order_relaxed);
+    ficha->pss = pss;
+    atomic_store_explicit(&ficha->generacion, pss->id, memory_order_release);
+
+    pthread_rwlock_wrlock(&registro_lock);
+    if (registro.num_sesiones == registro.cap_sesiones) {
+        size_t nueva_cap = registro.cap_sesiones ? registro.cap_sesiones * 2
+                                                 : REGISTRO_CAP_INICIAL;
+        struct per_session_data__chat **nuevo =
+            realloc(registro.sesiones, nueva_cap * sizeof(*nuevo));
+        if (!nuevo) {
+            atomic_store_explicit(&ficha->generacion, 0, memory_order_release);
+            reciclar_ficha(&ficha->retiro);     // nadie la vio todavía
+            ret = -1;
+            goto fin;
+        }
+        registro.sesiones = nuevo;
+        registro.cap_sesiones = nueva_cap;
+    }
+    pss->ficha = ficha;
+    pss->vinculo = NULL;
+    pss->slot = registro.num_sesiones;
+    registro.sesiones[registro.num_sesiones++] = pss;
+fin:
+    pthread_rwlock_unlock(&registro_lock);
+    return ret;
+}
+
+// Quita el nombre de pss del índice (requiere registro_lock de escritura)
+static void quitar_nombre_locked(struct per_session_data__chat *pss) {
+    if (!pss->vinculo) return;
+    indice_borrar(pss->vinculo);
+    pss->vinculo = NULL;
+    roster_evento_locked(pss->username, 0);
+}
+
+//------------------------------------------------------------------------------
+// Remover cliente de la lista. La ficha se retira: las manijas que queden
+// dejan de ser válidas.
+//------------------------------------------------------------------------------
+void eliminar_cliente(struct per_session_data__chat *pss) {
+    pthread_rwlock_wrlock(&registro_lock);
+    size_t slot = pss->slot;
+    if (slot < registro.num_sesiones && registro.sesiones[slot] == pss) {
+        quitar_nombre_locked(pss);
+
+        // Mover la última sesión al hueco
+        size_t ultimo = --registro.num_sesiones;
+        if (slot != ultimo) {
+            struct per_session_data__chat *movida = registro.sesiones[ultimo];
+            registro.sesiones[slot] = movida;
+            movida->slot = slot;
+        }
+        registro.sesiones[ultimo] = NULL;
+
+        atomic_store_explicit(&pss->ficha->generacion, 0, memory_order_release);
+        epoca_retirar(&pss->ficha->retiro, reciclar_ficha);
+        pss->ficha = NULL;
+    }
+    pthread_rwlock_unlock(&registro_lock);
+}
+
+//------------------------------------------------------------------------------
+// Asignar nombre a una sesión ya registrada.
+// El nombre se copia a pss->nombre (sin reservar memoria) y a un vínculo
+// nuevo del índice: los publicados no se modifican.
+// Devuelve 0 si se asignó, -1 si el nombre ya lo usa otra sesión,
+// -2 si no hay memoria, -3 si pasa de USUARIO_MAX bytes.
+//------------------------------------------------------------------------------
+int asignar_nombre(struct per_session_data__chat *pss, const char *nombre) {
+    int ret = 0;
+    size_t len = strlen(nombre);
+    if (len > USUARIO_MAX) return -3;
+    uint32_t h = hash_nombre(nombre);
+
+    pthread_rwlock_wrlock(&registro_lock);
+    struct vinculo_nombre *v = indice_buscar(nombre, h);
+    if (v) {
+        // Re-registrarse con el mismo nombre no es un duplicado
+        if (v != pss->vinculo) ret = -1;
+        goto fin;
+    }
+    struct tabla_indice *t = atomic_load_explicit(&registro.indice, memory_order_relaxed);
+    if (((!t || (registro.num_nombres + registro.num_lapidas + 1) * 2 > t->cap)
+         && indice_rehacer() < 0)
+        || !(v = slab_tomar_tam(sizeof(*v), NULL))) {
+        ret = -2;
+        goto fin;
+    }
+    v->hash = h;
+    v->sesion.ficha = pss->ficha;
+    v->sesion.generacion = pss->id;
+    v->sesion.shard = pss->shard;
+    memcpy(v->nombre, nombre, len + 1);
+
+    quitar_nombre_locked(pss);
+    memcpy(pss->nombre, nombre, len + 1);
+    pss->username = pss->nombre;
+    indice_insertar_sin_crecer(atomic_load_explicit(&registro.indice, memory_order_relaxed), v);
+    pss->vinculo = v;
+    registro.num_nombres++;
+    roster_evento_locked(pss->username, 1);
+fin:
+    pthread_rwlock_unlock(&registro_lock);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// Liberar el nombre de una sesión (disconnect / cierre)
+//------------------------------------------------------------------------------
+void liberar_nombre(struct per_session_data__chat *pss) {
+    pthread_rwlock_wrlock(&registro_lock);
+    quitar_nombre_locked(pss);
+    pss->username = NULL;
+    pthread_rwlock_unlock(&registro_lock);
+}
+
+//------------------------------------------------------------------------------
+// Buscar un cliente por nombre (O(1) promedio; sin locks en los hilos de
+// servicio, los demás esperan su turno en epocas.otros)
+// Devuelve su manija; ficha == NULL si no está registrado.
+//------------------------------------------------------------------------------
+static struct manija_sesion buscar_sesion(const char *nombre) {
+    struct manija_sesion m = { NULL, 0, 0 };
+    epoca_entrar();
+    struct vinculo_nombre *v = indice_buscar(nombre, hash_nombre(nombre));
+    if (v) m = v->sesion;
+    epoca_salir();
+    return m;
+}
+//------------------------------------------------------------------------------
+// Convertir enum estado_usuario a string
+//------------------------------------------------------------------------------
+static const char* estado_to_string(enum estado_usuario e) {
+    switch(e) {
+        case ESTADO_ACTIVO:   return "ACTIVO";
+        case ESTADO_OCUPADO:  return "OCUPADO";
+        case ESTADO_INACTIVO: return "INACTIVO";
+        default: return "ACTIVO";
+    }
+}
+
+//------------------------------------------------------------------------------
+// Memoria por shard
+// Slabs: frames, envíos entre shards y las colas de salida de las sesiones
+// salen de listas libres por shard y por clase de tamaño, así que en régimen
+// estable no se llama a malloc. Cada bloque lleva delante una cabecera con su
+// shard y su clase. Si lo suelta el hilo dueño vuelve a su lista, sin locks;
+// si lo suelta otro hilo (el último destinatario de un frame suele estar en
+// otro shard) va a una pila atómica del dueño, que este recoge entera cuando
+// su lista se vacía. Lo que se pide fuera de los hilos de servicio, o más
+// grande que la clase mayor, va directo a malloc.
+//
+// Arena de mensaje: memoria de paso para procesar un mensaje entrante; se
+// reinicia al terminar cada uno (en LWS_CALLBACK_RECEIVE). Lo que no entra
+// se pide aparte y el buffer crece al reiniciar, hasta ARENA_MAX.
+//------------------------------------------------------------------------------
+enum clase_slab {
+    SLAB_256,
+    SLAB_1K,
+    SLAB_4K,
+    SLAB_16K,
+    SLAB_COLA,                   // cola_salida.frames de cfg.cola_max entradas
+    SLAB_CLASES,
+    SLAB_NINGUNA = SLAB_CLASES   // de malloc
+};
+
+struct bloque_slab {
+    struct bloque_slab *sig;     // en la lista libre
+    int32_t shard;
+    int32_t clase;               // 16 bytes: los datos quedan alineados como los de malloc
+};
+
+struct lista_slab {
+    struct bloque_slab *libres;  // solo el hilo dueño
+    size_t num_libres;
+    _Alignas(64) _Atomic(struct bloque_slab *) devueltos;  // soltados por otros hilos
+};
+
+static size_t tam_slab[SLAB_CLASES] = { 256, 1024, 4096, 16384, 0 };  // SLAB_COLA: main
+static struct lista_slab slabs[MAX_HILOS][SLAB_CLASES];
+static _Thread_local int slab_hilo = -1;    // shard del hilo actual, -1 = ninguno
+
+// Pasa a la lista los bloques que devolvieron otros hilos
+static void slab_recoger(struct lista_slab *l) {
+    struct bloque_slab *b = atomic_exchange_explicit(&l->devueltos, NULL,
+                                                     memory_order_acquire);
+    while (b) {
+        struct bloque_slab *sig = b->sig;
+        if (l->num_libres < SLAB_LIBRES_MAX) {
+            b->sig = l->libres;
+            l->libres = b;
+            l->num_libres++;
+        } else {
+            free(b);
+        }
+        b = sig;
+    }
+}
+
+// Bloque de la clase; tam solo cuenta con SLAB_NINGUNA
+static void *slab_tomar(int clase, size_t tam) {
+    if (slab_hilo >= 0 && clase < SLAB_CLASES) {
+        struct lista_slab *l = &slabs[slab_hilo][clase];
+        if (!l->libres) slab_recoger(l);
+        struct bloque_slab *b = l->libres;
+        if (b) {
+            l->libres = b->sig;
+            l->num_libres--;
+            return b + 1;
+        }
+    }
+    struct bloque_slab *b = malloc(sizeof(*b) + (clase < SLAB_CLASES ? tam_slab[clase] : tam));
+    if (!b) return NULL;
+    b->shard = slab_hilo;
+    b->clase = slab_hilo >= 0 ? clase : SLAB_NINGUNA;
+    return b + 1;
+}
+
+// Bloque de al menos tam bytes, de la clase más chica que alcance. En *cap
+// (si no es NULL) quedan los bytes utilizables.
+static void *slab_tomar_tam(size_t tam, size_t *cap) {
+    int clase = SLAB_256;
+    while (clase <= SLAB_16K && tam_slab[clase] < tam) clase++;
+    if (clase > SLAB_16K) clase = SLAB_NINGUNA;
+    if (cap) *cap = clase < SLAB_CLASES ? tam_slab[clase] : tam;
+    return slab_tomar(clase, tam);
+}
+
+static void slab_devolver(void *p) {
+    if (!p) return;
+    struct bloque_slab *b = (struct bloque_slab *)p - 1;
+    if (b->clase == SLAB_NINGUNA) {
+        free(b);
+        return;
+    }
+    struct lista_slab *l = &slabs[b->shard][b->clase];
+    if (b->shard == slab_hilo) {
+        if (l->num_libres >= SLAB_LIBRES_MAX) {
+            free(b);
+            return;
+        }
+        b->sig = l->libres;
+        l->libres = b;
+        l->num_libres++;
+        return;
+    }
+    // Pila de Treiber: solo se apila aquí y el dueño la vacía entera, sin ABA
+    struct bloque_slab *cabeza = atomic_load_explicit(&l->devueltos, memory_order_relaxed);
+    do {
+        b->sig = cabeza;
+    } while (!atomic_compare_exchange_weak_explicit(&l->devueltos, &cabeza, b,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+struct arena_extra {
+    struct arena_extra *sig;
+    max_align_t datos[];
+};
+
+struct arena {
+    char *buf;
+    size_t cap;
+    size_t usado;
+    size_t pedido;               // total desde el último reinicio (con lo de aparte)
+    struct arena_extra *extras;  // lo que no entró en buf
+};
+
+static void *arena_tomar(struct arena *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    a->pedido += n;
+    if (a->usado + n <= a->cap) {
+        void *p = a->buf + a->usado;
+        a->usado += n;
+        return p;
+    }
+    struct arena_extra *x = malloc(sizeof(*x) + n);
+    if (!x) return NULL;
+    x->sig = a->extras;
+    a->extras = x;
+    return x->datos;
+}
+
+static void arena_reiniciar(struct arena *a) {
+    while (a->extras) {
+        struct arena_extra *sig = a->extras->sig;
+        free(a->extras);
+        a->extras = sig;
+    }
+    if (a->pedido > a->cap && a->pedido <= ARENA_MAX) {
+        size_t cap = a->cap ? a->cap : ARENA_INICIAL;
+        while (cap < a->pedido) cap *= 2;
+        char *buf = malloc(cap);
+        if (buf) {
+            free(a->buf);
+            a->buf = buf;
+            a->cap = cap;
+        }
+    }
+    a->usado = 0;
+    a->pedido = 0;
+}
+
+//------------------------------------------------------------------------------
+// Cola de salida por conexión
+// Nunca se llama lws_write fuera del callback WRITEABLE de la propia
+// conexión: los envíos solo encolan y piden WRITEABLE. La cola solo la toca
+// el hilo dueño de la sesión; otros hilos le envían frames por su buzón.
+//------------------------------------------------------------------------------
+static int cola_iniciar(struct cola_salida *cola, size_t cap) {
+    size_t tam = cap * sizeof(*cola->frames);
+    cola->frames = slab_tomar(tam == tam_slab[SLAB_COLA] ? SLAB_COLA : SLAB_NINGUNA, tam);
+    if (cola->frames) memset(cola->frames, 0, tam);
+    cola->cap = cola->frames ? cap : 0;
+    cola->cabeza = 0;
+    cola->num = 0;
+    return cola->frames ? 0 : -1;
+}
+
+static struct frame_salida *cola_sacar(struct cola_salida *cola) {
+    if (cola->num == 0) return NULL;
+    struct frame_salida *f = cola->frames[cola->cabeza];
+    cola->frames[cola->cabeza] = NULL;
+    cola->cabeza = (cola->cabeza + 1) % cola->cap;
+    cola->num--;
+    return f;
+}
+
+static struct frame_salida *frame_tomar(struct frame_salida *f) {
+    atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+    return f;
+}
+
+static void frame_soltar(struct frame_salida *f) {
+    if (f && atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) {
+        struct frame_comprimido *c, *sig;
+        for (c = f->comprimidos; c; c = sig) {
+            sig = c->sig;
+            slab_devolver(c);
+        }
+        slab_devolver(f->binario);
+        slab_devolver(f);
+    }
+}
+
+static void cola_liberar(struct cola_salida *cola) {
+    struct frame_salida *f;
+    while ((f = cola_sacar(cola)) != NULL) frame_soltar(f);
+    slab_devolver(cola->frames);
+    cola->frames = NULL;
+    cola->cap = 0;
+}
+
+// Encola una referencia al frame (la cola toma su propia referencia).
+// Devuelve -1 si la cola estaba llena (se aplicó la política).
+static int cola_meter(struct per_session_data__chat *pss, struct frame_salida *f) {
+    struct cola_salida *cola = &pss->cola;
+    struct metricas_hilo *met = &metricas[pss->shard];
+    int ret = 0;
+    if (cola->cap == 0) return -1;
+    if (cola->num == cola->cap) {
+        atomic_fetch_add_explicit(&pss->ficha->descartados, 1, memory_order_relaxed);
+        met_sumar(&met->contadores[MET_DESCARTADOS], 1);
+        ret = -1;
+        if (cfg.desborde == DESBORDE_DESCONECTAR) {
+            pss->desbordado = 1;
+            return ret;
+        }
+        frame_soltar(cola_sacar(cola));
+        met_ajustar(&met->frames_en_cola, -1);
+    }
+    frame_tomar(f);
+    cola->frames[(cola->cabeza + cola->num) % cola->cap] = f;
+    cola->num++;
+    atomic_store_explicit(&pss->ficha->en_cola, cola->num, memory_order_relaxed);
+    met_ajustar(&met->frames_en_cola, 1);
+    hist_registrar(&met->profundidad_cola, cola->num);
+    return ret;
+}
+
+// Copia privada de un frame para otro shard: así la cabecera que lws_write
+// escribe en los LWS_PRE bytes nunca se comparte entre hilos.
+static struct frame_salida *duplicar_frame(const struct frame_salida *f) {
+    struct frame_salida *d = slab_tomar_tam(sizeof(*d) + LWS_PRE + f->len, NULL);
+    if (!d) return NULL;
+    atomic_init(&d->refs, 1);
+    d->len = f->len;
+    d->comprimidos = NULL;
+    d->binario = NULL;
+    d->datos = &d->buf[LWS_PRE];
+    memcpy(d->datos, f->datos, f->len);
+    return d;
+}
+
+//------------------------------------------------------------------------------
+// Compresión (permessage-deflate)
+// lws negocia la extensión y comprime cada mensaje por conexión. Con
+// --deflate-compartido, a las sesiones que pidieron
+// server_no_context_takeover se les mandan bytes ya comprimidos: sin contexto
+// entre mensajes la salida de deflate no depende de la conexión, así que cada
+// frame se comprime una vez por ventana (server_max_window_bits) en su shard
+// y esa copia sirve a todos sus destinatarios. El frame WebSocket (RSV1 =
+// comprimido, sin máscara) se arma acá y se escribe con LWS_WRITE_RAW.
+//------------------------------------------------------------------------------
+#define DEFLATE_VENTANA_MIN 9         // zlib no comprime crudo con 8 bits
+#define DEFLATE_VENTANA_MAX 15
+#define DEFLATE_CABECERA_MAX 10       // cabecera WebSocket sin máscara
+
+// Un z_stream por ventana y por hilo; se reinicia antes de cada frame
+static _Thread_local z_stream *deflate_hilo[DEFLATE_VENTANA_MAX + 1];
+
+// Ventana con la que se le pueden mandar frames ya comprimidos a la sesión
+// (0 = no se puede): el cliente ofreció permessage-deflate con
+// server_no_context_takeover. Solo se mira la primera oferta, que es la que
+// acepta lws.
+static int ventana_compartida(struct lws *wsi) {
+    if (!cfg.deflate || !cfg.deflate_compartido) return 0;
+    char ext[256];
+    if (lws_hdr_copy(wsi, ext, sizeof(ext), WSI_TOKEN_EXTENSIONS) <= 0) return 0;
+    char *oferta = strstr(ext, "permessage-deflate");
+    if (!oferta) return 0;
+    char *fin = strchr(oferta, ',');
+    if (fin) *fin = '\0';
+    if (!strstr(oferta, "server_no_context_takeover")) return 0;
+    int ventana = DEFLATE_VENTANA_MAX;
+    char *bits = strstr(oferta, "server_max_window_bits");
+    if (bits && (bits = strchr(bits, '=')) != NULL)
+        ventana = atoi(bits + 1 + (bits[1] == '"'));
+    if (ventana < DEFLATE_VENTANA_MIN) return 0;
+    return ventana > DEFLATE_VENTANA_MAX ? DEFLATE_VENTANA_MAX : ventana;
+}
+
+// Bytes de salida que alcanzan para comprimir len bytes
+static size_t deflate_cota(size_t len) {
+    return len + len / 1000 + 64;
+}
+
+// Comprime payload como un mensaje de permessage-deflate: deflate crudo,
+// Z_SYNC_FLUSH y sin el 00 00 ff ff final (RFC 7692). out necesita
+// deflate_cota(len) bytes. Devuelve los bytes escritos o -1.
+
+static long deflate_mensaje(z_stream *z, const unsigned char *payload, size_t len,
+                            unsigned char *out) {
+    size_t cota = deflate_cota(len);
+    z->next_in = (unsigned char *)payload;
+    z->avail_in = (uInt)len;
+    z->next_out = out;
+    z->avail_out = (uInt)cota;
+    if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in > 0) return -1;
+    size_t n = cota - z->avail_out;
+    return n >= 4 ? (long)(n - 4) : -1;
+}
+
+static z_stream *deflate_nuevo(int ventana) {
+    z_stream *z = calloc(1, sizeof(*z));
+    if (z && deflateInit2(z, cfg.deflate_nivel, Z_DEFLATED, -ventana, cfg.deflate_memoria,
+                          Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(z);
+        z = NULL;
+    }
+    return z;
+}
+
+// Frame WebSocket comprimido de f para la ventana dada; queda guardado en f
+// para los demás destinatarios del shard. NULL si no se pudo comprimir.
+static struct frame_comprimido *frame_comprimido(struct frame_salida *f, int ventana) {
+    struct frame_comprimido *c;
+    for (c = f->comprimidos; c; c = c->sig)
+        if (c->ventana == ventana) return c;
+
+    z_stream *z = deflate_hilo[ventana];
+    if (!z) {
+        if (!(z = deflate_nuevo(ventana))) return NULL;
+        deflate_hilo[ventana] = z;
+    } else {
+        deflateReset(z);
+    }
+    c = slab_tomar_tam(sizeof(*c) + LWS_PRE + DEFLATE_CABECERA_MAX + deflate_cota(f->len), NULL);
+    if (!c) return NULL;
+    unsigned char *datos = c->buf + LWS_PRE + DEFLATE_CABECERA_MAX;
+    long n = deflate_mensaje(z, f->datos, f->len, datos);
+    if (n < 0) {
+        slab_devolver(c);
+        return NULL;
+    }
+    // FIN + RSV1 + texto; del servidor al cliente no va máscara
+    size_t largo = (size_t)n;
+    size_t cab = largo < 126 ? 2 : largo < 65536 ? 4 : 10;
+    unsigned char *h = datos - cab;
+    h[0] = 0xc1;
+    if (cab == 2) {
+        h[1] = (unsigned char)largo;
+    } else if (cab == 4) {
+        h[1] = 126;
+        h[2] = (unsigned char)(largo >> 8);
+        h[3] = (unsigned char)largo;
+    } else {
+        h[1] = 127;
+        for (int i = 0; i < 8; i++) h[2 + i] = (unsigned char)((uint64_t)largo >> (56 - 8 * i));
+    }
+    c->ventana = ventana;
+    c->inicio = h;
+    c->len = cab + largo;
+    c->sig = f->comprimidos;
+    f->comprimidos = c;
+    return c;
+}
+
+//------------------------------------------------------------------------------
+// Historial persistente
+// Log de solo-agregado en segmentos de SEGMENTO_TAM bytes mapeados con mmap.
+// Cada registro guarda el frame tal como se mandó (con LWS_PRE bytes libres
+// delante, que ya no se usan pero siguen en el formato). Al reproducirlo se
+// copia a un frame del shard: lws_write nunca escribe en el mapa, que
+// comparten todos los hilos.
+// Índices:
+//  - lobby.idx: anillo mapeado con las últimas HIST_LOBBY ubicaciones de
+//    broadcast.
+//  - buzones/<hex del nombre>.idx: privados guardados para un usuario que no
+//    estaba conectado; se consumen al registrarse (ver buzon_guardar).
+// Los privados entregados en vivo no se guardan. El historial es opcional
+// (--historial=DIR); sin él no hay replay ni buzones.
+// Al arrancar solo se abre el último segmento y se lee su cabecera, sin
+// recorrer los registros. Un hilo aparte hace msync/fdatasync en lotes cada
+// cfg.historial_sync_ms; los hilos de servicio nunca esperan al disco. Ese
+// hilo también baja entero (MS_SYNC) el segmento que se cierra al rotar y
+// borra los que pasan de cfg.historial_segmentos: lo que quedaba en ellos
+// (broadcasts viejos, privados sin leer) ya no se reproduce.
+//------------------------------------------------------------------------------
+#define SEGMENTO_TAM   (64u << 20)
+#define HIST_LOBBY     1024       // broadcasts que se pueden reproducir
+
+enum tipo_registro {
+    REG_BROADCAST = 1,
+    REG_PRIVADO   = 2
+};
+
+struct cabecera_segmento {
+    char magia[8];                // "CHATSEG1"
+    uint32_t numero;
+    uint32_t reservado;
+    _Atomic uint64_t fin;         // primer byte libre (registros completos)
+};
+
+// [cabecera][destino][relleno a 8][LWS_PRE libres][payload][relleno a 8]
+struct cabecera_registro {
+    uint32_t len;                 // bytes de payload
+    uint16_t len_destino;         // nombre del destinatario (privados)
+    uint8_t tipo;                 // enum tipo_registro
+    uint8_t reservado;
+    int64_t creado;
+};
+
+struct lobby_mapeado {
+    char magia[8];                // "CHATLOB1"
+    _Atomic uint64_t cuenta;      // broadcasts agregados desde siempre
+    struct ubicacion entradas[HIST_LOBBY];
+};
+
+struct segmento_log {
+    unsigned char *mapa;          // NULL = todavía sin mapear
+    int fd;
+};
+
+static struct {
+    int activo;
+    pthread_mutex_t lock;         // agregar, rotar, mapear y buzones
+    struct segmento_log *segmentos;   // índice = número de segmento
+    size_t cap_segmentos;
+    uint32_t actual;
+    struct cabecera_segmento *cab;    // del segmento actual
+    struct lobby_mapeado *lobby;
+    // Pendiente de sincronizar (lo consume hilo_historial)
+    uint32_t seg_sin_sync;
+    uint64_t desde_sin_sync;
+    uint32_t cerrado_desde;       // [cerrado_desde, cerrado_hasta): rotados
+    uint32_t cerrado_hasta;       // que todavía no bajaron enteros a disco
+    uint32_t primero;             // segmento más viejo que se conserva
+    atomic_int parar;
+    pthread_t hilo;
+} historial = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t alinear8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// Offset del payload dentro del registro
+static size_t registro_inicio_payload(size_t len_destino) {
+    return alinear8(sizeof(struct cabecera_registro) + len_destino) + LWS_PRE;
+}
+
+static void ruta_historial(char *buf, size_t n, const char *fmt, uint32_t num) {
+    int k = snprintf(buf, n, "%s/", cfg.historial_dir);
+    if (k > 0 && (size_t)k < n) snprintf(buf + k, n - (size_t)k, fmt, num);
+}
+
+// buzones/<hex>.idx: el nombre puede tener cualquier byte
+static void ruta_buzon(char *buf, size_t n, const char *nombre) {
+    static const char hex[] = "0123456789abcdef";
+    int k = snprintf(buf, n, "%s/buzones/", cfg.historial_dir);
+    size_t p = k > 0 ? (size_t)k : 0;
+    for (; *nombre && p + 7 < n; nombre++) {
+        buf[p++] = hex[(unsigned char)*nombre >> 4];
+        buf[p++] = hex[(unsigned char)*nombre & 0xf];
+    }
+    snprintf(buf + p, n - p, ".idx");
+}
+
+static void *mapear_archivo(const char *ruta, size_t tam, int *fd_out) {
+    int fd = open(ruta, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0
+        || ((size_t)st.st_size < tam && posix_fallocate(fd, 0, (off_t)tam) != 0)) {
+        close(fd);
+        return NULL;
+    }
+    void *m = mmap(NULL, tam, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (fd_out) *fd_out = fd;
+    else close(fd);
+    return m;
+}
+
+// Mapea el segmento num (creándolo si crear). Requiere historial.lock.
+static struct cabecera_segmento *segmento_mapear(uint32_t num, int crear) {
+    if (num < historial.primero) return NULL;   // borrado (o por borrarse)
+    if (num >= historial.cap_segmentos) {
+        size_t nueva_cap = historial.cap_segmentos ? historial.cap_segmentos : 16;
+        while (nueva_cap <= num) nueva_cap *= 2;
+        struct segmento_log *s = realloc(historial.segmentos, nueva_cap * sizeof(*s));
+        if (!s) return NULL;
+        memset(s + historial.cap_segmentos, 0,
+               (nueva_cap - historial.cap_segmentos) * sizeof(*s));
+        historial.segmentos = s;
+        historial.cap_segmentos = nueva_cap;
+    }
+    struct segmento_log *seg = &historial.segmentos[num];
+    if (!seg->mapa) {
+        char ruta[512];
+        ruta_historial(ruta, sizeof(ruta), "seg-%08u.log", num);
+        if (!crear && access(ruta, F_OK) != 0) return NULL;
+        seg->mapa = mapear_archivo(ruta, SEGMENTO_TAM, &seg->fd);
+        if (!seg->mapa) return NULL;
+        struct cabecera_segmento *c = (struct cabecera_segmento *)seg->mapa;
+        if (memcmp(c->magia, "CHATSEG1", 8) != 0) {
+            memcpy(c->magia, "CHATSEG1", 8);
+            c->numero = num;
+            atomic_store(&c->fin, alinear8(sizeof(*c)));
+        }
+    }
+    return (struct cabecera_segmento *)seg->mapa;
+}
+
+// Anota un rango del segmento actual para el próximo msync (requiere lock)
+static void historial_marcar_sucio(uint32_t seg, uint64_t desde) {
+    if (historial.seg_sin_sync != seg) {
+        // Cambió el segmento: el anterior lo baja entero hilo_historial
+        if (historial.cerrado_desde == historial.cerrado_hasta)
+            historial.cerrado_desde = historial.seg_sin_sync;
+        historial.cerrado_hasta = seg;
+        historial.seg_sin_sync = seg;
+        historial.desde_sin_sync = 0;
+    } else if (historial.desde_sin_sync == UINT64_MAX || desde < historial.desde_sin_sync) {
+        historial.desde_sin_sync = desde;
+    }
+}
+
+// Agrega el frame al log. Devuelve 0 y su ubicación, o -1.
+static int historial_agregar(enum tipo_registro tipo, const char *destino,
+                             const struct frame_salida *f, struct ubicacion *ub) {
+    if (!historial.activo || !f) return -1;
+    size_t len_destino = destino ? strlen(destino) : 0;
+    if (len_destino > UINT16_MAX) return -1;
+    size_t ini = registro_inicio_payload(len_destino);
+    size_t total = alinear8(ini + f->len);
+    if (total > SEGMENTO_TAM / 2) return -1;
+
+    pthread_mutex_lock(&historial.lock);
+    struct cabecera_segmento *c = historial.cab;
+    uint64_t fin = atomic_load_explicit(&c->fin, memory_order_relaxed);
+    if (fin + total > SEGMENTO_TAM) {
+        struct cabecera_segmento *nuevo = segmento_mapear(historial.actual + 1, 1);
+        if (!nuevo) {
+            pthread_mutex_unlock(&historial.lock);
+            log_error("historial", "No se pudo crear el segmento %u", historial.actual + 1);
+            return -1;
+        }
+        historial.actual++;
+        historial.cab = c = nuevo;
+        fin = atomic_load_explicit(&c->fin, memory_order_relaxed);
+    }
+    unsigned char *r = (unsigned char *)c + fin;
+    struct cabecera_registro cr = {
+        (uint32_t)f->len, (uint16_t)len_destino, (uint8_t)tipo, 0, (int64_t)time(NULL)
+    };
+    memcpy(r, &cr, sizeof(cr));
+    if (len_destino) memcpy(r + sizeof(cr), destino, len_destino);
+    memcpy(r + ini, f->datos, f->len);
+    atomic_store_explicit(&c->fin, fin + total, memory_order_release);
+    historial_marcar_sucio(historial.actual, fin);
+
+    struct ubicacion u = { historial.actual, (uint32_t)fin };
+    if (tipo == REG_BROADCAST) {
+        uint64_t n = atomic_load_explicit(&historial.lobby->cuenta, memory_order_relaxed);
+        historial.lobby->entradas[n % HIST_LOBBY] = u;
+        atomic_store_explicit(&historial.lobby->cuenta, n + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&historial.lock);
+    if (ub) *ub = u;
+    return 0;
+}
+
+// Frame con una copia del registro (del slab del shard); NULL si la ubicación
+// no es válida o el segmento ya se borró
+static struct frame_salida *historial_frame(struct ubicacion u) {
+    pthread_mutex_lock(&historial.lock);
+    struct cabecera_segmento *c = segmento_mapear(u.segmento, 0);
+    struct frame_salida *f = NULL;
+    if (c && u.offset + sizeof(struct cabecera_registro)
+                 <= atomic_load_explicit(&c->fin, memory_order_acquire)) {
+        unsigned char *r = (unsigned char *)c + u.offset;
+        struct cabecera_registro cr;
+        memcpy(&cr, r, sizeof(cr));
+        size_t ini = registro_inicio_payload(cr.len_destino);
+        if (u.offset + ini + cr.len <= atomic_load(&c->fin)
+            && (f = slab_tomar_tam(sizeof(*f) + LWS_PRE + cr.len, NULL)) != NULL) {
+            atomic_init(&f->refs, 1);
+            f->len = cr.len;
+            f->comprimidos = NULL;
+            f->binario = NULL;
+            f->datos = &f->buf[LWS_PRE];
+            memcpy(f->datos, r + ini, cr.len);
+        }
+    }
+    pthread_mutex_unlock(&historial.lock);
+    return f;
+}
+
+//------------------------------------------------------------------------------
+// Buzones fuera de línea
+// Privados (y acks) para usuarios sin conexión. El mensaje va al historial y
+// el buzón del destinatario guarda su ubicación en memoria. Los hilos de
+// servicio nunca tocan el .idx: hilo_historial escribe en lotes a
+// buzones/<hex>.idx lo que falta y, si el buzón pasa de cfg.buzon_memoria
+// mensajes, saca de memoria lo ya escrito (el .idx queda como única copia).
+// Al arrancar se cargan los .idx que quedaron (buzones_cargar), así que un
+// nombre sin buzón en la tabla no tiene nada en disco.
+// Cada buzón acepta hasta cfg.buzon_max mensajes; se vacía de una vez al
+// registrarse. Si parte está sólo en disco, el registro lo desengancha y
+// hilo_historial lee el .idx, lo borra y le manda la lista al shard de la
+// sesión por su buzón MPSC (buzon_entregar).
+// Orden de locks: buzones.io -> buzones.lock -> historial.lock.
+//------------------------------------------------------------------------------
+#define BUZONES_CAP_INICIAL 64    // listas de la tabla (crece al doble)
+
+struct buzon_usuario {
+    struct buzon_usuario *sig;        // misma lista de la tabla
+    struct buzon_usuario *sig_sucio;  // pendientes de persistir
+    struct buzon_usuario *prev_sucio;
+    int sucio;
+    int vaciando;                 // desenganchado, en buzones.vaciados
+    struct buzon_usuario *sig_vaciado;
+    struct manija_sesion destino; // vaciando: sesión que lo espera (ficha NULL = nadie)
+    char *usuario;
+    uint32_t hash;
+    struct ubicacion *entradas;   // los últimos num mensajes, en orden de llegada
+    size_t num;
+    size_t cap;
+    size_t persistidas;           // los primeros persistidas ya están en el .idx
+    size_t total;                 // mensajes pendientes (memoria o disco)
+};
+
+static struct {
+    pthread_mutex_t lock;         // tabla, buzones y listas de sucios y vaciados
+    pthread_mutex_t io;           // una pasada de buzones_persistir a la vez (.idx)
+    struct buzon_usuario **tabla;
+    size_t cap_tabla;             // siempre potencia de 2
+    size_t num;
+    struct buzon_usuario *sucios;
+    struct buzon_usuario *vaciados;   // en orden de registro
+    struct buzon_usuario *ultimo_vaciado;
+} buzones = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .io = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Mensajes esperando en los buzones (para /metrics)
+static atomic_long mensajes_en_buzones = 0;
+
+// Ids de los privados; main los arranca en (segundos << 20) para que no se
+// repitan entre ejecuciones
+static atomic_uint_fast64_t siguiente_mensaje_id = 1;
+
+// Definida en "Shards" (necesita el buzón MPSC de los shards)
+static void buzon_entregar(struct buzon_usuario *b);
+
+static void buzon_marcar_sucio_locked(struct buzon_usuario *b) {
+    if (b->sucio) return;
+    b->sucio = 1;
+    b->prev_sucio = NULL;
+    b->sig_sucio = buzones.sucios;
+    if (buzones.sucios) buzones.sucios->prev_sucio = b;
+    buzones.sucios = b;
+}
+
+static void buzon_desmarcar_sucio_locked(struct buzon_usuario *b) {
+    if (!b->sucio) return;
+    if (b->prev_sucio) b->prev_sucio->sig_sucio = b->sig_sucio;
+    else buzones.sucios = b->sig_sucio;
+    if (b->sig_sucio) b->sig_sucio->prev_sucio = b->prev_sucio;
+    b->sucio = 0;
+}
+
+static int buzones_crecer_locked(void) {
+    size_t nueva_cap = buzones.cap_tabla ? buzones.cap_tabla * 2 : BUZONES_CAP_INICIAL;
+    struct buzon_usuario **t = calloc(nueva_cap, sizeof(*t));
+    if (!t) return -1;
+    for (size_t i = 0; i < buzones.cap_tabla; i++) {
+        struct buzon_usuario *b = buzones.tabla[i], *sig;
+        for (; b; b = sig) {
+            sig = b->sig;
+            b->sig = t[b->hash & (nueva_cap - 1)];
+            t[b->hash & (nueva_cap - 1)] = b;
+        }
+    }
+    free(buzones.tabla);
+    buzones.tabla = t;
+    buzones.cap_tabla = nueva_cap;
+    return 0;
+}
+
+// Busca el buzón de nombre; si crear, lo crea vacío (lo que había en disco
+// ya lo cargó buzones_cargar). Requiere buzones.lock.
+static struct buzon_usuario *buzon_obtener_locked(const char *nombre, int crear) {
+    uint32_t h = hash_nombre(nombre);
+    if (buzones.cap_tabla) {
+        for (struct buzon_usuario *b = buzones.tabla[h & (buzones.cap_tabla - 1)]; b; b = b->sig)
+            if (b->hash == h && strcmp(b->usuario, nombre) == 0) return b;
+    }
+    if (!crear) return NULL;
+    if (buzones.num >= buzones.cap_tabla && buzones_crecer_locked() < 0) return NULL;
+
+    struct buzon_usuario *b = calloc(1, sizeof(*b));
+    if (!b || !(b->usuario = strdup(nombre))) {
+        free(b);
+        return NULL;
+    }
+    b->hash = h;
+    b->sig = buzones.tabla[h & (buzones.cap_tabla - 1)];
+    buzones.tabla[h & (buzones.cap_tabla - 1)] = b;
+    buzones.num++;
+    return b;
+}
+
+// Saca b de la tabla y de los sucios (queda en manos del llamador)
+static void buzon_desenganchar_locked(struct buzon_usuario *b) {
+    struct buzon_usuario **p = &buzones.tabla[b->hash & (buzones.cap_tabla - 1)];
+    while (*p != b) p = &(*p)->sig;
+    *p = b->sig;
+    buzones.num--;
+    buzon_desmarcar_sucio_locked(b);
+    atomic_fetch_sub(&mensajes_en_buzones, (long)b->total);
+}
+
+static void buzon_liberar(struct buzon_usuario *b) {
+    free(b->usuario);
+    free(b->entradas);
+    free(b);
+}
+
+// Crea en la tabla un buzón por cada .idx que quedó de una ejecución
+// anterior (el nombre sale del hex del archivo). Los vacíos se borran.
+static void buzones_cargar(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *de;
+    char ruta[512];
+    nombre_usuario nombre;
+    pthread_mutex_lock(&buzones.lock);
+    while ((de = readdir(d)) != NULL) {
+        size_t largo = strlen(de->d_name);
+        if (largo < 6 || strcmp(de->d_name + largo - 4, ".idx") != 0) continue;
+        size_t n = (largo - 4) / 2;
+        if ((largo - 4) % 2 || n > USUARIO_MAX) continue;
+        unsigned byte;
+        size_t i;
+        for (i = 0; i < n && sscanf(de->d_name + 2 * i, "%2x", &byte) == 1 && byte; i++)
+            nombre[i] = (char)byte;
+        if (i < n) continue;
+        nombre[n] = '\0';
+
+        struct stat st;
+        snprintf(ruta, sizeof(ruta), "%s/%s", dir, de->d_name);
+        if (stat(ruta, &st) < 0) continue;
+        size_t total = (size_t)st.st_size / sizeof(struct ubicacion);
+        struct buzon_usuario *b = total ? buzon_obtener_locked(nombre, 1) : NULL;
+        if (!total) {
+            unlink(ruta);
+        } else if (b) {
+            b->total = b->persistidas = total;
+            atomic_fetch_add(&mensajes_en_buzones, (long)total);
+        }
+    }
+    pthread_mutex_unlock(&buzones.lock);
+    closedir(d);
+}
+
+// Agrega n entradas al .idx de nombre. Devuelve el descriptor abierto (el
+// fdatasync lo hace el llamador fuera de buzones.io) o -1, sin dejar
+// entradas a medias en el archivo.
+static int escribir_idx(const char *nombre, const struct ubicacion *u, size_t n) {
+    char ruta[512];
+    ruta_buzon(ruta, sizeof(ruta), nombre);
+    int fd = open(ruta, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return -1;
+    struct stat st;
+    int ok = fstat(fd, &st) == 0;
+    if (ok && write(fd, u, n * sizeof(*u)) != (ssize_t)(n * sizeof(*u))) {
+        if (ftruncate(fd, st.st_size) < 0)
+            log_error("historial", "No se pudo recortar %s: %s", ruta, strerror(errno));
+        ok = 0;
+    }
+    if (!ok) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Guarda f para destino, que no está conectado. Sólo toca memoria: el .idx
+// lo escribe hilo_historial (buzones_persistir).
+// Devuelve 0, -1 si falló el historial o -2 si el buzón está lleno.
+static int buzon_guardar(const char *destino, const struct frame_salida *f) {
+    if (!historial.activo || !f) return -1;
+    int ret = -1;
+    pthread_mutex_lock(&buzones.lock);
+    struct buzon_usuario *b = buzon_obtener_locked(destino, 1);
+    if (!b) goto fin;
+    if (b->total >= (size_t)cfg.buzon_max) {
+        ret = -2;
+        goto fin;
+    }
+    if (b->num == b->cap) {
+        size_t nueva_cap = b->cap ? b->cap * 2 : 8;
+        struct ubicacion *e = realloc(b->entradas, nueva_cap * sizeof(*e));
+        if (!e) goto fin;
+        b->entradas = e;
+        b->cap = nueva_cap;
+    }
+    struct ubicacion u;
+    if (historial_agregar(REG_PRIVADO, destino, f, &u) < 0) goto fin;
+    b->entradas[b->num++] = u;
+    b->total++;
+    buzon_marcar_sucio_locked(b);
+    atomic_fetch_add(&mensajes_en_buzones, 1);
+    ret = 0;
+fin:
+    pthread_mutex_unlock(&buzones.lock);
+    return ret;
+}
+
+// Vuelve a poner en el buzón de b->usuario los mensajes de b, que se
+// desenganchó para una sesión que ya no está, y libera b. Quedan en memoria
+// como recién llegados (el .idx ya se borró). No aplica cfg.buzon_max: ya
+// estaban aceptados.
+static void buzon_devolver(struct buzon_usuario *b) {
+    pthread_mutex_lock(&buzones.lock);
+    struct buzon_usuario *d = buzon_obtener_locked(b->usuario, 1);
+    if (d && d->cap - d->num < b->num) {
+        size_t nueva_cap = d->num + b->num;
+        struct ubicacion *e = realloc(d->entradas, nueva_cap * sizeof(*e));
+        if (e) {
+            d->entradas = e;
+            d->cap = nueva_cap;
+        }
+    }
+    if (d && d->cap - d->num >= b->num) {
+        memcpy(d->entradas + d->num, b->entradas, b->num * sizeof(*b->entradas));
+        d->num += b->num;
+        d->total += b->num;
+        buzon_marcar_sucio_locked(d);
+        atomic_fetch_add(&mensajes_en_buzones, (long)b->num);
+    } else if (b->num) {
+        log_error("historial", "Se perdieron %zu privados para %s", b->num, b->usuario);
+    }
+    pthread_mutex_unlock(&buzones.lock);
+    buzon_liberar(b);
+}
+
+// Deja b, ya desenganchado, para que lo termine hilo_historial
+static void buzon_encolar_vaciado_locked(struct buzon_usuario *b) {
+    b->vaciando = 1;
+    b->sig_vaciado = NULL;
+    if (buzones.ultimo_vaciado) buzones.ultimo_vaciado->sig_vaciado = b;
+    else buzones.vaciados = b;
+    buzones.ultimo_vaciado = b;
+}
+
+// Saca los mensajes pendientes de nombre para la sesión destino, que se
+// acaba de registrar. Sin buzón no hace ninguna llamada al sistema. Si todo
+// está en memoria devuelve el arreglo (malloc; a hilo_historial le queda
+// sólo borrar el .idx, si había). Si parte está sólo en disco devuelve NULL:
+// hilo_historial lee el .idx y manda la lista al shard de destino. NULL
+// también si no hay nada.
+static struct ubicacion *buzon_vaciar(const char *nombre, const struct manija_sesion *destino,
+                                      size_t *num) {
+    *num = 0;
+    struct ubicacion *lista = NULL;
+    pthread_mutex_lock(&buzones.lock);
+    struct buzon_usuario *b = buzon_obtener_locked(nombre, 0);
+    if (!b) {
+        pthread_mutex_unlock(&buzones.lock);
+        return NULL;
+    }
+    buzon_desenganchar_locked(b);
+    if (b->total == b->num) {
+        lista = b->entradas;
+        *num = b->num;
+        b->entradas = NULL;
+        b->num = b->cap = 0;
+        b->destino = (struct manija_sesion){ NULL, 0, 0 };
+    } else {
+        b->destino = *destino;
+    }
+    if (b->persistidas == 0) buzon_liberar(b);   // nunca llegó al disco
+    else buzon_encolar_vaciado_locked(b);
+    pthread_mutex_unlock(&buzones.lock);
+    if (*num == 0) {
+        free(lista);
+        lista = NULL;
+    }
+    return lista;
+}
+
+// Termina de vaciar un buzón desenganchado por buzon_vaciar (hilo_historial,
+// con buzones.io; nadie más toca b). Lee el .idx, le agrega lo que seguía
+// en memoria, lo borra y manda todo a la sesión.
+static void buzon_terminar_vaciado(struct buzon_usuario *b) {
+    char ruta[512];
+    ruta_buzon(ruta, sizeof(ruta), b->usuario);
+    if (!b->destino.ficha) {
+        // Ya se entregó desde memoria
+        unlink(ruta);
+        buzon_liberar(b);
+        return;
+    }
+    // entradas[0] es el mensaje número total - num del buzón
+    size_t primera = b->total - b->num;
+    if (atomic_load(&historial.parar)) {
+        // Al cerrar ya no hay a quién mandarlo: el .idx se completa y espera
+        // al próximo registro
+        int fd = b->total > b->persistidas
+                 ? escribir_idx(b->usuario, b->entradas + (b->persistidas - primera),
+                                b->total - b->persistidas)
+                 : -1;
+        if (fd >= 0) {
+            fdatasync(fd);
+            close(fd);
+        }
+        buzon_liberar(b);
+        return;
+    }
+    int fd = open(ruta, O_RDONLY);
+    struct stat st;
+    size_t en_disco = 0, n = 0;
+    if (fd >= 0 && fstat(fd, &st) == 0) en_disco = (size_t)st.st_size / sizeof(struct ubicacion);
+    struct ubicacion *lista = en_disco + b->num ? malloc((en_disco + b->num) * sizeof(*lista))
+                                                : NULL;
+    if (lista && en_disco) {
+        ssize_t leido = read(fd, lista, en_disco * sizeof(*lista));
+        n = leido > 0 ? (size_t)leido / sizeof(*lista) : 0;
+    }
+    if (fd >= 0) close(fd);
+    if (!lista && en_disco + b->num) {
+        // Sin memoria: se reintenta en la próxima pasada
+        pthread_mutex_lock(&buzones.lock);
+        buzon_encolar_vaciado_locked(b);
+        pthread_mutex_unlock(&buzones.lock);
+        return;
+    }
+    size_t desde = n > primera ? n - primera : 0;
+    if (desde < b->num) {
+        memcpy(lista + n, b->entradas + desde, (b->num - desde) * sizeof(*lista));
+        n += b->num - desde;
+    }
+    unlink(ruta);
+    if (n == 0) {
+        free(lista);
+        buzon_liberar(b);
+        return;
+    }
+    free(b->entradas);
+    b->entradas = lista;
+    b->num = b->cap = n;
+    buzon_entregar(b);
+}
+
+// Termina los vaciados pendientes, escribe al .idx las entradas en memoria
+// que todavía no están en disco y saca de memoria las de los buzones que
+// pasan de cfg.buzon_memoria. El fdatasync va después de soltar buzones.io.
+static void buzones_persistir(void) {
+    struct lote {
+        struct buzon_usuario *buzon;
+        char *usuario;
+        struct ubicacion *entradas;
+        size_t desde;             // persistidas antes de este lote
+        size_t num;
+        int fd;                   // -1 = falló
+    } *lotes = NULL;
+    size_t num_lotes = 0;
+
+    pthread_mutex_lock(&buzones.io);
+    pthread_mutex_lock(&buzones.lock);
+    struct buzon_usuario *vaciados = buzones.vaciados;
+    buzones.vaciados = buzones.ultimo_vaciado = NULL;
+    size_t n = 0;
+    for (struct buzon_usuario *b = buzones.sucios; b; b = b->sig_sucio) n++;
+    if (n) lotes = calloc(n, sizeof(*lotes));
+    while (lotes && buzones.sucios) {
+        struct buzon_usuario *b = buzones.sucios;
+        struct lote *l = &lotes[num_lotes];
+        size_t primera = b->total - b->num;
+        l->buzon = b;
+        l->desde = b->persistidas;
+        l->num = b->total - b->persistidas;
+        l->usuario = strdup(b->usuario);
+        l->entradas = malloc(l->num * sizeof(*l->entradas));
+        if (!l->usuario || !l->entradas) {
+            free(l->usuario);
+            free(l->entradas);
+            break;
+        }
+        memcpy(l->entradas, b->entradas + (b->persistidas - primera),
+               l->num * sizeof(*l->entradas));
+        b->persistidas = b->total;
+        buzon_desmarcar_sucio_locked(b);
+        num_lotes++;
+    }
+    pthread_mutex_unlock(&buzones.lock);
+
+    // Los vaciados primero: si el usuario volvió a quedar sin conexión, su
+    // .idx nuevo se escribe después de borrar el viejo
+    while (vaciados) {
+        struct buzon_usuario *b = vaciados;
+        vaciados = b->sig_vaciado;
+        buzon_terminar_vaciado(b);
+    }
+
+    // Con buzones.io tomado ninguna otra pasada termina de vaciar estos
+    // buzones (los punteros de los lotes siguen valiendo); buzon_guardar y
+    // buzon_vaciar sólo esperan buzones.lock
+    for (size_t i = 0; i < num_lotes; i++) {
+        lotes[i].fd = escribir_idx(lotes[i].usuario, lotes[i].entradas, lotes[i].num);
+        if (lotes[i].fd < 0)
+            log_error("historial", "No se pudo escribir el buzón de %s", lotes[i].usuario);
+    }
+
+    pthread_mutex_lock(&buzones.lock);
+    for (size_t i = 0; i < num_lotes; i++) {
+        struct buzon_usuario *b = lotes[i].buzon;
+        if (lotes[i].fd < 0) {
+            // Se reintenta en la próxima pasada; mientras, queda en memoria
+            b->persistidas = lotes[i].desde;
+            if (!b->vaciando) buzon_marcar_sucio_locked(b);
+        } else if (!b->vaciando && b->total > (size_t)cfg.buzon_memoria) {
+            size_t primera = b->total - b->num;
+            size_t escritas = lotes[i].desde + lotes[i].num - primera;
+            memmove(b->entradas, b->entradas + escritas,
+                    (b->num - escritas) * sizeof(*b->entradas));
+            b->num -= escritas;
+            if (b->num == 0) {
+                free(b->entradas);
+                b->entradas = NULL;
+                b->cap = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&buzones.lock);
+    pthread_mutex_unlock(&buzones.io);
+
+    for (size_t i = 0; i < num_lotes; i++) {
+        if (lotes[i].fd >= 0) {
+            fdatasync(lotes[i].fd);
+            close(lotes[i].fd);
+        }
+        free(lotes[i].usuario);
+        free(lotes[i].entradas);
+    }
+    free(lotes);
+}
+
+//------------------------------------------------------------------------------
+// Historial: reproducción, sincronización y arranque
+//------------------------------------------------------------------------------
+// Lo que hay que reproducir al registrarse: los últimos cfg.historial_replay
+// broadcasts (del más viejo al más nuevo) y lo que esperaba en su buzón.
+// Devuelve el arreglo (malloc) o NULL si no hay nada. Lo del buzón que sólo
+// estaba en disco llega después a la sesión destino (buzon_entregar).
+static struct ubicacion *historial_reproduccion(const char *nombre,
+                                                const struct manija_sesion *destino,
+                                                size_t *num) {
+    *num = 0;
+    if (!historial.activo) return NULL;
+    size_t n_buzon;
+    struct ubicacion *buzon = buzon_vaciar(nombre, destino, &n_buzon);
+
+    pthread_mutex_lock(&historial.lock);
+    uint64_t cuenta = atomic_load_explicit(&historial.lobby->cuenta, memory_order_relaxed);
+    uint64_t n_lobby = cuenta < (uint64_t)cfg.historial_replay ? cuenta
+                                                               : (uint64_t)cfg.historial_replay;
+    struct ubicacion *lista = NULL;
+    if (n_lobby + n_buzon > 0) lista = malloc((n_lobby + n_buzon) * sizeof(*lista));
+    if (lista) {
+        for (uint64_t i = 0; i < n_lobby; i++)
+            lista[i] = historial.lobby->entradas[(cuenta - n_lobby + i) % HIST_LOBBY];
+        if (n_buzon) memcpy(lista + n_lobby, buzon, n_buzon * sizeof(*lista));
+        *num = (size_t)n_lobby + n_buzon;
+    }
+    pthread_mutex_unlock(&historial.lock);
+    free(buzon);
+    return lista;
+}
+
+// Baja a disco los segmentos que se cerraron al rotar, enteros (MS_SYNC y
+// fdatasync). Siguen pendientes hasta terminar, así historial_podar no los
+// borra mientras tanto.
+static void historial_sincronizar_cerrados(void) {
+    pthread_mutex_lock(&historial.lock);
+    uint32_t desde = historial.cerrado_desde, hasta = historial.cerrado_hasta;
+    pthread_mutex_unlock(&historial.lock);
+    if (desde == hasta) return;
+
+    for (uint32_t n = desde; n < hasta; n++) {
+        pthread_mutex_lock(&historial.lock);
+        struct segmento_log s = n < historial.cap_segmentos ? historial.segmentos[n]
+                                                            : (struct segmento_log){ NULL, -1 };
+        pthread_mutex_unlock(&historial.lock);
+        if (!s.mapa) continue;
+        if (msync(s.mapa, SEGMENTO_TAM, MS_SYNC) < 0 || fdatasync(s.fd) < 0)
+            log_error("historial", "No se pudo sincronizar el segmento %u: %s",
+                      n, strerror(errno));
+    }
+    // Lo que rotó mientras tanto queda para la próxima pasada
+    pthread_mutex_lock(&historial.lock);
+    historial.cerrado_desde = hasta;
+    pthread_mutex_unlock(&historial.lock);
+}
+
+// Primer segmento que se conserva según cfg.historial_segmentos, sin pasar
+// de los que todavía no bajaron a disco. Requiere historial.lock.
+static uint32_t historial_limite_poda_locked(void) {
+    if (!cfg.historial_segmentos) return historial.primero;
+    uint32_t n = (uint32_t)cfg.historial_segmentos;
+    uint32_t limite = historial.actual + 1 > n ? historial.actual + 1 - n : 0;
+    if (historial.cerrado_desde != historial.cerrado_hasta && limite > historial.cerrado_desde)
+        limite = historial.cerrado_desde;
+    return limite;
+}
+
+// Borra los segmentos viejos de a uno. historial.primero avanza antes de
+// soltar el lock, así nadie vuelve a mapearlos; el munmap y el unlink van
+// fuera del lock. historial_frame copia bajo el lock, así que ningún frame
+// apunta a un mapa que se desmapea.
+static void historial_podar(void) {
+    for (;;) {
+        pthread_mutex_lock(&historial.lock);
+        uint32_t n = historial.primero;
+        if (n >= historial_limite_poda_locked()) {
+            pthread_mutex_unlock(&historial.lock);
+            return;
+        }
+        struct segmento_log s = { NULL, -1 };
+        if (n < historial.cap_segmentos) {
+            s = historial.segmentos[n];
+            historial.segmentos[n].mapa = NULL;
+        }
+        historial.primero = n + 1;
+        pthread_mutex_unlock(&historial.lock);
+
+        if (s.mapa) {
+            munmap(s.mapa, SEGMENTO_TAM);
+            close(s.fd);
+        }
+        char ruta[512];
+        ruta_historial(ruta, sizeof(ruta), "seg-%08u.log", n);
+        if (unlink(ruta) == 0) log_info("historial", "Segmento %u borrado", n);
+    }
+}
+
+static void *hilo_historial(void *arg) {
+    (void)arg;
+    long pagina = sysconf(_SC_PAGESIZE);
+    while (!atomic_load(&historial.parar)) {
+        struct timespec espera = { cfg.historial_sync_ms / 1000,
+                                   (long)(cfg.historial_sync_ms % 1000) * 1000000L };
+        nanosleep(&espera, NULL);
+
+        pthread_mutex_lock(&historial.lock);
+        uint64_t desde = historial.desde_sin_sync;
+        struct cabecera_segmento *c = historial.cab;
+        uint64_t hasta = atomic_load(&c->fin);
+        historial.desde_sin_sync = UINT64_MAX;
+        pthread_mutex_unlock(&historial.lock);
+
+        // Fuera del lock: los hilos de servicio pueden seguir agregando
+        if (desde != UINT64_MAX && desde < hasta) {
+            uint64_t ini = desde & ~(uint64_t)(pagina - 1);
+            msync((unsigned char *)c + ini, hasta - ini, MS_SYNC);
+            msync(c, (size_t)pagina, MS_SYNC);          // cabecera (fin)
+            msync(historial.lobby, sizeof(*historial.lobby), MS_SYNC);
+        }
+        historial_sincronizar_cerrados();
+        historial_podar();
+        // Después de los segmentos: un .idx nunca apunta a datos sin bajar
+        buzones_persistir();
+    }
+    return NULL;
+}
+
+static int historial_iniciar(void) {
+    if (!cfg.historial_dir) return 0;
+    char ruta[512];
+    snprintf(ruta, sizeof(ruta), "%s/buzones", cfg.historial_dir);
+    mkdir(cfg.historial_dir, 0755);
+    mkdir(ruta, 0755);
+    buzones_cargar(ruta);
+
+    // El último segmento es el de número más alto (no se leen los registros)
+    // (y el primero, el más bajo: los que pasen de cfg.historial_segmentos
+    // los borra hilo_historial en su primera pasada)
+    DIR *d = opendir(cfg.historial_dir);
+    if (!d) return -1;
+    uint32_t ultimo = 0, primero = UINT32_MAX;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned num;
+        if (sscanf(de->d_name, "seg-%8u.log", &num) != 1) continue;
+        if (num > ultimo) ultimo = num;
+        if (num < primero) primero = num;
+    }
+    closedir(d);
+
+    pthread_mutex_lock(&historial.lock);
+    historial.primero = primero <= ultimo ? primero : ultimo;
+    historial.cab = segmento_mapear(ultimo, 1);
+    historial.actual = ultimo;
+    historial.seg_sin_sync = ultimo;
+    historial.cerrado_desde = historial.cerrado_hasta = ultimo;
+    historial.desde_sin_sync = UINT64_MAX;
+    ruta_historial(ruta, sizeof(ruta), "lobby.idx", 0);
+    historial.lobby = mapear_archivo(ruta, sizeof(struct lobby_mapeado), NULL);
+    if (historial.lobby && memcmp(historial.lobby->magia, "CHATLOB1", 8) != 0) {
+        memcpy(historial.lobby->magia, "CHATLOB1", 8);
+        atomic_store(&historial.lobby->cuenta, 0);
+    }
+    pthread_mutex_unlock(&historial.lock);
+    if (!historial.cab || !historial.lobby) return -1;
+
+    historial.activo = 1;
+    if (pthread_create(&historial.hilo, NULL, hilo_historial, NULL) != 0) {
+        historial.activo = 0;
+        return -1;
+    }
+    log_info("historial", "Historial en %s: segmento %u, %" PRIu64 " broadcasts",
+             cfg.historial_dir, ultimo, (uint64_t)atomic_load(&historial.lobby->cuenta));
+    return 0;
+}
+
+static void historial_detener(void) {
+    if (!historial.activo) return;
+    atomic_store(&historial.parar, 1);
+    pthread_join(historial.hilo, NULL);
+    buzones_persistir();
+    pthread_mutex_lock(&historial.lock);
+    for (size_t i = 0; i < historial.cap_segmentos; i++) {
+        struct segmento_log *s = &historial.segmentos[i];
+        if (!s->mapa) continue;
+        msync(s->mapa, SEGMENTO_TAM, MS_SYNC);
+        munmap(s->mapa, SEGMENTO_TAM);
+        close(s->fd);
+    }
+    msync(historial.lobby, sizeof(*historial.lobby), MS_SYNC);
+    munmap(historial.lobby, sizeof(*historial.lobby));
+    historial.activo = 0;
+    pthread_mutex_unlock(&historial.lock);
+}
+
+//------------------------------------------------------------------------------
+// Rueda de timers jerárquica (una por shard, sin locks)
+// Nivel 0: RUEDA_RANURAS0 ranuras de un tick. Nivel 1: RUEDA_RANURAS1 ranuras
+// de RUEDA_RANURAS0 ticks cada una, que se vuelcan al nivel 0 cuando este da
+// la vuelta. Armar, re-armar y desarmar un timer es O(1).
+//------------------------------------------------------------------------------
+#define RUEDA_BITS0     8
+#define RUEDA_BITS1     6
+#define RUEDA_RANURAS0  (1u << RUEDA_BITS0)
+#define RUEDA_RANURAS1  (1u << RUEDA_BITS1)
+#define RUEDA_TICK_US   (100 * LWS_US_PER_MS)
+
+struct rueda_timers {
+    uint64_t tick;                                 // tick actual
+    lws_usec_t inicio_us;                          // instante del tick 0
+    struct timer_nodo nivel0[RUEDA_RANURAS0];      // cabeceras (listas circulares)
+    struct timer_nodo nivel1[RUEDA_RANURAS1];
+};
+
+static void timer_iniciar(struct timer_nodo *t) {
+    t->prev = t->sig = t;
+}
+
+static int timer_armado(const struct timer_nodo *t) {
+    return t->sig != t;
+}
+
+static void timer_desarmar(struct timer_nodo *t) {
+    t->prev->sig = t->sig;
+    t->sig->prev = t->prev;
+    timer_iniciar(t);
+}
+
+static void lista_timers_agregar(struct timer_nodo *cabeza, struct timer_nodo *t) {
+    t->prev = cabeza->prev;
+    t->sig = cabeza;
+    cabeza->prev->sig = t;
+    cabeza->prev = t;
+}
+
+static void rueda_iniciar(struct rueda_timers *r, lws_usec_t ahora_us) {
+    r->tick = 0;
+    r->inicio_us = ahora_us;
+    for (unsigned i = 0; i < RUEDA_RANURAS0; i++) timer_iniciar(&r->nivel0[i]);
+    for (unsigned i = 0; i < RUEDA_RANURAS1; i++) timer_iniciar(&r->nivel1[i]);
+}
+
+// Requiere t->vence >= r->tick; si es igual (solo al volcar el nivel 1) cae
+// en la ranura que rueda_avanzar dispara a continuación
+static void rueda_insertar(struct rueda_timers *r, struct timer_nodo *t) {
+    uint64_t delta = t->vence - r->tick;
+    struct timer_nodo *ranura;
+    if (delta < RUEDA_RANURAS0) {
+        ranura = &r->nivel0[t->vence & (RUEDA_RANURAS0 - 1)];
+    } else if (delta < (uint64_t)RUEDA_RANURAS0 * RUEDA_RANURAS1) {
+        ranura = &r->nivel1[(t->vence >> RUEDA_BITS0) & (RUEDA_RANURAS1 - 1)];
+    } else {
+        // Más lejos que toda la rueda: la última ranura del nivel 1; al
+        // volcarse se vuelve a insertar según t->vence
+        ranura = &r->nivel1[((r->tick >> RUEDA_BITS0) + RUEDA_RANURAS1 - 1)
+                            & (RUEDA_RANURAS1 - 1)];
+    }
+    lista_timers_agregar(ranura, t);
+}
+
+// (Re)arma t para que venza dentro de espera_us
+static void rueda_armar(struct rueda_timers *r, struct timer_nodo *t, lws_usec_t espera_us) {
+    if (timer_armado(t)) timer_desarmar(t);
+    uint64_t ticks = (uint64_t)((espera_us + RUEDA_TICK_US - 1) / RUEDA_TICK_US);
+    t->vence = r->tick + (ticks ? ticks : 1);
+    rueda_insertar(r, t);
+}
+
+// Avanza un tick y deja en 'vencidos' los timers que vencieron
+static void rueda_avanzar(struct rueda_timers *r, struct timer_nodo *vencidos) {
+    r->tick++;
+    if ((r->tick & (RUEDA_RANURAS0 - 1)) == 0) {
+        struct timer_nodo *c = &r->nivel1[(r->tick >> RUEDA_BITS0) & (RUEDA_RANURAS1 - 1)];
+        while (timer_armado(c)) {
+            struct timer_nodo *t = c->sig;
+            timer_desarmar(t);
+            rueda_insertar(r, t);
+        }
+    }
+    struct timer_nodo *c = &r->nivel0[r->tick & (RUEDA_RANURAS0 - 1)];
+    while (timer_armado(c)) {
+        struct timer_nodo *t = c->sig;
+        timer_desarmar(t);
+        lista_timers_agregar(vencidos, t);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Shards: cada hilo de servicio (tsi) es dueño de las sesiones que lws le
+// asigna. Los demás hilos le entregan trabajo por un buzón MPSC sin locks
+// (cola intrusiva de Vyukov) y lo despiertan con lws_cancel_service.
+//------------------------------------------------------------------------------
+struct envio {
+    struct envio *_Atomic sig;
+    struct frame_salida *frame;
+    uint64_t excluir_id;      // broadcast: sesión que no lo recibe (0 = ninguna)
+    unsigned cap_mascara;     // broadcast: solo sesiones con
+    unsigned cap_valor;       //   (capacidades & cap_mascara) == cap_valor
+    struct manija_sesion destino;  // envío directo (ficha NULL = broadcast a todo el shard)
+    struct sala *sala;        // != NULL: solo a los miembros de la sala
+    struct buzon_usuario *vaciado;  // != NULL: buzón leído del disco para destino
+};
+
+struct buzon {
+    struct envio *_Atomic cabeza;  // último insertado (productores)
+    struct envio *cola;            // próximo a sacar (solo el consumidor)
+    struct envio vacio;            // nodo centinela
+};
+
+struct shard {
+    int tsi;
+    struct per_session_data__chat **sesiones;  // sesiones de este hilo
+    size_t num_sesiones;
+    size_t cap_sesiones;
+    struct buzon buzon;
+    struct rueda_timers rueda;          // timers de inactividad del shard
+    lws_sorted_usec_list_t sul_rueda;   // tick de la rueda en el bucle de lws
+    struct buffer_entrada *entradas;    // pool de buffers de rearmado libres
+    int num_entradas;
+    unsigned char *fragmento;           // LWS_PRE + cfg.fragmento, para enviar partes
+    struct arena arena;                 // memoria de paso del mensaje en proceso
+};
+
+static struct shard shards[MAX_HILOS];
+static _Thread_local struct shard *shard_actual = NULL;
+static atomic_uint_fast64_t siguiente_id = 1;
+
+static void buzon_iniciar(struct buzon *b) {
+    atomic_init(&b->vacio.sig, NULL);
+    atomic_init(&b->cabeza, &b->vacio);
+    b->cola = &b->vacio;
+}
+
+static void buzon_meter(struct buzon *b, struct envio *e) {
+    atomic_store_explicit(&e->sig, NULL, memory_order_relaxed);
+    struct envio *prev = atomic_exchange_explicit(&b->cabeza, e, memory_order_acq_rel);
+    atomic_store_explicit(&prev->sig, e, memory_order_release);
+}
+
+// NULL si está vacío (o si un productor está a medio insertar: ese
+// productor despierta al shard de nuevo al terminar)
+static struct envio *buzon_sacar(struct buzon *b) {
+    struct envio *cola = b->cola;
+    struct envio *sig = atomic_load_explicit(&cola->sig, memory_order_acquire);
+    if (cola == &b->vacio) {
+        if (!sig) return NULL;
+        b->cola = sig;
+        cola = sig;
+        sig = atomic_load_explicit(&sig->sig, memory_order_acquire);
+    }
+    if (sig) {
+        b->cola = sig;
+        return cola;
+    }
+    if (cola != atomic_load_explicit(&b->cabeza, memory_order_acquire)) return NULL;
+    buzon_meter(b, &b->vacio);
+    sig = atomic_load_explicit(&cola->sig, memory_order_acquire);
+    if (sig) {
+        b->cola = sig;
+        return cola;
+    }
+    return NULL;
+}
+
+// Despierta a los shards para que drenen sus buzones. Sin contexto (los
+// de bench.c) cada hilo drena el suyo por su cuenta.
+static void despertar_shards(void) {
+    if (contexto) lws_cancel_service(contexto);
+}
+
+static struct envio *crear_envio(struct frame_salida *f, uint64_t excluir_id,
+                                 const struct manija_sesion *destino) {
+    struct envio *e = slab_tomar_tam(sizeof(*e), NULL);
+    if (!e) return NULL;
+    e->frame = f;
+    e->excluir_id = excluir_id;
+    e->cap_mascara = 0;
+    e->cap_valor = 0;
+    e->destino = destino ? *destino : (struct manija_sesion){ NULL, 0, 0 };
+    e->sala = NULL;
+    e->vaciado = NULL;
+    return e;
+}
+
+// Agrega/quita una sesión de la lista del shard actual
+static int shard_agregar(struct shard *sh, struct per_session_data__chat *pss) {
+    if (sh->num_sesiones == sh->cap_sesiones) {
+        size_t nueva_cap = sh->cap_sesiones ? sh->cap_sesiones * 2
+                                            : REGISTRO_CAP_INICIAL;
+        struct per_session_data__chat **nuevo =
+            realloc(sh->sesiones, nueva_cap * sizeof(*nuevo));
+        if (!nuevo) return -1;
+        sh->sesiones = nuevo;
+        sh->cap_sesiones = nueva_cap;
+    }
+    pss->shard_slot = sh->num_sesiones;
+    sh->sesiones[sh->num_sesiones++] = pss;
+    return 0;
+}
+
+// Re-arma el timer de inactividad de la sesión (hilo dueño de la sesión)
+static void registrar_actividad(struct per_session_data__chat *pss) {
+    pss->last_activity = time(NULL);
+    rueda_armar(&shards[pss->shard].rueda, &pss->timer_inactividad,
+                (lws_usec_t)cfg.inactividad_seg * LWS_US_PER_SEC);
+}
+
+static void shard_quitar(struct shard *sh, struct per_session_data__chat *pss) {
+    size_t slot = pss->shard_slot;
+    if (slot >= sh->num_sesiones || sh->sesiones[slot] != pss) return;
+    size_t ultimo = --sh->num_sesiones;
+    if (slot != ultimo) {
+        sh->sesiones[slot] = sh->sesiones[ultimo];
+        sh->sesiones[slot]->shard_slot = slot;
+    }
+    sh->sesiones[ultimo] = NULL;
+}
+
+// Encola en una sesión del shard actual y pide WRITEABLE (las sesiones de
+// los benchmarks de bench.c no tienen wsi)
+static void entregar_local(struct per_session_data__chat *pss, struct frame_salida *f) {
+    cola_meter(pss, f);
+    if (pss->wsi) lws_callback_on_writable(pss->wsi);
+}
+
+static void entregar_shard(struct shard *sh, struct frame_salida *f, uint64_t excluir_id,
+                           unsigned cap_mascara, unsigned cap_valor) {
+    uint64_t destinatarios = 0;
+    for (size_t i = 0; i < sh->num_sesiones; i++) {
+        struct per_session_data__chat *c = sh->sesiones[i];
+        if (c->id != excluir_id && (c->capacidades & cap_mascara) == cap_valor) {
+            entregar_local(c, f);
+            destinatarios++;
+        }
+    }
+    hist_registrar(&metricas[sh->tsi].fanout, destinatarios);
+}
+
+static void entregar_sala(struct shard *sh, struct sala *s, struct frame_salida *f,
+                          uint64_t excluir_id) {
+    struct miembros_shard *ms = &s->miembros[sh->tsi];
+    uint64_t destinatarios = 0;
+    for (size_t i = 0; i < ms->num; i++) {
+        if (ms->v[i]->id != excluir_id) {
+            entregar_local(ms->v[i], f);
+            destinatarios++;
+        }
+    }
+    hist_registrar(&metricas[sh->tsi].fanout, destinatarios);
+}
+
+// Agrega lo que leyó hilo_historial del buzón b al final de lo que la sesión
+// tiene por reproducir y libera b (hilo dueño). -1 sin memoria (b queda).
+static int reproduccion_agregar(struct per_session_data__chat *pss, struct buzon_usuario *b) {
+    if (!pss->reproducir) {
+        pss->reproducir = b->entradas;
+        pss->num_reproducir = b->num;
+        pss->pos_reproducir = 0;
+    } else {
+        struct ubicacion *r = realloc(pss->reproducir,
+                                      (pss->num_reproducir + b->num) * sizeof(*r));
+        if (!r) return -1;
+        memcpy(r + pss->num_reproducir, b->entradas, b->num * sizeof(*r));
+        pss->reproducir = r;
+        pss->num_reproducir += b->num;
+        free(b->entradas);
+    }
+    b->entradas = NULL;
+    buzon_liberar(b);
+    if (pss->wsi) lws_callback_on_writable(pss->wsi);
+    return 0;
+}
+
+// Manda al shard de b->destino la lista que hilo_historial leyó del .idx
+static void buzon_entregar(struct buzon_usuario *b) {
+    struct envio *e = crear_envio(NULL, 0, &b->destino);
+    if (!e) {
+        buzon_devolver(b);
+        return;
+    }
+    e->vaciado = b;
+    buzon_meter(&shards[b->destino.shard].buzon, e);
+    despertar_shards();
+}
+
+// Procesa el buzón del shard (hilo dueño, en EVENT_WAIT_CANCELLED)
+static void shard_drenar_buzon(struct shard *sh) {
+    struct envio *e;
+    while ((e = buzon_sacar(&sh->buzon)) != NULL) {
+        if (e->vaciado) {
+            // Lo que le quedaba en disco a una sesión que se registró; si ya
+            // cerró, vuelve al buzón
+            if (!manija_valida(&e->destino)
+                || reproduccion_agregar(e->destino.ficha->pss, e->vaciado) < 0)
+                buzon_devolver(e->vaciado);
+        } else if (e->sala) {
+            entregar_sala(sh, e->sala, e->frame, e->excluir_id);
+        } else if (!e->destino.ficha) {
+            entregar_shard(sh, e->frame, e->excluir_id, e->cap_mascara, e->cap_valor);
+        } else if (manija_valida(&e->destino)) {
+            // La sesión solo puede cerrarse en este hilo: si la manija vale,
+            // el pss también
+            entregar_local(e->destino.ficha->pss, e->frame);
+        }
+        frame_soltar(e->frame);
+        slab_devolver(e);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Enviar un frame a un cliente del shard actual.
+// Las funciones enviar_* se quedan con la referencia del llamador a f
+// (f puede ser NULL si no hubo memoria para armarlo).
+//------------------------------------------------------------------------------
+static void enviar_a_cliente(struct per_session_data__chat *pss, struct frame_salida *f) {
+    if (!f) return;
+    entregar_local(pss, f);
+    frame_soltar(f);
+}
+
+//------------------------------------------------------------------------------
+// Enviar un frame a un usuario por nombre, en cualquier shard.
+// Devuelve -1 si el usuario no está registrado.
+//------------------------------------------------------------------------------
+static int enviar_a_usuario(const char *nombre, struct frame_salida *f) {
+    struct manija_sesion dest = buscar_sesion(nombre);
+    if (!dest.ficha) {
+        frame_soltar(f);
+        return -1;
+    }
+    if (!f) return -1;
+    if (shard_actual && dest.shard == shard_actual->tsi) {
+        if (manija_valida(&dest)) entregar_local(dest.ficha->pss, f);
+        frame_soltar(f);
+        return 0;
+    }
+    // El envío se queda con la referencia de f; el shard dueño comprueba la
+    // manija al sacarlo
+    struct envio *e = crear_envio(f, 0, &dest);
+    if (!e) {
+        frame_soltar(f);
+        return 0;
+    }
+    buzon_meter(&shards[dest.shard].buzon, e);
+    despertar_shards();
+    return 0;
+}
+
+// Serializa una vez; cada destinatario del shard recibe un puntero al frame
+// y cada shard remoto una sola copia por su buzón. Solo lo reciben las
+// sesiones con (capacidades & cap_mascara) == cap_valor.
+static void enviar_broadcast_filtrado(struct frame_salida *f, uint64_t excluir_id,
+                                      unsigned cap_mascara, unsigned cap_valor) {
+    if (!f) return;
+    int remotos = 0;
+    for (int t = 0; t < cfg.hilos; t++) {
+        struct shard *sh = &shards[t];
+        if (sh == shard_actual) {
+            entregar_shard(sh, f, excluir_id, cap_mascara, cap_valor);
+            continue;
+        }
+        struct frame_salida *copia = duplicar_frame(f);
+        struct envio *e = copia ? crear_envio(copia, excluir_id, NULL) : NULL;
+        if (!e) {
+            frame_soltar(copia);
+            continue;
+        }
+        e->cap_mascara = cap_mascara;
+        e->cap_valor = cap_valor;
+        buzon_meter(&sh->buzon, e);
+        remotos = 1;
+    }
+    if (remotos) despertar_shards();
+    frame_soltar(f);
+}
+
+static void enviar_broadcast(struct frame_salida *f,
+                             struct per_session_data__chat *excluir) {
+    enviar_broadcast_filtrado(f, excluir ? excluir->id : 0, 0, 0);
+}
+
+// Pasa a la cola el historial pendiente de reproducir, sin llenarla más de
+// la mitad para dejar lugar a los mensajes en vivo
+static void rellenar_reproduccion(struct per_session_data__chat *pss) {
+    while (pss->pos_reproducir < pss->num_reproducir && pss->cola.num * 2 < pss->cola.cap) {
+        struct frame_salida *f = historial_frame(pss->reproducir[pss->pos_reproducir++]);
+        if (!f) continue;
+        cola_meter(pss, f);
+        frame_soltar(f);
+    }
+    if (pss->reproducir && pss->pos_reproducir == pss->num_reproducir) {
+        free(pss->reproducir);
+        pss->reproducir = NULL;
+        pss->num_reproducir = pss->pos_reproducir = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Mensajes largos
+// Lo que llega en varias partes se rearma en un buffer que crece hasta
+// cfg.mensaje_max; al terminar vuelve al pool de su shard (sin lock: solo lo
+// usa el hilo dueño), así que los mensajes largos seguidos no reservan
+// memoria. Los frames de salida de más de cfg.fragmento bytes se escriben de
+// a un fragmento por WRITEABLE, para que un roster enorme no ocupe el socket
+// ni la memoria de lws de una sola vez.
+//------------------------------------------------------------------------------
+static struct buffer_entrada *entrada_tomar(struct shard *sh) {
+    struct buffer_entrada *b = sh->entradas;
+    if (b) {
+        sh->entradas = b->sig;
+        sh->num_entradas--;
+    } else {
+        b = malloc(sizeof(*b) + MAX_PAYLOAD_SIZE);
+        if (!b) return NULL;
+        b->cap = MAX_PAYLOAD_SIZE;
+    }
+    b->len = 0;
+    return b;
+}
+
+static void entrada_devolver(struct shard *sh, struct buffer_entrada *b) {
+    if (!b) return;
+    if (sh->num_entradas >= ENTRADA_POOL || b->cap > ENTRADA_POOL_CAP) {
+        free(b);
+        return;
+    }
+    b->sig = sh->entradas;
+    sh->entradas = b;
+    sh->num_entradas++;
+}
+
+// Agrega una parte al mensaje en curso de pss. Devuelve 0, -1 si no hay
+// memoria o -2 si el mensaje pasaría de cfg.mensaje_max.
+static int entrada_agregar(struct per_session_data__chat *pss, const void *in, size_t len) {
+    struct shard *sh = &shards[pss->shard];
+    if (!pss->entrada && !(pss->entrada = entrada_tomar(sh))) return -1;
+    struct buffer_entrada *b = pss->entrada;
+    if (len > cfg.mensaje_max - b->len) return -2;
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap * 2;
+        while (cap < b->len + len) cap *= 2;
+        if (cap > cfg.mensaje_max) cap = cfg.mensaje_max;
+        struct buffer_entrada *nb = realloc(b, sizeof(*nb) + cap);
+        if (!nb) return -1;
+        nb->cap = cap;
+        pss->entrada = b = nb;
+    }
+    memcpy(b->datos + b->len, in, len);
+    b->len += len;
+    return 0;
+}
+
+// Escribe el siguiente fragmento de pss->enviando. Cada parte se copia al
+// buffer del shard: la cabecera que lws_write pone en los LWS_PRE bytes
+// previos no puede ir sobre el frame, que ahí tiene payload.
+static int enviar_fragmento(struct per_session_data__chat *pss) {
+    struct metricas_hilo *met = &metricas[pss->shard];
+    struct shard *sh = &shards[pss->shard];
+    struct frame_salida *f = pss->enviando;
+    struct frame_binario *b = pss->binario ? f->binario : NULL;
+    const unsigned char *datos = b ? b->buf + LWS_PRE : f->datos;
+    size_t total = b ? b->len : f->len;
+    size_t n = total - pss->enviado;
+    if (n > cfg.fragmento) n = cfg.fragmento;
+    if (!sh->fragmento && !(sh->fragmento = malloc(LWS_PRE + cfg.fragmento))) {
+        log_error("memoria", "Sin memoria para el buffer de fragmentos");
+        return -1;
+    }
+    memcpy(sh->fragmento + LWS_PRE, datos + pss->enviado, n);
+    int modo = pss->enviado ? LWS_WRITE_CONTINUATION : b ? LWS_WRITE_BINARY : LWS_WRITE_TEXT;
+    if (pss->enviado + n < total) modo |= LWS_WRITE_NO_FIN;
+    if (lws_write(pss->wsi, sh->fragmento + LWS_PRE, n, (enum lws_write_protocol)modo) < 0)
+        return -1;
+    pss->enviado += n;
+    met_sumar(&met->contadores[MET_BYTES_SALIDA], n);
+    if (pss->enviado == total) {
+        met_sumar(&met->contadores[MET_FRAMES_ENVIADOS], 1);
+        met_sumar(&met->contadores[MET_FRAGMENTADOS], 1);
+        frame_soltar(f);
+        pss->enviando = NULL;
+        if (pss->cola.num == 0 && !pss->reproducir) return 0;
+    }
+    lws_callback_on_writable(pss->wsi);
+    return 0;
+}
+
+static int anunciar_usuarios(struct per_session_data__chat *pss, struct frame_salida *f);
+
+// Envía el frame más antiguo de la cola. Un solo lws_write por WRITEABLE.
+static int drenar_cola(struct per_session_data__chat *pss) {
+    struct metricas_hilo *met = &metricas[pss->shard];
+    if (pss->desbordado) {
+        met_sumar(&met->contadores[MET_LENTOS_CERRADOS], 1);
+        log_aviso("cliente_lento", "Cliente lento desconectado (%s)",
+                  pss->username ? pss->username : pss->ip);
+        lws_close_reason(pss->wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, NULL, 0);
+        return -1;
+    }
+    if (pss->enviando) return enviar_fragmento(pss);
+    if (pss->reproducir) rellenar_reproduccion(pss);
+    if (pss->binario && pss->cola.num > 0) {
+        int r = anunciar_usuarios(pss, pss->cola.frames[pss->cola.cabeza]);
+        if (r != 0) return r < 0 ? -1 : 0;
+    }
+    struct frame_salida *f = cola_sacar(&pss->cola);
+    atomic_store_explicit(&pss->ficha->en_cola, pss->cola.num, memory_order_relaxed);
+    if (!f) return 0;
+    met_ajustar(&met->frames_en_cola, -1);
+    // lws_write escribe la cabecera WebSocket en los LWS_PRE bytes previos
+    // del frame. El frame solo se comparte entre sesiones del mismo shard
+    // (a otro shard va una copia, y lo reproducido del historial se copia
+    // del mapa), y la cabecera es idéntica para todas (mismo opcode y
+    // longitud).
+    // Con deflate compartido se escribe el frame ya comprimido, tal cual
+    // (entero: ya trae su cabecera); a las sesiones binarias, su traducción
+    // (la hizo anunciar_usuarios). Los largos salen en fragmentos.
+    struct frame_comprimido *c = pss->deflate_ventana
+                                 ? frame_comprimido(f, pss->deflate_ventana) : NULL;
+    struct frame_binario *b = pss->binario ? f->binario : NULL;
+    size_t bytes = b ? b->len : f->len;
+    if (!c && cfg.fragmento && bytes > cfg.fragmento) {
+        pss->enviando = f;
+        pss->enviado = 0;
+        return enviar_fragmento(pss);
+    }
+    int n;
+    if (b) {
+        n = lws_write(pss->wsi, b->buf + LWS_PRE, b->len, LWS_WRITE_BINARY);
+    } else if (c) {
+        n = lws_write(pss->wsi, c->inicio, c->len, LWS_WRITE_RAW);
+        if (n >= 0) {
+            met_sumar(&met->contadores[MET_DEFLATE_COMPARTIDO], 1);
+            met_sumar(&met->contadores[MET_BYTES_DEFLATE], c->len);
+        }
+    } else {
+        n = lws_write(pss->wsi, f->datos, f->len, LWS_WRITE_TEXT);
+    }
+    if (n >= 0) {
+        met_sumar(&met->contadores[MET_FRAMES_ENVIADOS], 1);
+        met_sumar(&met->contadores[MET_BYTES_SALIDA], bytes);
+    }
+    frame_soltar(f);
+    if (n < 0) return -1;
+    if (pss->cola.num > 0 || pss->reproducir) lws_callback_on_writable(pss->wsi);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// Salas
+// Cada sala guarda sus miembros por shard en vectores densos que solo toca el
+// hilo dueño de esas sesiones: unirse, salir y el fan-out local no llevan
+// locks, y un mensaje a la sala recorre solo sus miembros. A los shards sin
+// miembros ni se les manda el frame. El nombre -> sala está en una tabla con
+// rwlock que solo se escribe al crear una sala; las salas no se borran
+// (hay como mucho cfg.salas_max).
+// "lobby" es la sala implícita de todos: room_message a "lobby" es un broadcast.
+//------------------------------------------------------------------------------
+#define SALA_LOBBY        "lobby"
+#define SALA_NOMBRE_MAX   64
+#define SALAS_CAP_INICIAL 64      // listas de la tabla (crece al doble)
+
+static struct {
+    pthread_rwlock_t lock;
+    struct sala **tabla;
+    size_t cap;               // siempre potencia de 2
+    size_t num;
+} salas = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+static struct sala *sala_buscar_locked(const char *nombre, uint32_t h) {
+    if (!salas.cap) return NULL;
+    for (struct sala *s = salas.tabla[h & (salas.cap - 1)]; s; s = s->sig)
+        if (s->hash == h && strcmp(s->nombre, nombre) == 0) return s;
+    return NULL;
+}
+
+static int salas_crecer_locked(void) {
+    size_t nueva_cap = salas.cap ? salas.cap * 2 : SALAS_CAP_INICIAL;
+    struct sala **t = calloc(nueva_cap, sizeof(*t));
+    if (!t) return -1;
+    for (size_t i = 0; i < salas.cap; i++) {
+        struct sala *s = salas.tabla[i], *sig;
+        for (; s; s = sig) {
+            sig = s->sig;
+            s->sig = t[s->hash & (nueva_cap - 1)];
+            t[s->hash & (nueva_cap - 1)] = s;
+        }
+    }
+    free(salas.tabla);
+    salas.tabla = t;
+    salas.cap = nueva_cap;
+    return 0;
+}
+
+// Devuelve la sala (creándola si crear); NULL si no existe o no se pudo crear
+static struct sala *sala_obtener(const char *nombre, int crear) {
+    uint32_t h = hash_nombre(nombre);
+    pthread_rwlock_rdlock(&salas.lock);
+    struct sala *s = sala_buscar_locked(nombre, h);
+    pthread_rwlock_unlock(&salas.lock);
+    if (s || !crear) return s;
+
+    pthread_rwlock_wrlock(&salas.lock);
+    s = sala_buscar_locked(nombre, h);     // otro hilo pudo crearla
+    if (!s && salas.num < (size_t)cfg.salas_max
+        && (salas.num < salas.cap || salas_crecer_locked() == 0)
+        && (s = calloc(1, sizeof(*s))) != NULL) {
+        if (!(s->nombre = strdup(nombre))) {
+            free(s);
+            s = NULL;
+        } else {
+            s->hash = h;
+            s->sig = salas.tabla[h & (salas.cap - 1)];
+            salas.tabla[h & (salas.cap - 1)] = s;
+            salas.num++;
+        }
+    }
+    pthread_rwlock_unlock(&salas.lock);
+    return s;
+}
+
+static long sala_membresia(const struct per_session_data__chat *pss, const struct sala *s) {
+    for (size_t i = 0; i < pss->num_salas; i++)
+        if (pss->salas[i].sala == s) return (long)i;
+    return -1;
+}
+
+// Agrega pss a la sala (hilo dueño de pss). 0 = ok (o ya era miembro).
+static int sala_unirse(struct sala *s, struct per_session_data__chat *pss) {
+    if (sala_membresia(pss, s) >= 0) return 0;
+    if (pss->num_salas == MAX_SALAS_SESION) return -1;
+    if (pss->num_salas == pss->cap_salas) {
+        size_t nueva_cap = pss->cap_salas ? pss->cap_salas * 2 : 4;
+        struct membresia *m = realloc(pss->salas, nueva_cap * sizeof(*m));
+        if (!m) return -1;
+        pss->salas = m;
+        pss->cap_salas = nueva_cap;
+    }
+    struct miembros_shard *ms = &s->miembros[pss->shard];
+    if (ms->num == ms->cap) {
+        size_t nueva_cap = ms->cap ? ms->cap * 2 : 8;
+        struct per_session_data__chat **v = realloc(ms->v, nueva_cap * sizeof(*v));
+        if (!v) return -1;
+        ms->v = v;
+        ms->cap = nueva_cap;
+    }
+    pss->salas[pss->num_salas].sala = s;
+    pss->salas[pss->num_salas].pos = ms->num;
+    pss->num_salas++;
+    ms->v[ms->num++] = pss;
+    atomic_store_explicit(&s->num_por_shard[pss->shard], ms->num, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->total, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Quita la membresía i de pss (hilo dueño de pss)
+static void sala_salir_pos(struct per_session_data__chat *pss, size_t i) {
+    struct membresia *m = &pss->salas[i];
+    struct sala *s = m->sala;
+    struct miembros_shard *ms = &s->miembros[pss->shard];
+    size_t ultimo = --ms->num;
+    if (m->pos != ultimo) {
+        // El último miembro pasa al hueco: actualizar su posición
+        struct per_session_data__chat *otro = ms->v[ultimo];
+        ms->v[m->pos] = otro;
+        otro->salas[sala_membresia(otro, s)].pos = m->pos;
+    }
+    ms->v[ultimo] = NULL;
+    atomic_store_explicit(&s->num_por_shard[pss->shard], ms->num, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&s->total, 1, memory_order_relaxed);
+    pss->salas[i] = pss->salas[--pss->num_salas];
+}
+
+static int sala_salir(struct sala *s, struct per_session_data__chat *pss) {
+    long i = sala_membresia(pss, s);
+    if (i < 0) return -1;
+    sala_salir_pos(pss, (size_t)i);
+    return 0;
+}
+
+// Al cerrar la sesión
+static void salas_salir_todas(struct per_session_data__chat *pss) {
+    while (pss->num_salas > 0) sala_salir_pos(pss, pss->num_salas - 1);
+    free(pss->salas);
+    pss->salas = NULL;
+    pss->cap_salas = 0;
+}
+
+// Como enviar_broadcast, pero solo a los miembros de la sala y solo a los
+// shards que tienen alguno
+static void enviar_a_sala(struct sala *s, struct frame_salida *f, uint64_t excluir_id) {
+    if (!f) return;
+    int remotos = 0;
+    for (int t = 0; t < cfg.hilos; t++) {
+        struct shard *sh = &shards[t];
+        if (atomic_load_explicit(&s->num_por_shard[t], memory_order_relaxed) == 0) continue;
+        if (sh == shard_actual) {
+            entregar_sala(sh, s, f, excluir_id);
+            continue;
+        }
+        struct frame_salida *copia = duplicar_frame(f);
+        struct envio *e = copia ? crear_envio(copia, excluir_id, NULL) : NULL;
+        if (!e) {
+            frame_soltar(copia);
+            continue;
+        }
+        e->sala = s;
+        buzon_meter(&sh->buzon, e);
+        remotos = 1;
+    }
+    if (remotos) despertar_shards();
+    frame_soltar(f);
+}
+
+//------------------------------------------------------------------------------
+// Escritor JSON de respuestas
+// Escribe cada tipo de mensaje directamente en el buffer de salida (tras
+// LWS_PRE), sin construir objetos json-c. Las partes constantes de cada
+// mensaje son literales ya renderizados. La salida es idéntica byte a byte a
+// la de json_object_to_json_string (formato JSON_C_TO_STRING_SPACED y el
+// mismo escapado de cadenas, incluido "\/").
+//------------------------------------------------------------------------------
+struct escritor_json {
+    struct frame_salida *frame;  // frame en construcción (crece con realloc)
+    unsigned char *buf;          // destino (ya desplazado LWS_PRE)
+    size_t len;
+    size_t cap;
+    int error;                   // sin memoria
+};
+
+// Frame del slab con lugar para al menos cap bytes de payload; en *cap
+// quedan los que tiene de verdad
+static struct frame_salida *ej_frame_nuevo(size_t *cap) {
+    size_t bloque;
+    struct frame_salida *f = slab_tomar_tam(sizeof(*f) + LWS_PRE + *cap, &bloque);
+    if (f) *cap = bloque - sizeof(*f) - LWS_PRE;
+    return f;
+}
+
+// Escribe sobre un frame nuevo; estimacion = tamaño inicial del payload
+static void ej_iniciar_frame(struct escritor_json *e, size_t estimacion) {
+    e->frame = ej_frame_nuevo(&estimacion);
+    e->buf = e->frame ? &e->frame->buf[LWS_PRE] : NULL;
+    e->len = 0;
+    e->cap = e->frame ? estimacion : 0;
+    e->error = e->frame ? 0 : 1;
+}
+
+// Si no entra, pasa lo escrito a un bloque de la clase siguiente
+static int ej_reservar(struct escritor_json *e, size_t n) {
+    if (e->error) return -1;
+    if (e->len + n <= e->cap) return 0;
+    size_t nueva_cap = e->cap * 2 > e->len + n ? e->cap * 2 : e->len + n;
+    struct frame_salida *f = ej_frame_nuevo(&nueva_cap);
+    if (!f) {
+        e->error = 1;
+        return -1;
+    }
+    memcpy(&f->buf[LWS_PRE], e->buf, e->len);
+    slab_devolver(e->frame);
+    e->frame = f;
+    e->buf = &f->buf[LWS_PRE];
+    e->cap = nueva_cap;
+    return 0;
+}
+
+static void ej_bytes(struct escritor_json *e, const char *s, size_t n) {
+    if (ej_reservar(e, n) < 0) return;
+    memcpy(e->buf + e->len, s, n);
+    e->len += n;
+}
+
+// Fragmento constante (literal de C)
+#define EJ_LIT(e, s) ej_bytes((e), (s), sizeof(s) - 1)
+
+// Contenido de una cadena escapado como json_escape_str de json-c
+static void ej_escapar(struct escritor_json *e, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    const char *tramo = s;
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        const char *esc = NULL;
+        switch (c) {
+        case '\b': esc = "\\b";  break;
+        case '\n': esc = "\\n";  break;
+        case '\r': esc = "\\r";  break;
+        case '\t': esc = "\\t";  break;
+        case '\f': esc = "\\f";  break;
+        case '"':  esc = "\\\""; break;
+        case '\\': esc = "\\\\"; break;
+        case '/':  esc = "\\/";  break;
+        default:
+            if (c >= 0x20) continue;
+            break;
+        }
+        ej_bytes(e, tramo, (size_t)(s - tramo));
+        tramo = s + 1;
+        if (esc) {
+            ej_bytes(e, esc, 2);
+        } else {
+            char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            ej_bytes(e, u, sizeof(u));
+        }
+    }
+    ej_bytes(e, tramo, (size_t)(s - tramo));
+}
+
+// Cadena JSON entre comillas
+static void ej_cadena(struct escritor_json *e, const char *s) {
+    EJ_LIT(e, "\"");
+    ej_escapar(e, s);
+    EJ_LIT(e, "\"");
+}
+
+static void ej_entero(struct escritor_json *e, int64_t v) {
+    char num[24];
+    int n = snprintf(num, sizeof(num), "%" PRId64, v);
+    ej_bytes(e, num, (size_t)n);
+}
+
+// Cierra el escritor y devuelve el frame (con una referencia)
+static struct frame_salida *ej_frame(struct escritor_json *e) {
+    if (e->error) {
+        slab_devolver(e->frame);
+        return NULL;
+    }
+    atomic_init(&e->frame->refs, 1);
+    e->frame->len = e->len;
+    e->frame->comprimidos = NULL;
+    e->frame->binario = NULL;
+    e->frame->datos = &e->frame->buf[LWS_PRE];
+    return e->frame;
+}
+
+// [ "u1", "u2", ... ] con los usuarios registrados (requiere registro_lock)
+static void ej_lista_usuarios_locked(struct escritor_json *e) {
+    int primero = 1;
+    EJ_LIT(e, "[");
+    for (size_t i = 0; i < registro.num_sesiones; i++) {
+        if (!registro.sesiones[i]->username) continue;
+        if (!primero) EJ_LIT(e, ",");
+        primero = 0;
+        EJ_LIT(e, " ");
+        ej_cadena(e, registro.sesiones[i]->username);
+    }
+    EJ_LIT(e, " ]");
+}
+
+// Lista de usuarios serializada (con una referencia) y su versión. Se rearma
+// solo si hubo altas o bajas desde la última vez; si no, todas las peticiones
+// comparten el mismo buffer.
+static struct frame_salida *roster_snapshot(uint64_t *version) {
+    pthread_mutex_lock(&roster.lock);
+    if (!roster.snapshot
+        || roster.version_snapshot != atomic_load_explicit(&roster.version,
+                                                           memory_order_acquire)) {
+        struct escritor_json e;
+        pthread_rwlock_rdlock(&registro_lock);
+        uint64_t v = atomic_load_explicit(&roster.version, memory_order_relaxed);
+        ej_iniciar_frame(&e, 16 + registro.num_nombres * 16);
+        ej_lista_usuarios_locked(&e);
+        pthread_rwlock_unlock(&registro_lock);
+        struct frame_salida *f = ej_frame(&e);
+        if (f) {
+            frame_soltar(roster.snapshot);
+            roster.snapshot = f;
+            roster.version_snapshot = v;
+        }
+    }
+    struct frame_salida *f = roster.snapshot;
+    if (f) {
+        frame_tomar(f);
+        *version = roster.version_snapshot;
+    }
+    pthread_mutex_unlock(&roster.lock);
+    return f;
+}
+
+// Tamaño inicial del frame: el texto sin escapar más las partes fijas
+#define EJ_ESTIMACION(...) (128 + ej_suma_len((const char *[]){ __VA_ARGS__, NULL }))
+static size_t ej_suma_len(const char **v) {
+    size_t n = 0;
+    for (; *v; v++) n += strlen(*v);
+    return n;
+}
+
+// broadcast / private: { "type", "sender", "content", "timestamp" }
+static struct frame_salida *json_mensaje_chat(const char *tipo, const char *sender,
+                                              const char *content, const char *ts) {
+    struct escritor_json e;
+    ej_iniciar_frame(&e, EJ_ESTIMACION(tipo, sender, content, ts));
+    EJ_LIT(&e, "{ \"type\": ");
+    ej_cadena(&e, tipo);
+    EJ_LIT(&e, ", \"sender\": ");
+    ej_cadena(&e, sender);
+    EJ_LIT(&e, ", \"content\": ");
+    ej_cadena(&e, content);
+    EJ_LIT(&e, ", \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+// { "type": "private", "id", "sender", "content", "timestamp" }
+// El id lo asigna el servidor; el destinatario lo devuelve en su "ack".
+static struct frame_salida *json_privado(uint64_t id, const char *sender,
+                                         const char *content, const char *ts) {
+    struct escritor_json e;
+    ej_iniciar_frame(&e, EJ_ESTIMACION(sender, content, ts));
+    EJ_LIT(&e, "{ \"type\": \"private\", \"id\": ");
+    ej_entero(&e, (int64_t)id);
+    EJ_LIT(&e, ", \"sender\": ");
+    ej_cadena(&e, sender);
+    EJ_LIT(&e, ", \"content\": ");
+    ej_cadena(&e, content);
+    EJ_LIT(&e, ", \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+// { "type": "ack", "id", "sender", "target"?, "content": estado, "timestamp" }
+// estado: "enviado" | "en_espera" | "rechazado" (del servidor al emisor) o
+// "entregado" (del destinatario, reenviado al emisor)
+static struct frame_salida *json_ack(uint64_t id, const char *sender, const char *target,
+                                     const char *estado, const char *ts) {
+    struct escritor_json e;
+    ej_iniciar_frame(&e, EJ_ESTIMACION(sender, estado, ts, target));
+    EJ_LIT(&e, "{ \"type\": \"ack\", \"id\": ");
+    ej_entero(&e, (int64_t)id);
+    EJ_LIT(&e, ", \"sender\": ");
+    ej_cadena(&e, sender);
+    if (target) {
+        EJ_LIT(&e, ", \"target\": ");
+        ej_cadena(&e, target);
+    }
+    EJ_LIT(&e, ", \"content\": ");
+    ej_cadena(&e, estado);
+    EJ_LIT(&e, ", \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+// { "type", "room", "sender", "content", "members"?, "timestamp" }
+// Para room_message y las respuestas room_joined/room_left/room_error
+// (miembros < 0: sin "members").
+static struct frame_salida *json_sala(const char *tipo, const char *sala, const char *sender,
+                                      const char *content, long miembros, const char *ts) {
+    struct escritor_json e;
+    ej_iniciar_frame(&e, EJ_ESTIMACION(tipo, sala, sender, content, ts));
+    EJ_LIT(&e, "{ \"type\": ");
+    ej_cadena(&e, tipo);
+    EJ_LIT(&e, ", \"room\": ");
+    ej_cadena(&e, sala);
+    EJ_LIT(&e, ", \"sender\": ");
+    ej_cadena(&e, sender);
+    EJ_LIT(&e, ", \"content\": ");
+    ej_cadena(&e, content);
+    if (miembros >= 0) {
+        EJ_LIT(&e, ", \"members\": ");
+        ej_entero(&e, miembros);
+    }
+    EJ_LIT(&e, ", \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+// Respuesta simple del servidor: { "type", "sender": "server", "content", "timestamp" }
+static struct frame_salida *json_respuesta_servidor(const char *tipo, const char *content,
+                                                    const char *ts) {
+    return json_mensaje_chat(tipo, "server", content, ts);
+}
+
+static struct frame_salida *json_register_success(const char *ts) {
+    uint64_t version = 0;
+    struct frame_salida *lista = roster_snapshot(&version);
+    if (!lista) return NULL;
+    struct escritor_json e;
+    ej_iniciar_frame(&e, 256 + lista->len);
+    EJ_LIT(&e, "{ \"type\": \"register_success\", \"sender\": \"server\", "
+               "\"content\": \"Registro exitoso\", \"userList\": ");
+    ej_bytes(&e, (const char *)lista->datos, lista->len);
+    frame_soltar(lista);
+    EJ_LIT(&e, ", \"version\": ");
+    ej_entero(&e, (int64_t)version);
+    EJ_LIT(&e, ", \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+static struct frame_salida *json_list_users(const char *ts) {
+    uint64_t version = 0;
+    struct frame_salida *lista = roster_snapshot(&version);
+    if (!lista) return NULL;
+    struct escritor_json e;
+    ej_iniciar_frame(&e, 256 + lista->len);
+    EJ_LIT(&e, "{ \"type\": \"list_users_response\", \"sender\": \"server\", "
+               "\"content\": ");
+    ej_bytes(&e, (const char *)lista->datos, lista->len);
+    frame_soltar(lista);
+    EJ_LIT(&e, ", \"version\": ");
+    ej_entero(&e, (int64_t)version);
+    EJ_LIT(&e, ", \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+// Altas y bajas posteriores a 'desde', en orden:
+// { "type": "list_users_delta", "content": [ { "user", "event": "join"|"leave" }, ... ],
+//   "since_version", "version", "timestamp" }
+// Devuelve NULL si el historial ya no cubre ese rango (o 'desde' es de otra
+// ejecución del servidor); entonces corresponde la lista completa.
+static struct frame_salida *json_list_users_delta(uint64_t desde, const char *ts) {
+    pthread_rwlock_rdlock(&registro_lock);
+    uint64_t v = atomic_load_explicit(&roster.version, memory_order_relaxed);
+    int cubierto = desde <= v && v - desde <= ROSTER_HISTORIAL;
+    for (uint64_t x = desde + 1; cubierto && x <= v; x++) {
+        if (!roster.historial[x % ROSTER_HISTORIAL].usuario[0]) cubierto = 0;
+    }
+    if (!cubierto) {
+        pthread_rwlock_unlock(&registro_lock);
+        return NULL;
+    }
+    struct escritor_json e;
+    ej_iniciar_frame(&e, 192 + (size_t)(v - desde) * 48);
+    EJ_LIT(&e, "{ \"type\": \"list_users_delta\", \"sender\": \"server\", "
+               "\"content\": [");
+    for (uint64_t x = desde + 1; x <= v; x++) {
+        const struct evento_roster *ev = &roster.historial[x % ROSTER_HISTORIAL];
+        if (x > desde + 1) EJ_LIT(&e, ",");
+        EJ_LIT(&e, " { \"user\": ");
+        ej_cadena(&e, ev->usuario);
+        if (ev->alta) EJ_LIT(&e, ", \"event\": \"join\" }");
+        else EJ_LIT(&e, ", \"event\": \"leave\" }");
+    }
+    pthread_rwlock_unlock(&registro_lock);
+    EJ_LIT(&e, " ], \"since_version\": ");
+    ej_entero(&e, (int64_t)desde);
+    EJ_LIT(&e, ", \"version\": ");
+    ej_entero(&e, (int64_t)v);
+    EJ_LIT(&e, ", \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+static struct frame_salida *json_user_info(const char *target, const char *ip,
+                                           const char *status, size_t en_cola,
+                                           size_t descartados, const char *ts) {
+    struct escritor_json e;
+    ej_iniciar_frame(&e, EJ_ESTIMACION(target, ip, status, ts));
+    EJ_LIT(&e, "{ \"type\": \"user_info_response\", \"sender\": \"server\", "
+               "\"target\": ");
+    ej_cadena(&e, target);
+    EJ_LIT(&e, ", \"content\": { \"ip\": ");
+    ej_cadena(&e, ip);
+    EJ_LIT(&e, ", \"status\": ");
+    ej_cadena(&e, status);
+    EJ_LIT(&e, ", \"queue\": ");
+    ej_entero(&e, (int64_t)en_cola);
+    EJ_LIT(&e, ", \"dropped\": ");
+    ej_entero(&e, (int64_t)descartados);
+    EJ_LIT(&e, " }, \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+static struct frame_salida *json_status_update(const char *user, const char *status,
+                                               const char *ts) {
+    struct escritor_json e;
+    ej_iniciar_frame(&e, EJ_ESTIMACION(user, status, ts));
+    EJ_LIT(&e, "{ \"type\": \"status_update\", \"sender\": \"server\", "
+               "\"content\": { \"user\": ");
+    ej_cadena(&e, user);
+    EJ_LIT(&e, ", \"status\": ");
+    ej_cadena(&e, status);
+    EJ_LIT(&e, " }, \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+// Este aviso siempre se armó a mano, en formato compacto
+static struct frame_salida *json_user_disconnected(const char *user, const char *ts) {
+    struct escritor_json e;
+    ej_iniciar_frame(&e, EJ_ESTIMACION(user, ts));
+    EJ_LIT(&e, "{\"type\":\"user_disconnected\",\"sender\":\"server\",\"content\":\"");
+    ej_escapar(&e, user);
+    EJ_LIT(&e, " ha salido\",\"timestamp\":");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, "}");
+    return ej_frame(&e);
+}
+
+//------------------------------------------------------------------------------
+// Presencia: los cambios de estado (change_status e inactividad) se juntan
+// durante cfg.presencia_ms y salen como un solo "status_batch" por cliente.
+// Los clientes que no negociaron CAP_STATUS_BATCH siguen recibiendo un
+// "status_update" por cambio. Si un usuario cambia varias veces dentro de la
+// ventana, solo se publica el último estado.
+//------------------------------------------------------------------------------
+struct cambio_presencia {
+    nombre_usuario usuario;
+    enum estado_usuario est;
+    uint64_t excluir_id;      // sesión que no recibe el status_update suelto
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct cambio_presencia *cambios;
+    size_t num;
+    size_t cap;
+    int32_t *indice;          // hash del nombre -> posición en cambios (-1 = libre)
+    size_t cap_indice;        // potencia de 2, al menos 2 * cap
+    lws_sorted_usec_list_t sul;
+} presencia = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Sesiones conectadas con y sin CAP_STATUS_BATCH (para no armar frames que
+// no tendrían destinatario)
+static atomic_long sesiones_con_lotes = 0;
+static atomic_long sesiones_sin_lotes = 0;
+
+static struct frame_salida *json_status_batch(const struct cambio_presencia *cambios,
+                                              size_t num, const char *ts) {
+    struct escritor_json e;
+    ej_iniciar_frame(&e, 128 + num * 48);
+    EJ_LIT(&e, "{ \"type\": \"status_batch\", \"sender\": \"server\", \"content\": [");
+    for (size_t i = 0; i < num; i++) {
+        if (i) EJ_LIT(&e, ",");
+        EJ_LIT(&e, " { \"user\": ");
+        ej_cadena(&e, cambios[i].usuario);
+        EJ_LIT(&e, ", \"status\": ");
+        ej_cadena(&e, estado_to_string(cambios[i].est));
+        EJ_LIT(&e, " }");
+    }
+    EJ_LIT(&e, " ], \"timestamp\": ");
+    ej_cadena(&e, ts);
+    EJ_LIT(&e, " }");
+    return ej_frame(&e);
+}
+
+// Agranda cambios e índice; se llama con presencia.lock tomado
+static int presencia_crecer_locked(void) {
+    size_t nueva_cap = presencia.cap ? presencia.cap * 2 : 64;
+    struct cambio_presencia *c = realloc(presencia.cambios, nueva_cap * sizeof(*c));
+    if (!c) return -1;
+    presencia.cambios = c;
+    int32_t *idx = malloc(nueva_cap * 2 * sizeof(*idx));
+    if (!idx) return -1;
+    free(presencia.indice);
+    presencia.indice = idx;
+    presencia.cap_indice = nueva_cap * 2;
+    presencia.cap = nueva_cap;
+    memset(idx, -1, presencia.cap_indice * sizeof(*idx));
+    size_t mascara = presencia.cap_indice - 1;
+    for (size_t i = 0; i < presencia.num; i++) {
+        size_t pos = hash_nombre(c[i].usuario) & mascara;
+        while (idx[pos] >= 0) pos = (pos + 1) & mascara;
+        idx[pos] = (int32_t)i;
+    }
+    return 0;
+}
+
+// Anuncia el nuevo estado de un usuario. excluir_id: sesión a la que no se
+// le manda el status_update suelto (0 = ninguna).
+static void publicar_estado(const char *usuario, enum estado_usuario est,
+                            uint64_t excluir_id, const char *ts) {
+    if (cfg.presencia_ms == 0) {
+        enviar_broadcast_filtrado(json_status_update(usuario, estado_to_string(est), ts),
+                                  excluir_id, 0, 0);
+        return;
+    }
+    size_t len = strlen(usuario);
+    pthread_mutex_lock(&presencia.lock);
+    if (len > USUARIO_MAX
+        || (presencia.num == presencia.cap && presencia_crecer_locked() < 0)) {
+        pthread_mutex_unlock(&presencia.lock);
+        // Sin memoria para agrupar (o no entra en la ranura): mandarlo suelto
+        enviar_broadcast_filtrado(json_status_update(usuario, estado_to_string(est), ts),
+                                  excluir_id, 0, 0);
+        return;
+    }
+    size_t mascara = presencia.cap_indice - 1;
+    size_t pos = hash_nombre(usuario) & mascara;
+    while (presencia.indice[pos] >= 0) {
+        struct cambio_presencia *c = &presencia.cambios[presencia.indice[pos]];
+        if (strcmp(c->usuario, usuario) == 0) {
+            c->est = est;
+            c->excluir_id = excluir_id;
+            pthread_mutex_unlock(&presencia.lock);
+            return;
+        }
+        pos = (pos + 1) & mascara;
+    }
+    struct cambio_presencia *c = &presencia.cambios[presencia.num];
+    memcpy(c->usuario, usuario, len + 1);
+    c->est = est;
+    c->excluir_id = excluir_id;
+    presencia.indice[pos] = (int32_t)presencia.num++;
+    pthread_mutex_unlock(&presencia.lock);
+}
+
+// Publica lo acumulado en la ventana
+static void presencia_publicar(void) {
+    pthread_mutex_lock(&presencia.lock);
+    struct cambio_presencia *cambios = presencia.cambios;
+    size_t num = presencia.num;
+    if (num > 0) {
+        presencia.cambios = NULL;
+        presencia.num = presencia.cap = 0;
+        free(presencia.indice);
+        presencia.indice = NULL;
+        presencia.cap_indice = 0;
+    }
+    pthread_mutex_unlock(&presencia.lock);
+
+    if (num > 0) {
+        char ts[64];
+        get_timestamp(ts, sizeof(ts));
+        if (atomic_load(&sesiones_con_lotes) > 0) {
+            enviar_broadcast_filtrado(json_status_batch(cambios, num, ts), 0,
+                                      CAP_STATUS_BATCH, CAP_STATUS_BATCH);
+        }
+        int sueltos = atomic_load(&sesiones_sin_lotes) > 0;
+        for (size_t i = 0; i < num; i++) {
+            if (sueltos) {
+                enviar_broadcast_filtrado(
+                    json_status_update(cambios[i].usuario, estado_to_string(cambios[i].est), ts),
+                    cambios[i].excluir_id, CAP_STATUS_BATCH, 0);
+            }
+        }
+        free(cambios);
+        if (num > 1) log_debug("presencia", "%zu cambios agrupados en un status_batch", num);
+    }
+}
+
+// Fin de la ventana (corre en el hilo del shard 0)
+static void presencia_vaciar(lws_sorted_usec_list_t *sul) {
+    (void)sul;
+    presencia_publicar();
+    lws_sul_schedule(contexto, 0, &presencia.sul, presencia_vaciar,
+                     (lws_usec_t)cfg.presencia_ms * LWS_US_PER_MS);
+}
+
+//------------------------------------------------------------------------------
+// Parser JSON de mensajes entrantes
+// Recorre el frame en su lugar (sin malloc) y llena un struct fijo con los
+// campos del protocolo. Las cadenas se decodifican dentro del mismo buffer
+// (una cadena escapada nunca crece al decodificarse) y al final se terminan
+// con '\0', así que el frame de entrada se modifica. No requiere que el
+// frame venga terminado en '\0'.
+//------------------------------------------------------------------------------
+#define JSON_MAX_PROFUNDIDAD 32
+
+enum tipo_valor {
+    VALOR_AUSENTE = 0,
+    VALOR_NULO,
+    VALOR_CADENA,
+    VALOR_OTRO                // número, booleano, objeto o arreglo (texto crudo)
+};
+
+struct campo_json {
+    enum tipo_valor tipo;
+    char *p;                  // cadena decodificada o texto crudo
+    size_t len;
+};
+
+struct mensaje_entrante {
+    struct campo_json id;
+    struct campo_json type;
+    struct campo_json room;
+    struct campo_json sender;
+    struct campo_json target;
+    struct campo_json content;
+    struct campo_json timestamp;
+    int extra;                // claves que no son ninguna de las anteriores
+};
+
+struct lector_json {
+    char *p;
+    char *fin;
+};
+
+static void json_saltar_espacios(struct lector_json *l) {
+    while (l->p < l->fin
+           && (*l->p == ' ' || *l->p == '\t' || *l->p == '\n' || *l->p == '\r'))
+        l->p++;
+}
+
+static int hex_valor(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int json_leer_hex4(struct lector_json *l, uint32_t *cp) {
+    if (l->fin - l->p < 4) return -1;
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        int h = hex_valor(l->p[i]);
+        if (h < 0) return -1;
+        v = (v << 4) | (uint32_t)h;
+    }
+    l->p += 4;
+    *cp = v;
+    return 0;
+}
+
+static char *utf8_escribir(char *out, uint32_t cp) {
+    if (cp < 0x80) {
+        *out++ = (char)cp;
+    } else if (cp < 0x800) {
+        *out++ = (char)(0xC0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        *out++ = (char)(0xE0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    } else {
+        *out++ = (char)(0xF0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    }
+    return out;
+}
+
+// Lee una cadena (l->p apunta a la comilla inicial) validando los escapes.
+// Con inicio la decodifica en su lugar y deja ahí la cadena decodificada
+// (con su largo en *len); con inicio NULL solo la salta, sin tocar el
+// buffer, para no alterar el texto crudo de un valor que la contiene.
+static int json_leer_cadena(struct lector_json *l, char **inicio, size_t *len) {
+    l->p++;  // comilla
+    char *out = inicio ? l->p : NULL;
+    if (inicio) *inicio = out;
+    while (l->p < l->fin) {
+        char c = *l->p++;
+        if (c == '"') {
+            if (inicio) *len = (size_t)(out - *inicio);
+            return 0;
+        }
+        if ((unsigned char)c < 0x20) return -1;
+        if (c != '\\') {
+            if (out) *out++ = c;
+            continue;
+        }
+        if (l->p >= l->fin) return -1;
+        c = *l->p++;
+        switch (c) {
+        case '"':  break;
+        case '\\': break;
+        case '/':  break;
+        case 'b':  c = '\b'; break;
+        case 'f':  c = '\f'; break;
+        case 'n':  c = '\n'; break;
+        case 'r':  c = '\r'; break;
+        case 't':  c = '\t'; break;
+        case 'u': {
+            uint32_t cp;
+            if (json_leer_hex4(l, &cp) < 0) return -1;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                // Par sustituto: debe seguir \uDC00-\uDFFF
+                uint32_t bajo;
+                if (l->fin - l->p < 2 || l->p[0] != '\\' || l->p[1] != 'u') return -1;
+                l->p += 2;
+                if (json_leer_hex4(l, &bajo) < 0 || bajo < 0xDC00 || bajo > 0xDFFF)
+                    return -1;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (bajo - 0xDC00);
+            } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                return -1;
+            }
+            // \uXXXX ocupa 6 bytes y produce como mucho 3 (o 12 -> 4)
+            if (out) out = utf8_escribir(out, cp);
+            continue;
+        }
+        default:
+            return -1;
+        }
+        if (out) *out++ = c;
+    }
+    return -1;
+}
+
+// Después de un número o literal tiene que venir un delimitador
+static int json_fin_escalar(const struct lector_json *l) {
+    if (l->p >= l->fin) return 0;
+    char c = *l->p;
+    return (c == ' ' || c == '\t' || c == '\n' || c == '\r'
+            || c == ',' || c == '}' || c == ']') ? 0 : -1;
+}
+
+static int json_saltar_digitos(struct lector_json *l) {
+    char *ini = l->p;
+    while (l->p < l->fin && *l->p >= '0' && *l->p <= '9') l->p++;
+    return l->p > ini ? 0 : -1;
+}
+
+// Número (gramática de JSON) o true/false/null
+static int json_saltar_escalar(struct lector_json *l) {
+    static const char *const literales[] = { "true", "false", "null" };
+    for (size_t i = 0; i < sizeof(literales) / sizeof(literales[0]); i++) {
+        size_t n = strlen(literales[i]);
+        if ((size_t)(l->fin - l->p) >= n && memcmp(l->p, literales[i], n) == 0) {
+            l->p += n;
+            return json_fin_escalar(l);
+        }
+    }
+    if (l->p < l->fin && *l->p == '-') l->p++;
+    if (l->p < l->fin && *l->p == '0') {
+        l->p++;
+    } else if (json_saltar_digitos(l) < 0) {
+        return -1;
+    }
+    if (l->p < l->fin && *l->p == '.') {
+        l->p++;
+        if (json_saltar_digitos(l) < 0) return -1;
+    }
+    if (l->p < l->fin && (*l->p == 'e' || *l->p == 'E')) {
+        l->p++;
+        if (l->p < l->fin && (*l->p == '+' || *l->p == '-')) l->p++;
+        if (json_saltar_digitos(l) < 0) return -1;
+    }
+    return json_fin_escalar(l);
+}
+
+// "clave": de un miembro de objeto que se salta
+static int json_saltar_clave(struct lector_json *l) {
+    json_saltar_espacios(l);
+    if (l->p >= l->fin || *l->p != '"' || json_leer_cadena(l, NULL, NULL) < 0) return -1;
+    json_saltar_espacios(l);
+    if (l->p >= l->fin || *l->p != ':') return -1;
+    l->p++;
+    return 0;
+}
+
+// Salta un valor que no interesa decodificar (número, literal, cadena,
+// objeto o arreglo) validando su sintaxis, con los separadores en su lugar.
+// No escribe en el buffer: el texto crudo queda tal como llegó.
+static int json_saltar_valor(struct lector_json *l) {
+    char cierres[JSON_MAX_PROFUNDIDAD];   // '}' o ']' por contenedor abierto
+    int profundidad = 0;
+    for (;;) {
+        json_saltar_espacios(l);
+        if (l->p >= l->fin) return -1;
+        char c = *l->p;
+        if (c == '{' || c == '[') {
+            if (profundidad == JSON_MAX_PROFUNDIDAD) return -1;
+            cierres[profundidad++] = c == '{' ? '}' : ']';
+            l->p++;
+            json_saltar_espacios(l);
+            if (l->p >= l->fin || *l->p != cierres[profundidad - 1]) {
+                // Primer elemento
+                if (c == '{' && json_saltar_clave(l) < 0) return -1;
+                continue;
+            }
+            l->p++;               // vacío
+            profundidad--;
+        } else if (c == '"') {
+            if (json_leer_cadena(l, NULL, NULL) < 0) return -1;
+        } else if (json_saltar_escalar(l) < 0) {
+            return -1;
+        }
+
+        // Terminó un valor: sigue ',' y otro elemento, o se cierra el
+        // contenedor (que a su vez es un valor terminado)
+        for (;;) {
+            if (profundidad == 0) return 0;
+            json_saltar_espacios(l);
+            if (l->p >= l->fin) return -1;
+            if (*l->p == ',') break;
+            if (*l->p != cierres[profundidad - 1]) return -1;
+            l->p++;
+            profundidad--;
+        }
+        l->p++;                   // ','
+        if (cierres[profundidad - 1] == '}' && json_saltar_clave(l) < 0) return -1;
+    }
+}
+
+// Entero sin signo (sin fracción ni exponente) en l->p, seguido de un
+// delimitador
+static int json_leer_natural(struct lector_json *l, uint64_t *v) {
+    char *ini = l->p;
+    uint64_t n = 0;
+    while (l->p < l->fin && *l->p >= '0' && *l->p <= '9') {
+        uint64_t d = (uint64_t)(*l->p++ - '0');
+        if (n > (UINT64_MAX - d) / 10) return -1;
+        n = n * 10 + d;
+    }
+    if (l->p == ini || json_fin_escalar(l) < 0) return -1;
+    *v = n;
+    return 0;
+}
+
+// Busca el miembro clave en el objeto JSON crudo que empieza en l->p (el
+// texto de un campo VALOR_OTRO) sin escribir en él: una clave con escapes
+// se decodifica en una copia. Devuelve 0 con l->p en el valor, -1 si no
+// está o el objeto no es válido.
+static int json_buscar_miembro(struct lector_json *l, const char *clave) {
+    size_t nclave = strlen(clave);
+    json_saltar_espacios(l);
+    if (l->p >= l->fin || *l->p != '{') return -1;
+    l->p++;
+    json_saltar_espacios(l);
+    if (l->p < l->fin && *l->p == '}') return -1;
+    for (;;) {
+        json_saltar_espacios(l);
+        if (l->p >= l->fin || *l->p != '"') return -1;
+        char *ini = l->p;
+        if (json_leer_cadena(l, NULL, NULL) < 0) return -1;
+        size_t n = (size_t)(l->p - ini);      // con las dos comillas
+        int coincide = n - 2 == nclave && memcmp(ini + 1, clave, nclave) == 0;
+        char copia[128];
+        if (!coincide && memchr(ini, '\\', n) && n <= sizeof(copia)) {
+            memcpy(copia, ini, n);
+            struct lector_json lk = { copia, copia + n };
+            char *k;
+            size_t nk;
+            coincide = json_leer_cadena(&lk, &k, &nk) == 0 && nk == nclave
+                       && memcmp(k, clave, nclave) == 0;
+        }
+        json_saltar_espacios(l);
+        if (l->p >= l->fin || *l->p != ':') return -1;
+        l->p++;
+        json_saltar_espacios(l);
+        if (coincide) return 0;
+        if (json_saltar_valor(l) < 0) return -1;
+        json_saltar_espacios(l);
+        if (l->p >= l->fin || *l->p != ',') return -1;
+        l->p++;
+    }
+}
+
+static struct campo_json *campo_por_clave(struct mensaje_entrante *m,
+                                          const char *k, size_t n) {
+    switch (n) {
+    case 2:  return memcmp(k, "id", 2) == 0 ? &m->id : NULL;
+    case 4:  return memcmp(k, "type", 4) == 0 ? &m->type
+                  : memcmp(k, "room", 4) == 0 ? &m->room : NULL;
+    case 6:  return memcmp(k, "sender", 6) == 0 ? &m->sender
+                  : memcmp(k, "target", 6) == 0 ? &m->target : NULL;
+    case 7:  return memcmp(k, "content", 7) == 0 ? &m->content : NULL;
+    case 9:  return memcmp(k, "timestamp", 9) == 0 ? &m->timestamp : NULL;
+    default: return NULL;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Parsear un frame {id, type, room, sender, target, content, timestamp, ...}
+// Devuelve 0 si es un objeto JSON válido, -1 en otro caso.
+//------------------------------------------------------------------------------
+static int parsear_mensaje(char *buf, size_t len, struct mensaje_entrante *m) {
+    struct lector_json l = { buf, buf + len };
+    memset(m, 0, sizeof(*m));
+
+    json_saltar_espacios(&l);
+    if (l.p >= l.fin || *l.p != '{') return -1;
+    l.p++;
+    json_saltar_espacios(&l);
+    int primero = 1;
+    while (l.p < l.fin && *l.p != '}') {
+        if (!primero) {
+            if (*l.p != ',') return -1;
+            l.p++;
+            json_saltar_espacios(&l);
+        }
+        primero = 0;
+        if (l.p >= l.fin || *l.p != '"') return -1;
+        char *clave;
+        size_t nclave;
+        if (json_leer_cadena(&l, &clave, &nclave) < 0) return -1;
+        json_saltar_espacios(&l);
+        if (l.p >= l.fin || *l.p != ':') return -1;
+        l.p++;
+        json_saltar_espacios(&l);
+        if (l.p >= l.fin) return -1;
+
+        struct campo_json tmp;
+        struct campo_json *campo = campo_por_clave(m, clave, nclave);
+        if (!campo) {             // clave desconocida: se valida y se ignora
+            campo = &tmp;
+            m->extra++;
+        }
+        if (*l.p == '"') {
+            // Solo se decodifican los campos conocidos
+            campo->tipo = VALOR_CADENA;
+            if (json_leer_cadena(&l, campo == &tmp ? NULL : &campo->p, &campo->len) < 0)
+                return -1;
+        } else if (l.fin - l.p >= 4 && memcmp(l.p, "null", 4) == 0) {
+            campo->tipo = VALOR_NULO;
+            campo->p = NULL;
+            campo->len = 0;
+            l.p += 4;
+        } else {
+            campo->tipo = VALOR_OTRO;
+            campo->p = l.p;
+            if (json_saltar_valor(&l) < 0) return -1;
+            campo->len = (size_t)(l.p - campo->p);
+        }
+        json_saltar_espacios(&l);
+    }
+    if (l.p >= l.fin) return -1;
+
+    // Ya no se vuelve a leer el buffer: terminar las cadenas en su lugar.
+    // El byte siguiente a cada valor es una comilla o un delimitador ya
+    // consumido, así que escribir '\0' ahí no pisa datos de otro campo.
+    struct campo_json *campos[] = { &m->id, &m->type, &m->room, &m->sender, &m->target,
+                                    &m->content, &m->timestamp };
+    for (size_t i = 0; i < sizeof(campos) / sizeof(campos[0]); i++) {
+        if (campos[i]->tipo == VALOR_CADENA || campos[i]->tipo == VALOR_OTRO)
+            campos[i]->p[campos[i]->len] = '\0';
+    }
+    return 0;
+}
+
+// Cadena C del campo (NULL si falta o es null)
+static const char *campo_str(const struct campo_json *c) {
+    return (c->tipo == VALOR_CADENA || c->tipo == VALOR_OTRO) ? c->p : NULL;
+}
+
+#ifdef FUZZ_JSON
+//------------------------------------------------------------------------------
+// Objetivo de libFuzzer para parsear_mensaje (sin main propio):
+//   clang -g -O1 -DFUZZ_JSON -fsanitize=fuzzer,address,undefined -o fuzz_json
+//         server.c -lwebsockets -lz -lpthread
+//   ./fuzz_json corpus/
+// El frame va en un buffer del largo exacto y sin '\0', así ASan ve
+// cualquier lectura de más. Si se acepta, los valores crudos tienen que
+// seguir tal como llegaron y las cadenas no pueden crecer al decodificarse.
+//------------------------------------------------------------------------------
+int LLVMFuzzerTestOneInput(const uint8_t *datos, size_t len) {
+    char *buf = malloc(len ? len : 1);
+    if (!buf) return 0;
+    if (len) memcpy(buf, datos, len);
+    struct mensaje_entrante m;
+    if (parsear_mensaje(buf, len, &m) == 0) {
+        const struct campo_json *campos[] = { &m.id, &m.type, &m.room, &m.sender, &m.target,
+                                              &m.content, &m.timestamp };
+        for (size_t i = 0; i < sizeof(campos) / sizeof(campos[0]); i++) {
+            const struct campo_json *c = campos[i];
+            if (c->tipo != VALOR_CADENA && c->tipo != VALOR_OTRO) continue;
+            size_t off = (size_t)(c->p - buf);
+            if (off + c->len >= len || c->p[c->len] != '\0') abort();
+            if (c->tipo == VALOR_OTRO && memcmp(c->p, datos + off, c->len) != 0) abort();
+        }
+    }
+    free(buf);
+    return 0;
+}
+#endif
+
+//------------------------------------------------------------------------------
+// Protocolo binario (chat-protocol-bin, ver protocolo_bin.h)
+// Manejadores y escritores de respuestas trabajan siempre en JSON; las
+// sesiones binarias se traducen en el borde. Entrada: el mensaje binario se
+// decodifica al mismo mensaje_entrante que arma parsear_mensaje. Salida:
+// cada frame se traduce una sola vez por shard, cuando la primera sesión
+// binaria lo saca de su cola, y la traducción queda en el frame para los
+// demás destinatarios (como frame_comprimido). Así clientes JSON y binarios
+// se mezclan sin que el resto del servidor lo note.
+// Los nombres de usuario viajan como ids de la tabla 'internados', que solo
+// crece. Solo entran los nombres que se registraron (register), no los que
+// un cliente ponga en sender o target; los demás, los que pasen de
+// USUARIOS_BIN_MAX nombres y los de más de USUARIO_MAX bytes van escritos. Los nombres se guardan en bloques de ranuras fijas que no se
+// mueven ni se liberan: una alta no reserva nada salvo al abrir un bloque.
+//------------------------------------------------------------------------------
+#define USUARIOS_BIN_MAX       (1u << 20)
+#define INTERNADOS_CAP_INICIAL 256
+#define INTERNADOS_BLOQUE      4096      // nombres por bloque
+
+static struct {
+    pthread_rwlock_t lock;
+    nombre_usuario *bloques[USUARIOS_BIN_MAX / INTERNADOS_BLOQUE];  // id -> nombre (el id 0 no se usa)
+    uint32_t num;             // próximo id
+    uint32_t *tabla;          // hash abierto nombre -> id (0 = libre)
+    size_t cap_tabla;         // potencia de 2, como mucho a la mitad
+} internados = { .lock = PTHREAD_RWLOCK_INITIALIZER, .num = 1 };
+
+static inline char *internado_nombre_locked(uint32_t id) {
+    return internados.bloques[id / INTERNADOS_BLOQUE][id % INTERNADOS_BLOQUE];
+}
+
+static struct tabla_tipos tipos_bin;     // nombre de tipo <-> código
+
+static uint32_t internado_buscar_locked(const char *nombre, uint32_t h) {
+    if (!internados.cap_tabla) return 0;
+    size_t mascara = internados.cap_tabla - 1;
+    for (size_t i = h & mascara; internados.tabla[i]; i = (i + 1) & mascara) {
+        uint32_t id = internados.tabla[i];
+        if (strcmp(internado_nombre_locked(id), nombre) == 0) return id;
+    }
+    return 0;
+}
+
+static void internado_insertar_locked(uint32_t id, uint32_t h) {
+    size_t mascara = internados.cap_tabla - 1;
+    size_t i = h & mascara;
+    while (internados.tabla[i]) i = (i + 1) & mascara;
+    internados.tabla[i] = id;
+}
+
+// Deja lugar para un id más
+static int internados_crecer_locked(void) {
+    nombre_usuario **b = &internados.bloques[internados.num / INTERNADOS_BLOQUE];
+    if (!*b && !(*b = malloc(INTERNADOS_BLOQUE * sizeof(**b)))) return -1;
+    if (2 * (size_t)internados.num >= internados.cap_tabla) {
+        size_t cap = internados.cap_tabla ? internados.cap_tabla * 2 : 2 * INTERNADOS_CAP_INICIAL;
+        uint32_t *t = calloc(cap, sizeof(*t));
+        if (!t) return -1;
+        free(internados.tabla);
+        internados.tabla = t;
+        internados.cap_tabla = cap;
+        for (uint32_t id = 1; id < internados.num; id++)
+            internado_insertar_locked(id, hash_nombre(internado_nombre_locked(id)));
+    }
+    return 0;
+}
+
+// Id de un nombre registrado; 0 si no tiene (va escrito)
+static uint32_t usuario_id(const char *nombre) {
+    pthread_rwlock_rdlock(&internados.lock);
+    uint32_t id = internado_buscar_locked(nombre, hash_nombre(nombre));
+    pthread_rwlock_unlock(&internados.lock);
+    return id;
+}
+
+// Le da un id a un nombre que se acaba de registrar (si no tenía). Devuelve
+// el id, o 0 si la tabla está llena o el nombre no entra en una ranura.
+static uint32_t usuario_internar(const char *nombre) {
+    size_t len = strlen(nombre);
+    if (len > USUARIO_MAX) return 0;
+    uint32_t id = usuario_id(nombre);
+    if (id) return id;
+
+    uint32_t h = hash_nombre(nombre);
+    pthread_rwlock_wrlock(&internados.lock);
+    id = internado_buscar_locked(nombre, h);
+    if (!id && internados.num < USUARIOS_BIN_MAX && internados_crecer_locked() == 0) {
+        id = internados.num++;
+        memcpy(internado_nombre_locked(id), nombre, len + 1);
+        internado_insertar_locked(id, h);
+    }
+    pthread_rwlock_unlock(&internados.lock);
+    return id;
+}
+
+// Nombre de un id (los nombres no se liberan nunca); NULL si no existe
+static const char *usuario_nombre(uint32_t id) {
+    pthread_rwlock_rdlock(&internados.lock);
+    const char *n = id > 0 && id < internados.num ? internado_nombre_locked(id) : NULL;
+    pthread_rwlock_unlock(&internados.lock);
+    return n;
+}
+
+// "%Y-%m-%d %H:%M:%S" en hora local (ver get_timestamp) -> microsegundos
+// desde 1970. Cambia una vez por segundo, así que cada hilo recuerda la
+// última conversión. Devuelve -1 si no tiene ese formato.
+static int timestamp_a_us(const char *ts, uint64_t *us) {
+    static _Thread_local char ultimo[32];
+    static _Thread_local uint64_t ultimo_us;
+    if (strcmp(ts, ultimo) == 0) {
+        *us = ultimo_us;
+        return 0;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(ts, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    if (t == (time_t)-1) return -1;
+    *us = (uint64_t)t * 1000000u;
+    if (strlen(ts) < sizeof(ultimo)) {
+        strcpy(ultimo, ts);
+        ultimo_us = *us;
+    }
+    return 0;
+}
+
+// Cadena que entra en un campo str16 del protocolo
+static int campo_corto(const struct campo_json *c) {
+    return c->tipo == VALOR_CADENA && c->len <= UINT16_MAX;
+}
+
+static void bin_usuario_de(struct bin_usuario *u, const struct campo_json *c) {
+    u->id = usuario_id(c->p);
+    u->nombre.p = c->p;
+    u->nombre.len = c->len;
+}
+
+// Pasa un mensaje JSON ya parseado a la forma binaria. Devuelve -1 si no
+// entra en los campos del protocolo (entonces va como BIN_JSON).
+static int entrante_a_binario(const struct mensaje_entrante *m, struct bin_mensaje *b) {
+    memset(b, 0, sizeof(*b));
+    if (m->extra || m->type.tipo != VALOR_CADENA) return -1;
+    int tipo = tabla_tipos_buscar(&tipos_bin, m->type.p, m->type.len);
+    if (tipo <= BIN_USUARIO) return -1;
+    b->tipo = (uint8_t)tipo;
+    if (m->id.tipo == VALOR_OTRO) {
+        char *fin;
+        b->id = strtoull(m->id.p, &fin, 10);
+        if (fin != m->id.p + m->id.len || m->id.p[0] == '-') return -1;
+        b->campos |= BIN_CAMPO_ID;
+    } else if (m->id.tipo == VALOR_CADENA) {
+        return -1;
+    }
+    if (m->timestamp.tipo == VALOR_CADENA) {
+        if (timestamp_a_us(m->timestamp.p, &b->ts_us) < 0) return -1;
+        b->campos |= BIN_CAMPO_TS;
+    } else if (m->timestamp.tipo == VALOR_OTRO) {
+        return -1;
+    }
+    // null y ausente valen lo mismo para los manejadores (campo_str)
+    const struct campo_json *cortos[] = { &m->sender, &m->target, &m->room };
+    for (size_t i = 0; i < sizeof(cortos) / sizeof(cortos[0]); i++)
+        if (cortos[i]->tipo > VALOR_NULO && !campo_corto(cortos[i])) return -1;
+    if (m->sender.tipo == VALOR_CADENA) {
+        bin_usuario_de(&b->sender, &m->sender);
+        b->campos |= BIN_CAMPO_SENDER;
+    }
+    if (m->target.tipo == VALOR_CADENA) {
+        bin_usuario_de(&b->target, &m->target);
+        b->campos |= BIN_CAMPO_TARGET;
+    }
+    if (m->room.tipo == VALOR_CADENA) {
+        b->room.p = m->room.p;
+        b->room.len = m->room.len;
+        b->campos |= BIN_CAMPO_ROOM;
+    }
+    if (m->content.tipo == VALOR_OTRO) return -1;
+    if (m->content.tipo == VALOR_CADENA) {
+        b->content.p = m->content.p;
+        b->content.len = m->content.len;
+        b->campos |= BIN_CAMPO_CONTENT;
+    }
+    return 0;
+}
+
+// Traducción binaria de f, hecha la primera vez que se pide en el shard.
+// NULL si no hay memoria.
+static struct frame_binario *frame_binario(struct frame_salida *f) {
+    if (f->binario) return f->binario;
+    char *copia = slab_tomar_tam(f->len, NULL);
+    if (!copia) return NULL;
+    memcpy(copia, f->datos, f->len);
+
+    struct mensaje_entrante m;
+    struct bin_mensaje b;
+    if (parsear_mensaje(copia, f->len, &m) < 0 || entrante_a_binario(&m, &b) < 0) {
+        memset(&b, 0, sizeof(b));
+        b.tipo = BIN_JSON;
+        b.campos = BIN_CAMPO_CONTENT;
+        b.content.p = (const char *)f->datos;
+        b.content.len = f->len;
+    }
+    size_t len = bin_tam(&b);
+    struct frame_binario *fb = slab_tomar_tam(sizeof(*fb) + LWS_PRE + len, NULL);
+    if (fb) {
+        fb->len = bin_codificar(&b, fb->buf + LWS_PRE);
+        fb->num_usuarios = 0;
+        if (b.sender.id) fb->usuarios[fb->num_usuarios++] = b.sender.id;
+        if (b.target.id) fb->usuarios[fb->num_usuarios++] = b.target.id;
+        f->binario = fb;
+    }
+    slab_devolver(copia);
+    return fb;
+}
+
+static int usuario_anunciado(const struct per_session_data__chat *pss, uint32_t id) {
+    size_t w = id / 64;
+    return w < pss->num_anunciados && (pss->anunciados[w] >> (id % 64)) & 1u;
+}
+
+static int marcar_anunciado(struct per_session_data__chat *pss, uint32_t id) {
+    size_t w = id / 64;
+    if (w >= pss->num_anunciados) {
+        size_t num = pss->num_anunciados ? pss->num_anunciados * 2 : 4;
+        if (num <= w) num = w + 1;
+        uint64_t *a = realloc(pss->anunciados, num * sizeof(*a));
+        if (!a) return -1;
+        memset(a + pss->num_anunciados, 0, (num - pss->num_anunciados) * sizeof(*a));
+        pss->anunciados = a;
+        pss->num_anunciados = num;
+    }
+    pss->anunciados[w] |= UINT64_C(1) << (id % 64);
+    return 0;
+}
+
+// Traduce f y, si usa un id que la sesión todavía no conoce, le manda su
+// BIN_USUARIO en lugar del frame (uno por WRITEABLE). Devuelve 0 si f ya se
+// puede escribir, 1 si se escribió una presentación y -1 si hay que cerrar.
+static int anunciar_usuarios(struct per_session_data__chat *pss, struct frame_salida *f) {
+    int traducido = f->binario != NULL;
+    struct frame_binario *fb = frame_binario(f);
+    if (!fb) {
+        log_error("memoria", "Sin memoria para traducir un frame a binario");
+        return -1;
+    }
+    if (!traducido)
+        met_sumar(&metricas[pss->shard].contadores[MET_TRADUCCIONES_BIN], 1);
+    for (int i = 0; i < fb->num_usuarios; i++) {
+        uint32_t id = fb->usuarios[i];
+        if (usuario_anunciado(pss, id)) continue;
+        const char *nombre = usuario_nombre(id);
+        struct bin_mensaje b;
+        memset(&b, 0, sizeof(b));
+        b.tipo = BIN_USUARIO;
+        b.campos = BIN_CAMPO_ID | BIN_CAMPO_CONTENT;
+        b.id = id;
+        b.content.p = nombre;
+        b.content.len = strlen(nombre);
+        // Los nombres internados entran en USUARIO_MAX bytes
+        unsigned char buf[LWS_PRE + BIN_CABECERA + 8 + 4 + USUARIO_MAX];
+        size_t len = bin_tam(&b);
+        if (marcar_anunciado(pss, id) < 0) return -1;
+        bin_codificar(&b, buf + LWS_PRE);
+        int n = lws_write(pss->wsi, buf + LWS_PRE, len, LWS_WRITE_BINARY);
+        if (n < 0) return -1;
+        met_sumar(&metricas[pss->shard].contadores[MET_BYTES_SALIDA], len);
+        lws_callback_on_writable(pss->wsi);
+        return 1;
+    }
+    return 0;
+}
+
+// Copia len bytes de s al final de aux, terminados en '\0', y deja el
+// campo apuntando ahí
+static int campo_copiar(struct campo_json *c, enum tipo_valor tipo, char **aux, char *fin,
+                        const char *s, size_t len) {
+    if ((size_t)(fin - *aux) < len + 1) return -1;
+    memcpy(*aux, s, len);
+    (*aux)[len] = '\0';
+    c->tipo = tipo;
+    c->p = *aux;
+    c->len = len;
+    *aux += len + 1;
+    return 0;
+}
 
-// Lista global de conexiones
-static struct per_session_data__chat *clientes[MAX_CLIENTES] = { NULL };
+static int campo_usuario(struct campo_json *c, const struct bin_usuario *u, char **aux, char *fin) {
+    if (!u->id) return campo_copiar(c, VALOR_CADENA, aux, fin, u->nombre.p, u->nombre.len);
+    const char *nombre = usuario_nombre(u->id);
+    return nombre ? campo_copiar(c, VALOR_CADENA, aux, fin, nombre, strlen(nombre)) : -1;
+}
 
-//------------------------------------------------------------------------------
-// Función para tomar la hora actual en ISO8601 (aproximado) o un formato de tu elección
-//------------------------------------------------------------------------------
-static void get_timestamp(char *buf, size_t buflen) {
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(buf, buflen, "%Y-%m-%d %H:%M:%S", tm_info);
+// Decodifica un mensaje binario de un cliente como lo haría parsear_mensaje
+// con su equivalente JSON. Las cadenas se copian a aux (cap bytes).
+static int parsear_binario(const unsigned char *in, size_t len, struct mensaje_entrante *m,
+                           char *aux, size_t cap) {
+    struct bin_mensaje b;
+    if (bin_decodificar(in, len, &b) < 0 || b.tipo >= BIN_NUM_TIPOS || b.tipo == BIN_USUARIO)
+        return -1;
+    if (b.tipo == BIN_JSON) {
+        if (!(b.campos & BIN_CAMPO_CONTENT) || b.content.len > cap) return -1;
+        memcpy(aux, b.content.p, b.content.len);
+        return parsear_mensaje(aux, b.content.len, m);
+    }
+    memset(m, 0, sizeof(*m));
+    char *p = aux, *fin = aux + cap;
+    const char *tipo = bin_nombres_tipo[b.tipo];
+    if (campo_copiar(&m->type, VALOR_CADENA, &p, fin, tipo, strlen(tipo)) < 0) return -1;
+    if (b.campos & BIN_CAMPO_ID) {
+        char num[24];
+        int n = snprintf(num, sizeof(num), "%" PRIu64, b.id);
+        if (campo_copiar(&m->id, VALOR_OTRO, &p, fin, num, (size_t)n) < 0) return -1;
+    }
+    if ((b.campos & BIN_CAMPO_SENDER) && campo_usuario(&m->sender, &b.sender, &p, fin) < 0)
+        return -1;
+    if ((b.campos & BIN_CAMPO_TARGET) && campo_usuario(&m->target, &b.target, &p, fin) < 0)
+        return -1;
+    if ((b.campos & BIN_CAMPO_ROOM)
+        && campo_copiar(&m->room, VALOR_CADENA, &p, fin, b.room.p, b.room.len) < 0)
+        return -1;
+    if ((b.campos & BIN_CAMPO_CONTENT)
+        && campo_copiar(&m->content, VALOR_CADENA, &p, fin, b.content.p, b.content.len) < 0)
+        return -1;
+    return 0;
 }
 
 //------------------------------------------------------------------------------
-// Añadir cliente a la lista
+// Límites de tasa (token bucket)
+// Cada sesión tiene una cubeta por tipo de mensaje con límite (broadcast,
+// list_users, ...: los que recorren a todos), y cada IP una cubeta para
+// todos sus mensajes y otra para sus conexiones nuevas. Una cubeta es un
+// uint64_t: [ms de la última recarga (32)][fichas en millonésimas (32)].
+// Las de la sesión solo las toca su hilo; las de las IP están en una tabla
+// fija de ranuras atómicas (4 vías por conjunto) que se actualizan con CAS.
+// Ni locks ni memoria en el camino de cada mensaje. Si una IP nueva no
+// tiene lugar, desplaza a otra del conjunto y ambas empiezan con la ráfaga
+// llena: el límite por IP es aproximado bajo colisiones.
 //------------------------------------------------------------------------------
-void registrar_cliente(struct per_session_data__chat *pss) {
-    pthread_mutex_lock(&clientes_mutex);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (clientes[i] == NULL) {
-            clientes[i] = pss;
-            break;
+#define RAFAGA_MAX     4000       // fichas (rafaga * FICHA cabe en 32 bits)
+#define IPS_VIAS       4
+#define LIMITE_IP      31         // bit de 'limitado' para la cubeta de la IP
+
+struct limite_tipo {
+    char tipo[32];
+    struct limite limite;
+};
+
+struct ranura_ip {
+    _Atomic uint64_t clave;       // hash de la IP (0 = libre)
+    _Atomic uint64_t mensajes;
+    _Atomic uint64_t conexiones;
+};
+
+// Límites por sesión; --limite=TIPO:TASA/RAFAGA los cambia o agrega
+static struct limite_tipo limites[LIMITES_MAX] = {
+    { "broadcast",    { 20 * 1000, 40 * FICHA } },
+    { "room_message", { 20 * 1000, 40 * FICHA } },
+    { "list_users",   { 2 * 1000, 5 * FICHA } },
+    { "user_info",    { 5 * 1000, 10 * FICHA } },
+};
+static int num_limites = 4;
+static int8_t ranura_limite[TABLA_TIPOS_MAX];   // tipo -> limites[] (-1 = sin límite)
+static struct ranura_ip ips[IPS_RANURAS];
+
+// "TASA/RAFAGA" (fichas por segundo / fichas) o "0" (sin límite)
+static int parsear_limite(const char *v, struct limite *l) {
+    char *fin;
+    double tasa = strtod(v, &fin);
+    if (fin == v || tasa < 0 || tasa > 1e6) return -1;
+    if (tasa == 0 && *fin == '\0') {
+        l->por_ms = l->rafaga = 0;
+        return 0;
+    }
+    if (*fin != '/') return -1;
+    long rafaga = strtol(fin + 1, &fin, 10);
+    if (*fin != '\0' || rafaga < 1 || rafaga > RAFAGA_MAX || tasa * 1000 < 1) return -1;
+    l->por_ms = (uint32_t)(tasa * 1000 + 0.5);
+    l->rafaga = (uint32_t)rafaga * FICHA;
+    return 0;
+}
+
+// "TIPO:TASA/RAFAGA"
+static int agregar_limite(const char *v) {
+    const char *dp = strchr(v, ':');
+    if (!dp || dp == v || (size_t)(dp - v) >= sizeof(limites[0].tipo)) return -1;
+    struct limite l;
+    if (parsear_limite(dp + 1, &l) < 0) return -1;
+    size_t n = (size_t)(dp - v);
+    int i;
+    for (i = 0; i < num_limites; i++)
+        if (strlen(limites[i].tipo) == n && strncmp(limites[i].tipo, v, n) == 0) break;
+    if (i == LIMITES_MAX) return -1;
+    if (i == num_limites) {
+        memcpy(limites[i].tipo, v, n);
+        limites[i].tipo[n] = '\0';
+        num_limites++;
+    }
+    limites[i].limite = l;
+    return 0;
+}
+
+// Resuelve los nombres de tipo con la tabla de despacho ya armada
+static int limites_iniciar(const struct tabla_tipos *tipos) {
+    memset(ranura_limite, -1, sizeof(ranura_limite));
+    for (int i = 0; i < num_limites; i++) {
+        int t = tabla_tipos_buscar(tipos, limites[i].tipo, strlen(limites[i].tipo));
+        if (t < 0) {
+            log_error("inicio", "--limite: tipo de mensaje desconocido: %s", limites[i].tipo);
+            return -1;
         }
+        ranura_limite[t] = limites[i].limite.por_ms ? (int8_t)i : -1;
     }
-    pthread_mutex_unlock(&clientes_mutex);
+    return 0;
 }
 
-//------------------------------------------------------------------------------
-// Remover cliente de la lista
-//------------------------------------------------------------------------------
-void eliminar_cliente(struct per_session_data__chat *pss) {
-    pthread_mutex_lock(&clientes_mutex);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (clientes[i] == pss) {
-            clientes[i] = NULL;
-            break;
+static uint32_t ahora_ms(void) {
+    return (uint32_t)(lws_now_usecs() / LWS_US_PER_MS);
+}
+
+// Recarga la cubeta hasta 'ahora' y saca una ficha. Devuelve el nuevo
+// estado; *espera queda en 0 si había ficha o en los ms que faltan.
+static uint64_t cubeta_tomar(uint64_t estado, uint32_t ahora, const struct limite *l,
+                             uint32_t *espera) {
+    uint32_t antes = (uint32_t)(estado >> 32);
+    uint64_t fichas = (uint32_t)estado;
+    if (!estado) {
+        fichas = l->rafaga;                    // cubeta nueva: llena
+    } else if ((int32_t)(ahora - antes) > 0) {
+        fichas += (uint64_t)(ahora - antes) * l->por_ms;
+        if (fichas > l->rafaga) fichas = l->rafaga;
+    } else {
+        ahora = antes;                         // otro hilo ya recargó más tarde
+    }
+    if (fichas >= FICHA) {
+        fichas -= FICHA;
+        *espera = 0;
+    } else {
+        *espera = (uint32_t)((FICHA - fichas + l->por_ms - 1) / l->por_ms);
+    }
+    return (uint64_t)ahora << 32 | fichas;
+}
+
+static uint32_t cubeta_tomar_atomica(_Atomic uint64_t *c, uint32_t ahora,
+                                     const struct limite *l) {
+    uint64_t viejo = atomic_load_explicit(c, memory_order_relaxed), nuevo;
+    uint32_t espera;
+    do {
+        nuevo = cubeta_tomar(viejo, ahora, l, &espera);
+    } while (!atomic_compare_exchange_weak_explicit(c, &viejo, nuevo, memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return espera;
+}
+
+// Ranura de la IP, tomando una libre o desplazando a otra del conjunto
+static struct ranura_ip *buscar_ranura_ip(const char *ip) {
+    uint64_t h = 14695981039346656037ull;
+    for (const char *c = ip; *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= 1099511628211ull;
+    }
+    h |= 1;
+    struct ranura_ip *conjunto = &ips[h & (IPS_RANURAS - 1) & ~(uint64_t)(IPS_VIAS - 1)];
+    for (int v = 0; v < IPS_VIAS; v++) {
+        uint64_t k = atomic_load_explicit(&conjunto[v].clave, memory_order_relaxed);
+        if (k == h) return &conjunto[v];
+        if (k == 0 && atomic_compare_exchange_strong_explicit(&conjunto[v].clave, &k, h,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed))
+            return &conjunto[v];
+        if (k == h) return &conjunto[v];       // la tomó otro hilo para la misma IP
+    }
+    struct ranura_ip *r = &conjunto[(h >> 32) % IPS_VIAS];
+    atomic_store_explicit(&r->clave, h, memory_order_relaxed);
+    atomic_store_explicit(&r->mensajes, 0, memory_order_relaxed);
+    atomic_store_explicit(&r->conexiones, 0, memory_order_relaxed);
+    return r;
+}
+
+// 1 si la IP es de loopback (127.0.0.0/8, ::1 o mapeada en IPv6). Lo que
+// corre en la misma máquina (client --bench, un proxy) no pasa por las
+// cubetas por IP: compartiría una sola entre todas sus conexiones.
+static int ip_local(const char *ip) {
+    if (strncmp(ip, "::ffff:", 7) == 0) ip += 7;
+    return strncmp(ip, "127.", 4) == 0 || strcmp(ip, "::1") == 0;
+}
+
+// Conexión nueva desde la IP de pss: 1 si entra en cfg.conexiones_ip
+static int conexion_permitida(const struct per_session_data__chat *pss) {
+    if (!cfg.conexiones_ip.por_ms || pss->ip_local) return 1;
+    return cubeta_tomar_atomica(&buscar_ranura_ip(pss->ip)->conexiones, ahora_ms(),
+                                &cfg.conexiones_ip) == 0;
+}
+
+// Saca una ficha de la cubeta del tipo (si tiene límite) y de la de la IP.
+// La de la sesión se guarda sólo si la IP también tenía ficha: un mensaje
+// rechazado no gasta ninguna. Si falta alguna, responde "rate_limited" (una
+// sola vez hasta que vuelva a pasar un mensaje por esa cubeta) o cierra la
+// sesión, según cfg.limite_accion.
+// Devuelve 1 si el mensaje puede seguir, 0 si se descarta y -1 si hay que
+// cerrar la conexión.
+static int limites_permiten(struct per_session_data__chat *pss, int tipo, const char *ts) {
+    int r = tipo >= 0 ? ranura_limite[tipo] : -1;
+    int por_ip = cfg.limite_ip.por_ms && !pss->ip_local;
+    if (r < 0 && !por_ip) return 1;
+    uint32_t ahora = ahora_ms(), espera = 0;
+    int bit = r;
+    uint64_t cubeta = r >= 0 ? cubeta_tomar(pss->cubetas[r], ahora, &limites[r].limite,
+                                            &espera)
+                             : 0;
+    if (!espera && por_ip) {
+        if (!pss->ranura_ip || atomic_load_explicit(&pss->ranura_ip->clave,
+                                                    memory_order_relaxed) != pss->clave_ip) {
+            pss->ranura_ip = buscar_ranura_ip(pss->ip);
+            pss->clave_ip = atomic_load_explicit(&pss->ranura_ip->clave, memory_order_relaxed);
         }
+        espera = cubeta_tomar_atomica(&pss->ranura_ip->mensajes, ahora, &cfg.limite_ip);
+        bit = LIMITE_IP;
+    }
+    // Si la IP no tenía ficha, la de la sesión no se gasta
+    if (r >= 0 && !(bit == LIMITE_IP && espera)) pss->cubetas[r] = cubeta;
+    if (!espera) {
+        pss->limitado &= ~((r >= 0 ? 1u << r : 0) | 1u << LIMITE_IP);
+        return 1;
+    }
+
+    met_sumar(&metricas[pss->shard].contadores[MET_LIMITADOS], 1);
+    if (cfg.limite_accion == LIMITE_DESCONECTAR) {
+        log_aviso("limite", "Sesión cerrada por exceso de mensajes (%s)",
+                  pss->username ? pss->username : pss->ip);
+        lws_close_reason(pss->wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, NULL, 0);
+        return -1;
+    }
+    if (!(pss->limitado & 1u << bit)) {
+        pss->limitado |= 1u << bit;
+        char motivo[96];
+        snprintf(motivo, sizeof(motivo), "%s: demasiados mensajes, reintentar en %u ms",
+                 bit == LIMITE_IP ? "ip" : limites[r].tipo, espera);
+        enviar_a_cliente(pss, json_respuesta_servidor("rate_limited", motivo, ts));
     }
-    pthread_mutex_unlock(&clientes_mutex);
+    return 0;
 }
 
 //------------------------------------------------------------------------------
-// Buscar un cliente por nombre
+// Manejadores de mensajes
+// Cada tipo de mensaje registra su manejador en la tabla de despacho (hash
+// perfecto sobre el campo "type"). Para agregar un tipo nuevo basta con
+// escribir su manejador y registrarlo en iniciar_manejadores().
 //------------------------------------------------------------------------------
-struct per_session_data__chat *buscar_destinatario(const char *nombre) {
-    pthread_mutex_lock(&clientes_mutex);
-    struct per_session_data__chat *found = NULL;
+struct contexto_mensaje {
+    struct lws *wsi;
+    struct per_session_data__chat *pss;
+    struct mensaje_entrante *msg;
+    const char *sender;
+    const char *target;
+    const char *content;
+    char ts[64];              // timestamp de la respuesta del servidor
+};
 
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (clientes[i]
-            && clientes[i]->username
-            && strcmp(clientes[i]->username, nombre) == 0) {
-            found = clientes[i];
-            break;
-        }
+typedef void (*manejador_mensaje)(struct contexto_mensaje *cm);
+
+static struct tabla_tipos tipos_mensaje;
+static manejador_mensaje manejadores[TABLA_TIPOS_MAX];
+
+// Registra (o reemplaza) el manejador de un tipo de mensaje.
+// Solo se llama al arrancar, antes de crear los hilos de servicio.
+static int registrar_manejador(const char *tipo, manejador_mensaje fn) {
+    int i = tabla_tipos_agregar(&tipos_mensaje, tipo);
+    if (i < 0) {
+        log_error("inicio", "No se pudo registrar el tipo de mensaje %s", tipo);
+        return -1;
+    }
+    manejadores[i] = fn;
+    return 0;
+}
+
+static void manejar_register(struct contexto_mensaje *cm) {
+    struct per_session_data__chat *pss = cm->pss;
+    // El cliente manda {type:"register",sender:"<user>",content:null|"<capacidades>"}
+    int r = asignar_nombre(pss, cm->sender ? cm->sender : "anon");
+    if (r < 0) {
+        // Nombre ocupado por otra sesión, demasiado largo (o sin memoria): rechazar
+        enviar_a_cliente(pss, json_respuesta_servidor("register_error",
+            r == -1 ? "Nombre de usuario en uso"
+            : r == -3 ? "Nombre de usuario demasiado largo" : "Error interno", cm->ts));
+        return;
+    }
+    pss->ficha->est = ESTADO_ACTIVO;
+    registrar_actividad(pss);
+    usuario_internar(pss->username);
+
+    // content opcional: capacidades separadas por coma, ej. "status_batch"
+    unsigned caps = 0;
+    for (const char *c = cm->content; c && *c; ) {
+        size_t n = strcspn(c, ",");
+        if (n == sizeof("status_batch") - 1 && strncmp(c, "status_batch", n) == 0)
+            caps |= CAP_STATUS_BATCH;
+        c += n + (c[n] == ',');
     }
+    if ((caps ^ pss->capacidades) & CAP_STATUS_BATCH) {
+        atomic_fetch_add(caps & CAP_STATUS_BATCH ? &sesiones_con_lotes : &sesiones_sin_lotes, 1);
+        atomic_fetch_sub(caps & CAP_STATUS_BATCH ? &sesiones_sin_lotes : &sesiones_con_lotes, 1);
+    }
+    pss->capacidades = caps;
+
+    log_info("registro", "Usuario registrado: %s", pss->username);
 
-    pthread_mutex_unlock(&clientes_mutex); 
-    return found;
+    // Respuesta "register_success" con userList
+    enviar_a_cliente(pss, json_register_success(cm->ts));
+
+    // Después, los últimos broadcasts y los privados que le llegaron sin
+    // conexión; drenar_cola los va encolando a medida que hay lugar
+    struct manija_sesion yo = { pss->ficha, pss->id, pss->shard };
+    free(pss->reproducir);
+    pss->reproducir = historial_reproduccion(pss->username, &yo, &pss->num_reproducir);
+    pss->pos_reproducir = 0;
+    if (pss->reproducir) lws_callback_on_writable(pss->wsi);
 }
 
+static void manejar_broadcast(struct contexto_mensaje *cm) {
+    // Mensaje general a todos
+    // {type:"broadcast", sender:"...", content:"...", timestamp:"..."}
+    registrar_actividad(cm->pss);
+    struct frame_salida *f = json_mensaje_chat("broadcast",
+                                               cm->sender ? cm->sender : "anon",
+                                               cm->content ? cm->content : "",
+                                               cm->ts);
+    if (f) historial_agregar(REG_BROADCAST, NULL, f, NULL);
+    // Enviar a todos menos al emisor
+    enviar_broadcast(f, cm->pss);
+}
 
-//------------------------------------------------------------------------------
-// Convertir enum estado_usuario a string
-//------------------------------------------------------------------------------
-static const char* estado_to_string(enum estado_usuario e) {
-    switch(e) {
-        case ESTADO_ACTIVO:   return "ACTIVO";
-        case ESTADO_OCUPADO:  return "OCUPADO";
-        case ESTADO_INACTIVO: return "INACTIVO";
-        default: return "ACTIVO";
+// Sala del mensaje (campo "room"); NULL si falta o el nombre no sirve
+static const char *nombre_sala(struct contexto_mensaje *cm) {
+    const char *sala = campo_str(&cm->msg->room);
+    if (!sala || !*sala || strlen(sala) > SALA_NOMBRE_MAX) {
+        enviar_a_cliente(cm->pss, json_sala("room_error", sala ? sala : "", "server",
+                                            "Nombre de sala inválido", -1, cm->ts));
+        return NULL;
     }
+    return sala;
 }
 
-//------------------------------------------------------------------------------
-// Enviar un JSON (string) a un cliente
-//------------------------------------------------------------------------------
-static void enviar_a_cliente(struct lws *wsi, const char *json_msg) {
-    unsigned char buffer[LWS_PRE + MAX_PAYLOAD_SIZE];
-    memset(buffer, 0, sizeof(buffer));
-    size_t len = strlen(json_msg);
-    memcpy(&buffer[LWS_PRE], json_msg, len);
-    lws_write(wsi, &buffer[LWS_PRE], len, LWS_WRITE_TEXT);
+static void manejar_join(struct contexto_mensaje *cm) {
+    // {type:"join", sender:"...", room:"<sala>"}
+    struct per_session_data__chat *pss = cm->pss;
+    const char *nombre = nombre_sala(cm);
+    if (!nombre) return;
+    if (strcmp(nombre, SALA_LOBBY) == 0) {
+        // Todos están en el lobby
+        enviar_a_cliente(pss, json_sala("room_joined", nombre, "server", "Unido a la sala",
+                                        -1, cm->ts));
+        return;
+    }
+    struct sala *s = pss->username ? sala_obtener(nombre, 1) : NULL;
+    if (!s || sala_unirse(s, pss) < 0) {
+        enviar_a_cliente(pss, json_sala("room_error", nombre, "server",
+            !pss->username ? "Registrate antes de unirte a una sala"
+                           : "No se pudo unir a la sala", -1, cm->ts));
+        return;
+    }
+    registrar_actividad(pss);
+    enviar_a_cliente(pss, json_sala("room_joined", nombre, "server", "Unido a la sala",
+                                    (long)atomic_load(&s->total), cm->ts));
+}
+
+static void manejar_leave(struct contexto_mensaje *cm) {
+    // {type:"leave", sender:"...", room:"<sala>"}
+    const char *nombre = nombre_sala(cm);
+    if (!nombre) return;
+    struct sala *s = sala_obtener(nombre, 0);
+    if (!s || sala_salir(s, cm->pss) < 0) {
+        enviar_a_cliente(cm->pss, json_sala("room_error", nombre, "server",
+                                            "No estás en la sala", -1, cm->ts));
+        return;
+    }
+    enviar_a_cliente(cm->pss, json_sala("room_left", nombre, "server", "Saliste de la sala",
+                                        (long)atomic_load(&s->total), cm->ts));
+}
+
+static void manejar_room_message(struct contexto_mensaje *cm) {
+    // {type:"room_message", sender:"...", room:"<sala>", content:"..."}
+    // Solo para miembros; al lobby es un broadcast de siempre
+    const char *nombre = nombre_sala(cm);
+    if (!nombre) return;
+    if (strcmp(nombre, SALA_LOBBY) == 0) {
+        manejar_broadcast(cm);
+        return;
+    }
+    struct per_session_data__chat *pss = cm->pss;
+    struct sala *s = sala_obtener(nombre, 0);
+    if (!s || sala_membresia(pss, s) < 0) {
+        enviar_a_cliente(pss, json_sala("room_error", nombre, "server",
+                                        "No estás en la sala", -1, cm->ts));
+        return;
+    }
+    registrar_actividad(pss);
+    enviar_a_sala(s, json_sala("room_message", nombre, pss->username,
+                               cm->content ? cm->content : "", -1, cm->ts),
+                  pss->id);
+}
+
+static void manejar_private(struct contexto_mensaje *cm) {
+    // {type:"private", sender:"...", target:"...", content:"...", timestamp:"..."}
+    if (!cm->target) {
+        // No se dio target
+        // Podríamos mandar un error
+        return;
+    }
+    registrar_actividad(cm->pss);
+    uint64_t id = atomic_fetch_add(&siguiente_mensaje_id, 1);
+    struct frame_salida *f = json_privado(id, cm->sender ? cm->sender : "anon",
+                                          cm->content ? cm->content : "", cm->ts);
+    if (!f) return;
+    // enviar_a_usuario se queda con una referencia; la otra es para el buzón.
+    // Lo entregado en vivo no va al historial: no hay índice por
+    // conversación con el que leerlo después.
+    frame_tomar(f);
+    const char *estado = "enviado";
+    if (enviar_a_usuario(cm->target, f) < 0) {
+        // Sin conexión: queda en su buzón hasta que se registre
+        int r = buzon_guardar(cm->target, f);
+        estado = r == 0 ? "en_espera" : "rechazado";
+        if (r < 0)
+            log_debug("privado", "Privado para %s rechazado (%s)", cm->target,
+                      r == -2 ? "buzón lleno" : "sin historial");
+    }
+    frame_soltar(f);
+    // El emisor sabe enseguida qué pasó; "entregado" llega con el ack del destino
+    enviar_a_cliente(cm->pss, json_ack(id, "server", cm->target, estado, cm->ts));
+}
+
+static void manejar_ack(struct contexto_mensaje *cm) {
+    // {type:"ack", sender:"...", target:"<emisor del privado>", id:N}
+    // Se reenvía al emisor como "entregado"; si no está conectado, a su buzón
+    const char *id = campo_str(&cm->msg->id);
+    struct per_session_data__chat *pss = cm->pss;
+    if (!cm->target || !id || !pss->username) return;
+    char *fin;
+    uint64_t n = strtoull(id, &fin, 10);
+    if (fin == id) return;
+    struct frame_salida *f = json_ack(n, pss->username, NULL, "entregado", cm->ts);
+    if (!f) return;
+    frame_tomar(f);
+    if (enviar_a_usuario(cm->target, f) < 0) buzon_guardar(cm->target, f);
+    frame_soltar(f);
+}
+
+static void manejar_list_users(struct contexto_mensaje *cm) {
+    // {type:"list_users", sender:"..."}  => lista completa
+    // content: {"since_version": N} (o solo N, número o cadena) => delta
+    // desde la versión N
+    const struct campo_json *c = &cm->msg->content;
+    if (c->tipo == VALOR_CADENA || c->tipo == VALOR_OTRO) {
+        struct lector_json l = { c->p, c->p + c->len };
+        uint64_t desde;
+        if ((c->tipo == VALOR_CADENA || *l.p != '{'
+             || json_buscar_miembro(&l, "since_version") == 0)
+            && json_leer_natural(&l, &desde) == 0) {
+            struct frame_salida *f = json_list_users_delta(desde, cm->ts);
+            if (f) {
+                enviar_a_cliente(cm->pss, f);
+                return;
+            }
+        }
+    }
+    enviar_a_cliente(cm->pss, json_list_users(cm->ts));
+}
+
+static void manejar_user_info(struct contexto_mensaje *cm) {
+    // {type:"user_info", sender:"...", target:"usuario_objetivo"}
+    if (!cm->target) return;
+    // Copiar los datos de la ficha dentro de una época: la sesión puede ser
+    // de otro shard y cerrarse mientras tanto
+    char info_ip[64];
+    enum estado_usuario info_est = ESTADO_ACTIVO;
+    size_t en_cola = 0, descartados = 0;
+    epoca_entrar();
+    struct vinculo_nombre *v = indice_buscar(cm->target, hash_nombre(cm->target));
+    int encontrado = v != NULL;
+    if (v) {
+        struct ficha_sesion *ficha = v->sesion.ficha;
+        memcpy(info_ip, ficha->ip, sizeof(info_ip));
+        info_est = atomic_load_explicit(&ficha->est, memory_order_relaxed);
+        en_cola = atomic_load_explicit(&ficha->en_cola, memory_order_relaxed);
+        descartados = atomic_load_explicit(&ficha->descartados, memory_order_relaxed);
+        encontrado = manija_valida(&v->sesion);
+    }
+    epoca_salir();
+    if (encontrado) {
+        // content: {"ip":"...", "status":"...", "queue":N, "dropped":N}
+        enviar_a_cliente(cm->pss, json_user_info(cm->target, info_ip,
+                                                 estado_to_string(info_est),
+                                                 en_cola, descartados, cm->ts));
+    }
+}
+
+static void manejar_change_status(struct contexto_mensaje *cm) {
+    struct per_session_data__chat *pss = cm->pss;
+    // {type:"change_status", sender:"...", content:"<nuevo_estado>"}
+    // Ej: content="OCUPADO"
+    if (cm->content) {
+        // Actualizar pss->est de acuerdo al contenido
+        if (strcmp(cm->content, "ACTIVO") == 0) {
+            pss->ficha->est = ESTADO_ACTIVO;
+        } else if (strcmp(cm->content, "OCUPADO") == 0) {
+            pss->ficha->est = ESTADO_OCUPADO;
+        } else {
+            pss->ficha->est = ESTADO_INACTIVO;
+        }
+    }
+    // Avisar a los demás ("status_update" o "status_batch")
+    publicar_estado(pss->username ? pss->username : "anon", pss->ficha->est, pss->id, cm->ts);
+}
+
+static void manejar_disconnect(struct contexto_mensaje *cm) {
+    struct per_session_data__chat *pss = cm->pss;
+    // {type:"disconnect", sender:"...", content:"Cierre de sesión"}
+    // Responder user_disconnected
+    enviar_broadcast(json_user_disconnected(pss->username ? pss->username : "anon",
+                                            cm->ts),
+                     pss);
+
+    // Eliminar al usuario
+    log_info("desconexion", "El usuario %s se desconectó", pss->username);
+    liberar_nombre(pss);
+
+    // O marcarlo inactivo, pero según el protocolo cierra
+    lws_close_reason(cm->wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+    lws_set_timeout(cm->wsi, NO_PENDING_TIMEOUT, 1);
+}
+
+static int iniciar_manejadores(void) {
+    tabla_tipos_iniciar(&tipos_mensaje);
+    if (registrar_manejador("register", manejar_register) < 0
+        || registrar_manejador("broadcast", manejar_broadcast) < 0
+        || registrar_manejador("private", manejar_private) < 0
+        || registrar_manejador("ack", manejar_ack) < 0
+        || registrar_manejador("join", manejar_join) < 0
+        || registrar_manejador("leave", manejar_leave) < 0
+        || registrar_manejador("room_message", manejar_room_message) < 0
+        || registrar_manejador("list_users", manejar_list_users) < 0
+        || registrar_manejador("user_info", manejar_user_info) < 0
+        || registrar_manejador("change_status", manejar_change_status) < 0
+        || registrar_manejador("disconnect", manejar_disconnect) < 0)
+        return -1;
+    return 0;
+}
+
+// Despacha un mensaje ya parseado; los tipos desconocidos reciben un error.
+// Devuelve -1 si hay que cerrar la conexión.
+static int despachar_mensaje(struct contexto_mensaje *cm) {
+    const struct campo_json *type = &cm->msg->type;
+    int i = type->tipo == VALOR_CADENA
+          ? tabla_tipos_buscar(&tipos_mensaje, type->p, type->len) : -1;
+    struct metricas_hilo *met = &metricas[cm->pss->shard];
+    int r = limites_permiten(cm->pss, i, cm->ts);
+    if (r <= 0) return r;
+    if (i >= 0) {
+        met_sumar(&met->por_tipo[i], 1);
+        manejadores[i](cm);
+        return 0;
+    }
+    met_sumar(&met->contadores[MET_TIPO_DESCONOCIDO], 1);
+    char motivo[128];
+    if (type->tipo == VALOR_CADENA) {
+        snprintf(motivo, sizeof(motivo), "Tipo de mensaje desconocido: %.*s",
+                 (int)(type->len > 64 ? 64 : type->len), type->p);
+    } else {
+        snprintf(motivo, sizeof(motivo), "Mensaje sin tipo");
+    }
+    enviar_a_cliente(cm->pss, json_respuesta_servidor("error", motivo, cm->ts));
+    return 0;
 }
 
-static void enviar_broadcast(const char *json_msg, struct lws *excluir_wsi) {
-    pthread_mutex_lock(&clientes_mutex);
-    for (int i = 0; i < MAX_CLIENTES; i++) {
-        if (clientes[i] && clientes[i]->wsi && clientes[i]->wsi != excluir_wsi) {
-            enviar_a_cliente(clientes[i]->wsi, json_msg);
+// Parsea y despacha un mensaje completo. El JSON se parsea en su lugar (sin
+// reservar memoria); lo binario se decodifica a aux, en la arena del shard,
+// que se reinicia al terminar. Devuelve -1 si hay que cerrar la conexión.
+static int procesar_mensaje(struct lws *wsi, struct per_session_data__chat *pss,
+                            void *in, size_t len) {
+    log_debug_muestreado("mensaje", "Mensaje recibido: %.*s", (int)len, (char *)in);
+    struct metricas_hilo *met = &metricas[pss->shard];
+    struct arena *arena = &shards[pss->shard].arena;
+    struct mensaje_entrante msg_in;
+    char *aux = NULL;
+    size_t cap_aux = 0;
+    if (pss->binario) {
+        // Cadenas del mensaje más los nombres de los ids que trae
+        cap_aux = 2 * len + MAX_PAYLOAD_SIZE;
+        if (!(aux = arena_tomar(arena, cap_aux))) {
+            log_error("memoria", "Sin memoria para decodificar un mensaje binario");
+            arena_reiniciar(arena);
+            return -1;
         }
     }
-    pthread_mutex_unlock(&clientes_mutex);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int r = pss->binario ? parsear_binario(in, len, &msg_in, aux, cap_aux)
+                         : parsear_mensaje((char *)in, len, &msg_in);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    hist_registrar(&met->parseo_ns,
+                   (uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000000LL
+                              + (t1.tv_nsec - t0.tv_nsec)));
+    if (r < 0) {
+        met_sumar(&met->contadores[MET_INVALIDOS], 1);
+        r = 0;
+        goto fin;
+    }
+
+    struct contexto_mensaje cm;
+    cm.wsi = wsi;
+    cm.pss = pss;
+    cm.msg = &msg_in;
+    cm.sender = campo_str(&msg_in.sender);
+    cm.target = campo_str(&msg_in.target);
+    cm.content = campo_str(&msg_in.content);
+    // Para la respuesta del servidor
+    get_timestamp(cm.ts, sizeof(cm.ts));
+
+    r = despachar_mensaje(&cm);
+fin:
+    arena_reiniciar(arena);
+    return r;
+}
+
+// Mensaje de más de cfg.mensaje_max: se corta la conexión (1009)
+static int mensaje_demasiado_grande(struct per_session_data__chat *pss) {
+    met_sumar(&metricas[pss->shard].contadores[MET_DEMASIADO_GRANDES], 1);
+    log_aviso("mensaje", "Mensaje de más de %zu bytes (%s)", cfg.mensaje_max,
+              pss->username ? pss->username : pss->ip);
+    lws_close_reason(pss->wsi, LWS_CLOSE_STATUS_MESSAGE_TOO_LARGE, NULL, 0);
+    return -1;
 }
+
 //------------------------------------------------------------------------------
 // Callback principal
 //------------------------------------------------------------------------------
@@ -128,269 +4838,142 @@ static int callback_chat(struct lws *wsi, enum lws_callback_reasons reason,
 
     switch (reason) {
     case LWS_CALLBACK_ESTABLISHED: {
-        printf("Conexión establecida\n");
         // Iniciar la estructura
         pss->username = NULL;
         pss->ip[0] = '\0';
-        pss->est = ESTADO_ACTIVO;
+        pss->ficha = NULL;        // registrar_cliente le da una
+        pss->vinculo = NULL;
         pss->wsi = wsi;
+        pss->desbordado = 0;
+        pss->alta = 0;
+        timer_iniciar(&pss->timer_inactividad);
+        pss->id = atomic_fetch_add(&siguiente_id, 1);
+        pss->shard = lws_get_tsi(wsi);
+        pss->capacidades = 0;
+        pss->binario = strcmp(lws_get_protocol(wsi)->name, PROTOCOLO_BIN) == 0;
+        // El deflate compartido comprime el JSON: no aplica a las binarias
+        pss->deflate_ventana = pss->binario ? 0 : ventana_compartida(wsi);
+        pss->anunciados = NULL;
+        pss->num_anunciados = 0;
+        pss->reproducir = NULL;
+        pss->num_reproducir = pss->pos_reproducir = 0;
+        pss->salas = NULL;
+        pss->num_salas = pss->cap_salas = 0;
+        memset(pss->cubetas, 0, sizeof(pss->cubetas));
+        pss->limitado = 0;
+        pss->ranura_ip = NULL;
+        pss->clave_ip = 0;
+        pss->ip_local = 0;
+        pss->entrada = NULL;
+        pss->enviando = NULL;
+        pss->enviado = 0;
+        if (cola_iniciar(&pss->cola, cfg.cola_max) < 0) {
+            log_error("memoria", "Sin memoria para la cola de salida");
+            return -1;
+        }
 
         // Extraer la IP del cliente (si la versión de libwebsockets lo soporta)
         char ip_buf[64];
         if (lws_get_peer_simple(wsi, ip_buf, sizeof(ip_buf))) {
             strncpy(pss->ip, ip_buf, sizeof(pss->ip) - 1);
             pss->ip[sizeof(pss->ip)-1] = '\0';
-            printf("IP del cliente: %s\n", pss->ip);
+        }
+        pss->ip_local = ip_local(pss->ip);
+        if (!conexion_permitida(pss)) {
+            met_sumar(&metricas[pss->shard].contadores[MET_CONEXIONES_RECHAZADAS], 1);
+            log_aviso("limite", "Conexión rechazada: demasiadas conexiones desde %s", pss->ip);
+            cola_liberar(&pss->cola);
+            return -1;
+        }
+        log_info("conexion", "Conexión establecida (IP %s)", pss->ip);
+        if (cfg.deflate) {
+            // Solo aplica si se negoció permessage-deflate; lws inicia zlib
+            // con el primer mensaje, así que todavía toma estos valores
+            char v[8];
+            snprintf(v, sizeof(v), "%d", cfg.deflate_nivel);
+            lws_set_extension_option(wsi, "permessage-deflate", "compression_level", v);
+            snprintf(v, sizeof(v), "%d", cfg.deflate_memoria);
+            lws_set_extension_option(wsi, "permessage-deflate", "mem_level", v);
         }
 
-        registrar_cliente(pss);
+        if (shard_agregar(&shards[pss->shard], pss) < 0) {
+            log_error("memoria", "Sin memoria para registrar la sesión");
+            cola_liberar(&pss->cola);
+            return -1;
+        }
+        if (registrar_cliente(pss) < 0) {
+            log_error("memoria", "Sin memoria para registrar la sesión");
+            shard_quitar(&shards[pss->shard], pss);
+            cola_liberar(&pss->cola);
+            return -1;
+        }
+        atomic_fetch_add(&sesiones_sin_lotes, 1);
+        met_ajustar(&metricas[pss->shard].sesiones, 1);
+        pss->alta = 1;
         break;
     }
 
-    case LWS_CALLBACK_RECEIVE:
-        if (!in || len == 0) break;
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+        return drenar_cola(pss);
 
-        printf("Mensaje recibido: %.*s\n", (int)len, (char *)in);
-        {
-            // Parsear el JSON
-            struct json_object *parsed = json_tokener_parse((char *)in);
-            if (!parsed) break;
-
-            // Extraer campos: type, sender, target, content, timestamp
-            struct json_object *jtype, *jsender, *jtarget, *jcontent, *jtstamp;
-            json_object_object_get_ex(parsed, "type", &jtype);
-            json_object_object_get_ex(parsed, "sender", &jsender);
-            json_object_object_get_ex(parsed, "target", &jtarget);
-            json_object_object_get_ex(parsed, "content", &jcontent);
-            json_object_object_get_ex(parsed, "timestamp", &jtstamp);
-
-            const char *type_str     = jtype    ? json_object_get_string(jtype)    : NULL;
-            const char *sender_str   = jsender  ? json_object_get_string(jsender)  : NULL;
-            const char *target_str   = jtarget  ? json_object_get_string(jtarget)  : NULL;
-            const char *content_str  = jcontent ? json_object_get_string(jcontent) : NULL;
-
-            // Para la respuesta del servidor
-            char out_ts[64];
-            get_timestamp(out_ts, sizeof(out_ts));
-
-            if (type_str && strcmp(type_str, "register") == 0) {
-                // El cliente manda {type:"register",sender:"<user>",content:null}
-                if (pss->username) free(pss->username);
-                pss->username = strdup(sender_str ? sender_str : "anon");
-                pss->est = ESTADO_ACTIVO;
-                pss->last_activity = time(NULL);  
-
-                printf("Usuario registrado: %s\n", pss->username);
-
-                // Respuesta "register_success" con userList (opcional)
-                struct json_object *jresp = json_object_new_object();
-                json_object_object_add(jresp, "type",
-                    json_object_new_string("register_success"));
-                json_object_object_add(jresp, "sender",
-                    json_object_new_string("server"));
-                json_object_object_add(jresp, "content",
-                    json_object_new_string("Registro exitoso"));
-                // Armar un array con la lista de usuarios
-                struct json_object *jarr = json_object_new_array();
-                for (int i = 0; i < MAX_CLIENTES; i++) {
-                    if (clientes[i] && clientes[i]->username) {
-                        json_object_array_add(jarr,
-                            json_object_new_string(clientes[i]->username));
-                    }
-                }
-                json_object_object_add(jresp, "userList", jarr);
-                json_object_object_add(jresp, "timestamp",
-                    json_object_new_string(out_ts));
-
-                const char *resp_str = json_object_to_json_string(jresp);
-                enviar_a_cliente(wsi, resp_str);
-                json_object_put(jresp);
-            }
-            else if (type_str && strcmp(type_str, "broadcast") == 0) {
-                // Mensaje general a todos
-                // {type:"broadcast", sender:"...", content:"...", timestamp:"..."}
-                pss->last_activity = time(NULL);
-                // Armar JSON de broadcast
-                struct json_object *jresp = json_object_new_object();
-                json_object_object_add(jresp, "type",
-                    json_object_new_string("broadcast"));
-                json_object_object_add(jresp, "sender",
-                    json_object_new_string(sender_str ? sender_str : "anon"));
-                json_object_object_add(jresp, "content",
-                    json_object_new_string(content_str ? content_str : ""));
-                json_object_object_add(jresp, "timestamp",
-                    json_object_new_string(out_ts));
-
-                const char *broad_str = json_object_to_json_string(jresp);
-
-                // Enviar a todos menos al emisor
-                for (int i = 0; i < MAX_CLIENTES; i++) {
-                    if (clientes[i] && clientes[i]->wsi != wsi) {
-                        enviar_a_cliente(clientes[i]->wsi, broad_str);
-                    }
-                }
-                json_object_put(jresp);
-            }
-            else if (type_str && strcmp(type_str, "private") == 0) {
-                // {type:"private", sender:"...", target:"...", content:"...", timestamp:"..."}
-                if (!target_str) {
-                    // No se dio target
-                    // Podríamos mandar un error
-                    break;
-                }
-                pss->last_activity = time(NULL);
-                struct per_session_data__chat *dest = buscar_destinatario(target_str);
-                if (dest && dest->wsi) {
-                    // Armar JSON
-                    struct json_object *jresp = json_object_new_object();
-                    json_object_object_add(jresp, "type",
-                        json_object_new_string("private"));
-                    json_object_object_add(jresp, "sender",
-                        json_object_new_string(sender_str ? sender_str : "anon"));
-                    json_object_object_add(jresp, "content",
-                        json_object_new_string(content_str ? content_str : ""));
-                    json_object_object_add(jresp, "timestamp",
-                        json_object_new_string(out_ts));
-
-                    const char *priv_str = json_object_to_json_string(jresp);
-                    enviar_a_cliente(dest->wsi, priv_str);
-                    json_object_put(jresp);
-                }
-                else {
-                    printf("Usuario destino no encontrado: %s\n", target_str);
-                    // Podrías mandar un mensaje de error al emisor
-                }
-            }
-            else if (type_str && strcmp(type_str, "list_users") == 0) {
-                // {type:"list_users", sender:"..."}
-                struct json_object *jresp = json_object_new_object();
-                json_object_object_add(jresp, "type",
-                    json_object_new_string("list_users_response"));
-                json_object_object_add(jresp, "sender",
-                    json_object_new_string("server"));
-            
-                // Crear un array de strings con los nombres de usuario
-                struct json_object *jarr = json_object_new_array();
-            
-                pthread_mutex_lock(&clientes_mutex); // Proteger acceso a clientes[]
-                for (int i = 0; i < MAX_CLIENTES; i++) {
-                    if (clientes[i] && clientes[i]->username) {
-                        json_object_array_add(jarr,
-                            json_object_new_string(clientes[i]->username));
-                    }
-                }
-                pthread_mutex_unlock(&clientes_mutex);
-            
-                json_object_object_add(jresp, "content", jarr);
-            
-                // Agregar timestamp
-                char out_ts[64];
-                get_timestamp(out_ts, sizeof(out_ts));
-                json_object_object_add(jresp, "timestamp",
-                    json_object_new_string(out_ts));
-            
-                // Enviar al cliente
-                const char *resp_str = json_object_to_json_string(jresp);
-                enviar_a_cliente(wsi, resp_str);
-                json_object_put(jresp);
-            }
-            
-            else if (type_str && strcmp(type_str, "user_info") == 0) {
-                // {type:"user_info", sender:"...", target:"usuario_objetivo"}
-                if (!target_str) break;
-                struct per_session_data__chat *info_usr = buscar_destinatario(target_str);
-                if (info_usr) {
-                    struct json_object *jresp = json_object_new_object();
-                    json_object_object_add(jresp, "type",
-                        json_object_new_string("user_info_response"));
-                    json_object_object_add(jresp, "sender",
-                        json_object_new_string("server"));
-                    json_object_object_add(jresp, "target",
-                        json_object_new_string(target_str));
-
-                    // content: {"ip":"...", "status":"..."}
-                    struct json_object *jcontent = json_object_new_object();
-                    json_object_object_add(jcontent, "ip",
-                        json_object_new_string(info_usr->ip));
-                    json_object_object_add(jcontent, "status",
-                        json_object_new_string(estado_to_string(info_usr->est)));
-
-                    json_object_object_add(jresp, "content", jcontent);
-                    json_object_object_add(jresp, "timestamp",
-                        json_object_new_string(out_ts));
-
-                    const char *res = json_object_to_json_string(jresp);
-                    enviar_a_cliente(wsi, res);
-                    json_object_put(jresp);
-                }
-            }
-            else if (type_str && strcmp(type_str, "change_status") == 0) {
-                // {type:"change_status", sender:"...", content:"<nuevo_estado>"}
-                // Ej: content="OCUPADO"
-                if (content_str) {
-                    // Actualizar pss->est de acuerdo al contenido
-                    if (strcmp(content_str, "ACTIVO") == 0) {
-                        pss->est = ESTADO_ACTIVO;
-                    } else if (strcmp(content_str, "OCUPADO") == 0) {
-                        pss->est = ESTADO_OCUPADO;
-                    } else {
-                        pss->est = ESTADO_INACTIVO;
-                    }
-                }
-                // Responder con "status_update"
-                struct json_object *jresp = json_object_new_object();
-                json_object_object_add(jresp, "type",
-                    json_object_new_string("status_update"));
-                json_object_object_add(jresp, "sender",
-                    json_object_new_string("server"));
-
-                // content: {"user":..., "status":...}
-                struct json_object *jcont = json_object_new_object();
-                json_object_object_add(jcont, "user",
-                    json_object_new_string(pss->username ? pss->username : "anon"));
-                json_object_object_add(jcont, "status",
-                    json_object_new_string(estado_to_string(pss->est)));
-
-                json_object_object_add(jresp, "content", jcont);
-                json_object_object_add(jresp, "timestamp",
-                    json_object_new_string(out_ts));
-
-                const char *resp_str = json_object_to_json_string(jresp);
-                enviar_broadcast(resp_str,wsi);
-                json_object_put(jresp);
-            }
-            else if (type_str && strcmp(type_str, "disconnect") == 0) {
-                // {type:"disconnect", sender:"...", content:"Cierre de sesión"}
-                // Responder user_disconnected
-                char msg[128];
-                snprintf(msg, sizeof(msg),
-                         "{\"type\":\"user_disconnected\",\"sender\":\"server\","
-                         "\"content\":\"%s ha salido\",\"timestamp\":\"%s\"}",
-                         pss->username ? pss->username : "anon", out_ts);
-                enviar_broadcast(msg,wsi);
-
-                // Eliminar al usuario
-                printf("El usuario %s se desconectó\n", pss->username);
-                eliminar_cliente(pss);
-                if (pss->username) {
-                    free(pss->username);
-                    pss->username = NULL;
-                }
-
-                // O marcarlo inactivo, pero según el protocolo cierra
-                lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
-                lws_set_timeout(wsi, NO_PENDING_TIMEOUT, 1);
-            }
+    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+        // Otro shard dejó frames en nuestro buzón
+        shard_drenar_buzon(&shards[lws_get_tsi(wsi)]);
+        break;
 
-            json_object_put(parsed);
+    case LWS_CALLBACK_RECEIVE: {
+        // lws_is_final_fragment: última parte del último fragmento. Lo que
+        // llega entero (lo normal) se parsea sobre el buffer de lws, sin copia.
+        int ultima = lws_is_final_fragment(wsi);
+        if (in && len > 0)
+            met_sumar(&metricas[pss->shard].contadores[MET_BYTES_ENTRADA], len);
+        if (!pss->entrada && ultima) {
+            if (!in || len == 0) break;
+            if (len > cfg.mensaje_max) return mensaje_demasiado_grande(pss);
+            return procesar_mensaje(wsi, pss, in, len);
         }
-        break;
+        int r = in && len > 0 ? entrada_agregar(pss, in, len) : 0;
+        if (r == -2) return mensaje_demasiado_grande(pss);
+        if (r < 0) {
+            log_error("memoria", "Sin memoria para rearmar un mensaje");
+            return -1;
+        }
+        if (!ultima) break;
+        struct buffer_entrada *b = pss->entrada;
+        pss->entrada = NULL;
+        if (b) {
+            met_sumar(&metricas[pss->shard].contadores[MET_REARMADOS], 1);
+            if (b->len > 0) r = procesar_mensaje(wsi, pss, b->datos, b->len);
+            entrada_devolver(&shards[pss->shard], b);
+        }
+        return r;
+    }
 
     case LWS_CALLBACK_CLOSED:
-        printf("Conexión cerrada\n");
+        // Si ESTABLISHED falló (límite de conexiones, sin memoria) ya
+        // deshizo lo suyo y no contó la sesión: no hay nada que descontar
+        if (!pss->alta) break;
+        pss->alta = 0;
+        log_info("conexion", "Conexión cerrada (%s)", pss->username ? pss->username : pss->ip);
         eliminar_cliente(pss);
-        if (pss->username) free(pss->username);
+        shard_quitar(&shards[pss->shard], pss);
+        met_ajustar(&metricas[pss->shard].sesiones, -1);
+        met_ajustar(&metricas[pss->shard].frames_en_cola, -(int64_t)pss->cola.num);
+        atomic_fetch_sub(pss->capacidades & CAP_STATUS_BATCH ? &sesiones_con_lotes
+                                                             : &sesiones_sin_lotes, 1);
+        if (timer_armado(&pss->timer_inactividad))
+            timer_desarmar(&pss->timer_inactividad);
         pss->username = NULL;
+        free(pss->reproducir);
+        pss->reproducir = NULL;
+        salas_salir_todas(pss);
+        free(pss->anunciados);
+        pss->anunciados = NULL;
+        entrada_devolver(&shards[pss->shard], pss->entrada);
+        pss->entrada = NULL;
+        frame_soltar(pss->enviando);
+        pss->enviando = NULL;
+        cola_liberar(&pss->cola);
         break;
 
     default:
@@ -400,65 +4983,485 @@ static int callback_chat(struct lws *wsi, enum lws_callback_reasons reason,
     return 0;
 }
 
-void* verificar_inactividad(void* arg) {
-    while (1) {
-        struct per_session_data__chat *inactivos[MAX_CLIENTES] = { NULL };
-        int count = 0;
-
-        pthread_mutex_lock(&clientes_mutex);
-        time_t ahora = time(NULL);
-
-        for (int i = 0; i < MAX_CLIENTES; i++) {
-            if (clientes[i] && clientes[i]->username) {
-                double segundos_inactivo = difftime(ahora, clientes[i]->last_activity);
-                if (clientes[i]->est != ESTADO_INACTIVO && segundos_inactivo >= 10) {
-                    clientes[i]->est = ESTADO_INACTIVO;
-                    inactivos[count++] = clientes[i];
-                }
-            }
+//------------------------------------------------------------------------------
+// Inactividad: cada actividad re-arma el timer de la sesión en la rueda de su
+// shard; al vencer se la pasa a INACTIVO. La rueda avanza con un lws_sul en
+// el propio bucle de servicio del shard, sin hilos extra.
+//------------------------------------------------------------------------------
+static void inactividad_vencida(struct per_session_data__chat *c) {
+    enum estado_usuario est = c->ficha->est;
+    if (!c->username || est == ESTADO_INACTIVO) return;
+    if (est == ESTADO_OCUPADO && !cfg.inactivo_desde_ocupado) return;
+    c->ficha->est = ESTADO_INACTIVO;
+
+    char ts[64];
+    get_timestamp(ts, sizeof(ts));
+    publicar_estado(c->username, ESTADO_INACTIVO, 0, ts);
+
+    log_info("inactividad", "%s marcado como INACTIVO", c->username);
+}
+
+static void tick_rueda(lws_sorted_usec_list_t *sul) {
+    struct shard *sh = lws_container_of(sul, struct shard, sul_rueda);
+    struct rueda_timers *r = &sh->rueda;
+    lws_usec_t ahora = lws_now_usecs();
+
+    // Ponerse al día si el bucle se demoró más de un tick
+    uint64_t objetivo = (uint64_t)((ahora - r->inicio_us) / RUEDA_TICK_US);
+    struct timer_nodo vencidos;
+    timer_iniciar(&vencidos);
+    while (r->tick < objetivo) rueda_avanzar(r, &vencidos);
+
+    while (timer_armado(&vencidos)) {
+        struct timer_nodo *t = vencidos.sig;
+        timer_desarmar(t);
+        inactividad_vencida(lws_container_of(t, struct per_session_data__chat,
+                                             timer_inactividad));
+    }
+
+    lws_usec_t proximo = r->inicio_us + (lws_usec_t)(r->tick + 1) * RUEDA_TICK_US;
+    lws_sul_schedule(contexto, sh->tsi, &sh->sul_rueda, tick_rueda, proximo - ahora);
+}
+
+//------------------------------------------------------------------------------
+// Endpoint HTTP /metrics (formato de texto de Prometheus)
+// Lo atiende el mismo contexto lws en el puerto 8080, en el hilo que reciba
+// la conexión. Solo lee los contadores de metricas[]: no toma registro_lock
+// ni espera a los demás hilos.
+//------------------------------------------------------------------------------
+struct texto {
+    char *buf;                // LWS_PRE bytes libres y luego el texto
+    size_t len;
+    size_t cap;
+    int error;
+};
+
+static void texto_printf(struct texto *t, const char *fmt, ...) {
+    if (t->error) return;
+    for (;;) {
+        size_t libre = t->cap - t->len;
+        va_list ap;
+        va_start(ap, fmt);
+        int n = t->buf ? vsnprintf(t->buf + LWS_PRE + t->len, libre, fmt, ap) : -1;
+        va_end(ap);
+        if (t->buf && n >= 0 && (size_t)n < libre) {
+            t->len += (size_t)n;
+            return;
+        }
+        size_t nueva_cap = t->cap ? t->cap * 2 : 8192;
+        char *b = realloc(t->buf, LWS_PRE + nueva_cap);
+        if (!b) {
+            t->error = 1;
+            return;
+        }
+        t->buf = b;
+        t->cap = nueva_cap;
+    }
+}
+
+static void texto_liberar(struct texto *t) {
+    free(t->buf);
+    memset(t, 0, sizeof(*t));
+}
+
+// Suma de un histograma entre todos los hilos
+struct histograma_total {
+    uint64_t cubetas[HIST_OCTAVAS][HIST_SUB];
+    uint64_t suma;
+    uint64_t cuenta;
+};
+
+static void hist_acumular(struct histograma_total *tot, struct histograma *h) {
+    for (unsigned o = 0; o < HIST_OCTAVAS; o++)
+        for (unsigned s = 0; s < HIST_SUB; s++)
+            tot->cubetas[o][s] += atomic_load_explicit(&h->cubetas[o][s],
+                                                       memory_order_relaxed);
+    tot->suma += atomic_load_explicit(&h->suma, memory_order_relaxed);
+    tot->cuenta += atomic_load_explicit(&h->cuenta, memory_order_relaxed);
+}
+
+static uint64_t hist_cuantil(const struct histograma_total *h, double q) {
+    uint64_t total = 0;
+    for (unsigned o = 0; o < HIST_OCTAVAS; o++)
+        for (unsigned s = 0; s < HIST_SUB; s++) total += h->cubetas[o][s];
+    if (total == 0) return 0;
+    uint64_t objetivo = (uint64_t)(q * (double)total), acumulado = 0;
+    if (objetivo >= total) objetivo = total - 1;
+    for (unsigned o = 0; o < HIST_OCTAVAS; o++) {
+        for (unsigned s = 0; s < HIST_SUB; s++) {
+            acumulado += h->cubetas[o][s];
+            if (acumulado > objetivo) return hist_limite(o, s);
         }
-        pthread_mutex_unlock(&clientes_mutex);
+    }
+    return hist_limite(HIST_OCTAVAS - 1, HIST_SUB - 1);
+}
+
+// Histograma con un 'le' por octava (hasta la última con datos) y, aparte,
+// los cuantiles calculados con la resolución completa
+static void exponer_histograma(struct texto *t, const char *nombre, const char *ayuda,
+                               const struct histograma_total *h) {
+    unsigned ultima = 0;
+    for (unsigned o = 0; o < HIST_OCTAVAS; o++)
+        for (unsigned s = 0; s < HIST_SUB; s++)
+            if (h->cubetas[o][s]) ultima = o;
 
-        // Ahora enviar fuera del mutex
-        for (int i = 0; i < count; i++) {
-            struct json_object *jresp = json_object_new_object();
-            json_object_object_add(jresp, "type",
-                json_object_new_string("status_update"));
-            json_object_object_add(jresp, "sender",
-                json_object_new_string("server"));
+    texto_printf(t, "# HELP %s %s\n# TYPE %s histogram\n", nombre, ayuda, nombre);
+    uint64_t acumulado = 0;
+    for (unsigned o = 0; o <= ultima; o++) {
+        for (unsigned s = 0; s < HIST_SUB; s++) acumulado += h->cubetas[o][s];
+        texto_printf(t, "%s_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n",
+                     nombre, hist_limite(o, HIST_SUB - 1), acumulado);
+    }
+    texto_printf(t, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", nombre, h->cuenta);
+    texto_printf(t, "%s_sum %" PRIu64 "\n%s_count %" PRIu64 "\n",
+                 nombre, h->suma, nombre, h->cuenta);
+
+    texto_printf(t, "# TYPE %s_cuantil gauge\n", nombre);
+    static const double qs[] = { 0.5, 0.99, 0.999 };
+    for (size_t i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+        texto_printf(t, "%s_cuantil{q=\"%g\"} %" PRIu64 "\n",
+                     nombre, qs[i], hist_cuantil(h, qs[i]));
+    }
+}
+
+static void exponer_contador(struct texto *t, const char *nombre, const char *ayuda,
+                             enum contador_metrica c) {
+    uint64_t v = 0;
+    for (int h = 0; h < cfg.hilos; h++)
+        v += atomic_load_explicit(&metricas[h].contadores[c], memory_order_relaxed);
+    texto_printf(t, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n",
+                 nombre, ayuda, nombre, nombre, v);
+}
+
+static void exponer_metricas(struct texto *t) {
+    texto_printf(t, "# HELP chat_mensajes_recibidos_total Mensajes recibidos por tipo\n"
+                    "# TYPE chat_mensajes_recibidos_total counter\n");
+    for (int i = 0; i < tipos_mensaje.num; i++) {
+        uint64_t v = 0;
+        for (int h = 0; h < cfg.hilos; h++)
+            v += atomic_load_explicit(&metricas[h].por_tipo[i], memory_order_relaxed);
+        texto_printf(t, "chat_mensajes_recibidos_total{tipo=\"%s\"} %" PRIu64 "\n",
+                     tipos_mensaje.nombres[i], v);
+    }
+    exponer_contador(t, "chat_mensajes_desconocidos_total",
+                     "Mensajes con tipo desconocido o sin tipo", MET_TIPO_DESCONOCIDO);
+    exponer_contador(t, "chat_mensajes_invalidos_total",
+                     "Frames que no son JSON valido", MET_INVALIDOS);
+    exponer_contador(t, "chat_frames_enviados_total", "Frames escritos a clientes",
+                     MET_FRAMES_ENVIADOS);
+    exponer_contador(t, "chat_bytes_entrada_total", "Bytes de payload recibidos",
+                     MET_BYTES_ENTRADA);
+    exponer_contador(t, "chat_bytes_salida_total", "Bytes de payload enviados",
+                     MET_BYTES_SALIDA);
+    exponer_contador(t, "chat_descartados_total", "Frames perdidos por cola llena",
+                     MET_DESCARTADOS);
+    exponer_contador(t, "chat_lentos_cerrados_total",
+                     "Sesiones cerradas por desborde de la cola", MET_LENTOS_CERRADOS);
+    exponer_contador(t, "chat_deflate_compartido_total",
+                     "Frames enviados con la compresion compartida", MET_DEFLATE_COMPARTIDO);
+    exponer_contador(t, "chat_deflate_bytes_total",
+                     "Bytes en el cable de los frames con compresion compartida",
+                     MET_BYTES_DEFLATE);
+    exponer_contador(t, "chat_traducciones_binario_total",
+                     "Frames JSON traducidos a chat-protocol-bin", MET_TRADUCCIONES_BIN);
+    exponer_contador(t, "chat_limitados_total",
+                     "Mensajes descartados por limite de tasa", MET_LIMITADOS);
+    exponer_contador(t, "chat_conexiones_rechazadas_total",
+                     "Conexiones rechazadas por limite de conexiones por IP",
+                     MET_CONEXIONES_RECHAZADAS);
+    exponer_contador(t, "chat_mensajes_rearmados_total",
+                     "Mensajes recibidos en varias partes", MET_REARMADOS);
+    exponer_contador(t, "chat_mensajes_demasiado_grandes_total",
+                     "Mensajes de mas de --mensaje-max bytes", MET_DEMASIADO_GRANDES);
+    exponer_contador(t, "chat_frames_fragmentados_total",
+                     "Frames enviados en varios fragmentos", MET_FRAGMENTADOS);
 
-            struct json_object *jcont = json_object_new_object();
-            json_object_object_add(jcont, "user",
-                json_object_new_string(inactivos[i]->username));
-            json_object_object_add(jcont, "status",
-                json_object_new_string("INACTIVO"));
-            json_object_object_add(jresp, "content", jcont);
+    int64_t sesiones = 0, en_cola = 0;
+    for (int h = 0; h < cfg.hilos; h++) {
+        sesiones += atomic_load_explicit(&metricas[h].sesiones, memory_order_relaxed);
+        en_cola += atomic_load_explicit(&metricas[h].frames_en_cola, memory_order_relaxed);
+    }
+    texto_printf(t, "# HELP chat_sesiones Conexiones WebSocket abiertas\n"
+                    "# TYPE chat_sesiones gauge\nchat_sesiones %" PRId64 "\n", sesiones);
+    texto_printf(t, "# HELP chat_frames_en_cola Frames esperando en las colas de salida\n"
+                    "# TYPE chat_frames_en_cola gauge\nchat_frames_en_cola %" PRId64 "\n",
+                 en_cola);
+    texto_printf(t, "# HELP chat_mensajes_en_buzones Privados esperando a usuarios desconectados\n"
+                    "# TYPE chat_mensajes_en_buzones gauge\nchat_mensajes_en_buzones %ld\n",
+                 atomic_load(&mensajes_en_buzones));
+
+    struct histograma_total *h = malloc(sizeof(*h));
+    if (!h) {
+        t->error = 1;
+        return;
+    }
+    memset(h, 0, sizeof(*h));
+    for (int i = 0; i < cfg.hilos; i++) hist_acumular(h, &metricas[i].parseo_ns);
+    exponer_histograma(t, "chat_parseo_ns", "Tiempo de parseo de un frame (ns)", h);
+    memset(h, 0, sizeof(*h));
+    for (int i = 0; i < cfg.hilos; i++) hist_acumular(h, &metricas[i].fanout);
+    exponer_histograma(t, "chat_fanout", "Destinatarios por entrega de broadcast en un hilo", h);
+    memset(h, 0, sizeof(*h));
+    for (int i = 0; i < cfg.hilos; i++) hist_acumular(h, &metricas[i].profundidad_cola);
+    exponer_histograma(t, "chat_profundidad_cola", "Frames en la cola tras encolar", h);
+    free(h);
+}
 
-            char ts[64];
-            get_timestamp(ts, sizeof(ts));
-            json_object_object_add(jresp, "timestamp",
-                json_object_new_string(ts));
+struct sesion_http {
+    struct texto cuerpo;
+};
 
-            const char *msg = json_object_to_json_string(jresp);
-            enviar_broadcast(msg, NULL);  // ya fuera del mutex
-            json_object_put(jresp);
+static int callback_metricas(struct lws *wsi, enum lws_callback_reasons reason,
+                             void *user, void *in, size_t len)
+{
+    struct sesion_http *sh = (struct sesion_http *)user;
+    unsigned char cabecera[LWS_PRE + 512];
+    unsigned char *p = &cabecera[LWS_PRE], *fin = &cabecera[sizeof(cabecera) - 1];
 
-            printf("[Sistema] %s marcado como INACTIVO\n", inactivos[i]->username);
+    switch (reason) {
+    case LWS_CALLBACK_HTTP:
+        memset(&sh->cuerpo, 0, sizeof(sh->cuerpo));
+        exponer_metricas(&sh->cuerpo);
+        if (sh->cuerpo.error) {
+            texto_liberar(&sh->cuerpo);
+            return -1;
         }
+        if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, "text/plain; version=0.0.4",
+                                        (long)sh->cuerpo.len, &p, fin)
+            || lws_finalize_write_http_header(wsi, &cabecera[LWS_PRE], &p, fin))
+            return 1;
+        lws_callback_on_writable(wsi);
+        return 0;
+
+    case LWS_CALLBACK_HTTP_WRITEABLE: {
+        if (!sh->cuerpo.buf) break;
+        int n = lws_write(wsi, (unsigned char *)sh->cuerpo.buf + LWS_PRE,
+                          sh->cuerpo.len, LWS_WRITE_HTTP_FINAL);
+        texto_liberar(&sh->cuerpo);
+        if (n < 0 || lws_http_transaction_completed(wsi)) return -1;
+        return 0;
+    }
+
+    case LWS_CALLBACK_CLOSED_HTTP:
+        texto_liberar(&sh->cuerpo);
+        break;
+
+    default:
+        break;
+    }
+    return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
 
-        sleep(10);
+//------------------------------------------------------------------------------
+// Bucle de servicio de un shard (un hilo por tsi)
+//------------------------------------------------------------------------------
+static void *hilo_shard(void *arg) {
+    struct shard *sh = arg;
+    shard_actual = sh;
+    slab_hilo = sh->tsi;
+    epoca_hilo = sh->tsi;
+    log_hilo = sh->tsi;
+    while (1) {
+        lws_service_tsi(contexto, 1000, sh->tsi);
     }
     return NULL;
 }
 
+//------------------------------------------------------------------------------
+// Argumentos de línea de comandos (--opcion=valor)
+//------------------------------------------------------------------------------
+static void uso(const char *prog) {
+    fprintf(stderr,
+            "Uso: %s [opciones]\n"
+            "  --cola-max=N                   frames pendientes por cliente (%d)\n"
+            "  --desborde=descartar|desconectar\n"
+            "                                 política con la cola llena\n"
+            "  --hilos=N                      hilos de servicio (1..%d)\n"
+            "  --inactividad=SEG              segundos sin actividad => INACTIVO (%d)\n"
+            "  --inactivo-desde-ocupado=0|1   pasar también OCUPADO a INACTIVO\n"
+            "  --presencia-ms=N               ventana de status_batch, 0 = sin agrupar (%d)\n"
+            "  --log-nivel=error|aviso|info|debug\n"
+            "                                 nivel de log (info)\n"
+            "  --log-muestreo=N               logs por mensaje: 1 de cada N (100)\n"
+            "  --log-formato=texto|json       formato de las líneas de log\n"
+            "  --historial=DIR|no             guardar el historial en DIR (no): sin él no\n"
+            "                                 hay replay ni buzones para desconectados\n"
+            "  --replay=N                     broadcasts reproducidos al registrarse (%d)\n"
+            "  --historial-sync-ms=N          intervalo de msync del historial (%d)\n"
+            "  --historial-segmentos=N        segmentos de %u MiB que se conservan; los\n"
+            "                                 más viejos se borran, 0 = todos (%d)\n"
+            "  --buzon-max=N                  privados pendientes por usuario desconectado (%d)\n"
+            "  --buzon-memoria=N              de esos, cuántos quedan en memoria (%d)\n"
+            "  --salas-max=N                  salas que se pueden crear (%d)\n"
+            "  --deflate=0|1                  negociar permessage-deflate (1)\n"
+            "  --deflate-nivel=N              nivel de compresión 0..9 (%d)\n"
+            "  --deflate-memoria=N            memLevel de zlib 1..9 (%d)\n"
+            "  --deflate-compartido=0|1       comprimir cada frame una vez para todos los\n"
+            "                                 clientes sin context takeover (0)\n"
+            "  --limite=TIPO:TASA/RAFAGA      límite por sesión de un tipo de mensaje, en\n"
+            "                                 mensajes/s y ráfaga; TIPO:0 lo quita (se\n"
+            "                                 puede repetir; broadcast:20/40 ...)\n"
+            "  --limite-ip=TASA/RAFAGA|0      mensajes por IP (200/400)\n"
+            "  --conexiones-ip=TASA/RAFAGA|0  conexiones nuevas por IP (5/20); los dos\n"
+            "                                 límites por IP no se aplican a loopback\n"
+            "  --limite-accion=responder|desconectar\n"
+            "                                 qué hacer al exceder un límite\n"
+            "  --mensaje-max=N                bytes de un mensaje entrante; más se\n"
+            "                                 cierra con 1009 (%d)\n"
+            "  --fragmento=N                  enviar en fragmentos de N bytes los\n"
+            "                                 frames más largos, 0 = nunca (%d)\n",
+            prog, COLA_CAP_DEFECTO, MAX_HILOS, INACTIVIDAD_SEG, PRESENCIA_MS,
+            REPLAY_DEFECTO, HISTORIAL_SYNC_MS, SEGMENTO_TAM >> 20, HISTORIAL_SEGMENTOS,
+            BUZON_MAX_DEFECTO, BUZON_MEMORIA,
+            SALAS_MAX_DEFECTO, DEFLATE_NIVEL, DEFLATE_MEMORIA,
+            MENSAJE_MAX_DEFECTO,
+            FRAGMENTO_DEFECTO);
+}
+
+// Devuelve el valor si arg es "--nombre=valor", NULL en otro caso
+static const char *valor_opcion(const char *arg, const char *nombre) {
+    size_t n = strlen(nombre);
+    if (strncmp(arg, nombre, n) == 0 && arg[n] == '=') return arg + n + 1;
+    return NULL;
+}
 
+static int parsear_argumentos(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *v;
+        if ((v = valor_opcion(argv[i], "--cola-max")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n <= 0) return -1;
+            cfg.cola_max = (size_t)n;
+        } else if ((v = valor_opcion(argv[i], "--desborde")) != NULL) {
+            if (strcmp(v, "descartar") == 0) {
+                cfg.desborde = DESBORDE_DESCARTAR_VIEJO;
+            } else if (strcmp(v, "desconectar") == 0) {
+                cfg.desborde = DESBORDE_DESCONECTAR;
+            } else {
+                return -1;
+            }
+        } else if ((v = valor_opcion(argv[i], "--hilos")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 1 || n > MAX_HILOS) return -1;
+            cfg.hilos = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--inactividad")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n <= 0) return -1;
+            cfg.inactividad_seg = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--inactivo-desde-ocupado")) != NULL) {
+            cfg.inactivo_desde_ocupado = strcmp(v, "0") != 0;
+        } else if ((v = valor_opcion(argv[i], "--presencia-ms")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 0) return -1;
+            cfg.presencia_ms = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--log-nivel")) != NULL) {
+            int n;
+            for (n = NIVEL_ERROR; n <= NIVEL_DEBUG; n++)
+                if (strcmp(v, nombres_nivel[n]) == 0) break;
+            if (n > NIVEL_DEBUG) return -1;
+            cfg.log_nivel = n;
+        } else if ((v = valor_opcion(argv[i], "--log-muestreo")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 1) return -1;
+            cfg.log_muestreo = (unsigned)n;
+        } else if ((v = valor_opcion(argv[i], "--log-formato")) != NULL) {
+            if (strcmp(v, "texto") == 0) cfg.log_json = 0;
+            else if (strcmp(v, "json") == 0) cfg.log_json = 1;
+            else return -1;
+        } else if ((v = valor_opcion(argv[i], "--historial")) != NULL) {
+            if (*v == '\0') return -1;
+            cfg.historial_dir = strcmp(v, "no") == 0 ? NULL : v;
+        } else if ((v = valor_opcion(argv[i], "--replay")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 0 || n > HIST_LOBBY) return -1;
+            cfg.historial_replay = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--historial-sync-ms")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 1) return -1;
+            cfg.historial_sync_ms = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--historial-segmentos")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 0 || n == 1 || n > INT32_MAX) return -1;
+            cfg.historial_segmentos = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--buzon-max")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 1) return -1;
+            cfg.buzon_max = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--buzon-memoria")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 0) return -1;
+            cfg.buzon_memoria = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--salas-max")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 0 || n > INT32_MAX) return -1;
+            cfg.salas_max = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--deflate")) != NULL) {
+            cfg.deflate = strcmp(v, "0") != 0;
+        } else if ((v = valor_opcion(argv[i], "--deflate-nivel")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 0 || n > 9) return -1;
+            cfg.deflate_nivel = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--deflate-memoria")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 1 || n > 9) return -1;
+            cfg.deflate_memoria = (int)n;
+        } else if ((v = valor_opcion(argv[i], "--deflate-compartido")) != NULL) {
+            cfg.deflate_compartido = strcmp(v, "0") != 0;
+        } else if ((v = valor_opcion(argv[i], "--limite")) != NULL) {
+            if (agregar_limite(v) < 0) return -1;
+        } else if ((v = valor_opcion(argv[i], "--limite-ip")) != NULL) {
+            if (parsear_limite(v, &cfg.limite_ip) < 0) return -1;
+        } else if ((v = valor_opcion(argv[i], "--conexiones-ip")) != NULL) {
+            if (parsear_limite(v, &cfg.conexiones_ip) < 0) return -1;
+        } else if ((v = valor_opcion(argv[i], "--limite-accion")) != NULL) {
+            if (strcmp(v, "responder") == 0) {
+                cfg.limite_accion = LIMITE_RESPONDER;
+            } else if (strcmp(v, "desconectar") == 0) {
+                cfg.limite_accion = LIMITE_DESCONECTAR;
+            } else {
+                return -1;
+            }
+        } else if ((v = valor_opcion(argv[i], "--mensaje-max")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 256 || n > INT32_MAX) return -1;
+            cfg.mensaje_max = (size_t)n;
+        } else if ((v = valor_opcion(argv[i], "--fragmento")) != NULL) {
+            long n = strtol(v, NULL, 10);
+            if (n < 0 || (n > 0 && n < 128) || n > INT32_MAX) return -1;
+            cfg.fragmento = (size_t)n;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
 
 //------------------------------------------------------------------------------
 // main
 //------------------------------------------------------------------------------
-int main(void)
+#if !defined(FUZZ_JSON) && !defined(BENCH_SERVIDOR)
+int main(int argc, char **argv)
 {
-    pthread_mutex_init(&clientes_mutex, NULL);
+    if (parsear_argumentos(argc, argv) < 0) {
+        uso(argv[0]);
+        return -1;
+    }
+    if (log_iniciar() < 0) {
+        fprintf(stderr, "No se pudo iniciar el hilo de log\n");
+        return -1;
+    }
+    if (iniciar_manejadores() < 0 || bin_tipos_iniciar(&tipos_bin) < 0
+        || limites_iniciar(&tipos_mensaje) < 0) {
+        log_detener();
+        return -1;
+    }
+    atomic_store(&siguiente_mensaje_id, (uint64_t)time(NULL) << 20);
+    if (historial_iniciar() < 0) {
+        log_error("inicio", "No se pudo abrir el historial en %s: %s",
+                  cfg.historial_dir, strerror(errno));
+        log_detener();
+        return -1;
+    }
     // Definimos el protocolo
     struct lws_protocols protocols[] = {
         {
@@ -467,37 +5470,95 @@ int main(void)
             sizeof(struct per_session_data__chat),
             MAX_PAYLOAD_SIZE,
         },
+        {
+            PROTOCOLO_BIN,
+            callback_chat,
+            sizeof(struct per_session_data__chat),
+            MAX_PAYLOAD_SIZE,
+        },
+        {
+            "http-metricas",
+            callback_metricas,
+            sizeof(struct sesion_http),
+            0,
+        },
         { NULL, NULL, 0, 0 }
     };
 
+    // permessage-deflate; los parámetros de ventana los propone el cliente
+    static const struct lws_extension extensiones[] = {
+        { "permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate" },
+        { NULL, NULL, NULL }
+    };
+
+    // GET /metrics lo atiende callback_metricas
+    static const struct lws_http_mount mount_metricas = {
+        .mountpoint = "/metrics",
+        .mountpoint_len = 8,
+        .origin = "http-metricas",
+        .origin_protocol = LWSMPRO_CALLBACK,
+    };
+
     // Crear la info para el contexto
     struct lws_context_creation_info info;
     memset(&info, 0, sizeof(info));
     info.port = 8080;
     info.protocols = protocols;
+    info.mounts = &mount_metricas;
+    if (cfg.deflate) info.extensions = extensiones;
     info.gid = -1;
     info.uid = -1;
+    info.count_threads = (unsigned int)cfg.hilos;
+
+    tam_slab[SLAB_COLA] = cfg.cola_max * sizeof(struct frame_salida *);
+    for (int t = 0; t < cfg.hilos; t++) {
+        shards[t].tsi = t;
+        buzon_iniciar(&shards[t].buzon);
+    }
 
     // Crear el contexto
     struct lws_context *context = lws_create_context(&info);
     if (!context) {
-        fprintf(stderr, "Fallo al crear el contexto WebSocket\n");
+        log_error("inicio", "Fallo al crear el contexto WebSocket");
+        historial_detener();
+        log_detener();
         return -1;
     }
-    pthread_t monitor_thread;
-    pthread_create(&monitor_thread, NULL, verificar_inactividad, NULL);
+    contexto = context;
 
-    printf("Servidor WebSocket en ejecución en el puerto 8080...\n");
-    while (1) {
-        lws_service(context, 1000);
+    // Arrancar la rueda de inactividad de cada shard
+    for (int t = 0; t < cfg.hilos; t++) {
+        rueda_iniciar(&shards[t].rueda, lws_now_usecs());
+        lws_sul_schedule(context, t, &shards[t].sul_rueda, tick_rueda, RUEDA_TICK_US);
+    }
+    if (cfg.presencia_ms > 0)
+        lws_sul_schedule(context, 0, &presencia.sul, presencia_vaciar,
+                         (lws_usec_t)cfg.presencia_ms * LWS_US_PER_MS);
+
+    log_info("inicio", "Servidor WebSocket en ejecución en el puerto 8080 (%d hilos)",
+             cfg.hilos);
+    // El hilo principal atiende el shard 0; el resto, uno por hilo
+    pthread_t hilos[MAX_HILOS];
+    for (int t = 1; t < cfg.hilos; t++) {
+        pthread_create(&hilos[t], NULL, hilo_shard, &shards[t]);
     }
+    hilo_shard(&shards[0]);
 
-   
+    for (int t = 1; t < cfg.hilos; t++) {
+        pthread_join(hilos[t], NULL);
+    }
     lws_context_destroy(context);
 
-    pthread_mutex_destroy(&clientes_mutex);
+    pthread_rwlock_destroy(&registro_lock);
+    historial_detener();
+    // Los buzones que hilo_historial leyó para sesiones que ya cerraron
+    // vuelven a memoria (shard_drenar_buzon) y de ahí al .idx
+    for (int t = 0; t < cfg.hilos; t++) shard_drenar_buzon(&shards[t]);
+    buzones_persistir();
+    log_detener();
     return 0;
 }
+#endif
 
 
 
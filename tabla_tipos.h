@@ -0,0 +1,103 @@
+/******************************************************************************
+ * tabla_tipos.h
+ * Tabla de hash perfecto para despachar mensajes por su campo "type".
+ * La usan server.c y client.c: cada uno registra sus tipos y guarda sus
+ * manejadores en un arreglo indexado por el número que devuelve la tabla.
+ *
+ * Cada vez que se agrega un tipo se busca de nuevo una semilla con la que
+ * ningún par de nombres caiga en el mismo slot, así que una búsqueda cuesta
+ * un hash y una sola comparación.
+ *****************************************************************************/
+
+#ifndef TABLA_TIPOS_H
+#define TABLA_TIPOS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define TABLA_TIPOS_MAX        64    // tipos registrables
+#define TABLA_TIPOS_MAX_SLOTS  4096
+#define TABLA_TIPOS_INTENTOS   10000 // semillas a probar antes de agrandar
+
+struct tabla_tipos {
+    const char *nombres[TABLA_TIPOS_MAX];
+    size_t lens[TABLA_TIPOS_MAX];
+    int num;
+
+    uint32_t semilla;
+    uint32_t mascara;                     // num_slots - 1
+    int8_t slots[TABLA_TIPOS_MAX_SLOTS];  // slot -> índice del tipo, -1 = libre
+};
+
+static inline uint32_t tabla_tipos_hash(uint32_t semilla, const char *s, size_t len) {
+    uint32_t h = 2166136261u ^ semilla;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+// Busca una semilla sin colisiones para los tipos registrados
+static inline int tabla_tipos_generar(struct tabla_tipos *t) {
+    uint32_t num_slots = 8;
+    while (num_slots < 2u * (uint32_t)t->num) num_slots *= 2;
+
+    for (; num_slots <= TABLA_TIPOS_MAX_SLOTS; num_slots *= 2) {
+        for (uint32_t semilla = 0; semilla < TABLA_TIPOS_INTENTOS; semilla++) {
+            memset(t->slots, -1, num_slots);
+            int ok = 1;
+            for (int i = 0; i < t->num && ok; i++) {
+                uint32_t s = tabla_tipos_hash(semilla, t->nombres[i], t->lens[i])
+                             & (num_slots - 1);
+                if (t->slots[s] >= 0) ok = 0;
+                else t->slots[s] = (int8_t)i;
+            }
+            if (ok) {
+                t->semilla = semilla;
+                t->mascara = num_slots - 1;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+static inline void tabla_tipos_iniciar(struct tabla_tipos *t) {
+    t->num = 0;
+    t->semilla = 0;
+    t->mascara = 0;
+    t->slots[0] = -1;
+}
+
+// Registra un tipo. Devuelve su índice (estable), o -1 si no hay lugar.
+// nombre debe seguir siendo válido mientras se use la tabla.
+static inline int tabla_tipos_agregar(struct tabla_tipos *t, const char *nombre) {
+    size_t len = strlen(nombre);
+    for (int i = 0; i < t->num; i++) {
+        if (t->lens[i] == len && memcmp(t->nombres[i], nombre, len) == 0) return i;
+    }
+    if (t->num == TABLA_TIPOS_MAX) return -1;
+    t->nombres[t->num] = nombre;
+    t->lens[t->num] = len;
+    t->num++;
+    if (tabla_tipos_generar(t) < 0) {
+        t->num--;
+        tabla_tipos_generar(t);
+        return -1;
+    }
+    return t->num - 1;
+}
+
+// Índice del tipo, o -1 si no está registrado
+static inline int tabla_tipos_buscar(const struct tabla_tipos *t, const char *s, size_t len) {
+    if (!s || t->num == 0) return -1;
+    int i = t->slots[tabla_tipos_hash(t->semilla, s, len) & t->mascara];
+    if (i < 0 || t->lens[i] != len || memcmp(t->nombres[i], s, len) != 0) return -1;
+    return i;
+}
+
+#endif